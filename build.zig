@@ -98,6 +98,16 @@ pub fn build(b: *std.Build) void {
     const run_step = b.step("run", "Run the app");
     run_step.dependOn(&run_cmd.step);
 
+    // This creates a `zig build bench` step sweeping the C benchmark c/ib over
+    // payload, queue depth, batch and thread counts. Arguments after `--` go to
+    // scripts/bench: `zig build bench -- results.csv`
+    const bench_cmd = b.addSystemCommand(&[_][]const u8{b.pathFromRoot("scripts/bench")});
+    if (b.args) |args| {
+        bench_cmd.addArgs(args);
+    }
+    const bench_step = b.step("bench", "Sweep c/ib and append JSON/CSV records");
+    bench_step.dependOn(&bench_cmd.step);
+
     // Creates a step for unit testing.
     const exe_tests = b.addTest(.{
         .root_source_file = .{ .path = "src/main.zig" },
@@ -0,0 +1,129 @@
+#include <ice_arena.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mman.h>
+#include <linux/mempolicy.h>
+
+static const uint64_t ARENA_ALIGN_BYTES = 64;                 // sub-allocations are cache line aligned
+
+uint64_t ice_arena_round(uint64_t sizeBytes) {
+  return (sizeBytes+ARENA_ALIGN_BYTES-1) & ~(ARENA_ALIGN_BYTES-1);
+}
+
+int ice_arena_initialize(struct Arena *arena, uint64_t sizeBytes, uint8_t page, int32_t numaNode) {
+  assert(arena);
+  assert(sizeBytes>0);
+  assert(page<=ICE_ARENA_PAGE_1GB);
+
+  memset(arena, 0, sizeof(struct Arena));
+  arena->numaNode = -1;
+
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  switch (page) {
+    case ICE_ARENA_PAGE_2MB:
+      arena->pageSizeBytes = 1ull<<21;
+      flags |= MAP_HUGETLB | MAP_HUGE_2MB;
+      break;
+    case ICE_ARENA_PAGE_1GB:
+      arena->pageSizeBytes = 1ull<<30;
+      flags |= MAP_HUGETLB | MAP_HUGE_1GB;
+      break;
+    default:
+      arena->pageSizeBytes = (uint64_t)sysconf(_SC_PAGESIZE);
+      break;
+  }
+
+  // Round up to whole pages so no page is shared with anything else
+  const uint64_t size = (sizeBytes+arena->pageSizeBytes-1) & ~(arena->pageSizeBytes-1);
+
+  void *memory = mmap(0, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (memory==MAP_FAILED) {
+    int rc = errno;
+    fprintf(stderr, "warn : ice_arena_initialize: cannot map %lu bytes of %lu byte pages: %s (errno %d)\n",
+      size, arena->pageSizeBytes, strerror(rc), rc);
+    return rc;
+  }
+  arena->memory = (uint8_t *)memory;
+  arena->sizeBytes = size;
+
+  // Bind before first touch so pages come from the NIC's node. The kernel reads one bit less than maxnode
+  if (numaNode>=0) {
+    unsigned long nodeMask[(numaNode/(8*sizeof(unsigned long)))+1];
+    memset(nodeMask, 0, sizeof(nodeMask));
+    nodeMask[numaNode/(8*sizeof(unsigned long))] = 1ul<<(numaNode%(8*sizeof(unsigned long)));
+    if (0!=syscall(SYS_mbind, memory, size, MPOL_BIND, nodeMask, (unsigned long)numaNode+2, MPOL_MF_STRICT)) {
+      int rc = errno;
+      fprintf(stderr, "warn : ice_arena_initialize: mbind to node %d failed: %s (errno %d)\n", numaNode,
+        strerror(rc), rc);
+    } else {
+      arena->numaNode = numaNode;
+    }
+  }
+
+  // Fault pages in now rather than in the first timed run. Kernels before 5.14 reject MADV_POPULATE_WRITE with
+  // EINVAL; writing a byte per page does the same there
+  int populated = 0;
+#ifdef MADV_POPULATE_WRITE
+  if (0==madvise(memory, size, MADV_POPULATE_WRITE)) {
+    populated = 1;
+  } else if (errno==EINVAL) {
+    fprintf(stderr, "warn : ice_arena_initialize: no MADV_POPULATE_WRITE; touching pages instead\n");
+  } else {
+    int rc = errno;
+    fprintf(stderr, "warn : ice_arena_initialize: cannot fault in %lu bytes: %s (errno %d)\n", size, strerror(rc), rc);
+    munmap(memory, size);
+    memset(arena, 0, sizeof(struct Arena));
+    return rc;
+  }
+#endif
+  for (uint64_t offset=0; !populated && offset<size; offset+=arena->pageSizeBytes) {
+    ((volatile uint8_t *)memory)[offset] = 0;
+  }
+
+  fprintf(stderr, "info : ice_arena_initialize: %lu bytes requested, %lu bytes mapped in %lu byte pages on node %d\n",
+    sizeBytes, size, arena->pageSizeBytes, arena->numaNode);
+
+  return 0;
+}
+
+void *ice_arena_allocate(struct Arena *arena, uint64_t sizeBytes) {
+  return ice_arena_allocate_aligned(arena, sizeBytes, ARENA_ALIGN_BYTES);
+}
+
+void *ice_arena_allocate_aligned(struct Arena *arena, uint64_t sizeBytes, uint64_t alignBytes) {
+  assert(arena);
+  assert(arena->memory);
+  assert(alignBytes>=ARENA_ALIGN_BYTES && (alignBytes & (alignBytes-1))==0);
+
+  // The mapping starts page aligned so aligning the offset aligns the address
+  const uint64_t start = (arena->usedBytes+alignBytes-1) & ~(alignBytes-1);
+  const uint64_t size = ice_arena_round(sizeBytes);
+  if (start>arena->sizeBytes || size>arena->sizeBytes-start) {
+    fprintf(stderr, "warn : ice_arena_allocate: %lu bytes wanted at %lu byte alignment, %lu of %lu bytes left\n",
+      size, alignBytes, arena->sizeBytes-arena->usedBytes, arena->sizeBytes);
+    return 0;
+  }
+
+  void *memory = arena->memory+start;
+  arena->usedBytes = start+size;
+
+  return memory;
+}
+
+int ice_arena_deinitialize(struct Arena *arena) {
+  assert(arena);
+
+  if (arena->memory) {
+    munmap(arena->memory, arena->sizeBytes);
+  }
+  memset(arena, 0, sizeof(struct Arena));
+
+  return 0;
+}
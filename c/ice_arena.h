@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+
+// One mmap'd region per session from which queues and common data are carved. Huge pages (2MB or 1GB) are used on
+// request, otherwise 4KB pages. Memory is bound to a NUMA node (the NIC's, see ice_topology.h) before first touch.
+// Allocations are cache line aligned, zero filled by the kernel and only released all at once by
+// 'ice_arena_deinitialize'.
+
+enum ICE_ArenaPage {
+  ICE_ARENA_PAGE_4KB = 0,                                     // regular pages
+  ICE_ARENA_PAGE_2MB = 1,                                     // MAP_HUGETLB 2MB pages
+  ICE_ARENA_PAGE_1GB = 2,                                     // MAP_HUGETLB 1GB pages
+};
+
+struct Arena {
+  uint8_t                   *memory;                          // start of mapping
+  uint64_t                  sizeBytes;                        // bytes mapped; multiple of 'pageSizeBytes'
+  uint64_t                  usedBytes;                        // bytes handed out; multiple of a cache line
+  uint64_t                  pageSizeBytes;                    // page size backing the mapping
+  int32_t                   numaNode;                         // node memory is bound to or -1 if unbound
+};
+
+// Map at least 'sizeBytes' into 'arena' backed by 'page' (ICE_ArenaPage) pages bound to 'numaNode' unless it's -1.
+// Pages are faulted in before return. Return 0 on success and non-zero otherwise
+int ice_arena_initialize(struct Arena *arena, uint64_t sizeBytes, uint8_t page, int32_t numaNode);
+
+// Return 'sizeBytes' of zeroed cache line aligned memory from 'arena' or 0 if exhausted
+void *ice_arena_allocate(struct Arena *arena, uint64_t sizeBytes);
+
+// As 'ice_arena_allocate' but aligned to 'alignBytes', a power of 2 at least a cache line. Padding skipped to get
+// there is lost
+void *ice_arena_allocate_aligned(struct Arena *arena, uint64_t sizeBytes, uint64_t alignBytes);
+
+// Unmap 'arena'. Everything allocated from it is invalid on return
+int ice_arena_deinitialize(struct Arena *arena);
+
+// Return 'sizeBytes' rounded up as 'ice_arena_allocate' would
+uint64_t ice_arena_round(uint64_t sizeBytes);
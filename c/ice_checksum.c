@@ -0,0 +1,156 @@
+#include <ice_checksum.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <immintrin.h>
+
+static ice_checksum_ipv4_batch_fn batchKernel = ice_checksum_ipv4_batch_scalar;
+static const char *batchKernelName = "scalar";
+
+// Fold a 32-bit ones-complement sum to 16 bits and complement it
+static inline uint16_t ice_checksum_fold(uint32_t sum) {
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  return (uint16_t)~sum;
+}
+
+void ice_checksum_ipv4_batch_scalar(uint8_t *header, uint32_t stride, uint32_t count) {
+  assert(header || count==0);
+
+  for (uint32_t i=0; i<count; ++i, header+=stride) {
+    uint16_t* ptr16 = (uint16_t*)header;
+    const uint32_t sum = (uint32_t)ptr16[0] + ptr16[1] + ptr16[2] + ptr16[3] + ptr16[4] + ptr16[6] + ptr16[7] +
+      ptr16[8] + ptr16[9];
+    ptr16[5] = ice_checksum_fold(sum);
+  }
+}
+
+__attribute__((target("avx2")))
+void ice_checksum_ipv4_batch_avx2(uint8_t *header, uint32_t stride, uint32_t count) {
+  assert(header || count==0);
+  assert((uint64_t)stride*count < (1ull<<31));
+
+  const __m256i lo16 = _mm256_set1_epi32(0xffff);
+  const __m256i index = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32((int)stride));
+  uint32_t checksum[8] __attribute__((aligned(32)));
+
+  uint32_t i = 0;
+  for (; i+8<=count; i+=8, header+=8*stride) {
+    // Lane 'j' gathers 32-bit word 'k' of header 'j'. The top half of
+    // word 2 is the old checksum and is left out of the sum
+    __m256i sum = _mm256_setzero_si256();
+    for (int k=0; k<ICE_CHECKSUM_IPV4_HEADER_SIZE/4; ++k) {
+      __m256i word = _mm256_i32gather_epi32((const int *)(header+4*k), index, 1);
+      if (k==ICE_CHECKSUM_IPV4_OFFSET/4) {
+        word = _mm256_and_si256(word, lo16);
+      }
+      sum = _mm256_add_epi32(sum, _mm256_add_epi32(_mm256_and_si256(word, lo16), _mm256_srli_epi32(word, 16)));
+    }
+    sum = _mm256_add_epi32(_mm256_and_si256(sum, lo16), _mm256_srli_epi32(sum, 16));
+    sum = _mm256_add_epi32(_mm256_and_si256(sum, lo16), _mm256_srli_epi32(sum, 16));
+    _mm256_store_si256((__m256i *)checksum, _mm256_andnot_si256(sum, lo16));
+
+    // AVX2 has no scatter
+    for (int j=0; j<8; ++j) {
+      *(uint16_t *)(header+j*stride+ICE_CHECKSUM_IPV4_OFFSET) = (uint16_t)checksum[j];
+    }
+  }
+
+  ice_checksum_ipv4_batch_scalar(header, stride, count-i);
+}
+
+__attribute__((target("avx512f")))
+void ice_checksum_ipv4_batch_avx512(uint8_t *header, uint32_t stride, uint32_t count) {
+  assert(header || count==0);
+  assert((uint64_t)stride*count < (1ull<<31));
+
+  const __m512i lo16 = _mm512_set1_epi32(0xffff);
+  const __m512i index = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+    _mm512_set1_epi32((int)stride));
+
+  uint32_t i = 0;
+  for (; i+16<=count; i+=16, header+=16*stride) {
+    __m512i sum = _mm512_setzero_si512();
+    __m512i keep = _mm512_setzero_si512();
+    for (int k=0; k<ICE_CHECKSUM_IPV4_HEADER_SIZE/4; ++k) {
+      __m512i word = _mm512_i32gather_epi32(index, (const void *)(header+4*k), 1);
+      if (k==ICE_CHECKSUM_IPV4_OFFSET/4) {
+        word = _mm512_and_si512(word, lo16);
+        keep = word;
+      }
+      sum = _mm512_add_epi32(sum, _mm512_add_epi32(_mm512_and_si512(word, lo16), _mm512_srli_epi32(word, 16)));
+    }
+    sum = _mm512_add_epi32(_mm512_and_si512(sum, lo16), _mm512_srli_epi32(sum, 16));
+    sum = _mm512_add_epi32(_mm512_and_si512(sum, lo16), _mm512_srli_epi32(sum, 16));
+
+    // Write checksums back as the top half of 32-bit word 2 in one scatter
+    const __m512i checksum = _mm512_slli_epi32(_mm512_andnot_si512(sum, lo16), 16);
+    _mm512_i32scatter_epi32((void *)(header+ICE_CHECKSUM_IPV4_OFFSET-2), index, _mm512_or_si512(keep, checksum), 1);
+  }
+
+  ice_checksum_ipv4_batch_scalar(header, stride, count-i);
+}
+
+ice_checksum_ipv4_batch_fn ice_checksum_find(const char *name) {
+  assert(name);
+
+  __builtin_cpu_init();
+  if (!strcmp(name, "scalar")) {
+    return ice_checksum_ipv4_batch_scalar;
+  }
+  if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2")) {
+    return ice_checksum_ipv4_batch_avx2;
+  }
+  if (!strcmp(name, "avx512") && __builtin_cpu_supports("avx512f")) {
+    return ice_checksum_ipv4_batch_avx512;
+  }
+
+  return 0;
+}
+
+const char *ice_checksum_initialize(void) {
+  static const char *name[] = {"avx512", "avx2", "scalar"};
+
+  for (uint32_t i=0; i<sizeof(name)/sizeof(name[0]); ++i) {
+    ice_checksum_ipv4_batch_fn kernel = ice_checksum_find(name[i]);
+    if (kernel) {
+      batchKernel = kernel;
+      batchKernelName = name[i];
+      break;
+    }
+  }
+
+  return batchKernelName;
+}
+
+void ice_checksum_ipv4_batch(uint8_t *header, uint32_t stride, uint32_t count) {
+  batchKernel(header, stride, count);
+}
+
+int ice_checksum_parse_mode(const char *name, uint8_t *mode) {
+  assert(name);
+  assert(mode);
+
+  for (uint8_t i=ICE_CHECKSUM_MODE_INCREMENTAL; i<=ICE_CHECKSUM_MODE_OFFLOAD; ++i) {
+    if (!strcmp(name, ice_checksum_mode_name(i))) {
+      *mode = i;
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+const char *ice_checksum_mode_name(uint8_t mode) {
+  switch (mode) {
+    case ICE_CHECKSUM_MODE_INCREMENTAL:
+      return "incremental";
+    case ICE_CHECKSUM_MODE_BATCH:
+      return "batch";
+    case ICE_CHECKSUM_MODE_OFFLOAD:
+      return "offload";
+    default:
+      return "unknown";
+  }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+
+// Batch IPV4 header checksums. Headers are 'stride' bytes apart starting at 'header' as they are in a packet pool.
+// Each header's checksum is recomputed over its other 9 16-bit words and written in place. AVX2 and AVX-512 kernels
+// checksum 8 and 16 headers per step; 'ice_checksum_ipv4_batch' calls the widest the CPU supports, chosen once by
+// 'ice_checksum_initialize'.
+
+enum kCHECKSUM {
+  ICE_CHECKSUM_IPV4_HEADER_SIZE = 20,                         // IPV4 header bytes without options
+  ICE_CHECKSUM_IPV4_OFFSET = 10,                              // byte offset of checksum in IPV4 header
+};
+
+// How send paths fill in IPV4 checksums
+enum ICE_ChecksumMode {
+  ICE_CHECKSUM_MODE_INCREMENTAL = 0,                          // fold packet id into precomputed template sum
+  ICE_CHECKSUM_MODE_BATCH = 1,                                // recompute each posted batch with vector kernel
+  ICE_CHECKSUM_MODE_OFFLOAD = 2,                              // NIC computes it via IBV_SEND_IP_CSUM
+};
+
+typedef void (*ice_checksum_ipv4_batch_fn)(uint8_t *header, uint32_t stride, uint32_t count);
+
+// Kernels. AVX2 and AVX-512 variants must only be called when the CPU supports them
+void ice_checksum_ipv4_batch_scalar(uint8_t *header, uint32_t stride, uint32_t count);
+void ice_checksum_ipv4_batch_avx2(uint8_t *header, uint32_t stride, uint32_t count);
+void ice_checksum_ipv4_batch_avx512(uint8_t *header, uint32_t stride, uint32_t count);
+
+// Return the kernel named 'name' ("scalar", "avx2", "avx512") if the CPU supports it and 0 otherwise
+ice_checksum_ipv4_batch_fn ice_checksum_find(const char *name);
+
+// Pick the widest kernel this CPU supports. Safe to call more than once; return its name
+const char *ice_checksum_initialize(void);
+
+// Checksum 'count' headers 'stride' bytes apart with the kernel picked by 'ice_checksum_initialize'
+void ice_checksum_ipv4_batch(uint8_t *header, uint32_t stride, uint32_t count);
+
+// Parse 'name' ("incremental", "batch", "offload") into '*mode'. Return 0 on success and non-zero otherwise
+int ice_checksum_parse_mode(const char *name, uint8_t *mode);
+
+// Return printable name of 'mode'
+const char *ice_checksum_mode_name(uint8_t mode);
@@ -0,0 +1,196 @@
+#include <ice_flow.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <arpa/inet.h>
+
+int ice_flow_parse_distribution(const char *text, uint8_t *distribution, double *zipfExponent) {
+  assert(text);
+  assert(distribution);
+  assert(zipfExponent);
+
+  *zipfExponent = 1.0;
+  if (!strcmp(text, "rr")) {
+    *distribution = ICE_FLOW_DIST_ROUND_ROBIN;
+  } else if (!strcmp(text, "uniform")) {
+    *distribution = ICE_FLOW_DIST_UNIFORM;
+  } else if (!strcmp(text, "zipf")) {
+    *distribution = ICE_FLOW_DIST_ZIPF;
+  } else if (!strncmp(text, "zipf:", 5)) {
+    char *end;
+    *distribution = ICE_FLOW_DIST_ZIPF;
+    *zipfExponent = strtod(text+5, &end);
+    if (end==text+5 || *end!=0 || *zipfExponent<=0) {
+      return -1;
+    }
+  } else {
+    return -1;
+  }
+
+  return 0;
+}
+
+int ice_flow_parse_fields(const char *text, uint8_t *fields) {
+  assert(text);
+  assert(fields);
+
+  *fields = 0;
+  while (*text) {
+    const char *end = strchr(text, ',');
+    const size_t length = end ? (size_t)(end-text) : strlen(text);
+    if (length==5 && !strncmp(text, "sport", 5)) {
+      *fields |= ICE_FLOW_FIELD_SRC_PORT;
+    } else if (length==5 && !strncmp(text, "dport", 5)) {
+      *fields |= ICE_FLOW_FIELD_DST_PORT;
+    } else if (length==3 && !strncmp(text, "sip", 3)) {
+      *fields |= ICE_FLOW_FIELD_SRC_IP;
+    } else if (length==3 && !strncmp(text, "dip", 3)) {
+      *fields |= ICE_FLOW_FIELD_DST_IP;
+    } else {
+      return -1;
+    }
+    text += length + (end ? 1 : 0);
+  }
+
+  return *fields ? 0 : -1;
+}
+
+const char *ice_flow_distribution_name(uint8_t distribution) {
+  switch (distribution) {
+    case ICE_FLOW_DIST_ROUND_ROBIN:
+      return "rr";
+    case ICE_FLOW_DIST_UNIFORM:
+      return "uniform";
+    case ICE_FLOW_DIST_ZIPF:
+      return "zipf";
+    default:
+      return "unknown";
+  }
+}
+
+// Return next value of xorshift64* state '*state'. Schedules only need to look random and be the same every run
+static uint64_t ice_flow_random(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545f4914f6cdd1dull;
+}
+
+// Return a uniform double in [0, 1) from '*state'
+static double ice_flow_random_unit(uint64_t *state) {
+  return (double)(ice_flow_random(state) >> 11) * (1.0/9007199254740992.0);
+}
+
+// Return 'address' (network order) plus 'offset' in network order
+static uint32_t ice_flow_add_ip(uint32_t address, uint32_t offset) {
+  return htonl(ntohl(address)+offset);
+}
+
+// Return 'port' (network order) plus 'offset' in network order
+static uint16_t ice_flow_add_port(uint16_t port, uint32_t offset) {
+  return htons((uint16_t)(ntohs(port)+offset));
+}
+
+// Draw 'table->schedule' from 'table->distribution' over 'table->count' flows
+static void ice_flow_draw_schedule(struct FlowTable *table) {
+  uint64_t state = 0x9e3779b97f4a7c15ull;
+
+  if (table->distribution==ICE_FLOW_DIST_ROUND_ROBIN) {
+    for (uint32_t i=0; i<FLOW_SCHEDULE_SIZE; ++i) {
+      table->schedule[i] = (uint16_t)(i % table->count);
+    }
+  } else if (table->distribution==ICE_FLOW_DIST_UNIFORM) {
+    for (uint32_t i=0; i<FLOW_SCHEDULE_SIZE; ++i) {
+      table->schedule[i] = (uint16_t)(ice_flow_random(&state) % table->count);
+    }
+  } else {
+    // Sample the Zipf CDF by binary search; flow 0 is the heaviest
+    double cdf[FLOW_MAX_FLOWS];
+    double total = 0;
+    for (uint32_t i=0; i<table->count; ++i) {
+      total += 1.0/pow((double)(i+1), table->zipfExponent);
+      cdf[i] = total;
+    }
+    for (uint32_t i=0; i<FLOW_SCHEDULE_SIZE; ++i) {
+      const double u = ice_flow_random_unit(&state)*total;
+      uint32_t lo = 0;
+      uint32_t hi = table->count-1;
+      while (lo<hi) {
+        const uint32_t mid = (lo+hi)/2;
+        if (cdf[mid]<=u) {
+          lo = mid+1;
+        } else {
+          hi = mid;
+        }
+      }
+      table->schedule[i] = (uint16_t)lo;
+    }
+  }
+}
+
+int ice_flow_initialize(struct FlowTable *table, uint32_t count, uint8_t distribution, double zipfExponent,
+  uint8_t fields, const uint16_t *ipv4Header, uint16_t srcPort, uint16_t dstPort, uint16_t basePort,
+  uint32_t sequenceStep) {
+  assert(table);
+  assert(ipv4Header);
+  assert(sequenceStep>0);
+
+  if (count<1 || count>FLOW_MAX_FLOWS || distribution>ICE_FLOW_DIST_ZIPF) {
+    fprintf(stderr, "warn : ice_flow_initialize: %u flows %s not in [1, %d]\n", count,
+      ice_flow_distribution_name(distribution), FLOW_MAX_FLOWS);
+    return -1;
+  }
+
+  memset(table, 0, sizeof(struct FlowTable));
+  table->count = count;
+  table->sequenceStep = sequenceStep;
+  table->distribution = distribution;
+  table->fields = fields;
+  table->zipfExponent = zipfExponent;
+
+  // IPV4 header words 6-7 and 8-9 are the source and destination addresses. Every other word but packetId (2) and
+  // checksum (5) is the same for all flows
+  uint32_t srcIpAddr;
+  uint32_t dstIpAddr;
+  memcpy(&srcIpAddr, ipv4Header+6, sizeof(srcIpAddr));
+  memcpy(&dstIpAddr, ipv4Header+8, sizeof(dstIpAddr));
+  const uint32_t fixedSum = (uint32_t)ipv4Header[0] + ipv4Header[1] + ipv4Header[3] + ipv4Header[4];
+
+  for (uint32_t i=0; i<count; ++i) {
+    struct FlowTemplate *flow = table->flow+i;
+    flow->srcIpAddr = (fields & ICE_FLOW_FIELD_SRC_IP) ? ice_flow_add_ip(srcIpAddr, i) : srcIpAddr;
+    flow->dstIpAddr = (fields & ICE_FLOW_FIELD_DST_IP) ? ice_flow_add_ip(dstIpAddr, i) : dstIpAddr;
+    flow->srcPort = (fields & ICE_FLOW_FIELD_SRC_PORT) ? ice_flow_add_port(srcPort, i) : srcPort;
+    flow->dstPort = (fields & ICE_FLOW_FIELD_DST_PORT) ? ice_flow_add_port(dstPort, i) : dstPort;
+    flow->sequenceFlow = (uint16_t)(ntohs(flow->srcPort)-basePort) & (SEQUENCE_MAX_FLOWS-1);
+
+    const uint16_t *src = (const uint16_t *)&flow->srcIpAddr;
+    const uint16_t *dst = (const uint16_t *)&flow->dstIpAddr;
+    uint32_t sum = fixedSum + src[0] + src[1] + dst[0] + dst[1];
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    flow->checksumBase = (uint16_t)sum;
+  }
+
+  ice_flow_draw_schedule(table);
+
+  // Share of packets the heaviest flow gets shows how skewed the schedule came out
+  uint32_t hits[FLOW_MAX_FLOWS];
+  uint32_t heaviest = 0;
+  memset(hits, 0, sizeof(hits));
+  for (uint32_t i=0; i<FLOW_SCHEDULE_SIZE; ++i) {
+    if (++hits[table->schedule[i]]>hits[heaviest]) {
+      heaviest = table->schedule[i];
+    }
+  }
+  fprintf(stderr, "info : ice_flow_initialize: %u flows %s (exponent %.3f) varying%s%s%s%s; heaviest flow %u takes "
+    "%.2f%% of packets\n", count, ice_flow_distribution_name(distribution),
+    distribution==ICE_FLOW_DIST_ZIPF ? zipfExponent : 0.0, (fields & ICE_FLOW_FIELD_SRC_PORT) ? " sport" : "",
+    (fields & ICE_FLOW_FIELD_DST_PORT) ? " dport" : "", (fields & ICE_FLOW_FIELD_SRC_IP) ? " sip" : "",
+    (fields & ICE_FLOW_FIELD_DST_IP) ? " dip" : "", heaviest, 100.0*hits[heaviest]/FLOW_SCHEDULE_SIZE);
+
+  return 0;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdint.h>
+#include <ice_sequence.h>
+
+// Multi-flow traffic. A client spreads its packets over up to FLOW_MAX_FLOWS UDP 5-tuples so receivers see many RSS
+// hashes and NIC flow entries rather than one. Flow 'i' adds 'i' to each varied field of the client and server
+// endpoints: source port, destination port, source and destination IPV4 addresses. Everything a packet takes from
+// its flow, addresses, ports and IPV4 header sum, is precomputed into a 16 byte template and which flow the 'n'th
+// packet gets into a schedule drawn once from the distribution. Table and schedule are 96KB and stay cache resident;
+// the hot path is one schedule lookup and a few stores.
+//
+// Servers track sequences per source port (see ice_sequence.h) so packets are numbered per tracker slot their source
+// port maps to, not per sender. Loss counts are exact when one receive queue takes every flow sharing a slot.
+
+enum kFLOW {
+  FLOW_MAX_FLOWS = 4096,                                      // flows fit 'FlowTable::schedule' entries
+  FLOW_SCHEDULE_SIZE = 16384,                                 // power of 2; packet 'n' takes flow schedule[n%size]
+};
+
+enum ICE_FlowDistribution {
+  ICE_FLOW_DIST_ROUND_ROBIN = 0,                              // flows in turn
+  ICE_FLOW_DIST_UNIFORM = 1,                                  // flows drawn uniformly at random
+  ICE_FLOW_DIST_ZIPF = 2,                                     // flow 'i' drawn in proportion to 1/(i+1)^s
+};
+
+enum ICE_FlowField {
+  ICE_FLOW_FIELD_SRC_PORT = 1,
+  ICE_FLOW_FIELD_DST_PORT = 2,
+  ICE_FLOW_FIELD_SRC_IP = 4,
+  ICE_FLOW_FIELD_DST_IP = 8,
+};
+
+// What a packet takes from its flow. Network order like the headers it is copied into
+struct FlowTemplate {
+  uint32_t                  srcIpAddr;
+  uint32_t                  dstIpAddr;
+  uint16_t                  srcPort;
+  uint16_t                  dstPort;
+  uint16_t                  checksumBase;                     // folded IPV4 header sum less packetId and checksum
+  uint16_t                  sequenceFlow;                     // receiver's tracker slot for 'srcPort'
+};
+
+_Static_assert(sizeof(struct FlowTemplate)==16, "flow template is not 16 bytes");
+
+// One sender's flows. Not shared: 'taken' and 'nextSequence' advance on every packet
+struct FlowTable {
+  uint64_t                  taken;                            // packets given a flow so far
+  uint32_t                  count;                            // flows in 'flow'
+  uint32_t                  sequenceStep;                     // sequences per packet: frames per TSO send else 1
+  uint8_t                   distribution;                     // ICE_FlowDistribution 'schedule' was drawn from
+  uint8_t                   fields;                           // ICE_FlowField mask of fields flows vary
+  double                    zipfExponent;                     // 's' if 'distribution' is ICE_FLOW_DIST_ZIPF
+  uint64_t                  nextSequence[SEQUENCE_MAX_FLOWS]; // next sequence per receiver tracker slot
+  uint16_t                  schedule[FLOW_SCHEDULE_SIZE];     // flow of packet 'n' is 'schedule[n%FLOW_SCHEDULE_SIZE]'
+  struct FlowTemplate       flow[FLOW_MAX_FLOWS];
+};
+
+// Parse 'text' "rr", "uniform", "zipf" or "zipf:<s>" into '*distribution' and '*zipfExponent' (1.0 unless given).
+// Return 0 on success and non-zero otherwise
+int ice_flow_parse_distribution(const char *text, uint8_t *distribution, double *zipfExponent);
+
+// Parse 'text', a comma separated list of "sport", "dport", "sip" and "dip", into an ICE_FlowField mask in '*fields'.
+// Return 0 on success and non-zero otherwise
+int ice_flow_parse_fields(const char *text, uint8_t *fields);
+
+// Return printable name of ICE_FlowDistribution 'distribution'
+const char *ice_flow_distribution_name(uint8_t distribution);
+
+// Build 'count' flows varying 'fields' from a template packet's ten word IPV4 header 'ipv4Header' and UDP ports
+// 'srcPort', 'dstPort' (network order), then draw the schedule from 'distribution'. 'basePort' is the receiver's
+// tracker base port in host order (see 'ice_sequence_initialize_set'). Each packet advances its flow's sequence by
+// 'sequenceStep'. Return 0 on success and non-zero otherwise
+int ice_flow_initialize(struct FlowTable *table, uint32_t count, uint8_t distribution, double zipfExponent,
+  uint8_t fields, const uint16_t *ipv4Header, uint16_t srcPort, uint16_t dstPort, uint16_t basePort,
+  uint32_t sequenceStep);
+
+// Return the next packet's flow and set '*seq' to its sequence number
+static inline const struct FlowTemplate *ice_flow_next(struct FlowTable *table, uint64_t *seq) {
+  const struct FlowTemplate *flow = table->flow + table->schedule[table->taken++ & (FLOW_SCHEDULE_SIZE-1)];
+  uint64_t *next = table->nextSequence + flow->sequenceFlow;
+  *seq = *next;
+  *next += table->sequenceStep;
+  return flow;
+}
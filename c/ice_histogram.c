@@ -0,0 +1,88 @@
+#include <ice_histogram.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+void ice_histogram_initialize(struct Histogram *histogram) {
+  assert(histogram);
+
+  memset(histogram, 0, sizeof(struct Histogram));
+  histogram->min = UINT64_MAX;
+}
+
+void ice_histogram_merge(struct Histogram *into, const struct Histogram *from) {
+  assert(into);
+  assert(from);
+
+  for (uint32_t i=0; i<ICE_HISTOGRAM_BUCKETS; ++i) {
+    into->bucket[i] += from->bucket[i];
+  }
+  into->count += from->count;
+  into->total += from->total;
+  if (from->min<into->min) {
+    into->min = from->min;
+  }
+  if (from->max>into->max) {
+    into->max = from->max;
+  }
+}
+
+uint64_t ice_histogram_bucket_value(uint32_t index) {
+  assert(index<ICE_HISTOGRAM_BUCKETS);
+
+  if (index<(1<<ICE_HISTOGRAM_SUB_BUCKET_BITS)) {
+    return index;
+  }
+
+  // Invert ice_histogram_index: index = shift*HALF + (value>>shift)
+  const uint32_t shift = index/ICE_HISTOGRAM_SUB_BUCKET_HALF - 1;
+  const uint64_t sub = index - shift*ICE_HISTOGRAM_SUB_BUCKET_HALF;
+  return ((sub+1)<<shift) - 1;
+}
+
+uint64_t ice_histogram_percentile(const struct Histogram *histogram, double percentile) {
+  assert(histogram);
+  assert(percentile>=0.0 && percentile<=100.0);
+
+  if (histogram->count==0) {
+    return 0;
+  }
+
+  // Smallest bucket whose cumulative count reaches 'percentile'
+  uint64_t want = (uint64_t)((percentile/100.0)*(double)histogram->count + 0.5);
+  if (want==0) {
+    want = 1;
+  }
+  uint64_t seen = 0;
+  for (uint32_t i=0; i<ICE_HISTOGRAM_BUCKETS; ++i) {
+    seen += histogram->bucket[i];
+    if (seen>=want) {
+      // Bucket value can over-shoot what was actually recorded
+      const uint64_t value = ice_histogram_bucket_value(i);
+      return value<histogram->max ? value : histogram->max;
+    }
+  }
+
+  return histogram->max;
+}
+
+void ice_histogram_print(const struct Histogram *histogram, const char *name, double scale) {
+  assert(histogram);
+  assert(name);
+
+  if (histogram->count==0) {
+    fprintf(stderr, "info : %s: no values recorded\n", name);
+    return;
+  }
+
+  fprintf(stderr, "info : %s: count %lu, min %.1f, mean %.1f, p50 %.1f, p99 %.1f, p99.9 %.1f, p99.99 %.1f, max %.1f\n",
+    name, histogram->count,
+    (double)histogram->min*scale,
+    (double)histogram->total*scale/(double)histogram->count,
+    (double)ice_histogram_percentile(histogram, 50.0)*scale,
+    (double)ice_histogram_percentile(histogram, 99.0)*scale,
+    (double)ice_histogram_percentile(histogram, 99.9)*scale,
+    (double)ice_histogram_percentile(histogram, 99.99)*scale,
+    (double)histogram->max*scale);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+
+// HDR-style log-linear histogram of uint64_t values. Values below 2^ICE_HISTOGRAM_SUB_BUCKET_BITS are recorded
+// exactly. Larger values fall in one of 2^(ICE_HISTOGRAM_SUB_BUCKET_BITS-1) linear sub-buckets per power of two so
+// relative error is under 1%. Storage is fixed and preallocated. Recording neither allocates nor locks: each
+// histogram has exactly one writer and readers only look once the writer is done.
+
+enum kHISTOGRAM {
+  ICE_HISTOGRAM_SUB_BUCKET_BITS = 8,
+  ICE_HISTOGRAM_SUB_BUCKET_HALF = 1<<(ICE_HISTOGRAM_SUB_BUCKET_BITS-1),
+  ICE_HISTOGRAM_BUCKETS = (64-ICE_HISTOGRAM_SUB_BUCKET_BITS)*ICE_HISTOGRAM_SUB_BUCKET_HALF +
+                          (1<<ICE_HISTOGRAM_SUB_BUCKET_BITS),
+};
+
+struct Histogram {
+  uint64_t                  count;                            // number of values recorded
+  uint64_t                  min;                              // smallest value recorded
+  uint64_t                  max;                              // largest value recorded
+  uint64_t                  total;                            // sum of values recorded
+  uint64_t                  bucket[ICE_HISTOGRAM_BUCKETS];    // counts per log-linear bucket
+};
+
+// Return bucket index holding 'value'
+static inline uint32_t ice_histogram_index(uint64_t value) {
+  const uint32_t msb = 63 - __builtin_clzll(value|1);
+  if (msb<ICE_HISTOGRAM_SUB_BUCKET_BITS) {
+    return (uint32_t)value;
+  }
+  const uint32_t shift = msb - ICE_HISTOGRAM_SUB_BUCKET_BITS + 1;
+  return shift*ICE_HISTOGRAM_SUB_BUCKET_HALF + (uint32_t)(value>>shift);
+}
+
+// Record 'value' into 'histogram'. Hot path: no allocation, no locks, no atomics
+static inline void ice_histogram_record(struct Histogram *histogram, uint64_t value) {
+  ++histogram->bucket[ice_histogram_index(value)];
+  ++histogram->count;
+  histogram->total += value;
+  if (value<histogram->min) {
+    histogram->min = value;
+  }
+  if (value>histogram->max) {
+    histogram->max = value;
+  }
+}
+
+void ice_histogram_initialize(struct Histogram *histogram);
+
+// Add every value recorded in 'from' to 'into'
+void ice_histogram_merge(struct Histogram *into, const struct Histogram *from);
+
+// Return the largest value equivalent to bucket 'index'
+uint64_t ice_histogram_bucket_value(uint32_t index);
+
+// Return the value at 'percentile' in [0, 100] or 0 if 'histogram' is empty
+uint64_t ice_histogram_percentile(const struct Histogram *histogram, double percentile);
+
+// Print count, min, mean, p50/p99/p99.9/p99.99 and max of 'histogram' to stderr tagged with 'name'. Values are
+// multiplied by 'scale' before printing e.g. nanoseconds per rdtsc tick
+void ice_histogram_print(const struct Histogram *histogram, const char *name, double scale);
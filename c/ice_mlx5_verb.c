@@ -1,12 +1,31 @@
-#include <ice_mlx5.h>
+#include <ice_mlx5_verb.h>
+#include <ice_report.h>
 
+#include <time.h>
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
-#include <sys/ipc.h>
-#include <sys/shm.h>
-#include <sys/mman.h>
+#include <x86intrin.h>
+
+// x86 keeps stores to write-back memory in order so WQE writes only need a
+// compiler barrier before the doorbell record. Doorbell/BlueFlame register
+// stores go to write-combining memory and need sfence around them
+#define ICE_MLX5_COMPILER_BARRIER() __asm__ volatile("" ::: "memory")
+#define ICE_MLX5_SFENCE()           _mm_sfence()
+
+// Striding RQ CQE 'byte_cnt': packet bytes, strides consumed and a filler flag for strides skipped at a WQE's end
+static const uint32_t MLX5_MPRQ_LEN_MASK = 0xffff;
+static const uint32_t MLX5_MPRQ_STRIDE_NUM_SHIFT = 16;
+static const uint32_t MLX5_MPRQ_STRIDE_NUM_MASK = 0x3fff;
+static const uint32_t MLX5_MPRQ_FILLER = 0x80000000;
+
+// 'mlx5dv_get_cqe_format' of a compressed session's title CQE
+static const uint8_t MLX5_CQE_FORMAT_COMPRESSED = 3;
+
+// One WQ needs no spreading: RSS hashes no fields but the QP still wants a key
+static uint8_t MLX5_STRIDING_RSS_KEY[40];
 
 struct ibv_device **ice_mlx5_find_device(const char *deviceName, struct ibv_device **device, int *rc) {
   assert(deviceName);
@@ -33,14 +52,14 @@ struct ibv_device **ice_mlx5_find_device(const char *deviceName, struct ibv_devi
     if (!strcmp(ibv_get_device_name(*item), deviceName)) {
       // matched device
       *device = *item;
-      rc = 0;
+      *rc = 0;
       break;
     }
   }
 
   // OK there are devices but none matching 'deviceName'
-  if (rc!=0) {
-    *rc = ICE_IB_ERROR_NO_DEVICE;
+  if (*rc!=0) {
+    *rc = ICE_IB_ERROR_ENOENT_DEVICE;
   }
 
   return list;
@@ -62,7 +81,6 @@ int ice_mlx5_open_device(struct ibv_device *device, struct mlx5dv_context_attr *
     int rc = errno;
     fprintf(stderr, "warn : ice_mlx5_open_device.mlx5dv_open_device failed: %s (errno %d)\n", strerror(rc), rc);
     return ICE_IB_ERROR_NO_DEVICE;
-    }
   }
 
   return 0;
@@ -75,21 +93,23 @@ int ice_mlx5_query_devport(struct SessionCommon *common, int portId) {
   assert(common->deviceList);
   assert(portId>0);
 
+  // Ask for the optional caps receive modes are gated on
+  common->contextExtended.comp_mask = MLX5DV_CONTEXT_MASK_STRIDING_RQ | MLX5DV_CONTEXT_MASK_CQE_COMPRESION;
   if (0!=mlx5dv_query_device(common->context, &common->contextExtended)) {
     int rc = errno;
-    fprintf(stderr, "warn : ice_mlx5_query_devport.mlx5dv_query_device %d: failed: %s (errno %d)\n", portId, strerror(rc), rc);                            
+    fprintf(stderr, "warn : ice_mlx5_query_devport.mlx5dv_query_device %d: failed: %s (errno %d)\n", portId, strerror(rc), rc);
     return ICE_IB_ERROR_API_ERROR;
   }
 
   if (0!=ibv_query_port(common->context, portId, &common->portData)) {
     int rc = errno;
-    fprintf(stderr, "warn : ice_mlx5_query_devport.ibv_query_port %d: failed: %s (errno %d)\n", portId, strerror(rc), rc);                            
+    fprintf(stderr, "warn : ice_mlx5_query_devport.ibv_query_port %d: failed: %s (errno %d)\n", portId, strerror(rc), rc);
     return ICE_IB_ERROR_API_ERROR;
   }
 
   if (0!=mlx5dv_query_port(common->context, portId, &common->portDataExtended)) {
     int rc = errno;
-    fprintf(stderr, "warn : ice_mlx5_query_devport.mlx5dv_query_port %d: failed: %s (errno %d)\n", portId, strerror(rc), rc);                            
+    fprintf(stderr, "warn : ice_mlx5_query_devport.mlx5dv_query_port %d: failed: %s (errno %d)\n", portId, strerror(rc), rc);
     return ICE_IB_ERROR_API_ERROR;
   }
 
@@ -113,20 +133,31 @@ int ice_mlx5_allocate_session(const struct UserParam *param, struct Session *ses
   // Initialize session
   memset(session, 0, sizeof(struct Session));
 
+  // Prepare session endpoints in network ready binary format
+  if (0!=ice_verb_initialize_endpoint(param->clientMac, param->clientIpAddr, param->clientPort, &session->client)) {
+    return ICE_IB_ERROR_BAD_IP_ADDR;
+  }
+  if (0!=ice_verb_initialize_endpoint(param->serverMac, param->serverIpAddr, param->serverPort, &session->server)) {
+    return ICE_IB_ERROR_BAD_IP_ADDR;
+  }
+
   // See if the callers's device exists
   int rc;
   struct ibv_device *device;
   struct ibv_device **deviceList;
   deviceList=ice_mlx5_find_device(param->deviceId, &device, &rc);
   if (deviceList==0 || device==0 || rc!=0) {
-      // No viable device
-      return ICE_IB_ERROR_NO_DEVICE;
+    if (deviceList) {
+      ibv_free_device_list(deviceList);
+    }
+    // No viable device
+    return ICE_IB_ERROR_NO_DEVICE;
   }
 
   // Open a context on found device, if any
   struct ibv_context *context = 0;
-  struct mlx5dv_context_attr contextAttrs = {0};
-  if (0!=ice_mlx5_open_device(device, &contextAttrs, &context) {
+  struct mlx5dv_context_attr contextAttrs;
+  if (0!=ice_mlx5_open_device(device, &contextAttrs, &context)) {
     if (context) {
       ibv_close_device(context);
       context = 0;
@@ -139,93 +170,995 @@ int ice_mlx5_allocate_session(const struct UserParam *param, struct Session *ses
     return ICE_IB_ERROR_NO_DEVICE;
   }
 
-  // Start initializing session
-  char valid = 1;
-  session->userParam = param;
-  session->context = context;
-  session->common.device = device;
-  session->common.deviceList = deviceList;
+  // Stride buffers are sized at the stride the device will take; its minimum may exceed a packet's
+  struct mlx5dv_context caps;
+  memset(&caps, 0, sizeof(caps));
+  caps.comp_mask = MLX5DV_CONTEXT_MASK_STRIDING_RQ;
+  const uint32_t minStrideShift = (param->stridesPerWqe && 0==mlx5dv_query_device(context, &caps) &&
+    (caps.comp_mask & MLX5DV_CONTEXT_MASK_STRIDING_RQ)) ? caps.striding_rq_caps.min_single_stride_log_num_of_bytes : 0;
 
-  // Prepare session endpoints in network ready binary format
-  if (0!=ice_verb_initialize_endpoint(param->clientMac, param->clientIpAddr, param->clientPort, &session->client)) {
-    valid = 0;
-    return ICE_IB_ERROR_BAD_IP_ADDR;
-  }
-  if (0!=ice_verb_initialize_endpoint(param->serverMac, param->serverIpAddr, param->serverPort, &session->server)) {
-    valid = 0;
-    return ICE_IB_ERROR_BAD_IP_ADDR;
+  // Queues, PD and QP are the same as the verbs path
+  rc = ice_verb_initialize_session(param, session, device, deviceList, context,
+    ice_mlx5_striding_rq_size(param, minStrideShift));
+  if (session->common) {
+    session->common->contextAttrs = contextAttrs;
   }
 
   // Make sure NIC and its specified port in good state
-  if (0!=(ice_mlx5_query_devport(&session->common, param->portId))) {
-    valid = 0;
-    // No viable device
-    return ICE_IB_ERROR_NO_DEVICE;
+  if (rc==0) {
+    rc = ice_mlx5_query_devport(session->common, param->portId);
   }
 
-  return valid ? 0 : ICE_IB_ERROR_API_ERROR;
+  return rc;
 }
 
 int ice_mlx5_deallocate_session(struct Session *session) {
   assert(session);
 
-  if (session->common) {
-    ice_verb_deinitalize_session_common(session->common);
+  return ice_verb_deallocate_session(session);
+}
+
+// Return non-zero unless firmware says 'context' sends WQEs without inline headers: ethernet offload cap
+// 'wqe_inline_mode' NOT_REQUIRED, or VPORT_CONTEXT and the NIC vport's 'min_wqe_inline_mode' none. Asked over DevX;
+// a failed query counts as required
+static int ice_mlx5_inline_required(struct ibv_context *context) {
+  assert(context);
+
+  uint32_t in[4];
+  uint32_t out[(MLX5_CMD_HEADER_SIZE+MLX5_CMD_HCA_CAP_SIZE)/sizeof(uint32_t)];
+  memset(in, 0, sizeof(in));
+  memset(out, 0, sizeof(out));
+  in[0] = htobe32(MLX5_CMD_QUERY_HCA_CAP<<16);
+  in[1] = htobe32(MLX5_HCA_CAP_ETH_OFFLOADS_CUR);
+  int rc = mlx5dv_devx_general_cmd(context, in, sizeof(in), out, sizeof(out));
+  if (rc!=0) {
+    fprintf(stderr, "warn : ice_mlx5_inline_required: QUERY_HCA_CAP failed: %s (errno %d)\n", strerror(rc), rc);
+    return 1;
   }
 
-  memset(session, 0, sizeof(struct Session));
+  // 'wqe_inline_mode' is bits 13:12 of the capability's first word
+  const uint32_t mode = (be32toh(out[MLX5_CMD_HEADER_SIZE/sizeof(uint32_t)]) >> 12) & 0x3;
+  if (mode!=MLX5_CAP_INLINE_MODE_VPORT_CONTEXT) {
+    return mode!=MLX5_CAP_INLINE_MODE_NOT_REQUIRED;
+  }
+
+  memset(in, 0, sizeof(in));
+  memset(out, 0, sizeof(out));
+  in[0] = htobe32(MLX5_CMD_QUERY_NIC_VPORT_CONTEXT<<16);
+  rc = mlx5dv_devx_general_cmd(context, in, sizeof(in), out, MLX5_CMD_HEADER_SIZE+MLX5_CMD_NIC_VPORT_CONTEXT_SIZE);
+  if (rc!=0) {
+    fprintf(stderr, "warn : ice_mlx5_inline_required: QUERY_NIC_VPORT_CONTEXT failed: %s (errno %d)\n",
+      strerror(rc), rc);
+    return 1;
+  }
+
+  // 'min_wqe_inline_mode' is bits 26:24 of the context's first word; 0 is none
+  return ((be32toh(out[MLX5_CMD_HEADER_SIZE/sizeof(uint32_t)]) >> 24) & 0x7)!=0;
+}
+
+int ice_mlx5_initialize_send_queue(struct Session *session, struct Mlx5SendQueue *sq) {
+  assert(session);
+  assert(session->send);
+  assert(session->common);
+  assert(session->common->qp);
+  assert(sq);
+
+  memset(sq, 0, sizeof(struct Mlx5SendQueue));
+
+  struct mlx5dv_qp dvQp;
+  struct mlx5dv_cq dvCq;
+  struct mlx5dv_obj obj;
+  memset(&dvQp, 0, sizeof(dvQp));
+  memset(&dvCq, 0, sizeof(dvCq));
+  memset(&obj, 0, sizeof(obj));
+
+  obj.qp.in = session->common->qp;
+  obj.qp.out = &dvQp;
+  obj.cq.in = session->send->cq;
+  obj.cq.out = &dvCq;
+
+  int rc = mlx5dv_init_obj(&obj, MLX5DV_OBJ_QP | MLX5DV_OBJ_CQ);
+  if (rc!=0) {
+    fprintf(stderr, "warn : ice_mlx5_initialize_send_queue: mlx5dv_init_obj failed: %s (errno %d)\n",
+      strerror(rc), rc);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  if (dvQp.sq.stride!=MLX5_SEND_WQE_BB || dvQp.sq.wqe_cnt==0 || (dvQp.sq.wqe_cnt & (dvQp.sq.wqe_cnt-1))!=0) {
+    fprintf(stderr, "warn : ice_mlx5_initialize_send_queue: unsupported SQ: stride %u, wqe count %u\n",
+      dvQp.sq.stride, dvQp.sq.wqe_cnt);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  sq->sqBuf = (uint8_t *)dvQp.sq.buf;
+  sq->sqWqeCount = dvQp.sq.wqe_cnt;
+  sq->sqStride = dvQp.sq.stride;
+  sq->qpDbrec = dvQp.dbrec;
+  sq->bfReg = (uint8_t *)dvQp.bf.reg;
+  sq->bfSize = dvQp.bf.size;
+  sq->bfOffset = 0;
+  sq->qpNum = session->common->qp->qp_num;
+  sq->pi = 0;
+
+  // Each WQE is one 64 byte basic block with a single data segment
+  if (session->send->pktPayload) {
+    fprintf(stderr, "warn : ice_mlx5_initialize_send_queue: split payload mode not supported on the mlx5 direct "
+      "path\n");
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  // Enhanced MPW is a device capability, legacy MPW (MPW_ALLOWED) a different WQE format not done here
+  const struct UserParam *param = session->userParam;
+  if (param && param->packetsPerWqe>0) {
+    if (0==(session->common->contextExtended.flags & MLX5DV_CONTEXT_FLAGS_ENHANCED_MPW)) {
+      fprintf(stderr, "warn : ice_mlx5_initialize_send_queue: device has no enhanced multi-packet send WQEs\n");
+      return ICE_IB_ERROR_API_ERROR;
+    }
+    if (param->packetsPerWqe>MLX5_EMPW_MAX_PACKETS) {
+      fprintf(stderr, "warn : ice_mlx5_initialize_send_queue: %u packets per WQE beyond %d\n", param->packetsPerWqe,
+        MLX5_EMPW_MAX_PACKETS);
+      return ICE_IB_ERROR_API_ERROR;
+    }
+    // The eMPW ethernet segment has no room for per packet headers. A device that wants them inline gets every
+    // packet inline instead, as the DPDK mlx5 PMD does, so each must fit a WQE
+    sq->mpwInline = (uint8_t)ice_mlx5_inline_required(session->common->context);
+    if (sq->mpwInline && sizeof(__be32)+session->send->pktSize>(MLX5_WQE_MAX_DS-2)*MLX5_WQE_DS_SIZE) {
+      fprintf(stderr, "warn : ice_mlx5_initialize_send_queue: device requires inline headers and %u byte packets "
+        "do not fit inline in a multi-packet WQE\n", session->send->pktSize);
+      return ICE_IB_ERROR_API_ERROR;
+    }
+    sq->useMpw = 1;
+  }
+
+  sq->cqBuf = (uint8_t *)dvCq.buf;
+  sq->cqeCount = dvCq.cqe_cnt;
+  sq->cqeSize = dvCq.cqe_size;
+  sq->cqDbrec = dvCq.dbrec;
+  sq->ci = 0;
+
+  fprintf(stderr, "info : ice_mlx5_initialize_send_queue: qpn 0x%x, sq wqes %u, cqes %u x %u bytes, blueflame %u "
+    "bytes\n", sq->qpNum, sq->sqWqeCount, sq->cqeCount, sq->cqeSize, sq->bfSize);
 
   return 0;
 }
 
-int ice_mlx5x_deinitalize_session_common(struct SessionCommon *common) {
-  assert(common);
+int ice_mlx5_poll_send_cq(struct Mlx5SendQueue *sq, uint64_t *completed) {
+  assert(sq);
+  assert(completed);
+
+  int n = 0;
+  for (uint32_t i=0; i<MAX_POLL_ENTRIES; ++i) {
+    uint8_t *entry = sq->cqBuf + (sq->ci & (sq->cqeCount-1))*sq->cqeSize;
+    // 128 byte CQEs carry the 64 byte CQE in their second half
+    struct mlx5_cqe64 *cqe = (struct mlx5_cqe64 *)(sq->cqeSize==64 ? entry : entry+64);
+
+    // CQE is ours when its owner bit matches the pass we're on
+    const uint8_t opcode = mlx5dv_get_cqe_opcode(cqe);
+    if (opcode==MLX5_CQE_INVALID || (mlx5dv_get_cqe_owner(cqe) ^ !!(sq->ci & sq->cqeCount))) {
+      break;
+    }
+    ICE_MLX5_COMPILER_BARRIER();
+
+    if (opcode!=MLX5_CQE_REQ) {
+      struct mlx5_err_cqe *err = (struct mlx5_err_cqe *)cqe;
+      fprintf(stderr, "warn : ice_mlx5_poll_send_cq: CQE opcode 0x%x, syndrome 0x%x, vendor syndrome 0x%x\n",
+        opcode, err->syndrome, err->vendor_err_synd);
+      return -1;
+    }
 
-  if (common->qp) {
-    ibv_destroy_qp(common->qp);
+    // A CQE completes every WQE up to and including 'wqe_counter'
+    const uint16_t wqeCounter = be16toh(cqe->wqe_counter);
+    const uint16_t delta = (uint16_t)(wqeCounter - (uint16_t)*completed) + 1;
+    *completed += delta;
+    n += delta;
+    ++sq->ci;
   }
-  if (common->pd) {
-    ibv_dealloc_pd(common->pd);
+
+  if (n>0) {
+    ICE_MLX5_COMPILER_BARRIER();
+    *sq->cqDbrec = htobe32(sq->ci & 0xffffff);
   }
-  if (common->context) {
-    ibv_close_device(common->context);
+
+  return n;
+}
+
+// Write one ctrl+eth+data send WQE at 'sq->pi' for the packet 'sge' describes
+// and return it. The first MLX5_INLINE_HEADER_SIZE bytes of the packet are
+// inlined in the ethernet segment; the data segment points at the rest.
+// 'csFlags' asks the NIC for checksums e.g. MLX5_ETH_WQE_L3_CSUM
+static inline uint8_t *ice_mlx5_write_send_wqe(struct Mlx5SendQueue *sq, const struct ibv_sge *sge, uint8_t fmCeSe,
+  uint8_t csFlags) {
+  uint8_t *wqe = sq->sqBuf + (sq->pi & (sq->sqWqeCount-1))*MLX5_SEND_WQE_BB;
+  struct mlx5_wqe_ctrl_seg *ctrl = (struct mlx5_wqe_ctrl_seg *)wqe;
+  struct mlx5_wqe_eth_seg *eth = (struct mlx5_wqe_eth_seg *)(wqe+sizeof(struct mlx5_wqe_ctrl_seg));
+  struct mlx5_wqe_data_seg *data = (struct mlx5_wqe_data_seg *)(wqe+sizeof(struct mlx5_wqe_ctrl_seg)+
+    sizeof(struct mlx5_wqe_eth_seg));
+
+  mlx5dv_set_ctrl_seg(ctrl, (uint16_t)sq->pi, MLX5_OPCODE_SEND, 0, sq->qpNum, fmCeSe, MLX5_SEND_WQE_DS, 0, 0);
+  eth->rsvd0 = 0;
+  eth->rsvd1 = 0;
+  eth->rsvd2 = 0;
+  mlx5dv_set_eth_seg(eth, csFlags, 0, MLX5_INLINE_HEADER_SIZE, (uint8_t *)sge->addr);
+  mlx5dv_set_data_seg(data, sge->length-MLX5_INLINE_HEADER_SIZE, sge->lkey, sge->addr+MLX5_INLINE_HEADER_SIZE);
+
+  ++sq->pi;
+  ++sq->wqes;
+  return wqe;
+}
+
+// Publish WQEs up to 'sq->pi' then ring the doorbell with 'lastWqe'. With
+// 'blueFlame' the whole 64 byte WQE goes through the BlueFlame buffer so the
+// NIC need not fetch it; otherwise only its first 8 bytes are written
+static inline void ice_mlx5_ring_doorbell(struct Mlx5SendQueue *sq, const uint8_t *lastWqe, int blueFlame) {
+  ICE_MLX5_COMPILER_BARRIER();
+  sq->qpDbrec[MLX5_SND_DBR] = htobe32(sq->pi & 0xffff);
+  ICE_MLX5_SFENCE();
+
+  volatile uint64_t *reg = (volatile uint64_t *)(sq->bfReg+sq->bfOffset);
+  const uint64_t *src = (const uint64_t *)lastWqe;
+  if (blueFlame) {
+    for (uint32_t i=0; i<MLX5_SEND_WQE_BB/sizeof(uint64_t); ++i) {
+      reg[i] = src[i];
+    }
+  } else {
+    reg[0] = src[0];
   }
-  if (common->deviceList) {
-    ibv_free_device_list(common->deviceList);
+  ICE_MLX5_SFENCE();
+
+  sq->bfOffset ^= sq->bfSize;
+  ++sq->doorbells;
+}
+
+int ice_mlx5_send_loop(struct Mlx5SendQueue *sq, struct Queue *queue, const struct UserParam *param, uint64_t iters,
+  struct RunResult *result) {
+  assert(sq);
+  assert(queue);
+  assert(param);
+  assert(result);
+
+  const uint64_t ringSize = param->txQueueSize<sq->sqWqeCount ? param->txQueueSize : sq->sqWqeCount;
+  const uint64_t batchSize = param->txBatchSize<ringSize ? param->txBatchSize : ringSize;
+  const uint64_t signalInterval = param->txSignalInterval<ringSize ? param->txSignalInterval : ringSize;
+  const int useBlueFlame = param->useBlueFlame && sq->bfSize>0;
+  const uint8_t checksumMode = param->checksumMode;
+  const uint8_t csFlags = (checksumMode==ICE_CHECKSUM_MODE_OFFLOAD) ? MLX5_ETH_WQE_L3_CSUM : 0;
+
+  uint64_t posted = 0;                                        // WQEs posted so far
+  uint64_t completed = 0;                                     // WQEs known complete so far
+  uint64_t sinceSignal = 0;                                   // WQEs posted since last signaled WQE
+  struct Pacer pacer;
+  struct StatsCounters *counters = &result->counters;
+
+  memset(result, 0, sizeof(struct RunResult));
+  ice_pacer_initialize(&pacer, param->useHardwarePacing ? 0 : param->txRatePps/param->queueCount, ringSize);
+  clock_gettime(CLOCK_MONOTONIC, &result->startTime);
+
+  while (completed<iters) {
+    // Same batching, signaling and pacing policy as ice_verb_send_loop but
+    // one doorbell per batch replaces ibv_post_send
+    while (posted<iters) {
+      const uint64_t free = ringSize - (posted-completed);
+      const uint64_t want = (iters-posted < batchSize) ? iters-posted : batchSize;
+      if (free<want || ice_pacer_due(&pacer, posted)<want) {
+        break;
+      }
+
+      const uint64_t nextPosted = posted+want;
+      const uint64_t nextWant = (iters-nextPosted < batchSize) ? iters-nextPosted : batchSize;
+      // Headers are inlined into the WQEs so checksums must be final first
+      for (uint64_t i=0; i<want; ++i) {
+        ice_verb_take_packet(queue, queue->sqe[(posted+i)%param->txQueueSize], posted+i, checksumMode);
+      }
+      if (checksumMode==ICE_CHECKSUM_MODE_BATCH) {
+        ice_verb_checksum_taken(queue, want);
+      }
+
+      uint8_t *wqe = 0;
+      for (uint64_t i=0; i<want; ++i) {
+        const uint64_t seq = posted+i;
+
+        // Signal every Kth WQE, the very last one, and the last of a batch
+        // if the next batch must wait for room
+        uint8_t fmCeSe = 0;
+        if (++sinceSignal>=signalInterval || seq+1==iters ||
+           (i+1==want && ringSize-(nextPosted-completed)<nextWant)) {
+          fmCeSe = MLX5_WQE_CTRL_CQ_UPDATE;
+          sinceSignal = 0;
+        }
+        wqe = ice_mlx5_write_send_wqe(sq, queue->sqe[seq%param->txQueueSize], fmCeSe, csFlags);
+      }
+      ice_mlx5_ring_doorbell(sq, wqe, useBlueFlame && want==1);
+      posted = nextPosted;
+    }
+
+    const uint32_t priorCi = sq->ci;
+    int n = ice_mlx5_poll_send_cq(sq, &completed);
+    ice_stats_add(&counters->polls, 1);
+    if (n<0) {
+      ice_stats_add(&counters->errors, 1);
+      return ICE_IB_ERROR_API_ERROR;
+    } else if (n==0) {
+      ice_stats_add(&counters->emptyPolls, 1);
+      continue;
+    }
+    ice_verb_retire_packets(queue, n);
+    ice_stats_add(&counters->completions, sq->ci-priorCi);
+    ice_stats_set(&counters->packets, completed);
+    ice_stats_set(&counters->bytes, completed * queue->pktSize);
   }
 
-  memset(common, 0, sizeof(struct SessionCommon));
+  clock_gettime(CLOCK_MONOTONIC, &result->endTime);
+  result->paceRestarts = pacer.restarts;
 
   return 0;
 }
 
-int ice_mlx5_initialize_endpoint(const char *mac, const char *ipAddr, uint16_t port, struct IPV4UDPEndpoint *endpoint) {
-  char valid = 1;
+// Return the 'ds'th 16 byte segment of the WQE starting at basic block 'pi'. Multi block WQEs wrap at the ring's end
+static inline uint8_t *ice_mlx5_wqe_segment(const struct Mlx5SendQueue *sq, uint32_t pi, uint32_t ds) {
+  return sq->sqBuf + ((uint64_t)((pi + (ds>>2)) & (sq->sqWqeCount-1)) << MLX5_SEND_WQE_SHIFT) +
+    (ds & 3)*MLX5_WQE_DS_SIZE;
+}
+
+// Return data segments one packet of 'length' bytes takes in a multi-packet WQE: a pointer or, if 'isInline', a 4
+// byte header and the packet rounded up to whole segments
+static inline uint32_t ice_mlx5_mpw_packet_ds(uint32_t length, int isInline) {
+  return isInline ? (uint32_t)(sizeof(__be32)+length+MLX5_WQE_DS_SIZE-1)/MLX5_WQE_DS_SIZE : 1;
+}
+
+// Write one enhanced multi-packet send WQE at 'sq->pi' for the 'count' packets 'sge[i][0]' describe and return its
+// first basic block. Each packet is a data segment or, if 'isInline', copied in after a 4 byte inline header
+static inline uint8_t *ice_mlx5_write_mpw_wqe(struct Mlx5SendQueue *sq, struct ibv_sge (*sge)[MAX_SGE_ENTRIES],
+  uint32_t ringSize, uint64_t first, uint32_t count, uint8_t fmCeSe, uint8_t csFlags, int isInline) {
+  uint8_t *wqe = ice_mlx5_wqe_segment(sq, sq->pi, 0);
+  struct mlx5_wqe_eth_seg *eth = (struct mlx5_wqe_eth_seg *)ice_mlx5_wqe_segment(sq, sq->pi, 1);
+
+  // No inline headers: the NIC takes every packet whole from its segment, or inline if 'sq->mpwInline'
+  eth->rsvd0 = 0;
+  eth->rsvd1 = 0;
+  eth->rsvd2 = 0;
+  mlx5dv_set_eth_seg(eth, csFlags, 0, 0, 0);
+
+  uint32_t ds = 2;
+  for (uint32_t i=0; i<count; ++i) {
+    const struct ibv_sge *packet = sge[(first+i)%ringSize];
+    if (!isInline) {
+      mlx5dv_set_data_seg((struct mlx5_wqe_data_seg *)ice_mlx5_wqe_segment(sq, sq->pi, ds), packet->length,
+        packet->lkey, packet->addr);
+      ++ds;
+      continue;
+    }
+    // Inline header then the packet segment by segment: segments of a block are contiguous but blocks may wrap
+    const uint32_t packetDs = ice_mlx5_mpw_packet_ds(packet->length, 1);
+    const uint8_t *src = (const uint8_t *)packet->addr;
+    uint32_t offset = sizeof(__be32);
+    uint32_t left = packet->length;
+    *(__be32 *)ice_mlx5_wqe_segment(sq, sq->pi, ds) = htobe32(packet->length | MLX5_INLINE_SEG);
+    for (uint32_t k=0; k<packetDs; ++k) {
+      const uint32_t chunk = (left < MLX5_WQE_DS_SIZE-offset) ? left : MLX5_WQE_DS_SIZE-offset;
+      memcpy(ice_mlx5_wqe_segment(sq, sq->pi, ds+k)+offset, src, chunk);
+      src += chunk;
+      left -= chunk;
+      offset = 0;
+    }
+    ds += packetDs;
+  }
+
+  mlx5dv_set_ctrl_seg((struct mlx5_wqe_ctrl_seg *)wqe, (uint16_t)sq->pi, MLX5_OPCODE_ENHANCED_MPSW,
+    MLX5_OPC_MOD_ENHANCED_MPSW, sq->qpNum, fmCeSe, (uint8_t)ds, 0, 0);
+
+  sq->pi += (ds+3)>>2;
+  ++sq->wqes;
+  return wqe;
+}
+
+// Posted multi-packet WQE awaiting completion
+struct Mlx5MpwRecord {
+  uint32_t                  pi;                               // first basic block
+  uint32_t                  packets;                          // packets it sends
+};
+
+int ice_mlx5_send_loop_mpw(struct Mlx5SendQueue *sq, struct Queue *queue, const struct UserParam *param,
+  uint64_t iters, struct RunResult *result) {
+  assert(sq);
+  assert(queue);
+  assert(param);
+  assert(param->packetsPerWqe>0 && param->packetsPerWqe<=MLX5_EMPW_MAX_PACKETS);
+  assert(result);
+
+  // Packets per WQE bounded by the DS a WQE can hold
+  const int isInline = sq->mpwInline || (param->useInline && queue->pktSize<=queue->inlineSize);
+  const uint32_t packetDs = ice_mlx5_mpw_packet_ds(queue->pktSize, isInline);
+  uint32_t perWqe = (MLX5_WQE_MAX_DS-2)/packetDs;
+  perWqe = perWqe<param->packetsPerWqe ? perWqe : param->packetsPerWqe;
+  const uint32_t wqeBlocks = (2+perWqe*packetDs+3)>>2;
+
+  const uint64_t ringSize = param->txQueueSize;
+  const uint64_t batchSize = param->txBatchSize<ringSize ? param->txBatchSize : ringSize;
+  const uint64_t signalInterval = param->txSignalInterval<ringSize ? param->txSignalInterval : ringSize;
+  const uint8_t checksumMode = param->checksumMode;
+  const uint8_t csFlags = (checksumMode==ICE_CHECKSUM_MODE_OFFLOAD) ? MLX5_ETH_WQE_L3_CSUM : 0;
+  if ((batchSize+perWqe-1)/perWqe*wqeBlocks>sq->sqWqeCount) {
+    fprintf(stderr, "warn : ice_mlx5_send_loop_mpw: batch of %lu packets needs more than %u WQE basic blocks\n",
+      batchSize, sq->sqWqeCount);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  // Outstanding WQEs never outnumber outstanding packets
+  struct Mlx5MpwRecord record[MAX_QUEUE_ENTRIES];
+  uint64_t recordHead = 0;                                    // WQEs posted
+  uint64_t recordTail = 0;                                    // WQEs completed
+  uint32_t freePi = 0;                                        // first basic block not yet completed
+  uint64_t posted = 0;                                        // packets posted so far
+  uint64_t completed = 0;                                     // packets known complete so far
+  uint64_t completedBlocks = 0;                               // one past the newest completed WQE's first block
+  uint64_t sinceSignal = 0;                                   // packets posted since last signaled WQE
+  struct Pacer pacer;
+  struct StatsCounters *counters = &result->counters;
+
+  memset(result, 0, sizeof(struct RunResult));
+  ice_pacer_initialize(&pacer, param->useHardwarePacing ? 0 : param->txRatePps/param->queueCount, ringSize);
+  clock_gettime(CLOCK_MONOTONIC, &result->startTime);
+  fprintf(stderr, "info : ice_mlx5_send_loop_mpw: %u packets per WQE, %s, %u basic blocks per full WQE\n", perWqe,
+    isInline ? "inline" : "data segments", wqeBlocks);
+
+  while (completed<iters) {
+    while (posted<iters) {
+      const uint64_t free = ringSize - (posted-completed);
+      const uint64_t want = (iters-posted < batchSize) ? iters-posted : batchSize;
+      const uint64_t blocks = (want+perWqe-1)/perWqe*wqeBlocks;
+      if (free<want || sq->sqWqeCount-(sq->pi-freePi)<blocks || ice_pacer_due(&pacer, posted)<want) {
+        break;
+      }
+
+      const uint64_t nextPosted = posted+want;
+      const uint64_t nextWant = (iters-nextPosted < batchSize) ? iters-nextPosted : batchSize;
+      for (uint64_t i=0; i<want; ++i) {
+        ice_verb_take_packet(queue, queue->sqe[(posted+i)%ringSize], posted+i, checksumMode);
+      }
+      if (checksumMode==ICE_CHECKSUM_MODE_BATCH) {
+        ice_verb_checksum_taken(queue, want);
+      }
+
+      uint8_t *wqe = 0;
+      for (uint64_t i=0; i<want; i+=perWqe) {
+        const uint32_t count = (want-i < perWqe) ? (uint32_t)(want-i) : perWqe;
+        const uint64_t last = posted+i+count;
+
+        // Same signaling policy as 'ice_mlx5_send_loop' counted in packets
+        uint8_t fmCeSe = 0;
+        sinceSignal += count;
+        if (sinceSignal>=signalInterval || last==iters ||
+           (last==nextPosted && ringSize-(nextPosted-completed)<nextWant)) {
+          fmCeSe = MLX5_WQE_CTRL_CQ_UPDATE;
+          sinceSignal = 0;
+        }
+        struct Mlx5MpwRecord *entry = record + (recordHead++ & (MAX_QUEUE_ENTRIES-1));
+        entry->pi = sq->pi;
+        entry->packets = count;
+        wqe = ice_mlx5_write_mpw_wqe(sq, queue->sqe, (uint32_t)ringSize, posted+i, count, fmCeSe, csFlags,
+          isInline);
+      }
+      ice_mlx5_ring_doorbell(sq, wqe, 0);
+      posted = nextPosted;
+    }
+
+    const uint32_t priorCi = sq->ci;
+    int n = ice_mlx5_poll_send_cq(sq, &completedBlocks);
+    ice_stats_add(&counters->polls, 1);
+    if (n<0) {
+      ice_stats_add(&counters->errors, 1);
+      return ICE_IB_ERROR_API_ERROR;
+    } else if (n==0) {
+      ice_stats_add(&counters->emptyPolls, 1);
+      continue;
+    }
+
+    // CQEs name the first block of the newest completed WQE; every WQE starting at or before it is done
+    uint64_t retired = 0;
+    while (recordTail<recordHead &&
+           (int32_t)(record[recordTail & (MAX_QUEUE_ENTRIES-1)].pi-(uint32_t)completedBlocks)<0) {
+      retired += record[recordTail & (MAX_QUEUE_ENTRIES-1)].packets;
+      ++recordTail;
+    }
+    freePi = recordTail<recordHead ? record[recordTail & (MAX_QUEUE_ENTRIES-1)].pi : sq->pi;
+    completed += retired;
+    ice_verb_retire_packets(queue, retired);
+    ice_stats_add(&counters->completions, sq->ci-priorCi);
+    ice_stats_set(&counters->packets, completed);
+    ice_stats_set(&counters->bytes, completed * queue->pktSize);
+  }
 
-  // Get IPV4 address into network ready binary format
-  if (0==(inet_pton(AF_INET, ipAddr, &endpoint->ipAddr))) {
+  clock_gettime(CLOCK_MONOTONIC, &result->endTime);
+  result->paceRestarts = pacer.restarts;
+
+  return 0;
+}
+
+int ice_mlx5_run_client(struct Session *session, struct Mlx5SendQueue *sq) {
+  assert(session);
+  assert(session->send);
+  assert(session->userParam);
+  assert(sq);
+
+  struct RunResult result;
+  ice_verb_start_stats(session, &result);
+  int rc = sq->useMpw ? ice_mlx5_send_loop_mpw(sq, session->send, session->userParam, session->userParam->iters,
+                                                &result)
+                      : ice_mlx5_send_loop(sq, session->send, session->userParam, session->userParam->iters, &result);
+  ice_stats_stop(&session->stats);
+  if (rc==0) {
+    ice_verb_print_result("ice_mlx5_run_client", &result);
+    fprintf(stderr, "info : ice_mlx5_run_client: batch %u, signal every %u, blueflame %s, checksum %s\n",
+      session->userParam->txBatchSize, session->userParam->txSignalInterval,
+      (session->userParam->useBlueFlame && sq->bfSize>0) ? "on" : "off",
+      ice_checksum_mode_name(session->userParam->checksumMode));
+    const uint64_t packets = result.counters.packets;
+    fprintf(stderr, "info : ice_mlx5_run_client: WQEs %lu, doorbells %lu, packets per WQE %.1f, per doorbell %.1f\n",
+      sq->wqes, sq->doorbells, sq->wqes ? (double)packets/sq->wqes : 0.0,
+      sq->doorbells ? (double)packets/sq->doorbells : 0.0);
+    ice_verb_print_pacing("ice_mlx5_run_client", session->userParam, &result);
+    rc = ice_report_write(session->userParam, "mlx5-client", 1, &result, 0, "none", 0);
+  }
+
+  return rc;
+}
+
+// Set '*strideShift' to log2 of the stride holding a packet under 'param', at least 'minStrideShift', and
+// '*bufferCount' to the power of 2 WQE buffers holding at least 'param->rxQueueSize' packets
+static void ice_mlx5_striding_geometry(const struct UserParam *param, uint32_t minStrideShift, uint32_t *strideShift,
+  uint32_t *bufferCount) {
+  const uint32_t packetSize = ice_verb_packet_size(param->payloadSize);
+  *strideShift = minStrideShift;
+  while ((1u<<*strideShift)<MLX5_STRIDING_MIN_STRIDE_SIZE || (1u<<*strideShift)<packetSize) {
+    ++*strideShift;
+  }
+  *bufferCount = MLX5_STRIDING_MIN_WQES;
+  while ((uint64_t)*bufferCount*param->stridesPerWqe<param->rxQueueSize) {
+    *bufferCount <<= 1;
+  }
+}
+
+uint64_t ice_mlx5_striding_rq_size(const struct UserParam *param, uint32_t minStrideShift) {
+  assert(param);
+
+  if (param->stridesPerWqe==0) {
+    return 0;
+  }
+  uint32_t strideShift, bufferCount;
+  ice_mlx5_striding_geometry(param, minStrideShift, &strideShift, &bufferCount);
+  return ice_arena_round((uint64_t)bufferCount*param->stridesPerWqe << strideShift);
+}
+
+// Return a name for mini-CQE 'format' (MLX5DV_CQE_RES_FORMAT_*); 0 is uncompressed
+static const char *ice_mlx5_cqe_format_name(uint8_t format) {
+  switch (format) {
+    case 0:
+      return "off";
+    case MLX5DV_CQE_RES_FORMAT_HASH:
+      return "hash";
+    case MLX5DV_CQE_RES_FORMAT_CSUM_STRIDX:
+      return "csum";
+  }
+  return "unknown";
+}
+
+// Return log2 of power of 2 'value'
+static uint32_t ice_mlx5_log2(uint32_t value) {
+  return (uint32_t)__builtin_ctz(value);
+}
+
+int ice_mlx5_initialize_striding_rq(struct Session *session, struct Mlx5StridingRq *rq) {
+  assert(session);
+  assert(session->recv);
+  assert(session->common);
+  assert(session->userParam);
+  assert(session->userParam->stridesPerWqe>0);
+  assert(rq);
+
+  const struct UserParam *param = session->userParam;
+  struct SessionCommon *common = session->common;
+  const struct mlx5dv_striding_rq_caps *caps = &common->contextExtended.striding_rq_caps;
+
+  memset(rq, 0, sizeof(struct Mlx5StridingRq));
+
+  // Device must do striding RQs on raw packet QPs at this geometry
+  if (0==(common->contextExtended.comp_mask & MLX5DV_CONTEXT_MASK_STRIDING_RQ) ||
+      0==(caps->supported_qpts & (1u<<IBV_QPT_RAW_PACKET))) {
+    fprintf(stderr, "warn : ice_mlx5_initialize_striding_rq: device has no striding RQ for raw packet QPs\n");
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  // Same geometry 'ice_mlx5_allocate_session' sized the arena for
+  ice_mlx5_striding_geometry(param, caps->min_single_stride_log_num_of_bytes, &rq->strideShift, &rq->bufferCount);
+  rq->strideSize = 1u<<rq->strideShift;
+  rq->strideCount = param->stridesPerWqe;
+  const uint32_t strideCountShift = ice_mlx5_log2(rq->strideCount);
+  if (rq->strideShift>caps->max_single_stride_log_num_of_bytes ||
+      strideCountShift<caps->min_single_wqe_log_num_of_strides ||
+      strideCountShift>caps->max_single_wqe_log_num_of_strides) {
+    fprintf(stderr, "warn : ice_mlx5_initialize_striding_rq: %u strides of %u bytes outside device caps: "
+      "strides [%u,%u], stride bytes [%u,%u]\n", rq->strideCount, rq->strideSize,
+      1u<<caps->min_single_wqe_log_num_of_strides, 1u<<caps->max_single_wqe_log_num_of_strides,
+      1u<<caps->min_single_stride_log_num_of_bytes, 1u<<caps->max_single_stride_log_num_of_bytes);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  // Stride buffers come from the session arena; 'ice_mlx5_allocate_session' left room for them
+  const uint64_t bufferBytes = (uint64_t)rq->bufferCount*rq->strideCount << rq->strideShift;
+  if (0==(rq->buffer = (uint8_t *)ice_arena_allocate(&session->arena, bufferBytes))) {
+    return ICE_IB_ERROR_NO_MEMORY;
+  }
+  if (0==(rq->mr = ibv_reg_mr(common->pd, rq->buffer, bufferBytes, IBV_ACCESS_LOCAL_WRITE))) {
+    int rc = errno;
+    fprintf(stderr, "warn : ice_mlx5_initialize_striding_rq: ibv_reg_mr failed: %s (errno %d)\n", strerror(rc), rc);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  // Own CQ so compression is set at creation; 64 byte CQEs so mini-CQE arrays fill whole slots
+  if (param->cqeFormat && (0==(common->contextExtended.comp_mask & MLX5DV_CONTEXT_MASK_CQE_COMPRESION) ||
+      common->contextExtended.cqe_comp_caps.max_num==0 ||
+      0==(common->contextExtended.cqe_comp_caps.supported_format & param->cqeFormat))) {
+    fprintf(stderr, "warn : ice_mlx5_initialize_striding_rq: device cannot compress CQEs to mini-CQE format 0x%x "
+      "(supported 0x%x)\n", param->cqeFormat, common->contextExtended.cqe_comp_caps.supported_format);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+  struct ibv_cq_init_attr_ex cqAttr;
+  memset(&cqAttr, 0, sizeof(cqAttr));
+  cqAttr.cqe = MAX_COMPLETION_QUEUE_ENTRIES;
+  struct mlx5dv_cq_init_attr dvCqAttr;
+  memset(&dvCqAttr, 0, sizeof(dvCqAttr));
+  dvCqAttr.comp_mask = MLX5DV_CQ_INIT_ATTR_MASK_CQE_SIZE;
+  dvCqAttr.cqe_size = 64;
+  if (param->cqeFormat) {
+    dvCqAttr.comp_mask |= MLX5DV_CQ_INIT_ATTR_MASK_COMPRESSED_CQE;
+    dvCqAttr.cqe_comp_res_format = param->cqeFormat;
+  }
+  if (0==(rq->cq = mlx5dv_create_cq(common->context, &cqAttr, &dvCqAttr))) {
+    int rc = errno;
+    fprintf(stderr, "warn : ice_mlx5_initialize_striding_rq: mlx5dv_create_cq failed: %s (errno %d)\n",
+      strerror(rc), rc);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+  rq->cqeFormat = param->cqeFormat;
+
+  struct ibv_wq_init_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.wq_type = IBV_WQT_RQ;
+  attr.max_wr = rq->bufferCount;
+  attr.max_sge = 1;
+  attr.pd = common->pd;
+  attr.cq = ibv_cq_ex_to_cq(rq->cq);
+
+  struct mlx5dv_wq_init_attr dvAttr;
+  memset(&dvAttr, 0, sizeof(dvAttr));
+  dvAttr.comp_mask = MLX5DV_WQ_INIT_ATTR_MASK_STRIDING_RQ;
+  dvAttr.striding_rq_attrs.single_stride_log_num_of_bytes = rq->strideShift;
+  dvAttr.striding_rq_attrs.single_wqe_log_num_of_strides = strideCountShift;
+
+  if (0==(rq->wq = mlx5dv_create_wq(common->context, &attr, &dvAttr))) {
     int rc = errno;
-    fprintf(stderr, "warn : ice_verb_initialize_endpoint: inet_pton failed on '%s': %s (errno %d)\n",
-      ipAddr, strerror(rc), rc);
-    valid = 0;
+    fprintf(stderr, "warn : ice_mlx5_initialize_striding_rq: mlx5dv_create_wq failed: %s (errno %d)\n",
+      strerror(rc), rc);
+    return ICE_IB_ERROR_API_ERROR;
   }
 
-  // Get IPV4 UDP port into network ready binary format
-  endpoint->port = htons(port);
+  struct mlx5dv_rwq dvRwq;
+  struct mlx5dv_cq dvCq;
+  struct mlx5dv_obj obj;
+  memset(&dvRwq, 0, sizeof(dvRwq));
+  memset(&dvCq, 0, sizeof(dvCq));
+  memset(&obj, 0, sizeof(obj));
+  obj.rwq.in = rq->wq;
+  obj.rwq.out = &dvRwq;
+  obj.cq.in = ibv_cq_ex_to_cq(rq->cq);
+  obj.cq.out = &dvCq;
 
-  // Get IP MAC addreses into network ready binary format
-  uint32_t macData[6];
-  if (MAC_ADDR_SIZE!=(sscanf(mac, "%02x:%02x:%02x:%02x:%02x:%02x",
-    macData+0, macData+1, macData+2,
-    macData+3, macData+4, macData+5))) {
+  int rc = mlx5dv_init_obj(&obj, MLX5DV_OBJ_RWQ | MLX5DV_OBJ_CQ);
+  if (rc!=0) {
+    fprintf(stderr, "warn : ice_mlx5_initialize_striding_rq: mlx5dv_init_obj failed: %s (errno %d)\n",
+      strerror(rc), rc);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+  if (dvRwq.wqe_cnt<rq->bufferCount || (dvRwq.wqe_cnt & (dvRwq.wqe_cnt-1))!=0 ||
+      dvRwq.stride<sizeof(struct mlx5_mprq_wqe) || dvCq.cqe_size!=64) {
+    fprintf(stderr, "warn : ice_mlx5_initialize_striding_rq: unsupported WQ: stride %u, wqe count %u, cqe size %u\n",
+      dvRwq.stride, dvRwq.wqe_cnt, dvCq.cqe_size);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+  rq->wqBuf = (uint8_t *)dvRwq.buf;
+  rq->wqeCount = dvRwq.wqe_cnt;
+  rq->wqeStride = dvRwq.stride;
+  rq->wqDbrec = dvRwq.dbrec;
+  rq->cqBuf = (uint8_t *)dvCq.buf;
+  rq->cqeCount = dvCq.cqe_cnt;
+  rq->cqeSize = dvCq.cqe_size;
+  rq->cqDbrec = dvCq.dbrec;
+
+  // Ring slot 's' always points at buffer 's mod bufferCount' so a consumed WQE is re-posted by doorbell alone: the
+  // slot it's re-posted into names the buffer it just released. A larger ring than asked keeps that true since both
+  // counts are powers of 2
+  for (uint32_t i=0; i<rq->wqeCount; ++i) {
+    struct mlx5_mprq_wqe *wqe = (struct mlx5_mprq_wqe *)(rq->wqBuf + (uint64_t)i*rq->wqeStride);
+    memset(&wqe->nseg, 0, sizeof(wqe->nseg));
+    mlx5dv_set_data_seg(&wqe->dseg, rq->strideCount << rq->strideShift, rq->mr->lkey,
+      (uint64_t)(rq->buffer + ((uint64_t)(i & (rq->bufferCount-1))*rq->strideCount << rq->strideShift)));
+  }
+
+  struct ibv_wq_attr wqAttr;
+  memset(&wqAttr, 0, sizeof(wqAttr));
+  wqAttr.attr_mask = IBV_WQ_ATTR_STATE;
+  wqAttr.wq_state = IBV_WQS_RDY;
+  if (0!=ibv_modify_wq(rq->wq, &wqAttr)) {
     int rc = errno;
-    fprintf(stderr, "warn : ice_verb_initialize_endpoint: MAC address invalid '%s': %s (errno %d)\n",
-      mac, strerror(rc), rc);
-    valid = 0;
+    fprintf(stderr, "warn : ice_mlx5_initialize_striding_rq: ibv_modify_wq failed: %s (errno %d)\n",
+      strerror(rc), rc);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  struct ibv_rwq_ind_table_init_attr tableAttr;
+  memset(&tableAttr, 0, sizeof(tableAttr));
+  tableAttr.log_ind_tbl_size = 0;
+  tableAttr.ind_tbl = &rq->wq;
+  if (0==(rq->indTable = ibv_create_rwq_ind_table(common->context, &tableAttr))) {
+    int rc = errno;
+    fprintf(stderr, "warn : ice_mlx5_initialize_striding_rq: ibv_create_rwq_ind_table failed: %s (errno %d)\n",
+      strerror(rc), rc);
+    return ICE_IB_ERROR_API_ERROR;
   }
-  for (uint16_t i=0; i<MAC_ADDR_SIZE; ++i) {
-    endpoint->mac[i] = (uint8_t)(macData[i] & 0xff);
+
+  struct ibv_qp_init_attr_ex qpAttr;
+  memset(&qpAttr, 0, sizeof(qpAttr));
+  qpAttr.qp_type = IBV_QPT_RAW_PACKET;
+  qpAttr.comp_mask = IBV_QP_INIT_ATTR_PD | IBV_QP_INIT_ATTR_IND_TABLE | IBV_QP_INIT_ATTR_RX_HASH;
+  qpAttr.pd = common->pd;
+  qpAttr.rwq_ind_tbl = rq->indTable;
+  qpAttr.rx_hash_conf.rx_hash_function = IBV_RX_HASH_FUNC_TOEPLITZ;
+  qpAttr.rx_hash_conf.rx_hash_key_len = sizeof(MLX5_STRIDING_RSS_KEY);
+  qpAttr.rx_hash_conf.rx_hash_key = MLX5_STRIDING_RSS_KEY;
+  qpAttr.rx_hash_conf.rx_hash_fields_mask = 0;
+  if (0==(rq->qp = ibv_create_qp_ex(common->context, &qpAttr))) {
+    int rc = errno;
+    fprintf(stderr, "warn : ice_mlx5_initialize_striding_rq: ibv_create_qp_ex failed: %s (errno %d)\n",
+      strerror(rc), rc);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  // Fill the ring then steer the flow
+  rq->wqHead = rq->bufferCount;
+  ICE_MLX5_COMPILER_BARRIER();
+  rq->wqDbrec[MLX5_RCV_DBR] = htobe32(rq->wqHead & 0xffff);
+  if (0==(rq->flow = ice_verb_create_flow(rq->qp, param->portId, &session->server,
+    ice_verb_flow_wildcards(param), param->flowCount))) {
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  fprintf(stderr, "info : ice_mlx5_initialize_striding_rq: %u WQEs posted of %u, %u strides of %u bytes each, "
+    "%lu bytes, CQE compression %s\n", rq->bufferCount, rq->wqeCount, rq->strideCount, rq->strideSize, bufferBytes,
+    ice_mlx5_cqe_format_name(rq->cqeFormat));
+
+  return 0;
+}
+
+int ice_mlx5_deinitialize_striding_rq(struct Mlx5StridingRq *rq) {
+  assert(rq);
+
+  if (rq->flow) {
+    ibv_destroy_flow(rq->flow);
+  }
+  if (rq->qp) {
+    ibv_destroy_qp(rq->qp);
+  }
+  if (rq->indTable) {
+    ibv_destroy_rwq_ind_table(rq->indTable);
+  }
+  if (rq->wq) {
+    ibv_destroy_wq(rq->wq);
+  }
+  if (rq->cq) {
+    ibv_destroy_cq(ibv_cq_ex_to_cq(rq->cq));
+  }
+  if (rq->mr) {
+    ibv_dereg_mr(rq->mr);
+  }
+
+  memset(rq, 0, sizeof(struct Mlx5StridingRq));
+
+  return 0;
+}
+
+// Read the next completion of 'rq' into '*byteCount' ('mlx5_cqe64::byte_cnt' layout) and '*stride', the stride its
+// packet starts at. Compressed sessions are expanded one mini-CQE per call. Return 1 if a completion was read, 0 if
+// none is ready and -1 on an error CQE
+static inline int ice_mlx5_striding_next(struct Mlx5StridingRq *rq, uint32_t *byteCount, uint32_t *stride) {
+  const uint32_t mask = rq->cqeCount-1;
+
+  if (rq->zipCount==0) {
+    uint8_t *entry = rq->cqBuf + (rq->ci & mask)*rq->cqeSize;
+    // 128 byte CQEs carry the 64 byte CQE in their second half
+    struct mlx5_cqe64 *cqe = (struct mlx5_cqe64 *)(rq->cqeSize==64 ? entry : entry+64);
+
+    const uint8_t opcode = mlx5dv_get_cqe_opcode(cqe);
+    if (opcode==MLX5_CQE_INVALID || (mlx5dv_get_cqe_owner(cqe) ^ !!(rq->ci & rq->cqeCount))) {
+      return 0;
+    }
+    ICE_MLX5_COMPILER_BARRIER();
+
+    if (opcode!=MLX5_CQE_RESP_SEND) {
+      struct mlx5_err_cqe *err = (struct mlx5_err_cqe *)cqe;
+      fprintf(stderr, "warn : ice_mlx5_striding_next: CQE opcode 0x%x, syndrome 0x%x, vendor syndrome 0x%x\n",
+        opcode, err->syndrome, err->vendor_err_synd);
+      return -1;
+    }
+
+    if (__builtin_expect(mlx5dv_get_cqe_format(cqe)!=MLX5_CQE_FORMAT_COMPRESSED, 1)) {
+      *byteCount = be32toh(cqe->byte_cnt);
+      *stride = be16toh(cqe->wqe_counter);
+      rq->cqeBytes += rq->cqeSize;
+      ++rq->ci;
+      return 1;
+    }
+
+    // Title of a compressed session: 'byte_cnt' counts its mini-CQEs
+    rq->zipCount = be32toh(cqe->byte_cnt);
+    rq->zipIndex = 0;
+    rq->cqeBytes += 64*(1+(rq->zipCount+MLX5_MINI_CQE_PER_ARRAY-1)/MLX5_MINI_CQE_PER_ARRAY);
+    ++rq->zipSessions;
+  }
+
+  const uint32_t index = rq->zipIndex;
+  const uint32_t slot = rq->ci + (index<MLX5_MINI_CQE_PER_ARRAY ? 1 : (index & ~(MLX5_MINI_CQE_PER_ARRAY-1)));
+  const struct Mlx5MiniCqe *mini = (const struct Mlx5MiniCqe *)(rq->cqBuf + (slot & mask)*64) +
+    (index & (MLX5_MINI_CQE_PER_ARRAY-1));
+  *byteCount = be32toh(mini->byteCount);
+  // Hash mini-CQEs have no stride index but packets take strides in order
+  *stride = rq->cqeFormat==MLX5DV_CQE_RES_FORMAT_CSUM_STRIDX ? be16toh(mini->strideIndex) : rq->strideConsumed;
+
+  if (++rq->zipIndex==rq->zipCount) {
+    // Array slots hold mini-CQEs where the owner byte would be so mark every slot of the session invalid before the
+    // NIC comes round again
+    for (uint32_t i=0; i<rq->zipCount; ++i) {
+      ((struct mlx5_cqe64 *)(rq->cqBuf + ((rq->ci+i) & mask)*64))->op_own = MLX5_CQE_INVALID << 4;
+    }
+    rq->ci += rq->zipCount;
+    rq->zipCount = 0;
+  }
+
+  return 1;
+}
+
+int ice_mlx5_striding_recv_loop(struct Mlx5StridingRq *rq, uint64_t iters, const struct RecvCheck *check,
+  struct RunResult *result) {
+  assert(rq);
+  assert(result);
+
+  const uint32_t bufferMask = rq->bufferCount-1;
+  uint64_t received = 0;                                      // packets received so far
+  uint64_t idlePolls = 0;                                     // consecutive empty polls
+  struct timespec idleTime;
+  struct StatsCounters *counters = &result->counters;
+
+  memset(result, 0, sizeof(struct RunResult));
+  memset(&idleTime, 0, sizeof(idleTime));
+
+  while (received<iters) {
+    const uint32_t priorCi = rq->ci;
+    const uint32_t priorHead = rq->wqHead;
+    const uint64_t now = check ? __rdtsc() : 0;
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    uint32_t completions = 0;
+
+    for (; completions<MAX_POLL_ENTRIES; ++completions) {
+      uint32_t byteCount, stride;
+      const int rc = ice_mlx5_striding_next(rq, &byteCount, &stride);
+      if (rc==0) {
+        break;
+      } else if (rc<0) {
+        ice_stats_add(&counters->errors, 1);
+        return ICE_IB_ERROR_API_ERROR;
+      }
+
+      // A packet starts at stride 'stride' of the WQE being filled. Filler completions only give back the strides
+      // left at a WQE's end
+      if (0==(byteCount & MLX5_MPRQ_FILLER)) {
+        if (check) {
+          const uint64_t offset = ((uint64_t)(rq->wqTail & bufferMask)*rq->strideCount + stride) << rq->strideShift;
+          ice_verb_check_packet(check, (const struct IPV4Packet *)(rq->buffer + offset), now);
+        }
+        bytes += byteCount & MLX5_MPRQ_LEN_MASK;
+        ++packets;
+      }
+
+      // Every stride of the WQE used: the NIC moved on so it can be posted again
+      rq->strideConsumed += (byteCount >> MLX5_MPRQ_STRIDE_NUM_SHIFT) & MLX5_MPRQ_STRIDE_NUM_MASK;
+      if (rq->strideConsumed>=rq->strideCount) {
+        rq->strideConsumed = 0;
+        ++rq->wqTail;
+        ++rq->wqHead;
+      }
+    }
+
+    ice_stats_add(&counters->polls, 1);
+    if (completions==0) {
+      ice_stats_add(&counters->emptyPolls, 1);
+      if (received>0 && ice_verb_idle_timeout(idlePolls++, &idleTime)) {
+        fprintf(stderr, "warn : ice_mlx5_striding_recv_loop: idle timeout: received %lu of %lu packets\n",
+          received, iters);
+        break;
+      }
+      continue;
+    }
+
+    ICE_MLX5_COMPILER_BARRIER();
+    if (rq->ci!=priorCi) {
+      *rq->cqDbrec = htobe32(rq->ci & 0xffffff);
+    }
+    if (rq->wqHead!=priorHead) {
+      rq->wqDbrec[MLX5_RCV_DBR] = htobe32(rq->wqHead & 0xffff);
+    }
+
+    if (received==0 && packets>0) {
+      clock_gettime(CLOCK_MONOTONIC, &result->startTime);
+    }
+    idlePolls = 0;
+    received += packets;
+    ice_stats_add(&counters->completions, completions);
+    ice_stats_add(&counters->bytes, bytes);
+    ice_stats_set(&counters->packets, received);
+  }
+
+  // Don't count trailing idle time
+  if (received<iters && received>0) {
+    result->endTime = idleTime;
+  } else {
+    clock_gettime(CLOCK_MONOTONIC, &result->endTime);
+  }
+  if (received==0) {
+    result->startTime = result->endTime;
+  }
+
+  return 0;
+}
+
+int ice_mlx5_run_striding_server(struct Session *session, struct Mlx5StridingRq *rq) {
+  assert(session);
+  assert(session->common);
+  assert(session->userParam);
+  assert(rq);
+
+  struct RunResult result;
+  struct RecvCheck check;
+  struct SequenceTracker sequence;
+  const uint32_t wqesPosted = rq->wqHead;
+  const uint64_t cqeBytes = rq->cqeBytes;
+  const uint64_t zipSessions = rq->zipSessions;
+  ice_verb_initialize_check(session->userParam, session->common, &check);
+  ice_verb_start_stats(session, &result);
+  int rc = ice_mlx5_striding_recv_loop(rq, session->userParam->iters, &check, &result);
+  ice_stats_stop(&session->stats);
+  if (rc==0) {
+    const uint64_t packets = result.counters.packets;
+    const uint64_t completions = result.counters.completions;
+    const double elapsedNs = ice_verb_elapsed_ns(&result);
+    ice_verb_print_result("ice_mlx5_run_striding_server", &result);
+    fprintf(stderr, "info : ice_mlx5_run_striding_server: %u strides of %u bytes per WQE, WQEs re-posted %u, "
+      "packets per re-post %.1f\n", rq->strideCount, rq->strideSize, rq->wqHead-wqesPosted,
+      rq->wqHead>wqesPosted ? (double)packets/(rq->wqHead-wqesPosted) : 0.0);
+
+    // PCIe CQE traffic against one 64 byte CQE per completion
+    const uint64_t written = rq->cqeBytes-cqeBytes;
+    const uint64_t uncompressed = completions*64;
+    fprintf(stderr, "info : ice_mlx5_run_striding_server: CQE compression %s, completions %lu, %.3f M/sec, "
+      "compressed sessions %lu, CQE bytes written %lu, saved %lu (%.1f%%, %.1f bytes per packet)\n",
+      ice_mlx5_cqe_format_name(rq->cqeFormat), completions, elapsedNs>0 ? (double)completions*1e3/elapsedNs : 0.0,
+      rq->zipSessions-zipSessions, written, uncompressed>written ? uncompressed-written : 0,
+      uncompressed>written ? 100.0*(double)(uncompressed-written)/(double)uncompressed : 0.0,
+      packets>0 && uncompressed>written ? (double)(uncompressed-written)/(double)packets : 0.0);
+
+    ice_verb_print_check("ice_mlx5_run_striding_server", &check, session->userParam->iters, &sequence);
+    rc = ice_report_write(session->userParam, "mlx5-striding-server", 1, &result, check.latency, "one-way",
+      &sequence);
   }
 
-  return valid ? 0 : ICE_IB_ERROR_BAD_IP_ADDR;
+  return rc;
 }
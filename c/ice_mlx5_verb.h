@@ -1,149 +1,115 @@
 #pragma once
 
-#include <ib.h>
-#include <umad.h>
-#include <verbs.h>
-#include <mlx5dv.h>
-#include <mlx5_api.h>
-
-static const uint64_t HUGEPAGE_ALIGN_2MB = 0x200000;
-static const uint64_t CPU_CACHE_LINE_SIZE_BYTES = 64;
-static const uint64_t CPU_CACHE_LINE_SIZE_MASK = (64-1);
+#include <ice_verb.h>
 
 // ---------------------------------------------------
 // ENUMERATIONS
 // ---------------------------------------------------
 
-enum kMAX {
-  MAC_ADDR_SIZE = 6,
-  MAX_QUEUE_ENTRIES = 1024,
-  MAX_PACKET_ENTRIES = 4096,
-};
-
-// define to not conflict with errno
-enum ICE_IB_Error {
-  ICE_IB_ERROR_NO_DEVICE = -1,        // Zero eligble IB devices found
-  ICE_IB_ERROR_NO_MEMORY = -2,        // Memory allocation failed
-  ICE_IB_ERROR_BAD_IP_ADDR = -3,      // Bad textual MAC or IPV4 IP addresses 
-  ICE_IB_ERROR_API_ERROR = -4,        // API error not enumerated elsewhere
-  ICE_IB_ERROR_MAX = -5,
+enum kMLX5 {
+  MLX5_INLINE_HEADER_SIZE = 18,                               // L2 header bytes inlined in ethernet segment
+  MLX5_SEND_WQE_DS = 4,                                       // 16-byte segments in one ctrl+eth+data WQE
+  MLX5_STRIDING_MIN_WQES = 4,                                 // striding RQ WQEs posted at least; NIC fills one ahead
+  MLX5_STRIDING_MIN_STRIDE_SIZE = 64,                         // smallest stride; one cache line
+  MLX5_MINI_CQE_PER_ARRAY = 8,                                // mini-CQEs packed in one 64 byte CQE slot
+  // Enhanced MPW opcode and opmod as DPDK drivers/common/mlx5/mlx5_prm.h and Linux mlx5e en_tx.c (mlx5e_tx_mpwqe_*)
+  // post them
+  MLX5_OPCODE_ENHANCED_MPSW = 0x29,                           // enhanced multi-packet send; not in mlx5dv.h
+  MLX5_OPC_MOD_ENHANCED_MPSW = 0x00,
+  MLX5_WQE_DS_SIZE = 16,                                      // bytes per WQE data segment (DS)
+  MLX5_WQE_MAX_DS = 63,                                       // DS per WQE; 'qpn_ds' has 6 bits for it
+  MLX5_EMPW_MAX_PACKETS = 32,                                 // packets per enhanced MPW WQE
+  MLX5_CMD_QUERY_HCA_CAP = 0x100,                             // DevX command opcodes
+  MLX5_CMD_QUERY_NIC_VPORT_CONTEXT = 0x754,
+  MLX5_CMD_HEADER_SIZE = 16,                                  // bytes of command output before its payload
+  MLX5_CMD_HCA_CAP_SIZE = 4096,                               // bytes of one HCA capability page
+  MLX5_CMD_NIC_VPORT_CONTEXT_SIZE = 256,                      // bytes of 'nic_vport_context'
+  MLX5_HCA_CAP_ETH_OFFLOADS_CUR = 0x3,                        // QUERY_HCA_CAP op_mod: current ethernet offload caps
+  MLX5_CAP_INLINE_MODE_VPORT_CONTEXT = 1,                     // 'wqe_inline_mode': vport's 'min_wqe_inline_mode' says
+  MLX5_CAP_INLINE_MODE_NOT_REQUIRED = 2,                      // 'wqe_inline_mode': no inline headers needed
 };
 
 // ---------------------------------------------------
 // TYPES
 // ---------------------------------------------------
 
-// Application payload in packets
-struct Payload {
-  uint64_t                  sequenceId;                       // payload sequence number
-  uint64_t                  createTimestamp;                  // rdtsc value when packet created
-};
-
-#pragma pack(push,1)
-// Assumes little endian callers
-struct IPHeader {
-  uint8_t                   dstMac[6];
-  uint8_t                   srcMac[6];
-  uint16_t                  ethType;
-};
-
-// Assumes little endian callers
-struct IPV4Header {
-  uint8_t                   ihl:4;
-  uint8_t                   version:4;
-  uint8_t                   typeOfService;
-  uint16_t                  size;
-  uint16_t                  packetId;
-  uint16_t                  fragmentOffset;
-  uint8_t                   ttl;
-  uint8_t                   nextProtoId;
-  uint16_t                  checksum;
-  uint32_t                  srcIpAddr;
-  uint32_t                  dstIpAddr;
-};
-
-// Assumes little endian callers
-struct IPV4UDPHeader {
-  uint16_t                  srcPort;
-  uint16_t                  dstPort;
-  uint16_t                  size;
-  uint16_t                  checksum;
-};
-
-// Assumes little endian callers
-struct IPV4Packet {
-  struct IPHeader           ip_header;
-  struct IPV4Header         ipv4_header;
-  struct IPV4UDPHeader      ipv4udp_header;
-  strucy Payload            payload;
+// Send queue and its completion queue exposed by mlx5dv_init_obj. WQEs
+// are written straight into 'sqBuf' and completions read straight out of
+// 'cqBuf' bypassing ibv_post_send and ibv_poll_cq
+struct Mlx5SendQueue {
+  uint8_t                   *sqBuf;                           // send WQE ring
+  uint32_t                  sqWqeCount;                       // number of WQE basic blocks in 'sqBuf'; power of 2
+  uint32_t                  sqStride;                         // bytes per WQE basic block
+  volatile __be32           *qpDbrec;                         // QP doorbell record; send counter at MLX5_SND_DBR
+  uint8_t                   *bfReg;                           // BlueFlame/doorbell register in UAR page
+  uint32_t                  bfSize;                           // BlueFlame buffer size; 0 if no BlueFlame
+  uint32_t                  bfOffset;                         // alternates between the two BlueFlame buffers
+  uint32_t                  qpNum;                            // QP number stamped in ctrl segments
+  uint32_t                  pi;                               // producer index in WQE basic blocks
+  uint64_t                  wqes;                             // WQEs posted so far
+  uint64_t                  doorbells;                        // doorbells rung so far
+  uint8_t                   useMpw;                           // enhanced MPW WQEs per 'UserParam::packetsPerWqe'
+  uint8_t                   mpwInline;                        // device wants inline headers: eMPW inlines packets
+
+  uint8_t                   *cqBuf;                           // CQE ring
+  uint32_t                  cqeCount;                         // number of CQEs in 'cqBuf'; power of 2
+  uint32_t                  cqeSize;                          // bytes per CQE (64 or 128)
+  volatile __be32           *cqDbrec;                         // CQ doorbell record; consumer index at 0
+  uint32_t                  ci;                               // CQ consumer index
 };
-#pragma pack(pop)
 
-struct IPV4UDPEndpoint {
-  uint32_t                  ipAddr;                           // IPV4 address (192.16.0.2) in network binary format
-  uint16_t                  port;                             // server IPV4 port in network binary format
-  uint8_t                   mac[MAC_ADDR_SIZE];               // MAC address in network binary format
-};
-
-struct UserParam {
-  char                      deviceId[64];
-  char                      clientMac[64];
-  char                      serverMac[64];
-  char                      clientIpAddr[64];
-  char                      serverIpAddr[64];
-  uint16_t                  clientPort;
-  uint16_t                  serverPort;
-  uint32_t                  iters;                            // number of packets to send (and receive)
-  uint32_t                  portId;                           // some NICs are dual port. one-based
-  uint8_t                   isServer;
-};
-
-struct HugePageMemory {
-  const void                *hugePageMemory;                  // pointer to allocated memory
-  uint64_t                  requestSizeBytes;                 // how much requested
-  uint64_t                  actualSizeBytes;                  // actual alloc rounded up to nearest HUGEPAGE_ALIGN_2MB
-  uint32_t                  shmid;                            // shared memory handle to huge memory
-};
-
-struct Queue {
-  struct ibv_mr             *mr;                              // memory registration [start, end)
-  struct ibv_cq             *cq;                              // completion queue
-  struct ibv_sge            sqe[MAX_QUEUE_ENTRIES];           // scatter-gather memory (to send or receive into)
+// One 8 byte mini-CQE of a compressed CQE session; which of the first two forms per the CQ's 'cqe_comp_res_format'.
+// Fields not here (opcode, flow, timestamp ...) are the session's title CQE's
+struct Mlx5MiniCqe {
   union {
-    struct ibv_send_wr      wsq[MAX_QUEUE_ENTRIES];           // work request queue (for senders)
-    struct ibv_recv_wr      wrq[MAX_QUEUE_ENTRIES];           // work request queue (for receivers)
+    __be32                  rxHashResult;                     // MLX5DV_CQE_RES_FORMAT_HASH
+    struct {
+      __be16                checksum;                         // MLX5DV_CQE_RES_FORMAT_CSUM_STRIDX
+      __be16                strideIndex;                      // stride the packet starts at
+    };
   };
-  uint32_t                  pktReadIndex;                     // read  index
-  uint32_t                  pktWriteIndex;                    // write index for next packet (write or read into)
-  struct IPV4Packet         packet[MAX_PACKET_ENTRIES];       // packet memory to send via queue (or receive into)
+  __be32                    byteCount;                        // as 'mlx5_cqe64::byte_cnt'
 };
 
-struct SessionCommon {
-  struct ibv_qp             *qp;                              // queue pair coordinating send/recv members
-  struct ibv_pd             *pd;                              // memory protection domain (for multiple memory regions)
-  struct ibv_context        *context;                         // NIC device context
-  struct ibv_device         *device;                          // the device this session operates on
-  struct ibv_device         **deviceList;                     // all known devices at initialize time
-
-  struct ibv_port_attr       portData;                        // port data in NIC this session is on
-  struct mlx5dv_context_attr contextAttrs;                    // attributes 'context' created with
-  struct mlx5dv_context      contextExtended;                 // other data not in 'context'
-  struct mlx5dv_port         portDataExtended;                // other data not in 'portData'
-};
-
-struct Session {
-  struct Queue              *send;                            // conveneince pointer into 'sendMemory' memory
-  struct Queue              *recv;                            // conveneince pointer into 'recvMemory' memory
-  struct SessionCommon      *common;                          // conveneince pointer into 'cmmnMemory' memory
-
-  struct HugePageMemory     sendMemory;                       // huge page memory for send work
-  struct HugePageMemory     recvMemory;                       // huge page memory for receive work
-  struct HugePageMemory     cmmnMemory;                       // huge page memory for data common to send, recv
-
-  struct IPV4UDPEndpoint    server;                           // server endpoint in binary network order
-  struct IPV4UDPEndpoint    client;                           // client endpoint in binary network order
-
-  const struct UserParam    *userParam;                       // not owned
+// Striding (multi-packet) receive queue. Each WQE is one buffer of 'strideCount' 'strideSize' byte strides the NIC
+// fills with consecutive packets, one CQE per packet naming its first stride. Packets are parsed where they landed and
+// a WQE is re-posted, by doorbell alone since its buffer never changes, once the NIC has consumed all its strides.
+// Flows steer to an RSS QP over the one WQ; the session QP receives nothing.
+//
+// With CQE compression the NIC writes runs of completions as one title CQE followed by arrays of 8 mini-CQEs, one 64
+// byte slot per array, so a run of N completions costs 64*(1+ceil(N/8)) bytes of PCIe writes rather than 64*N.
+// Mini-CQE array 0 is the slot after the title and array 'j>0' is 'j*8' slots past it
+struct Mlx5StridingRq {
+  struct ibv_wq             *wq;                              // striding RQ from mlx5dv_create_wq
+  struct ibv_rwq_ind_table  *indTable;                        // indirection table holding only 'wq'
+  struct ibv_qp             *qp;                              // RSS QP over 'indTable' flows steer to
+  struct ibv_flow           *flow;                            // flow steering 'qp' receives on
+  struct ibv_mr             *mr;                              // registration of 'buffer'
+  uint8_t                   *buffer;                          // buffer 'i's strides at 'i*strideCount*strideSize'
+  uint32_t                  bufferCount;                      // buffers in 'buffer'; power of 2 <= 'wqeCount'
+  uint32_t                  strideSize;                       // bytes per stride; power of 2
+  uint32_t                  strideCount;                      // strides per WQE; power of 2
+  uint32_t                  strideShift;                      // log2 'strideSize'
+
+  uint8_t                   *wqBuf;                           // WQE ring of 'struct mlx5_mprq_wqe'
+  uint32_t                  wqeCount;                         // WQEs in 'wqBuf'; power of 2
+  uint32_t                  wqeStride;                        // bytes per WQE in 'wqBuf'
+  volatile __be32           *wqDbrec;                         // WQ doorbell record; receive counter at MLX5_RCV_DBR
+  uint32_t                  wqHead;                           // WQEs posted so far
+  uint32_t                  wqTail;                           // WQEs consumed so far; NIC fills WQE 'wqTail'
+  uint32_t                  strideConsumed;                   // strides of WQE 'wqTail' consumed
+
+  struct ibv_cq_ex          *cq;                              // 'wq's CQ from mlx5dv_create_cq
+  uint8_t                   *cqBuf;                           // CQE ring
+  uint32_t                  cqeCount;                         // number of CQEs in 'cqBuf'; power of 2
+  uint32_t                  cqeSize;                          // bytes per CQE (64 or 128)
+  volatile __be32           *cqDbrec;                         // CQ doorbell record; consumer index at 0
+  uint32_t                  ci;                               // CQ consumer index; a session's title until read
+  uint8_t                   cqeFormat;                        // MLX5DV_CQE_RES_FORMAT_* if compressed else 0
+  uint32_t                  zipCount;                         // mini-CQEs in the session at 'ci'; 0 if none
+  uint32_t                  zipIndex;                         // next mini-CQE of the session to read
+  uint64_t                  cqeBytes;                         // CQE bytes the NIC wrote so far
+  uint64_t                  zipSessions;                      // compressed sessions read so far
 };
 
 // ---------------------------------------------------
@@ -157,4 +123,48 @@ int ice_mlx5_query_devport(struct SessionCommon *common, int portId);
 int ice_mlx5_allocate_session(const struct UserParam *param, struct Session *session);
 int ice_mlx5_deallocate_session(struct Session *session);
 
-int ice_mlx5x_deinitalize_session_common(struct SessionCommon *common);
+// Expose 'session's send queue and send CQ through 'mlx5dv_init_obj' into 'sq'. Call after 'ice_verb_set_rts'.
+// Once called completions for 'session->send->cq' must only be read through 'ice_mlx5_poll_send_cq'. Multi-packet
+// WQEs ('userParam->packetsPerWqe') need MLX5DV_CONTEXT_FLAGS_ENHANCED_MPW. Return 0 on success and non-zero
+// otherwise.
+int ice_mlx5_initialize_send_queue(struct Session *session, struct Mlx5SendQueue *sq);
+
+// Return the number of WQEs completed according to CQEs read from 'sq's CQ or a negative value on a completion
+// error. '*completed' is the running count of completed WQEs and is advanced past each CQE's 'wqe_counter'.
+int ice_mlx5_poll_send_cq(struct Mlx5SendQueue *sq, uint64_t *completed);
+
+// Send 'iters' packets from a ring built by 'ice_verb_build_send_ring' by writing ethernet WQEs directly into 'sq'.
+// Each batch of 'param->txBatchSize' WQEs rings the doorbell once; single WQE batches go through BlueFlame when
+// 'param->useBlueFlame' is set. Every 'param->txSignalInterval'th WQE requests a CQE. Return 0 on success and
+// non-zero otherwise.
+int ice_mlx5_send_loop(struct Mlx5SendQueue *sq, struct Queue *queue, const struct UserParam *param, uint64_t iters,
+  struct RunResult *result);
+
+// As 'ice_mlx5_send_loop' but each WQE is an enhanced multi-packet send of up to 'param->packetsPerWqe' packets: one
+// ctrl and ethernet segment then a data segment per packet, or with 'param->useInline' the packet itself when it
+// fits the QP's inline size. Batches still ring one doorbell. Every 'param->txSignalInterval' packets the WQE
+// holding the last requests a CQE. Return 0 on success and non-zero otherwise.
+int ice_mlx5_send_loop_mpw(struct Mlx5SendQueue *sq, struct Queue *queue, const struct UserParam *param,
+  uint64_t iters, struct RunResult *result);
+
+// Direct path equivalent of 'ice_verb_run_client'
+int ice_mlx5_run_client(struct Session *session, struct Mlx5SendQueue *sq);
+
+// Return arena bytes 'ice_mlx5_initialize_striding_rq' needs under 'param' on a device whose strides are at least
+// 1<<'minStrideShift' bytes; 0 unless 'param->stridesPerWqe' is set
+uint64_t ice_mlx5_striding_rq_size(const struct UserParam *param, uint32_t minStrideShift);
+
+// Create a striding RQ of 'userParam->stridesPerWqe' packets per WQE with enough WQEs to buffer
+// 'userParam->rxQueueSize' packets, post every WQE and steer 'session->server' to it. Strides are the packet size
+// rounded up to a power of 2 within the device's striding RQ caps. The RQ's CQ compresses CQEs into
+// 'userParam->cqeFormat' mini-CQEs if set and the device can. Return 0 on success and non-zero otherwise
+int ice_mlx5_initialize_striding_rq(struct Session *session, struct Mlx5StridingRq *rq);
+int ice_mlx5_deinitialize_striding_rq(struct Mlx5StridingRq *rq);
+
+// Receive 'iters' packets from 'rq' reading CQEs directly and checking packets in place per 'check' if not null.
+// Return 0 on success and non-zero otherwise
+int ice_mlx5_striding_recv_loop(struct Mlx5StridingRq *rq, uint64_t iters, const struct RecvCheck *check,
+  struct RunResult *result);
+
+// Striding RQ equivalent of 'ice_verb_run_server'
+int ice_mlx5_run_striding_server(struct Session *session, struct Mlx5StridingRq *rq);
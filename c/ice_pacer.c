@@ -0,0 +1,19 @@
+#include <ice_pacer.h>
+#include <ice_tsc.h>
+
+#include <string.h>
+#include <assert.h>
+
+void ice_pacer_initialize(struct Pacer *pacer, double packetsPerSecond, uint64_t maxLag) {
+  assert(pacer);
+  assert(packetsPerSecond>=0);
+  assert(maxLag>0);
+
+  memset(pacer, 0, sizeof(struct Pacer));
+  pacer->maxLag = maxLag;
+  if (packetsPerSecond>0) {
+    pacer->ticksPerPacket = ice_tsc_ticks_per_ns()*1e9/packetsPerSecond;
+    pacer->packetsPerTick = 1.0/pacer->ticksPerPacket;
+  }
+  pacer->startTsc = __rdtsc();
+}
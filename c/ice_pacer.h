@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <x86intrin.h>
+
+// Software rate control on an rdtsc deadline schedule. Packet 'n' is due 'n' packet intervals after the schedule
+// starts. Senders ask how many packets are due and post only whole batches of due packets so pacing never costs
+// batching. A sender more than 'maxLag' packets behind restarts the schedule instead of bursting to catch up.
+
+struct Pacer {
+  uint64_t                  startTsc;                         // rdtsc at which packet 0 is due
+  double                    packetsPerTick;                   // target rate; 0 is unpaced
+  double                    ticksPerPacket;                   // 1/'packetsPerTick'
+  uint64_t                  maxLag;                           // packets behind schedule tolerated before restart
+  uint64_t                  restarts;                         // times sender fell more than 'maxLag' behind
+};
+
+// Start 'pacer's schedule now at 'packetsPerSecond'. Zero 'packetsPerSecond' makes every packet due immediately.
+// Call before a run's start time is taken: the first paced call calibrates rdtsc unless session setup already did
+void ice_pacer_initialize(struct Pacer *pacer, double packetsPerSecond, uint64_t maxLag);
+
+// Return how many packets after the first 'sent' are due now; UINT64_MAX if 'pacer' is unpaced
+static inline uint64_t ice_pacer_due(struct Pacer *pacer, uint64_t sent) {
+  if (pacer->packetsPerTick==0) {
+    return UINT64_MAX;
+  }
+
+  const uint64_t now = __rdtsc();
+  const uint64_t due = (uint64_t)((double)(now-pacer->startTsc)*pacer->packetsPerTick) + 1;
+  if (due<=sent) {
+    return 0;
+  }
+  if (due-sent>pacer->maxLag) {
+    // Move the schedule so exactly 'maxLag' packets are due now
+    pacer->startTsc = now - (uint64_t)((double)(sent+pacer->maxLag-1)*pacer->ticksPerPacket);
+    ++pacer->restarts;
+    return pacer->maxLag;
+  }
+
+  return due-sent;
+}
@@ -0,0 +1,397 @@
+#include <ice_param.h>
+#include <ice_worker.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static const char *programName = "ib";
+
+// Parse 'text' "<number>[k|M|G][pps|bps]" into '*value' units per second. '*isBits' is set for bps. Bare numbers are
+// pps. Return 0 on success and non-zero otherwise
+static int ice_param_parse_rate(const char *text, double *value, uint8_t *isBits) {
+  char *end;
+  *value = strtod(text, &end);
+  if (end==text || *value<=0) {
+    return -1;
+  }
+  switch (*end) {
+    case 'k':
+      *value *= 1e3;
+      ++end;
+      break;
+    case 'M':
+      *value *= 1e6;
+      ++end;
+      break;
+    case 'G':
+      *value *= 1e9;
+      ++end;
+      break;
+  }
+  *isBits = 0;
+  if (!strcmp(end, "bps")) {
+    *isBits = 1;
+  } else if (*end!=0 && strcmp(end, "pps")) {
+    return -1;
+  }
+  return 0;
+}
+
+// Parse 'text' "hash" or "csum" into '*format' the mlx5dv mini-CQE format compressed RX CQEs carry. Striding RQs
+// need the stride index so checksum mini-CQEs are the stride index variant. Return 0 on success and non-zero otherwise
+static int ice_param_parse_cqe_format(const char *text, uint8_t *format) {
+  if (!strcmp(text, "hash")) {
+    *format = MLX5DV_CQE_RES_FORMAT_HASH;
+  } else if (!strcmp(text, "csum")) {
+    *format = MLX5DV_CQE_RES_FORMAT_CSUM_STRIDX;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+void ice_param_initialize(struct UserParam *param) {
+  memset(param, 0, sizeof(struct UserParam));
+
+  strcpy(param->deviceId, "rocep1s0f1");
+  strcpy(param->clientMac, "08:c0:eb:d4:d0:df");
+  strcpy(param->serverMac, "08:c0:eb:d4:d0:df");
+  strcpy(param->clientIpAddr, "192.168.0.2");
+  strcpy(param->serverIpAddr, "192.168.0.2");
+  param->clientPort = 10011;
+  param->serverPort = 10013;
+  param->iters = 100;
+  param->portId = 1;
+  param->txQueueSize = 128;
+  param->rxQueueSize = 128;
+  param->txBatchSize = 16;
+  param->txSignalInterval = 32;
+  param->payloadSize = 32;
+  param->queueCount = 1;
+  param->firstCpu = -1;
+  param->tscPeerCpu = -1;
+  param->flowCount = 1;
+  param->flowDistribution = ICE_FLOW_DIST_ROUND_ROBIN;
+  param->flowFields = ICE_FLOW_FIELD_SRC_PORT;
+  param->flowZipfExponent = 1.0;
+  param->statsIntervalMs = 1000;
+  param->checksumMode = ICE_CHECKSUM_MODE_INCREMENTAL;
+  param->isServer = 0;
+}
+
+void ice_param_usage_and_exit(const struct UserParam *param) {
+  fprintf(stderr, "Benchmark IPV4 UDP packets over userspace verbs API.\n\n");
+  fprintf(stderr, "usage: %s ...options...\n\n", programName);
+  fprintf(stderr, "-d <string>      optional: infiniband device name from 'ibstats'; netdev with -T packet or xdp "
+    "(default %s)\n", param->deviceId);
+  fprintf(stderr, "-B <string>      optional: client ethernet MAC address (default %s)\n", param->clientMac);
+  fprintf(stderr, "-j <string>      optional: client IPV4 address (default %s)\n", param->clientIpAddr);
+  fprintf(stderr, "-E <string>      optional: server ethernet MAC address (default %s)\n", param->serverMac);
+  fprintf(stderr, "-J <string>      optional: server IPV4 address (default %s)\n", param->serverIpAddr);
+  fprintf(stderr, "-K <int>         optional: server IPV4 port (default %u) in [1025,65535)\n", param->serverPort);
+  fprintf(stderr, "-k <int>         optional: client IPV4 port (default %u) in [1025,65535)\n", param->clientPort);
+  fprintf(stderr, "-n <int>         optional: number of packets >0 to send (default %u)\n", param->iters);
+  fprintf(stderr, "-t <int>         optional: number of client TX request items (default %u) in [1,%d]\n",
+    param->txQueueSize, MAX_QUEUE_ENTRIES);
+  fprintf(stderr, "-r <int>         optional: number of server RX request items (default %u) in [1,%d]\n",
+    param->rxQueueSize, MAX_QUEUE_ENTRIES);
+  fprintf(stderr, "-b <int>         optional: client TX requests posted per batch (default %u) in [1,txQueueSize]\n",
+    param->txBatchSize);
+  fprintf(stderr, "-e <int>         optional: signal every Nth client TX request (default %u) in [1,txQueueSize]\n",
+    param->txSignalInterval);
+  fprintf(stderr, "-l <int>         optional: latency mode with N packets in flight; 0 for bandwidth (default %u)\n",
+    param->latencyWindow);
+  fprintf(stderr, "-q <int>         optional: number of queues each on own core (default %u) in [1,%d]\n",
+    param->queueCount, MAX_WORKERS);
+  fprintf(stderr, "-c <int>         optional: pin hot threads to cores from here up (default NIC-local cores)\n");
+  fprintf(stderr, "-y <int>         optional: core of a client or server on this host; check its TSC skew against "
+    "ours before one-way latencies\n");
+  fprintf(stderr, "-s <int>         optional: size of packet payload (default %u) in [32, %d]\n", param->payloadSize,
+    MAX_PAYLOAD_SIZE);
+  fprintf(stderr, "-L <int>         optional: client sends each packet as one TSO request the NIC cuts into frames "
+    "of N payload bytes each starting with its own sequence number; needs -C offload and -s a multiple of N. Run "
+    "the server with -s N and -n times the frames per packet (default none)\n");
+  fprintf(stderr, "-f <int>         optional: client spreads packets over N flows from a precomputed table; servers "
+    "given the same -f and -V accept every flow (default %u) in [1,%d]\n", param->flowCount, FLOW_MAX_FLOWS);
+  fprintf(stderr, "-D <string>      optional: flow each packet takes: rr, uniform or zipf[:<exponent>] (default %s)\n",
+    ice_flow_distribution_name(param->flowDistribution));
+  fprintf(stderr, "-V <string>      optional: comma separated fields flow 'i' adds 'i' to: sport, dport, sip, dip "
+    "(default sport)\n");
+  fprintf(stderr, "-P               optional: send headers and payload as separate SGEs; payload is never copied\n");
+  fprintf(stderr, "-C <string>      optional: IPV4 checksums: incremental, batch or offload (default %s)\n",
+    ice_checksum_mode_name(param->checksumMode));
+  fprintf(stderr, "-I               optional: inline packets that fit the QP's max inline size\n");
+  fprintf(stderr, "-R <rate>        optional: client send rate e.g. 2.5Mpps or 10Gbps over all queues "
+    "(default unpaced)\n");
+  fprintf(stderr, "-W               optional: pace -R by NIC rate limiter (ibv_modify_qp_rate_limit) not rdtsc\n");
+  fprintf(stderr, "-A               optional: NIC completion timestamps (extended CQs) split bandwidth server one-way "
+    "and latency client rtt times into NIC and host parts; not for other modes\n");
+  fprintf(stderr, "-T <string>      optional: run bandwidth test over transport verbs, packet (AF_PACKET), xdp "
+    "(AF_XDP) or loopback (client and server threads in this process; no NIC)\n");
+  fprintf(stderr, "-X <string>      optional: AF_XDP mode auto, zerocopy or copy (default auto)\n");
+  fprintf(stderr, "-Q <int>         optional: AF_XDP NIC queue to bind (default %u)\n", param->xdpQueueId);
+  fprintf(stderr, "-N               optional: AF_XDP kicks the kernel every batch and empty poll; no need-wakeup\n");
+  fprintf(stderr, "-i <int>         optional: print live rates every N ms from a spare core; 0 for none (default %u)\n",
+    param->statsIntervalMs);
+  fprintf(stderr, "-o <file>        optional: append a run record to file: CSV if it ends in .csv else JSON lines\n");
+  fprintf(stderr, "-m <int>         optional: ib_mlx5 server receives into striding RQ WQEs of N packets each; "
+    "power of 2 or 0 for one WQE per packet (default %u)\n", param->stridesPerWqe);
+  fprintf(stderr, "-Z <string>      optional: ib_mlx5 striding server compresses RX CQEs into hash or csum mini-CQEs "
+    "(default uncompressed)\n");
+  fprintf(stderr, "-w <int>         optional: ib_mlx5 direct path packs up to N packets per enhanced multi-packet send "
+    "WQE; inlined with -I where they fit; 0 for one WQE per packet (default %u)\n", param->packetsPerWqe);
+  fprintf(stderr, "-F               optional: ib_mlx5 direct path writes single WQE batches through BlueFlame\n");
+  fprintf(stderr, "-H               optional: allocate memory from 2MB hugepages (4KB pages if omitted)\n");
+  fprintf(stderr, "-G               optional: allocate memory from 1GB hugepages\n");
+  fprintf(stderr, "-S               optional: run in server mode and client model if omitted\n");
+  fprintf(stderr, "-h               optional: show usage and exit\n");
+  exit(2);
+}
+
+void ice_param_parse(int argc, char **argv, struct UserParam *param) {
+  int opt;
+  char valid = 1;
+  double rate = 0;
+  uint8_t rateIsBits = 0;
+
+  programName = argv[0];
+
+  while ((opt = getopt(argc, argv, "d:B:j:k:E:J:K:n:t:r:b:e:l:q:c:y:s:C:R:T:X:Q:i:o:m:Z:w:L:f:D:V:PIFHGWANSh")) != -1) {
+    switch (opt) {
+      case 'd':
+        snprintf(param->deviceId, sizeof(param->deviceId), "%s", optarg);
+        break;
+      case 'B':
+        snprintf(param->clientMac, sizeof(param->clientMac), "%s", optarg);
+        break;
+      case 'j':
+        snprintf(param->clientIpAddr, sizeof(param->clientIpAddr), "%s", optarg);
+        break;
+      case 'E':
+        snprintf(param->serverMac, sizeof(param->serverMac), "%s", optarg);
+        break;
+      case 'J':
+        snprintf(param->serverIpAddr, sizeof(param->serverIpAddr), "%s", optarg);
+        break;
+      case 'k':
+        param->clientPort = (uint16_t)atoi(optarg);
+        break;
+      case 'K':
+        param->serverPort = (uint16_t)atoi(optarg);
+        break;
+      case 'n':
+        param->iters = (uint32_t)atoi(optarg);
+        break;
+      case 't':
+        param->txQueueSize = (uint32_t)atoi(optarg);
+        break;
+      case 'r':
+        param->rxQueueSize = (uint32_t)atoi(optarg);
+        break;
+      case 'b':
+        param->txBatchSize = (uint32_t)atoi(optarg);
+        break;
+      case 'e':
+        param->txSignalInterval = (uint32_t)atoi(optarg);
+        break;
+      case 'l':
+        param->latencyWindow = (uint32_t)atoi(optarg);
+        break;
+      case 'q':
+        param->queueCount = (uint32_t)atoi(optarg);
+        break;
+      case 'c':
+        param->firstCpu = atoi(optarg);
+        break;
+      case 'y':
+        param->tscPeerCpu = atoi(optarg);
+        break;
+      case 's':
+        param->payloadSize = (uint32_t)atoi(optarg);
+        break;
+      case 'C':
+        if (0!=ice_checksum_parse_mode(optarg, &param->checksumMode)) {
+          valid = 0;
+        }
+        break;
+      case 'P':
+        param->splitPayload = 1;
+        break;
+      case 'I':
+        param->useInline = 1;
+        break;
+      case 'F':
+        param->useBlueFlame = 1;
+        break;
+      case 'R':
+        if (0!=ice_param_parse_rate(optarg, &rate, &rateIsBits)) {
+          valid = 0;
+        }
+        break;
+      case 'T':
+        if (0!=ice_transport_parse_kind(optarg, &param->transport)) {
+          valid = 0;
+        }
+        break;
+      case 'X':
+        if (0!=ice_transport_parse_xdp_mode(optarg, &param->xdpMode)) {
+          valid = 0;
+        }
+        break;
+      case 'Q':
+        param->xdpQueueId = (uint32_t)atoi(optarg);
+        break;
+      case 'N':
+        param->xdpAlwaysKick = 1;
+        break;
+      case 'i':
+        param->statsIntervalMs = (uint32_t)atoi(optarg);
+        break;
+      case 'o':
+        snprintf(param->reportPath, sizeof(param->reportPath), "%s", optarg);
+        break;
+      case 'm':
+        param->stridesPerWqe = (uint32_t)atoi(optarg);
+        break;
+      case 'w':
+        param->packetsPerWqe = (uint32_t)atoi(optarg);
+        break;
+      case 'L':
+        param->tsoMss = (uint32_t)atoi(optarg);
+        break;
+      case 'f':
+        param->flowCount = (uint32_t)atoi(optarg);
+        break;
+      case 'D':
+        if (0!=ice_flow_parse_distribution(optarg, &param->flowDistribution, &param->flowZipfExponent)) {
+          valid = 0;
+        }
+        break;
+      case 'V':
+        if (0!=ice_flow_parse_fields(optarg, &param->flowFields)) {
+          valid = 0;
+        }
+        break;
+      case 'Z':
+        if (0!=ice_param_parse_cqe_format(optarg, &param->cqeFormat)) {
+          valid = 0;
+        }
+        break;
+      case 'A':
+        param->useHardwareTimestamps = 1;
+        break;
+      case 'W':
+        param->useHardwarePacing = 1;
+        break;
+      case 'H':
+        param->useHugePages = ICE_ARENA_PAGE_2MB;
+        break;
+      case 'G':
+        param->useHugePages = ICE_ARENA_PAGE_1GB;
+        break;
+      case 'S':
+        param->isServer = 1;
+        break;
+      default:
+        ice_param_usage_and_exit(param);
+    }
+  }
+
+  if (param->clientPort<1025 || param->serverPort<1025) {
+    valid = 0;
+  }
+  if (param->iters==0) {
+    valid = 0;
+  }
+  if (param->txQueueSize<1 || param->txQueueSize>MAX_QUEUE_ENTRIES) {
+    valid = 0;
+  }
+  if (param->rxQueueSize<1 || param->rxQueueSize>MAX_QUEUE_ENTRIES) {
+    valid = 0;
+  }
+  if (param->txBatchSize<1 || param->txBatchSize>param->txQueueSize) {
+    valid = 0;
+  }
+  if (param->txSignalInterval<1 || param->txSignalInterval>param->txQueueSize) {
+    valid = 0;
+  }
+  if (param->latencyWindow>param->txQueueSize || param->latencyWindow>param->rxQueueSize) {
+    valid = 0;
+  }
+  if (param->latencyWindow>0 && param->isServer && param->txQueueSize<param->rxQueueSize) {
+    valid = 0;
+  }
+  if (param->queueCount<1 || param->queueCount>MAX_WORKERS) {
+    valid = 0;
+  }
+  if (param->queueCount>1 && param->latencyWindow>0) {
+    valid = 0;
+  }
+  if (param->clientPort+param->queueCount>65536) {
+    valid = 0;
+  }
+  if (param->payloadSize<32 || param->payloadSize>MAX_PAYLOAD_SIZE) {
+    valid = 0;
+  }
+  if (param->firstCpu<-1 || param->tscPeerCpu<-1) {
+    valid = 0;
+  }
+  // Transports run single queue bandwidth tests
+  if (param->transport!=ICE_TRANSPORT_NONE && (param->queueCount>1 || param->latencyWindow>0)) {
+    valid = 0;
+  }
+  if (param->transport==ICE_TRANSPORT_LOOPBACK && param->isServer) {
+    valid = 0;
+  }
+
+  // Gbps counts packet bytes as results do so a paced run reports the rate asked for
+  param->txRatePps = rateIsBits ? rate/(8.0*ice_verb_packet_size(param->payloadSize)) : rate;
+  if (param->useHardwarePacing && (param->txRatePps==0 ||
+      (param->transport!=ICE_TRANSPORT_NONE && param->transport!=ICE_TRANSPORT_VERBS))) {
+    valid = 0;
+  }
+  // Only the single queue native verbs bandwidth server and latency client read NIC timestamps. Bandwidth clients,
+  // mlx5 direct ones included, and reflectors would only pay for extended CQs
+  if (param->useHardwareTimestamps && (param->transport!=ICE_TRANSPORT_NONE || param->queueCount>1 ||
+      (param->isServer ? param->latencyWindow>0 : param->latencyWindow==0))) {
+    valid = 0;
+  }
+  // Striding RQ replaces the single queue native bandwidth server's receive ring
+  if (param->stridesPerWqe>0 && ((param->stridesPerWqe & (param->stridesPerWqe-1))!=0 ||
+      param->stridesPerWqe>65536 || !param->isServer || param->latencyWindow>0 || param->queueCount>1 ||
+      param->transport!=ICE_TRANSPORT_NONE || param->useHardwareTimestamps)) {
+    valid = 0;
+  }
+  // Multi-packet WQEs carry whole packets from one SGE each
+  if (param->packetsPerWqe>0 && (param->isServer || param->latencyWindow>0 || param->splitPayload ||
+      param->transport!=ICE_TRANSPORT_NONE)) {
+    valid = 0;
+  }
+  // TSO sends through verbs WRs; the NIC fixes each frame's IPV4 header so needs checksum offload. It repeats the
+  // UDP length 8+tsoMss on every frame and never shortens the last, so packets are whole frames
+  if (param->tsoMss>0 && (param->tsoMss<32 || param->tsoMss>=param->payloadSize || param->isServer ||
+      param->latencyWindow>0 || param->splitPayload || param->packetsPerWqe>0 ||
+      param->transport!=ICE_TRANSPORT_NONE || param->checksumMode!=ICE_CHECKSUM_MODE_OFFLOAD ||
+      param->payloadSize%param->tsoMss!=0)) {
+    valid = 0;
+  }
+  // One flow table per process: multi-flow clients send from one queue and get no replies. Varied ports stay in range
+  if (param->flowCount<1 || param->flowCount>FLOW_MAX_FLOWS) {
+    valid = 0;
+  }
+  if (param->flowCount>1 && ((!param->isServer && param->queueCount>1) || param->latencyWindow>0 ||
+      ((param->flowFields & ICE_FLOW_FIELD_SRC_PORT) && param->clientPort+param->flowCount>65536) ||
+      ((param->flowFields & ICE_FLOW_FIELD_DST_PORT) && param->serverPort+param->flowCount>65536))) {
+    valid = 0;
+  }
+  // Only the striding server reads RX CQEs itself
+  if (param->cqeFormat && param->stridesPerWqe==0) {
+    valid = 0;
+  }
+
+  if (!valid) {
+    ice_param_usage_and_exit(param);
+  }
+}
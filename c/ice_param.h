@@ -0,0 +1,12 @@
+#pragma once
+
+#include <ice_verb.h>
+
+// Set 'param' to defaults suitable for a single NIC used as both client and server
+void ice_param_initialize(struct UserParam *param);
+
+// Print command line usage with 'param' defaults to stderr and exit
+void ice_param_usage_and_exit(const struct UserParam *param);
+
+// Update 'param' from command line options then validate it. Exits via 'ice_param_usage_and_exit' on bad options
+void ice_param_parse(int argc, char **argv, struct UserParam *param);
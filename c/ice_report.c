@@ -0,0 +1,184 @@
+#include <ice_report.h>
+#include <ice_verb.h>
+#include <ice_tsc.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+enum kREPORT {
+  REPORT_LINE_BYTES = 2048,
+};
+
+// One record being formatted: CSV header and values, and the JSON object, side by side so columns always agree
+struct ReportLine {
+  char                      header[REPORT_LINE_BYTES];        // CSV column names
+  char                      csv[REPORT_LINE_BYTES];           // CSV values
+  char                      json[REPORT_LINE_BYTES];          // JSON object
+  uint32_t                  headerBytes;
+  uint32_t                  csvBytes;
+  uint32_t                  jsonBytes;
+};
+
+static void ice_report_append(char *line, uint32_t *bytes, const char *text) {
+  const int n = snprintf(line+*bytes, REPORT_LINE_BYTES-*bytes, "%s", text);
+  *bytes += (n>0 && (uint32_t)n<REPORT_LINE_BYTES-*bytes) ? (uint32_t)n : 0;
+}
+
+// Add column 'name' whose CSV and JSON values are 'csvValue' and 'jsonValue', both already formatted
+static void ice_report_field(struct ReportLine *line, const char *name, const char *csvValue, const char *jsonValue) {
+  const char *sep = line->headerBytes ? "," : "";
+  char text[512];
+
+  snprintf(text, sizeof(text), "%s%s", sep, name);
+  ice_report_append(line->header, &line->headerBytes, text);
+  snprintf(text, sizeof(text), "%s%s", sep, csvValue);
+  ice_report_append(line->csv, &line->csvBytes, text);
+  snprintf(text, sizeof(text), "%s\"%s\":%s", line->jsonBytes>1 ? "," : "", name, jsonValue);
+  ice_report_append(line->json, &line->jsonBytes, text);
+}
+
+// Add string column 'name'. CSV quotes 'value' if it holds a comma, quote or line break and doubles its quotes;
+// JSON always quotes it and escapes quotes, backslashes and control characters. Values too long are cut short
+static void ice_report_string(struct ReportLine *line, const char *name, const char *value) {
+  char csv[160];
+  char json[160];
+  const uint8_t quoteCsv = 0!=strpbrk(value, ",\"\r\n");
+  uint32_t c = 0;
+  uint32_t j = 0;
+
+  if (quoteCsv) {
+    csv[c++] = '"';
+  }
+  json[j++] = '"';
+  for (const char *p=value; *p && c+3<sizeof(csv) && j+8<sizeof(json); ++p) {
+    const unsigned char ch = (unsigned char)*p;
+    if (ch=='"' && quoteCsv) {
+      csv[c++] = '"';
+    }
+    csv[c++] = (char)ch;
+    if (ch=='"' || ch=='\\') {
+      json[j++] = '\\';
+      json[j++] = (char)ch;
+    } else if (ch<0x20) {
+      j += (uint32_t)snprintf(json+j, sizeof(json)-j, "\\u%04x", ch);
+    } else {
+      json[j++] = (char)ch;
+    }
+  }
+  if (quoteCsv) {
+    csv[c++] = '"';
+  }
+  json[j++] = '"';
+  csv[c] = 0;
+  json[j] = 0;
+
+  ice_report_field(line, name, csv, json);
+}
+
+static void ice_report_uint(struct ReportLine *line, const char *name, uint64_t value) {
+  char text[32];
+  snprintf(text, sizeof(text), "%lu", value);
+  ice_report_field(line, name, text, text);
+}
+
+static void ice_report_double(struct ReportLine *line, const char *name, double value) {
+  char text[32];
+  snprintf(text, sizeof(text), "%.3f", value);
+  ice_report_field(line, name, text, text);
+}
+
+int ice_report_write(const struct UserParam *param, const char *role, uint32_t threads,
+  const struct RunResult *result, const struct Histogram *latency, const char *latencyKind,
+  const struct SequenceTracker *sequence) {
+  assert(param);
+  assert(role);
+  assert(result);
+  assert(latencyKind);
+
+  if (param->reportPath[0]==0) {
+    return 0;
+  }
+
+  const uint64_t nameLength = strlen(param->reportPath);
+  const uint8_t isCsv = nameLength>=4 && !strcmp(param->reportPath+nameLength-4, ".csv");
+  const struct StatsCounters *counters = &result->counters;
+  const double elapsedNs = ice_verb_elapsed_ns(result);
+  const double ns = elapsedNs>0 ? elapsedNs : 1;
+  const double ticksPerNs = ice_tsc_ticks_per_ns();
+  const double nsPerTick = 1.0/ticksPerNs;
+  const uint8_t hasLatency = latency && latency->count>0;
+  const char *transport = param->transport==ICE_TRANSPORT_NONE ? "native" : ice_transport_kind_name(param->transport);
+  // Hot threads spin for the whole run so wall clock TSC ticks are their cycles
+  const double cycles = elapsedNs*ticksPerNs*threads;
+
+  struct ReportLine line;
+  memset(&line, 0, sizeof(line));
+  ice_report_append(line.json, &line.jsonBytes, "{");
+
+  ice_report_string(&line, "role", role);
+  ice_report_string(&line, "transport", transport);
+  ice_report_string(&line, "device", param->deviceId);
+  ice_report_uint(&line, "payload", param->payloadSize);
+  ice_report_uint(&line, "packetBytes", ice_verb_packet_size(param->payloadSize));
+  ice_report_uint(&line, "txQueue", param->txQueueSize);
+  ice_report_uint(&line, "rxQueue", param->rxQueueSize);
+  ice_report_uint(&line, "batch", param->txBatchSize);
+  ice_report_uint(&line, "tsoMss", param->tsoMss);
+  ice_report_uint(&line, "flows", param->flowCount);
+  ice_report_string(&line, "flowDistribution", ice_flow_distribution_name(param->flowDistribution));
+  ice_report_uint(&line, "threads", threads);
+  ice_report_string(&line, "checksum", ice_checksum_mode_name(param->checksumMode));
+  ice_report_double(&line, "targetPps", param->txRatePps);
+  ice_report_uint(&line, "packets", counters->packets);
+  ice_report_uint(&line, "bytes", counters->bytes);
+  ice_report_uint(&line, "errors", counters->errors);
+  ice_report_double(&line, "elapsedNs", elapsedNs);
+  ice_report_double(&line, "pps", (double)counters->packets*1e9/ns);
+  ice_report_double(&line, "gbps", (double)counters->bytes*8.0/ns);
+  ice_report_double(&line, "cyclesPerPacket", counters->packets ? cycles/(double)counters->packets : 0.0);
+  ice_report_double(&line, "cyclesPerByte", counters->bytes ? cycles/(double)counters->bytes : 0.0);
+  ice_report_string(&line, "latency", hasLatency ? latencyKind : "none");
+  ice_report_uint(&line, "latencyCount", hasLatency ? latency->count : 0);
+  ice_report_double(&line, "minNs", hasLatency ? (double)latency->min*nsPerTick : 0.0);
+  ice_report_double(&line, "meanNs", hasLatency ? (double)latency->total*nsPerTick/(double)latency->count : 0.0);
+  ice_report_double(&line, "p50Ns", hasLatency ? (double)ice_histogram_percentile(latency, 50.0)*nsPerTick : 0.0);
+  ice_report_double(&line, "p99Ns", hasLatency ? (double)ice_histogram_percentile(latency, 99.0)*nsPerTick : 0.0);
+  ice_report_double(&line, "p999Ns", hasLatency ? (double)ice_histogram_percentile(latency, 99.9)*nsPerTick : 0.0);
+  ice_report_double(&line, "p9999Ns", hasLatency ? (double)ice_histogram_percentile(latency, 99.99)*nsPerTick : 0.0);
+  ice_report_double(&line, "maxNs", hasLatency ? (double)latency->max*nsPerTick : 0.0);
+  ice_report_uint(&line, "lost", sequence ? sequence->lost : 0);
+  ice_report_uint(&line, "duplicates", sequence ? sequence->duplicates : 0);
+  ice_report_uint(&line, "reordered", sequence ? sequence->reordered : 0);
+  ice_report_uint(&line, "maxReorder", sequence ? sequence->maxReorder : 0);
+
+  ice_report_append(line.json, &line.jsonBytes, "}");
+
+  FILE *file = fopen(param->reportPath, "a");
+  if (file==0) {
+    fprintf(stderr, "warn : ice_report_write: cannot open '%s': %s (errno %d)\n", param->reportPath, strerror(errno),
+      errno);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  // One write per record so processes sharing the file don't interleave lines
+  char text[2*REPORT_LINE_BYTES+2];
+  setvbuf(file, 0, _IOFBF, sizeof(text));
+  if (isCsv) {
+    fseek(file, 0, SEEK_END);
+    const uint8_t isEmpty = ftell(file)==0;
+    snprintf(text, sizeof(text), "%s%s%s\n", isEmpty ? line.header : "", isEmpty ? "\n" : "", line.csv);
+  } else {
+    snprintf(text, sizeof(text), "%s\n", line.json);
+  }
+  const uint8_t failed = fputs(text, file)<0;
+  if (0!=fclose(file) || failed) {
+    fprintf(stderr, "warn : ice_report_write: write to '%s' failed: %s (errno %d)\n", param->reportPath,
+      strerror(errno), errno);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  fprintf(stderr, "info : ice_report_write: %s record appended to %s\n", role, param->reportPath);
+  return 0;
+}
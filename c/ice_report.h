@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+
+// Machine readable run records for parameter sweeps. '-o <file>' appends one record per finished run: CSV if the
+// file name ends in ".csv" (header written when the file is empty) else one JSON object per line. Client and server
+// processes may append to the same file; each record names its role and carries every knob the sweep varies.
+
+struct Histogram;
+struct RunResult;
+struct UserParam;
+struct SequenceTracker;
+
+// Append 'result' of a 'role' run under 'param' to 'param->reportPath' if set. 'threads' busy-polling threads shared
+// the run. 'latency' if not null and not empty holds 'latencyKind' ("rtt", "one-way") times in rdtsc ticks.
+// 'sequence' if not null holds a receiver's loss, duplicate and reorder totals. Return 0 on success and non-zero
+// otherwise
+int ice_report_write(const struct UserParam *param, const char *role, uint32_t threads,
+  const struct RunResult *result, const struct Histogram *latency, const char *latencyKind,
+  const struct SequenceTracker *sequence);
@@ -0,0 +1,131 @@
+#include <ice_sequence.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+void ice_sequence_initialize(struct SequenceTracker *tracker, uint32_t windowBits) {
+  assert(tracker);
+  assert(windowBits<=SEQUENCE_MAX_WINDOW_BITS);
+
+  // At least a word so a slot's word and bit never need a bounds check
+  uint64_t window = 64;
+  while (window<windowBits) {
+    window <<= 1;
+  }
+
+  memset(tracker, 0, sizeof(struct SequenceTracker));
+  tracker->mask = window-1;
+}
+
+void ice_sequence_initialize_set(struct SequenceSet *set, uint16_t basePort, uint32_t windowBits) {
+  assert(set);
+
+  set->basePort = basePort;
+  for (uint32_t i=0; i<SEQUENCE_MAX_FLOWS; ++i) {
+    ice_sequence_initialize(set->flow+i, windowBits);
+  }
+}
+
+// Return 1 if 'seq' is marked seen in 'tracker's window else 0
+static inline uint64_t ice_sequence_seen(const struct SequenceTracker *tracker, uint64_t seq) {
+  return (tracker->seen[(seq & tracker->mask) >> 6] >> (seq & 63)) & 1;
+}
+
+static inline void ice_sequence_mark(struct SequenceTracker *tracker, uint64_t seq, uint64_t seen) {
+  uint64_t *word = tracker->seen + ((seq & tracker->mask) >> 6);
+  const uint64_t bit = 1ull << (seq & 63);
+  *word = seen ? (*word | bit) : (*word & ~bit);
+}
+
+// Return sequences in [max(next-window, 0), next) not marked seen
+static uint64_t ice_sequence_missing(const struct SequenceTracker *tracker) {
+  const uint64_t window = tracker->mask+1;
+  const uint64_t first = tracker->next>window ? tracker->next-window : 0;
+  uint64_t missing = 0;
+  for (uint64_t seq=first; seq<tracker->next; ++seq) {
+    missing += !ice_sequence_seen(tracker, seq);
+  }
+  return missing;
+}
+
+void ice_sequence_record_slow(struct SequenceTracker *tracker, uint64_t seq) {
+  assert(tracker);
+
+  const uint64_t window = tracker->mask+1;
+
+  if (seq>tracker->next) {
+    // Gap: 'next' up to 'seq' take window slots from the sequences 'window' below them. Jumps of a window or more
+    // retire the whole window and anything skipped below the new one never entered it
+    const uint64_t advance = seq+1-tracker->next;
+    if (advance>=window) {
+      tracker->lost += ice_sequence_missing(tracker) + (advance-window);
+      memset(tracker->seen, 0, sizeof(tracker->seen));
+    } else {
+      for (uint64_t p=tracker->next; p<seq; ++p) {
+        tracker->lost += (p>tracker->mask) & !ice_sequence_seen(tracker, p);
+        ice_sequence_mark(tracker, p, 0);
+      }
+      tracker->lost += (seq>tracker->mask) & !ice_sequence_seen(tracker, seq);
+    }
+    ice_sequence_mark(tracker, seq, 1);
+    tracker->next = seq+1;
+    return;
+  }
+
+  // Behind the highest seen
+  const uint64_t distance = tracker->next-1-seq;
+  if (distance>tracker->mask) {
+    ++tracker->late;
+  } else if (ice_sequence_seen(tracker, seq)) {
+    ++tracker->duplicates;
+    return;
+  } else {
+    ice_sequence_mark(tracker, seq, 1);
+  }
+  ++tracker->reordered;
+  if (distance>tracker->maxReorder) {
+    tracker->maxReorder = distance;
+  }
+}
+
+void ice_sequence_merge_set(struct SequenceTracker *total, const struct SequenceSet *set) {
+  assert(total);
+  assert(set);
+
+  for (uint32_t i=0; i<SEQUENCE_MAX_FLOWS; ++i) {
+    const struct SequenceTracker *flow = set->flow+i;
+    if (flow->received==0) {
+      continue;
+    }
+    total->next += flow->next;
+    total->received += flow->received;
+    total->lost += flow->lost + ice_sequence_missing(flow);
+    total->duplicates += flow->duplicates;
+    total->reordered += flow->reordered;
+    total->late += flow->late;
+    if (flow->mask>total->mask) {
+      total->mask = flow->mask;
+    }
+    if (flow->maxReorder>total->maxReorder) {
+      total->maxReorder = flow->maxReorder;
+    }
+  }
+}
+
+void ice_sequence_expect(struct SequenceTracker *total, uint64_t expected) {
+  assert(total);
+
+  if (expected>total->next) {
+    total->lost += expected-total->next;
+  }
+}
+
+void ice_sequence_print(const struct SequenceTracker *total, const char *name) {
+  assert(total);
+  assert(name);
+
+  fprintf(stderr, "info : %s: received %lu, lost %lu, duplicates %lu, reordered %lu (max distance %lu, %lu after "
+    "leaving the %lu packet window)\n", name, total->received, total->lost, total->duplicates, total->reordered,
+    total->maxReorder, total->late, total->mask+1);
+}
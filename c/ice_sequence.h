@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+
+// Receiver side loss, duplicate and reorder detection over sender sequence numbers. Each flow has a sliding bitmap
+// of the last 'window' sequence numbers below the highest seen: bit 's&mask' is set once 's' arrives. A sequence
+// leaving the window unseen is lost; one arriving with its bit set is a duplicate; one arriving below the highest
+// seen is reordered by the difference. In order arrivals, the common case, cost one bit test and set.
+//
+// Sequences start at 0 per flow. A flow is a sender queue told apart by UDP source port: client worker 'i' sends
+// from port 'clientPort+i' so sequence numbers are only unique per port.
+
+enum kSEQUENCE {
+  SEQUENCE_MAX_WINDOW_BITS = 1024,                            // == MAX_QUEUE_ENTRIES: window covers the RX queue
+  SEQUENCE_MAX_FLOWS = 64,                                    // == MAX_WORKERS: one flow per client worker
+};
+
+struct SequenceTracker {
+  uint64_t                  next;                             // one past the highest sequence seen
+  uint64_t                  mask;                             // window bits-1; window is a power of 2
+  uint64_t                  received;                         // packets seen including duplicates
+  uint64_t                  lost;                             // sequences that left the window unseen
+  uint64_t                  duplicates;                       // sequences seen more than once
+  uint64_t                  reordered;                        // sequences arriving below the highest seen
+  uint64_t                  late;                             // arrived after leaving the window; also in 'lost'
+  uint64_t                  maxReorder;                       // largest distance below the highest seen
+  uint64_t                  seen[SEQUENCE_MAX_WINDOW_BITS/64]; // window bitmap
+};
+
+// Trackers for every flow into one receiver. Flow 'f' is UDP source port 'basePort+f'
+struct SequenceSet {
+  uint16_t                  basePort;                         // source port of flow 0; host order
+  struct SequenceTracker    flow[SEQUENCE_MAX_FLOWS];
+};
+
+// Reset 'tracker' with a window of at least 'windowBits' bits. Larger windows tolerate more reordering before a
+// sequence is taken as lost
+void ice_sequence_initialize(struct SequenceTracker *tracker, uint32_t windowBits);
+
+// Reset every flow of 'set' per 'ice_sequence_initialize'. 'basePort' is flow 0's source port in host order
+void ice_sequence_initialize_set(struct SequenceSet *set, uint16_t basePort, uint32_t windowBits);
+
+// Out of order, duplicate or gap handling for 'ice_sequence_record'
+void ice_sequence_record_slow(struct SequenceTracker *tracker, uint64_t seq);
+
+// Record arrival of 'seq'. Hot path: no allocation, no locks, no atomics
+static inline void ice_sequence_record(struct SequenceTracker *tracker, uint64_t seq) {
+  ++tracker->received;
+  if (__builtin_expect(seq==tracker->next, 1)) {
+    // Slot last held 'seq-window' which is lost if it never arrived
+    uint64_t *word = tracker->seen + ((seq & tracker->mask) >> 6);
+    const uint64_t bit = 1ull << (seq & 63);
+    tracker->lost += (seq>tracker->mask) & ((*word & bit)==0);
+    *word |= bit;
+    tracker->next = seq+1;
+  } else {
+    ice_sequence_record_slow(tracker, seq);
+  }
+}
+
+// Record arrival of 'seq' from source port 'srcPort' (host order) into its flow in 'set'
+static inline void ice_sequence_record_flow(struct SequenceSet *set, uint16_t srcPort, uint64_t seq) {
+  ice_sequence_record(set->flow + ((uint16_t)(srcPort-set->basePort) & (SEQUENCE_MAX_FLOWS-1)), seq);
+}
+
+// Add every flow of 'set' to 'total' counting sequences still missing from a window as lost. 'total' need only be
+// zeroed. 'total->next' sums flows' 'next' i.e. sequences sent up to the highest seen
+void ice_sequence_merge_set(struct SequenceTracker *total, const struct SequenceSet *set);
+
+// Count sequences never seen above the highest per flow as lost given 'expected' packets were sent over all flows
+void ice_sequence_expect(struct SequenceTracker *total, uint64_t expected);
+
+// Print 'total's counts to stderr tagged with 'name'
+void ice_sequence_print(const struct SequenceTracker *total, const char *name);
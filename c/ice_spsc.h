@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdint.h>
+
+// Lock-free single producer single consumer ring of packet descriptors. Producer and consumer indexes are on their
+// own cache lines, each next to a cached copy of the other side's index, so neither side touches the other's line
+// except to refresh that copy when it looks full (producer) or empty (consumer). Indexes count entries since start
+// and never wrap within a run.
+//
+// The consumer may look at entries before giving them back: 'ice_spsc_peek' returns what's readable and
+// 'ice_spsc_release' frees it. So the consumer index doubles as a completion count for the producer.
+
+enum kSPSC {
+  SPSC_CACHE_LINE_SIZE_BYTES = 64,
+};
+
+// One packet: 'length' bytes at 'addr'
+struct SpscEntry {
+  uint64_t                  addr;                             // packet address
+  uint32_t                  length;                           // packet bytes
+  uint32_t                  reserved;
+};
+
+// Starts on a cache line
+struct SpscRing {
+  uint64_t                  head;                             // entries published; producer writes
+  uint64_t                  tailCache;                        // producer's last view of 'tail'
+  uint8_t                   producerPad[SPSC_CACHE_LINE_SIZE_BYTES-2*sizeof(uint64_t)];
+  uint64_t                  tail;                             // entries released; consumer writes
+  uint64_t                  headCache;                        // consumer's last view of 'head'
+  uint8_t                   consumerPad[SPSC_CACHE_LINE_SIZE_BYTES-2*sizeof(uint64_t)];
+  struct SpscEntry          *entry;                           // 'mask+1' entries; read-only after initialize
+  uint64_t                  mask;                             // entries-1; entries is a power of 2
+  uint8_t                   sharedPad[SPSC_CACHE_LINE_SIZE_BYTES-2*sizeof(uint64_t)];
+};
+
+// Return bytes 'ice_spsc_initialize' needs for a ring of 'entries' (a power of 2)
+static inline uint64_t ice_spsc_memory_size(uint64_t entries) {
+  return sizeof(struct SpscRing) + entries*sizeof(struct SpscEntry);
+}
+
+// Lay out a ring of 'entries' (a power of 2) in 'ice_spsc_memory_size(entries)' bytes of cache line aligned 'memory'.
+// Return the ring
+static inline struct SpscRing *ice_spsc_initialize(void *memory, uint64_t entries) {
+  struct SpscRing *ring = (struct SpscRing *)memory;
+  ring->head = ring->tailCache = ring->tail = ring->headCache = 0;
+  ring->entry = (struct SpscEntry *)(ring+1);
+  ring->mask = entries-1;
+  return ring;
+}
+
+// Producer: return free entries, at least 'want' if that many are free
+static inline uint64_t ice_spsc_free(struct SpscRing *ring, uint64_t want) {
+  uint64_t free = ring->mask+1 - (ring->head-ring->tailCache);
+  if (free<want) {
+    ring->tailCache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    free = ring->mask+1 - (ring->head-ring->tailCache);
+  }
+  return free;
+}
+
+// Producer: return the entry 'i' past the last published one. Only valid for 'i' below 'ice_spsc_free'
+static inline struct SpscEntry *ice_spsc_slot(struct SpscRing *ring, uint64_t i) {
+  return ring->entry + ((ring->head+i) & ring->mask);
+}
+
+// Producer: make the next 'count' entries visible to the consumer
+static inline void ice_spsc_publish(struct SpscRing *ring, uint64_t count) {
+  __atomic_store_n(&ring->head, ring->head+count, __ATOMIC_RELEASE);
+}
+
+// Producer: return entries the consumer has released so far
+static inline uint64_t ice_spsc_released(struct SpscRing *ring) {
+  return ring->tailCache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+// Consumer: return readable entries from 'ring->tail' on, refreshing the producer's index only if none are known
+static inline uint64_t ice_spsc_peek(struct SpscRing *ring) {
+  if (ring->headCache==ring->tail) {
+    ring->headCache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  }
+  return ring->headCache-ring->tail;
+}
+
+// Consumer: return entry 'i' past the last released one. Only valid for 'i' below 'ice_spsc_peek'
+static inline const struct SpscEntry *ice_spsc_entry(const struct SpscRing *ring, uint64_t i) {
+  return ring->entry + ((ring->tail+i) & ring->mask);
+}
+
+// Consumer: give the next 'count' entries back to the producer
+static inline void ice_spsc_release(struct SpscRing *ring, uint64_t count) {
+  __atomic_store_n(&ring->tail, ring->tail+count, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,125 @@
+#include <ice_stats.h>
+#include <ice_topology.h>
+
+#include <time.h>
+#include <sched.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+enum kSTATS_MONITOR {
+  STATS_STOP_CHECK_MS = 50,                                   // longest a stop request waits
+};
+
+static double ice_stats_seconds(const struct timespec *from, const struct timespec *to) {
+  return (double)(to->tv_sec-from->tv_sec) + (double)(to->tv_nsec-from->tv_nsec)/1e9;
+}
+
+static void *ice_stats_main(void *arg) {
+  struct StatsMonitor *monitor = (struct StatsMonitor *)arg;
+
+  // Off the data path: only run when the core has nothing better to do
+  ice_topology_pin_thread(monitor->cpu);
+  struct sched_param sched;
+  memset(&sched, 0, sizeof(sched));
+  int rc = pthread_setschedparam(pthread_self(), SCHED_IDLE, &sched);
+  if (rc!=0) {
+    fprintf(stderr, "warn : ice_stats_main: SCHED_IDLE failed: %s (errno %d)\n", strerror(rc), rc);
+  }
+
+  struct StatsCounters last[MAX_STATS_SOURCES];
+  memset(last, 0, sizeof(last));
+  struct timespec start, previous, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  previous = start;
+
+  while (!__atomic_load_n(&monitor->stop, __ATOMIC_RELAXED)) {
+    // Sleep in short steps so stopping doesn't wait a whole interval
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const double waitMs = monitor->intervalMs - ice_stats_seconds(&previous, &now)*1e3;
+    if (waitMs>0) {
+      const uint32_t stepMs = waitMs<STATS_STOP_CHECK_MS ? (uint32_t)waitMs+1 : STATS_STOP_CHECK_MS;
+      struct timespec step = {.tv_sec = 0, .tv_nsec = (long)stepMs*1000000};
+      nanosleep(&step, 0);
+      continue;
+    }
+
+    // Sum deltas over sources; note the slowest for multi-queue runs
+    const double seconds = ice_stats_seconds(&previous, &now);
+    uint64_t packets = 0, bytes = 0, errors = 0, polls = 0, emptyPolls = 0;
+    uint64_t slowest = UINT64_MAX;
+    for (uint32_t i=0; i<monitor->count; ++i) {
+      struct StatsCounters sample;
+      sample.packets = __atomic_load_n(&monitor->source[i]->packets, __ATOMIC_RELAXED);
+      sample.bytes = __atomic_load_n(&monitor->source[i]->bytes, __ATOMIC_RELAXED);
+      sample.errors = __atomic_load_n(&monitor->source[i]->errors, __ATOMIC_RELAXED);
+      sample.polls = __atomic_load_n(&monitor->source[i]->polls, __ATOMIC_RELAXED);
+      sample.emptyPolls = __atomic_load_n(&monitor->source[i]->emptyPolls, __ATOMIC_RELAXED);
+      // A loop starting clears its counters; restart deltas from there
+      if (sample.packets<last[i].packets || sample.polls<last[i].polls) {
+        memset(last+i, 0, sizeof(struct StatsCounters));
+      }
+      const uint64_t sourcePackets = sample.packets-last[i].packets;
+      packets += sourcePackets;
+      bytes += sample.bytes-last[i].bytes;
+      errors += sample.errors;
+      polls += sample.polls-last[i].polls;
+      emptyPolls += sample.emptyPolls-last[i].emptyPolls;
+      slowest = sourcePackets<slowest ? sourcePackets : slowest;
+      last[i] = sample;
+    }
+    previous = now;
+
+    char slowestText[64] = "";
+    if (monitor->count>1) {
+      snprintf(slowestText, sizeof(slowestText), ", slowest queue %.3f Mpps", (double)slowest/seconds/1e6);
+    }
+    fprintf(stderr, "info : ice_stats: %.1f s: %.3f Mpps, %.3f Gbps, CQ empty %.1f%%, errors %lu%s\n",
+      ice_stats_seconds(&start, &now), (double)packets/seconds/1e6, (double)bytes*8.0/seconds/1e9,
+      polls>0 ? 100.0*(double)emptyPolls/(double)polls : 0.0, errors, slowestText);
+  }
+
+  return 0;
+}
+
+void ice_stats_watch(struct StatsMonitor *monitor, const struct StatsCounters *counters) {
+  assert(monitor);
+  assert(counters);
+  assert(!monitor->running);
+
+  if (monitor->count<MAX_STATS_SOURCES) {
+    monitor->source[monitor->count++] = counters;
+  }
+}
+
+int ice_stats_start(struct StatsMonitor *monitor, uint32_t intervalMs, int32_t cpu) {
+  assert(monitor);
+  assert(!monitor->running);
+
+  if (intervalMs==0 || monitor->count==0) {
+    return 0;
+  }
+
+  monitor->intervalMs = intervalMs;
+  monitor->cpu = cpu;
+  __atomic_store_n(&monitor->stop, 0, __ATOMIC_RELAXED);
+  int rc = pthread_create(&monitor->thread, 0, ice_stats_main, monitor);
+  if (rc!=0) {
+    fprintf(stderr, "warn : ice_stats_start: pthread_create failed: %s (errno %d)\n", strerror(rc), rc);
+    return rc;
+  }
+  monitor->running = 1;
+
+  return 0;
+}
+
+void ice_stats_stop(struct StatsMonitor *monitor) {
+  assert(monitor);
+
+  if (monitor->running) {
+    __atomic_store_n(&monitor->stop, 1, __ATOMIC_RELAXED);
+    pthread_join(monitor->thread, 0);
+    monitor->running = 0;
+  }
+  monitor->count = 0;
+}
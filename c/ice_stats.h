@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+
+// Live counters. Every hot thread owns one 'StatsCounters' block on its own cache line and is its only writer, so
+// updates are plain loads and stores: no locked instructions, no sharing between hot threads. A low priority monitor
+// thread samples the blocks every interval and prints per-second rates, so throughput dips show while a run is on.
+
+enum kSTATS {
+  MAX_STATS_SOURCES = 64,
+  STATS_CACHE_LINE_SIZE_BYTES = 64,
+};
+
+struct StatsCounters {
+  uint64_t                  packets;                          // packets sent or received
+  uint64_t                  bytes;                            // bytes sent or received
+  uint64_t                  completions;                      // completions reaped
+  uint64_t                  errors;                           // failed completions or calls
+  uint64_t                  polls;                            // completion polls
+  uint64_t                  emptyPolls;                       // completion polls returning nothing
+} __attribute__((aligned(STATS_CACHE_LINE_SIZE_BYTES)));
+
+struct StatsMonitor {
+  const struct StatsCounters *source[MAX_STATS_SOURCES];      // blocks sampled
+  uint32_t                  count;                            // entries in 'source'
+  uint32_t                  intervalMs;                       // sample period
+  int32_t                   cpu;                              // core monitor thread is pinned to
+  uint8_t                   running;                          // 'thread' was started
+  _Atomic uint8_t           stop;                             // asks 'thread' to exit
+  pthread_t                 thread;                           // monitor thread
+};
+
+// Add 'n' to 'counter'. Only the owning thread writes so relaxed atomics compile to a plain add and store; they only
+// keep the compiler from holding the counter in a register where the monitor can't see it
+static inline void ice_stats_add(uint64_t *counter, uint64_t n) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED)+n, __ATOMIC_RELAXED);
+}
+
+// Set 'counter' to 'value'. Owning thread only
+static inline void ice_stats_set(uint64_t *counter, uint64_t value) {
+  __atomic_store_n(counter, value, __ATOMIC_RELAXED);
+}
+
+// Have 'monitor' sample 'counters'. Call before 'ice_stats_start'
+void ice_stats_watch(struct StatsMonitor *monitor, const struct StatsCounters *counters);
+
+// Start a low priority thread pinned to 'cpu' printing aggregate pps, Gbps and CQ empty ratio of the watched counters
+// every 'intervalMs'. Nothing starts if 'intervalMs' is 0. Return 0 on success and non-zero otherwise
+int ice_stats_start(struct StatsMonitor *monitor, uint32_t intervalMs, int32_t cpu);
+
+// Stop 'monitor's thread if running and forget its sources
+void ice_stats_stop(struct StatsMonitor *monitor);
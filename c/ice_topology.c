@@ -0,0 +1,217 @@
+#include <ice_topology.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+
+// Read sysfs cpulist file 'path' ("0-3,8,10-11") into 'set'. Return 0 on success and non-zero otherwise
+static int ice_topology_read_cpulist(const char *path, cpu_set_t *set) {
+  assert(path);
+  assert(set);
+
+  CPU_ZERO(set);
+
+  FILE *file = fopen(path, "r");
+  if (file==0) {
+    return errno;
+  }
+
+  char buffer[4096];
+  if (0==fgets(buffer, sizeof(buffer), file)) {
+    // Empty list e.g. no isolated cores
+    fclose(file);
+    return 0;
+  }
+  fclose(file);
+
+  for (char *ptr=buffer; *ptr && *ptr!='\n'; ) {
+    char *end;
+    long first = strtol(ptr, &end, 10);
+    if (end==ptr) {
+      return EINVAL;
+    }
+    long last = first;
+    if (*end=='-') {
+      ptr = end+1;
+      last = strtol(ptr, &end, 10);
+      if (end==ptr) {
+        return EINVAL;
+      }
+    }
+    for (long cpu=first; cpu<=last && cpu<MAX_TOPOLOGY_CPUS; ++cpu) {
+      CPU_SET(cpu, set);
+    }
+    ptr = (*end==',') ? end+1 : end;
+  }
+
+  return 0;
+}
+
+// Append every cpu in 'candidate' not yet placed to 'topology'. A cpu whose SMT sibling is already placed goes to
+// 'deferred' instead so it's only used once physical cores run out
+static void ice_topology_place(struct Topology *topology, const cpu_set_t *candidate, const cpu_set_t *local,
+  const cpu_set_t *isolated, cpu_set_t *placed, cpu_set_t *deferred) {
+  char path[128];
+  cpu_set_t siblings;
+
+  for (int32_t cpu=0; cpu<MAX_TOPOLOGY_CPUS; ++cpu) {
+    if (!CPU_ISSET(cpu, candidate) || CPU_ISSET(cpu, placed) || CPU_ISSET(cpu, deferred)) {
+      continue;
+    }
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+    if (0!=ice_topology_read_cpulist(path, &siblings)) {
+      CPU_ZERO(&siblings);
+    }
+    CPU_AND(&siblings, &siblings, placed);
+    if (CPU_COUNT(&siblings)>0) {
+      CPU_SET(cpu, deferred);
+      continue;
+    }
+
+    struct TopologyCpu *entry = topology->cpu+topology->cpuCount++;
+    entry->cpu = cpu;
+    entry->isLocal = CPU_ISSET(cpu, local) ? 1 : 0;
+    entry->isIsolated = CPU_ISSET(cpu, isolated) ? 1 : 0;
+    entry->isSibling = 0;
+    CPU_SET(cpu, placed);
+  }
+}
+
+int ice_topology_discover(const char *deviceDir, struct Topology *topology) {
+  assert(deviceDir);
+  assert(topology);
+
+  memset(topology, 0, sizeof(struct Topology));
+  topology->numaNode = -1;
+
+  char path[512];
+  snprintf(path, sizeof(path), "%s/numa_node", deviceDir);
+  FILE *file = fopen(path, "r");
+  if (file) {
+    if (1!=fscanf(file, "%d", &topology->numaNode)) {
+      topology->numaNode = -1;
+    }
+    fclose(file);
+  } else if (errno!=ENOENT) {
+    // Virtual and absent devices have no numa_node; that's no preference
+    int rc = errno;
+    fprintf(stderr, "warn : ice_topology_discover: cannot open '%s': %s (errno %d)\n", path, strerror(rc), rc);
+  }
+
+  // Cores this process may use. Isolated cores are only in here when the
+  // launcher deliberately granted them, so they are never taken from
+  // under another isolated workload
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  int rc = sched_getaffinity(0, sizeof(allowed), &allowed);
+  if (rc!=0) {
+    rc = errno;
+    fprintf(stderr, "warn : ice_topology_discover: sched_getaffinity failed: %s (errno %d)\n", strerror(rc), rc);
+    return rc;
+  }
+
+  cpu_set_t local;
+  snprintf(path, sizeof(path), "%s/local_cpulist", deviceDir);
+  if ((0!=ice_topology_read_cpulist(path, &local) || CPU_COUNT(&local)==0) && topology->numaNode>=0) {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", topology->numaNode);
+    if (0!=ice_topology_read_cpulist(path, &local)) {
+      CPU_ZERO(&local);
+    }
+  }
+
+  cpu_set_t isolated;
+  if (0!=ice_topology_read_cpulist("/sys/devices/system/cpu/isolated", &isolated)) {
+    CPU_ZERO(&isolated);
+  }
+
+  cpu_set_t placed, deferred;
+  CPU_ZERO(&placed);
+  CPU_ZERO(&deferred);
+
+  // Placement order: local isolated, local, remote isolated, remote
+  cpu_set_t remote, candidate;
+  CPU_XOR(&remote, &allowed, &local);
+  CPU_AND(&remote, &remote, &allowed);
+  CPU_AND(&candidate, &allowed, &local);
+  CPU_AND(&candidate, &candidate, &isolated);
+  ice_topology_place(topology, &candidate, &local, &isolated, &placed, &deferred);
+  CPU_AND(&candidate, &allowed, &local);
+  ice_topology_place(topology, &candidate, &local, &isolated, &placed, &deferred);
+  CPU_AND(&candidate, &remote, &isolated);
+  ice_topology_place(topology, &candidate, &local, &isolated, &placed, &deferred);
+  ice_topology_place(topology, &remote, &local, &isolated, &placed, &deferred);
+
+  // SMT siblings last in the same local-first order
+  for (int pass=0; pass<2; ++pass) {
+    for (int32_t cpu=0; cpu<MAX_TOPOLOGY_CPUS; ++cpu) {
+      if (CPU_ISSET(cpu, &deferred) && (pass==0)==(CPU_ISSET(cpu, &local)!=0)) {
+        struct TopologyCpu *entry = topology->cpu+topology->cpuCount++;
+        entry->cpu = cpu;
+        entry->isLocal = CPU_ISSET(cpu, &local) ? 1 : 0;
+        entry->isIsolated = CPU_ISSET(cpu, &isolated) ? 1 : 0;
+        entry->isSibling = 1;
+      }
+    }
+  }
+
+  uint32_t localCount = 0;
+  uint32_t coreCount = 0;
+  for (uint32_t i=0; i<topology->cpuCount; ++i) {
+    localCount += topology->cpu[i].isLocal && !topology->cpu[i].isSibling;
+    coreCount += !topology->cpu[i].isSibling;
+  }
+  fprintf(stderr, "info : ice_topology_discover: %s on NUMA node %d: %u usable cpus, %u physical cores, "
+    "%u NIC-local\n", deviceDir, topology->numaNode, topology->cpuCount, coreCount, localCount);
+
+  return topology->cpuCount>0 ? 0 : ENOENT;
+}
+
+int32_t ice_topology_take_cpu(struct Topology *topology, const char *role) {
+  assert(topology);
+  assert(topology->cpuCount>0);
+  assert(role);
+
+  if (topology->next==topology->cpuCount) {
+    fprintf(stderr, "warn : ice_topology_take_cpu: all %u cpus taken; threads now share cpus\n", topology->cpuCount);
+  }
+  const struct TopologyCpu *entry = topology->cpu+(topology->next++ % topology->cpuCount);
+
+  fprintf(stderr, "info : ice_topology_take_cpu: %s thread on cpu %d: %s%s%s\n", role, entry->cpu,
+    entry->isLocal ? "NIC-local" : (topology->numaNode<0 ? "NUMA node unknown" : "REMOTE to NIC"),
+    entry->isIsolated ? ", isolated" : "", entry->isSibling ? ", SMT sibling of a taken core" : "");
+
+  return entry->cpu;
+}
+
+int32_t ice_topology_spare_cpu(const struct Topology *topology, const char *role) {
+  assert(topology);
+  assert(topology->cpuCount>0);
+  assert(role);
+
+  // Least preferred core: remote or an SMT sibling when there is one
+  const struct TopologyCpu *entry = topology->cpu+topology->cpuCount-1;
+  fprintf(stderr, "info : ice_topology_spare_cpu: %s thread on cpu %d%s\n", role, entry->cpu,
+    topology->next>=topology->cpuCount ? ", shared with a hot thread" : "");
+
+  return entry->cpu;
+}
+
+int ice_topology_pin_thread(int32_t cpu) {
+  assert(cpu>=0);
+
+  cpu_set_t cpuSet;
+  CPU_ZERO(&cpuSet);
+  CPU_SET(cpu, &cpuSet);
+
+  int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+  if (rc!=0) {
+    fprintf(stderr, "warn : ice_topology_pin_thread: pthread_setaffinity_np cpu %d failed: %s (errno %d)\n",
+      cpu, strerror(rc), rc);
+  }
+
+  return rc;
+}
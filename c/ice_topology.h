@@ -0,0 +1,44 @@
+#pragma once
+
+#include <sched.h>
+#include <stdint.h>
+
+// Where to run hot threads. The NIC's NUMA node and its local cores come from its sysfs device directory e.g.
+// /sys/class/infiniband/<dev>/device or /sys/class/net/<netdev>/device.
+// Cores are ordered for placement: NIC-local before remote, isolated (when this process may use them) before
+// housekeeping cores, and one hardware thread per physical core before any SMT sibling. Threads take cores in that
+// order so two hot threads never share a core until physical cores run out.
+
+enum kTOPOLOGY {
+  MAX_TOPOLOGY_CPUS = CPU_SETSIZE,                            // cores this module can describe
+};
+
+struct TopologyCpu {
+  int32_t                   cpu;                              // logical cpu number
+  uint8_t                   isLocal;                          // on the NIC's NUMA node
+  uint8_t                   isIsolated;                       // in /sys/devices/system/cpu/isolated
+  uint8_t                   isSibling;                        // SMT sibling of an earlier entry
+};
+
+struct Topology {
+  int32_t                   numaNode;                         // NIC's NUMA node or -1 if unknown
+  uint32_t                  cpuCount;                         // entries in 'cpu'
+  uint32_t                  next;                             // next 'cpu' entry 'ice_topology_take_cpu' returns
+  struct TopologyCpu        cpu[MAX_TOPOLOGY_CPUS];           // usable cores in placement order
+};
+
+// Discover the NUMA node of the device at sysfs directory 'deviceDir' and order the cores this process may run on
+// into 'topology'. Missing sysfs entries degrade to no NUMA preference. Return 0 on success and non-zero if no core
+// is usable
+int ice_topology_discover(const char *deviceDir, struct Topology *topology);
+
+// Return the next core in placement order for a thread doing 'role' and print the choice. Wraps around with a warning
+// once every core is taken
+int32_t ice_topology_take_cpu(struct Topology *topology, const char *role);
+
+// Return the last core in placement order for an off-data-path thread doing 'role' and print the choice. Hot threads
+// reach it last if at all
+int32_t ice_topology_spare_cpu(const struct Topology *topology, const char *role);
+
+// Pin the calling thread to 'cpu'. Return 0 on success and non-zero otherwise
+int ice_topology_pin_thread(int32_t cpu);
@@ -0,0 +1,342 @@
+#include <ice_verb.h>
+#include <ice_tsc.h>
+#include <ice_report.h>
+
+#include <stdio.h>
+#include <pthread.h>
+
+static const struct TransportOps *ice_transport_ops(uint8_t kind) {
+  switch (kind) {
+    case ICE_TRANSPORT_VERBS:
+      return &iceTransportVerbs;
+    case ICE_TRANSPORT_PACKET:
+      return &iceTransportPacket;
+    case ICE_TRANSPORT_XDP:
+      return &iceTransportXdp;
+    case ICE_TRANSPORT_LOOPBACK:
+      return &iceTransportLoopback;
+    default:
+      return 0;
+  }
+}
+
+int ice_transport_parse_kind(const char *name, uint8_t *kind) {
+  assert(name);
+  assert(kind);
+
+  for (uint8_t i=ICE_TRANSPORT_VERBS; ice_transport_ops(i); ++i) {
+    if (!strcmp(name, ice_transport_ops(i)->name)) {
+      *kind = i;
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+const char *ice_transport_kind_name(uint8_t kind) {
+  const struct TransportOps *ops = ice_transport_ops(kind);
+  return ops ? ops->name : "none";
+}
+
+int ice_transport_parse_xdp_mode(const char *name, uint8_t *mode) {
+  assert(name);
+  assert(mode);
+
+  if (!strcmp(name, "auto")) {
+    *mode = ICE_XDP_MODE_AUTO;
+  } else if (!strcmp(name, "zerocopy")) {
+    *mode = ICE_XDP_MODE_ZEROCOPY;
+  } else if (!strcmp(name, "copy")) {
+    *mode = ICE_XDP_MODE_COPY;
+  } else {
+    return -1;
+  }
+
+  return 0;
+}
+
+int ice_transport_allocate_session(const struct UserParam *param, struct Session *session) {
+  assert(param);
+  assert(session);
+
+  const struct TransportOps *ops = ice_transport_ops(param->transport);
+  assert(ops);
+
+  // Backends may start from 'ice_verb_allocate_session' which clears the
+  // session so the transport is attached after
+  memset(session, 0, sizeof(struct Session));
+  int rc = ops->initialize(param, session);
+  session->userParam = param;
+  session->transport.ops = ops;
+  session->transport.session = session;
+  session->transport.ringSize = param->txQueueSize;
+
+  if (rc==0) {
+    fprintf(stderr, "info : ice_transport_allocate_session: transport %s\n", ops->name);
+  }
+
+  return rc;
+}
+
+int ice_transport_deallocate_session(struct Session *session) {
+  assert(session);
+
+  if (session->transport.ops) {
+    session->transport.ops->deinitialize(&session->transport);
+  }
+
+  return ice_verb_deallocate_session(session);
+}
+
+// Send 'iters' packets over 'transport' from 'queue's pool and record the outcome in 'result'. Same batching, pacing
+// and checksum policy as 'ice_verb_send_loop'
+static int ice_transport_send_loop(struct Transport *transport, struct Queue *queue, const struct UserParam *param,
+  uint64_t iters, struct RunResult *result) {
+  assert(transport);
+  assert(queue);
+  assert(param);
+  assert(result);
+
+  const struct TransportOps *ops = transport->ops;
+  const uint64_t ringSize = transport->ringSize;
+  const uint64_t batchSize = param->txBatchSize;
+  const uint8_t checksumMode = param->checksumMode;
+  assert(batchSize>0 && batchSize<=ringSize);
+
+  uint64_t posted = 0;                                        // packets posted so far
+  uint64_t completed = 0;                                     // packets known complete so far
+  struct Pacer pacer;
+  struct StatsCounters *counters = &result->counters;
+
+  memset(result, 0, sizeof(struct RunResult));
+  ice_pacer_initialize(&pacer, param->useHardwarePacing ? 0 : param->txRatePps, ringSize);
+  clock_gettime(CLOCK_MONOTONIC, &result->startTime);
+
+  while (completed<iters) {
+    while (posted<iters) {
+      const uint64_t free = ringSize - (posted-completed);
+      const uint64_t want = (iters-posted < batchSize) ? iters-posted : batchSize;
+      if (free<want || ice_pacer_due(&pacer, posted)<want) {
+        break;
+      }
+
+      // Batch ends early if it would wrap the ring
+      const uint64_t slot = posted % ringSize;
+      const uint64_t count = (ringSize-slot < want) ? ringSize-slot : want;
+      for (uint64_t i=0; i<count; ++i) {
+        ice_verb_take_packet(queue, queue->sqe[slot+i], posted+i, checksumMode);
+      }
+      if (checksumMode==ICE_CHECKSUM_MODE_BATCH) {
+        ice_verb_checksum_taken(queue, count);
+      }
+
+      // Flush when this is the last batch or the next must wait for room
+      const uint64_t nextPosted = posted+count;
+      const uint64_t nextWant = (iters-nextPosted < batchSize) ? iters-nextPosted : batchSize;
+      const uint8_t flush = (nextPosted==iters || ringSize-(nextPosted-completed)<nextWant);
+      if (0!=ops->post_send(transport, posted, (uint32_t)count, flush)) {
+        ice_stats_add(&counters->errors, 1);
+        return ICE_IB_ERROR_API_ERROR;
+      }
+      posted = nextPosted;
+    }
+
+    const uint64_t priorCompleted = completed;
+    int n = ops->poll_send(transport, &completed);
+    ice_stats_add(&counters->polls, 1);
+    if (n<0) {
+      ice_stats_add(&counters->errors, 1);
+      return ICE_IB_ERROR_API_ERROR;
+    } else if (n==0) {
+      ice_stats_add(&counters->emptyPolls, 1);
+      continue;
+    }
+    ice_verb_retire_packets(queue, completed-priorCompleted);
+    ice_stats_add(&counters->completions, (uint64_t)n);
+    ice_stats_set(&counters->packets, completed);
+    ice_stats_set(&counters->bytes, completed * queue->pktSize);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &result->endTime);
+  result->paceRestarts = pacer.restarts;
+
+  return 0;
+}
+
+// Receive up to 'iters' packets over 'transport', check each per 'check' and record the outcome in 'result'. Same
+// idle policy as 'ice_verb_recv_loop'
+static int ice_transport_recv_loop(struct Transport *transport, uint64_t iters, const struct RecvCheck *check,
+  struct RunResult *result) {
+  assert(transport);
+  assert(result);
+
+  const struct TransportOps *ops = transport->ops;
+  const uint8_t *packet[MAX_POLL_ENTRIES];
+  uint32_t length[MAX_POLL_ENTRIES];
+  uint64_t received = 0;                                      // packets received so far
+  uint64_t idlePolls = 0;                                     // consecutive empty polls
+  struct timespec idleTime;
+  struct StatsCounters *counters = &result->counters;
+
+  memset(result, 0, sizeof(struct RunResult));
+  memset(&idleTime, 0, sizeof(idleTime));
+
+  while (received<iters) {
+    int n = ops->poll_recv(transport, packet, length, MAX_POLL_ENTRIES);
+    ice_stats_add(&counters->polls, 1);
+    if (n<0) {
+      ice_stats_add(&counters->errors, 1);
+      return ICE_IB_ERROR_API_ERROR;
+    } else if (n==0) {
+      ice_stats_add(&counters->emptyPolls, 1);
+      if (received>0 && ice_verb_idle_timeout(idlePolls++, &idleTime)) {
+        fprintf(stderr, "warn : ice_transport_recv_loop: idle timeout: received %lu of %lu packets\n", received,
+          iters);
+        break;
+      }
+      continue;
+    }
+
+    if (received==0) {
+      clock_gettime(CLOCK_MONOTONIC, &result->startTime);
+    }
+    idlePolls = 0;
+
+    const uint64_t now = __rdtsc();
+    uint64_t bytes = 0;
+    for (int i=0; i<n; ++i) {
+      bytes += length[i];
+      if (length[i]>=sizeof(struct IPV4Packet)) {
+        ice_verb_check_packet(check, (const struct IPV4Packet *)packet[i], now);
+      }
+    }
+    received += (uint64_t)n;
+    ice_stats_add(&counters->completions, (uint64_t)n);
+    ice_stats_add(&counters->bytes, bytes);
+    ice_stats_set(&counters->packets, received);
+
+    if (0!=ops->release_recv(transport, (uint32_t)n)) {
+      ice_stats_add(&counters->errors, 1);
+      return ICE_IB_ERROR_API_ERROR;
+    }
+  }
+
+  // Don't count trailing idle time
+  if (received<iters && received>0) {
+    result->endTime = idleTime;
+  } else {
+    clock_gettime(CLOCK_MONOTONIC, &result->endTime);
+  }
+  if (received==0) {
+    result->startTime = result->endTime;
+  }
+
+  return 0;
+}
+
+// Run the client side of a test over 'session->transport' under live stats and print results. Return 0 on success
+// and non-zero otherwise
+static int ice_transport_client(struct Session *session) {
+  const struct UserParam *param = session->userParam;
+  struct RunResult result;
+  ice_verb_start_stats(session, &result);
+  int rc = ice_transport_send_loop(&session->transport, session->send, param, param->iters, &result);
+  ice_stats_stop(&session->stats);
+  if (rc==0) {
+    ice_verb_print_result("ice_transport_run_client", &result);
+    fprintf(stderr, "info : ice_transport_run_client: transport %s, batch %u, checksum %s\n",
+      session->transport.ops->name, param->txBatchSize, ice_checksum_mode_name(param->checksumMode));
+    ice_verb_print_pacing("ice_transport_run_client", param, &result);
+    rc = ice_report_write(param, "client", 1, &result, 0, "none", 0);
+  }
+
+  return rc;
+}
+
+// Server side counterpart of 'ice_transport_client'; live stats only if 'withStats'
+static int ice_transport_server(struct Session *session, uint8_t withStats) {
+  struct RunResult result;
+  struct RecvCheck check;
+  struct SequenceTracker sequence;
+  ice_verb_initialize_check(session->userParam, session->common, &check);
+  if (withStats) {
+    ice_verb_start_stats(session, &result);
+  }
+  int rc = ice_transport_recv_loop(&session->transport, session->userParam->iters, &check, &result);
+  if (withStats) {
+    ice_stats_stop(&session->stats);
+  }
+  if (rc==0) {
+    ice_verb_print_result("ice_transport_run_server", &result);
+    fprintf(stderr, "info : ice_transport_run_server: transport %s\n", session->transport.ops->name);
+    ice_verb_print_check("ice_transport_run_server", &check, session->userParam->iters, &sequence);
+    rc = ice_report_write(session->userParam, "server", 1, &result, check.latency, "one-way", &sequence);
+  }
+
+  return rc;
+}
+
+int ice_transport_run_client(struct Session *session) {
+  assert(session);
+  assert(session->send);
+  assert(session->transport.ops);
+  assert(session->userParam);
+
+  return ice_transport_client(session);
+}
+
+int ice_transport_run_server(struct Session *session) {
+  assert(session);
+  assert(session->transport.ops);
+  assert(session->userParam);
+
+  return ice_transport_server(session, 1);
+}
+
+// Loopback server thread's argument and result
+struct LoopbackServer {
+  struct Session            *session;                         // session both sides share
+  int32_t                   cpu;                              // core to pin to
+  int                       rc;                               // 'ice_transport_server' outcome
+};
+
+// Live stats follow the client only: both sides count the same packets
+static void *ice_transport_loopback_server(void *arg) {
+  struct LoopbackServer *server = (struct LoopbackServer *)arg;
+  ice_topology_pin_thread(server->cpu);
+  server->rc = ice_transport_server(server->session, 0);
+  return 0;
+}
+
+int ice_transport_run_loopback(struct Session *session) {
+  assert(session);
+  assert(session->userParam);
+
+  const struct UserParam *param = session->userParam;
+  struct LoopbackServer server;
+  server.session = session;
+  server.rc = 0;
+  if (param->firstCpu<0) {
+    server.cpu = ice_topology_take_cpu(&session->topology, "rx loopback");
+  } else {
+    server.cpu = param->firstCpu+1;
+    fprintf(stderr, "info : ice_transport_run_loopback: rx loopback thread on cpu %d per -c\n", server.cpu);
+  }
+
+  // The server's one-way latencies subtract the client's rdtsc send stamps
+  if (0!=ice_tsc_check_skew(sched_getcpu(), server.cpu)) {
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  pthread_t thread;
+  int rc = pthread_create(&thread, 0, ice_transport_loopback_server, &server);
+  if (rc!=0) {
+    fprintf(stderr, "warn : ice_transport_run_loopback: pthread_create failed: %s (errno %d)\n", strerror(rc), rc);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+  rc = ice_transport_client(session);
+  pthread_join(thread, 0);
+
+  return rc!=0 ? rc : server.rc;
+}
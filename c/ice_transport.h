@@ -0,0 +1,157 @@
+#pragma once
+
+#include <stdint.h>
+
+// Transport interface under Session. A backend moves packets from a session's send queue pool onto the wire and
+// hands received packets back; everything else (batching, pacing, checksums, counting, timing) is the shared
+// measurement code in 'ice_transport_send_loop' and 'ice_transport_recv_loop'. So kernel-path backends are measured
+// exactly as verbs kernel-bypass is.
+//
+// Send side: the loop takes packets from the pool into 'queue->sqe[seq%ringSize]' then 'post_send' puts 'count'
+// consecutive slots starting at 'seq' on the wire. Batches never wrap the ring. 'flush' asks for a completion of the
+// batch's last packet; otherwise a backend may report completions late. 'poll_send' advances '*completed', the count
+// of packets whose slots may be reused.
+//
+// Receive side: 'poll_recv' returns up to 'max' packets and their lengths which stay valid until the next
+// 'poll_recv'. 'release_recv' hands the previous 'count' packets' buffers back to the backend.
+
+struct Session;
+struct SpscRing;
+struct UserParam;
+
+// Backends
+enum ICE_TransportKind {
+  ICE_TRANSPORT_NONE = 0,                                     // native verbs loops; no transport interface
+  ICE_TRANSPORT_VERBS = 1,                                    // ibverbs RAW_PACKET QP
+  ICE_TRANSPORT_PACKET = 2,                                   // AF_PACKET TPACKET_V3 mmap rings
+  ICE_TRANSPORT_XDP = 3,                                      // AF_XDP socket over a UMEM spanning the session arena
+  ICE_TRANSPORT_LOOPBACK = 4,                                 // in-process SPSC ring between two threads; no NIC
+};
+
+// AF_XDP copy modes
+enum ICE_XdpMode {
+  ICE_XDP_MODE_AUTO = 0,                                      // zero-copy if the driver supports it else copy
+  ICE_XDP_MODE_ZEROCOPY = 1,                                  // zero-copy or fail
+  ICE_XDP_MODE_COPY = 2,                                      // copy even if zero-copy is supported
+};
+
+struct Transport;
+
+struct TransportOps {
+  const char *name;
+  // Set up 'session' (memory, queues, endpoints, device) for 'param'. Return 0 on success and non-zero otherwise
+  int (*initialize)(const struct UserParam *param, struct Session *session);
+  // Put 'count' send slots from 'seq' on the wire. Return 0 on success and non-zero otherwise
+  int (*post_send)(struct Transport *transport, uint64_t seq, uint32_t count, uint8_t flush);
+  // Advance '*completed' past finished sends. Return completions seen (0 is an empty poll) or negative on error
+  int (*poll_send)(struct Transport *transport, uint64_t *completed);
+  // Return up to 'max' received packets in 'packet' and 'length' or negative on error
+  int (*poll_recv)(struct Transport *transport, const uint8_t **packet, uint32_t *length, uint32_t max);
+  // Give the buffers of the last 'count' received packets back. Return 0 on success and non-zero otherwise
+  int (*release_recv)(struct Transport *transport, uint32_t count);
+  // Free whatever 'initialize' set up beyond session memory
+  void (*deinitialize)(struct Transport *transport);
+};
+
+// Verbs backend state
+struct VerbsTransport {
+  uint64_t                  sinceSignal;                      // send WRs posted since last signaled WR
+  uint64_t                  recvFirst;                        // wr_id heading the chain 'release_recv' reposts
+};
+
+// AF_PACKET backend state. Client uses the TX ring, server the RX ring
+struct PacketTransport {
+  int                       fd;                               // AF_PACKET socket
+  uint8_t                   *ring;                            // mmap'd TX or RX ring
+  uint64_t                  ringBytes;                        // bytes mapped at 'ring'
+  uint32_t                  frameSize;                        // TX frame bytes; power of 2
+  uint32_t                  frameCount;                       // TX frames in 'ring'
+  uint32_t                  blockSize;                        // RX block bytes
+  uint32_t                  blockCount;                       // RX blocks in 'ring'
+  uint32_t                  block;                            // RX block being read
+  uint32_t                  blockLeft;                        // packets in 'block' not yet returned
+  uint8_t                   *blockNext;                       // next tpacket3_hdr in 'block'
+  uint64_t                  posted;                           // TX frames handed to the kernel so far
+  uint16_t                  port;                             // first UDP destination port received; host order
+  uint32_t                  portCount;                        // received ports are in [port, port+portCount)
+  uint64_t                  dropped;                          // RX blocks seen with TP_STATUS_LOSING
+};
+
+// One AF_XDP ring: fill and TX are produced by us, completion and RX consumed. 'head' is our producer or consumer
+// index; the kernel sees it when stored to '*producer' or '*consumer'
+struct XdpRing {
+  uint32_t                  *producer;                        // shared producer index
+  uint32_t                  *consumer;                        // shared consumer index
+  uint32_t                  *flags;                           // XDP_RING_NEED_WAKEUP
+  void                      *desc;                            // uint64_t addresses or struct xdp_desc entries
+  uint32_t                  mask;                             // entries-1; entries is a power of 2
+  uint32_t                  head;                             // local producer (fill, TX) or consumer (completion, RX)
+  void                      *map;                             // mmap'd ring
+  uint64_t                  mapBytes;                         // bytes mapped at 'map'
+};
+
+// AF_XDP backend state. The UMEM is the whole session arena so clients send pool packets in place; servers receive
+// into frames carved from the arena after the queues
+struct XdpTransport {
+  int                       fd;                               // AF_XDP socket
+  int                       mapFd;                            // XSKMAP redirecting the NIC queue to 'fd' (server)
+  int                       progFd;                           // XDP program doing the redirect (server)
+  int                       linkFd;                           // XDP link attaching 'progFd'; closing detaches (server)
+  uint8_t                   *umem;                            // UMEM start == session arena memory
+  struct XdpRing            fill;                             // frames handed to the kernel for RX
+  struct XdpRing            completion;                       // TX frames the kernel is done with
+  struct XdpRing            rx;                               // received frames
+  struct XdpRing            tx;                               // frames to send
+  uint32_t                  peeked;                           // RX descriptors the last 'poll_recv' consumed
+  uint16_t                  port;                             // first UDP destination port received; host order
+  uint32_t                  portCount;                        // received ports are in [port, port+portCount)
+  uint8_t                   zeroCopy;                         // socket bound in zero-copy mode
+  uint8_t                   needWakeup;                       // kick only when the kernel sets XDP_RING_NEED_WAKEUP
+  uint64_t                  wakeups;                          // sendto/recvfrom kicks made
+};
+
+// Loopback backend state: a "null NIC". The client publishes pool packet descriptors on 'ring'; a server thread in
+// the same process reads the packets in place and releases them, which completes them for the client
+struct LoopbackTransport {
+  struct SpscRing           *ring;                            // client to server descriptors in the session arena
+};
+
+struct Transport {
+  const struct TransportOps *ops;                             // backend; 0 if session runs native verbs loops
+  struct Session            *session;                         // session transport belongs to
+  uint32_t                  ringSize;                         // send slots in flight at most; == txQueueSize
+  union {
+    struct VerbsTransport   verbs;
+    struct PacketTransport  packet;
+    struct XdpTransport     xdp;
+    struct LoopbackTransport loopback;
+  };
+};
+
+extern const struct TransportOps iceTransportVerbs;
+extern const struct TransportOps iceTransportPacket;
+extern const struct TransportOps iceTransportXdp;
+extern const struct TransportOps iceTransportLoopback;
+
+// Parse 'name' ("verbs", "packet", "xdp", "loopback") into '*kind'. Return 0 on success and non-zero otherwise
+int ice_transport_parse_kind(const char *name, uint8_t *kind);
+
+// Return printable name of transport 'kind'
+const char *ice_transport_kind_name(uint8_t kind);
+
+// Parse 'name' ("auto", "zerocopy", "copy") into '*mode'. Return 0 on success and non-zero otherwise
+int ice_transport_parse_xdp_mode(const char *name, uint8_t *mode);
+
+// Initialize 'session' for 'param->transport'. Call 'ice_transport_deallocate_session' whatever the outcome. Return
+// 0 on success and non-zero otherwise
+int ice_transport_allocate_session(const struct UserParam *param, struct Session *session);
+int ice_transport_deallocate_session(struct Session *session);
+
+// Run the client (send) or server (receive) side of a bandwidth test over 'session->transport' and print results.
+// Return 0 on success and non-zero otherwise
+int ice_transport_run_client(struct Session *session);
+int ice_transport_run_server(struct Session *session);
+
+// Run both sides of a loopback bandwidth test: the server on a second pinned thread, the client on the caller.
+// Return 0 on success and non-zero otherwise
+int ice_transport_run_loopback(struct Session *session);
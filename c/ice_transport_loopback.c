@@ -0,0 +1,118 @@
+#include <ice_verb.h>
+#include <ice_spsc.h>
+
+#include <stdio.h>
+
+// Loopback backend: no device at all. The client's pool packets are templated, checksummed and stamped exactly as for
+// a NIC, then their descriptors go over a lock-free SPSC ring to the receive loop on a server thread in the same
+// process. What's measured is the per-packet software cost of the generator and the measurement loops. '-d' is
+// ignored.
+
+static int ice_transport_loopback_initialize(const struct UserParam *param, struct Session *session) {
+  assert(param);
+  assert(session);
+
+  struct LoopbackTransport *loopback = &session->transport.loopback;
+  session->userParam = param;
+
+  if (0!=ice_verb_initialize_endpoint(param->clientMac, param->clientIpAddr, param->clientPort, &session->client) ||
+      0!=ice_verb_initialize_endpoint(param->serverMac, param->serverIpAddr, param->serverPort, &session->server)) {
+    return ICE_IB_ERROR_BAD_IP_ADDR;
+  }
+
+  if (param->checksumMode==ICE_CHECKSUM_MODE_OFFLOAD) {
+    fprintf(stderr, "warn : ice_transport_loopback_initialize: loopback has no IPV4 checksum offload\n");
+    return ICE_IB_ERROR_API_ERROR;
+  } else if (param->checksumMode==ICE_CHECKSUM_MODE_BATCH) {
+    fprintf(stderr, "info : ice_transport_loopback_initialize: batch checksum kernel %s\n", ice_checksum_initialize());
+  }
+
+  // Ring holds every send slot so the client never waits on it for room
+  uint64_t entries = 1;
+  while (entries<param->txQueueSize) {
+    entries <<= 1;
+  }
+  const uint64_t ringBytes = ice_spsc_memory_size(entries);
+
+  // No device so no NUMA preference; the caller becomes the client thread
+  int rc = ice_verb_allocate_queues(param, session, "/sys/devices/system/cpu", ringBytes);
+  if (rc!=0) {
+    return rc;
+  }
+  void *memory = ice_arena_allocate(&session->arena, ringBytes);
+  if (memory==0) {
+    return ICE_IB_ERROR_NO_MEMORY;
+  }
+  loopback->ring = ice_spsc_initialize(memory, entries);
+
+  fprintf(stderr, "info : ice_transport_loopback_initialize: SPSC ring %lu entries\n", entries);
+  return ice_verb_initialize_send_ring(session);
+}
+
+static int ice_transport_loopback_post_send(struct Transport *transport, uint64_t seq, uint32_t count, uint8_t flush) {
+  struct SpscRing *ring = transport->loopback.ring;
+  struct Queue *queue = transport->session->send;
+  const uint64_t slot = seq % transport->ringSize;
+  (void)flush;
+
+  if (ice_spsc_free(ring, count)<count) {
+    fprintf(stderr, "warn : ice_transport_loopback_post_send: ring full posting %u packets\n", count);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  // A split packet is described by its header SGE and its total length
+  for (uint32_t i=0; i<count; ++i) {
+    const struct ibv_sge *sge = queue->sqe[slot+i];
+    struct SpscEntry *entry = ice_spsc_slot(ring, i);
+    entry->addr = sge[0].addr;
+    entry->length = sge[0].length + (queue->pktPayload ? sge[1].length : 0);
+  }
+  ice_spsc_publish(ring, count);
+
+  return 0;
+}
+
+static int ice_transport_loopback_poll_send(struct Transport *transport, uint64_t *completed) {
+  // Released by the server is complete
+  const uint64_t released = ice_spsc_released(transport->loopback.ring);
+  const int n = (int)(released-*completed);
+  *completed = released;
+  return n;
+}
+
+static int ice_transport_loopback_poll_recv(struct Transport *transport, const uint8_t **packet, uint32_t *length,
+  uint32_t max) {
+  const struct SpscRing *ring = transport->loopback.ring;
+
+  uint64_t n = ice_spsc_peek(transport->loopback.ring);
+  if (n>max) {
+    n = max;
+  }
+  for (uint64_t i=0; i<n; ++i) {
+    const struct SpscEntry *entry = ice_spsc_entry(ring, i);
+    packet[i] = (const uint8_t *)entry->addr;
+    length[i] = entry->length;
+  }
+
+  return (int)n;
+}
+
+static int ice_transport_loopback_release_recv(struct Transport *transport, uint32_t count) {
+  ice_spsc_release(transport->loopback.ring, count);
+  return 0;
+}
+
+static void ice_transport_loopback_deinitialize(struct Transport *transport) {
+  // Ring lives in the session arena
+  transport->loopback.ring = 0;
+}
+
+const struct TransportOps iceTransportLoopback = {
+  .name = "loopback",
+  .initialize = ice_transport_loopback_initialize,
+  .post_send = ice_transport_loopback_post_send,
+  .poll_send = ice_transport_loopback_poll_send,
+  .poll_recv = ice_transport_loopback_poll_recv,
+  .release_recv = ice_transport_loopback_release_recv,
+  .deinitialize = ice_transport_loopback_deinitialize,
+};
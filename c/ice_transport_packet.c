@@ -0,0 +1,295 @@
+#include <ice_verb.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+// AF_PACKET backend: kernel network stack baseline. '-d' names a network interface (e.g. one end of a veth pair).
+// Clients copy pool packets into a TPACKET_V3 TX ring and kick the kernel once per batch with sendto. Servers read
+// packets in place from TPACKET_V3 RX ring blocks. Packet memory is ordinary process memory; nothing is registered.
+
+enum kPACKET {
+  PACKET_RX_BLOCK_SIZE = 1<<18,                               // RX ring block bytes
+  PACKET_RX_BLOCK_COUNT = 64,                                 // RX ring blocks
+  PACKET_RX_FRAME_SIZE = 2048,                                // RX frame size the kernel accounts blocks by
+  PACKET_RX_BLOCK_TIMEOUT_MS = 1,                             // partly filled RX block handed to user after this
+  PACKET_TX_MIN_BLOCK_SIZE = 4096,                            // TX blocks are whole pages
+};
+
+// Bytes from a TX frame's start to its packet data
+static const uint32_t PACKET_TX_DATA_OFFSET = TPACKET_ALIGN(sizeof(struct tpacket3_hdr));
+
+static int ice_transport_packet_fail(const char *what) {
+  int rc = errno;
+  fprintf(stderr, "warn : ice_transport_packet_initialize: %s failed: %s (errno %d)\n", what, strerror(rc), rc);
+  return ICE_IB_ERROR_API_ERROR;
+}
+
+static int ice_transport_packet_initialize(const struct UserParam *param, struct Session *session) {
+  assert(param);
+  assert(session);
+
+  struct PacketTransport *packet = &session->transport.packet;
+  packet->fd = -1;
+  session->userParam = param;
+
+  if (0!=ice_verb_initialize_endpoint(param->clientMac, param->clientIpAddr, param->clientPort, &session->client) ||
+      0!=ice_verb_initialize_endpoint(param->serverMac, param->serverIpAddr, param->serverPort, &session->server)) {
+    return ICE_IB_ERROR_BAD_IP_ADDR;
+  }
+
+  if (param->checksumMode==ICE_CHECKSUM_MODE_OFFLOAD) {
+    fprintf(stderr, "warn : ice_transport_packet_initialize: AF_PACKET has no IPV4 checksum offload\n");
+    return ICE_IB_ERROR_API_ERROR;
+  } else if (param->checksumMode==ICE_CHECKSUM_MODE_BATCH) {
+    fprintf(stderr, "info : ice_transport_packet_initialize: batch checksum kernel %s\n", ice_checksum_initialize());
+  }
+
+  const unsigned int ifIndex = if_nametoindex(param->deviceId);
+  if (ifIndex==0) {
+    return ice_transport_packet_fail("if_nametoindex");
+  }
+
+  char deviceDir[256];
+  snprintf(deviceDir, sizeof(deviceDir), "/sys/class/net/%s/device", param->deviceId);
+  int rc = ice_verb_allocate_queues(param, session, deviceDir, 0);
+  if (rc!=0) {
+    return rc;
+  }
+
+  // Send-only sockets use protocol 0 so the kernel never queues received
+  // packets to them
+  const uint16_t protocol = param->isServer ? htons(ETH_P_IP) : 0;
+  if (0>(packet->fd = socket(AF_PACKET, SOCK_RAW, protocol))) {
+    return ice_transport_packet_fail("socket(AF_PACKET)");
+  }
+  int version = TPACKET_V3;
+  if (0!=setsockopt(packet->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version))) {
+    return ice_transport_packet_fail("setsockopt(PACKET_VERSION)");
+  }
+
+  struct tpacket_req3 req;
+  memset(&req, 0, sizeof(req));
+  if (param->isServer) {
+    packet->blockSize = PACKET_RX_BLOCK_SIZE;
+    packet->blockCount = PACKET_RX_BLOCK_COUNT;
+    packet->port = ntohs(session->server.port);
+    packet->portCount = ice_verb_flow_ports(param);
+    req.tp_block_size = packet->blockSize;
+    req.tp_block_nr = packet->blockCount;
+    req.tp_frame_size = PACKET_RX_FRAME_SIZE;
+    req.tp_frame_nr = (packet->blockSize/PACKET_RX_FRAME_SIZE)*packet->blockCount;
+    req.tp_retire_blk_tov = PACKET_RX_BLOCK_TIMEOUT_MS;
+    if (0!=setsockopt(packet->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req))) {
+      return ice_transport_packet_fail("setsockopt(PACKET_RX_RING)");
+    }
+    packet->ringBytes = (uint64_t)packet->blockSize*packet->blockCount;
+  } else {
+    // Frames are a power of 2 holding header and packet; blocks whole
+    // pages of frames; at least one frame per send ring slot
+    packet->frameSize = 64;
+    while (packet->frameSize<PACKET_TX_DATA_OFFSET+session->send->pktSize) {
+      packet->frameSize <<= 1;
+    }
+    const uint32_t blockSize = (packet->frameSize>PACKET_TX_MIN_BLOCK_SIZE) ? packet->frameSize
+                                                                            : PACKET_TX_MIN_BLOCK_SIZE;
+    const uint32_t framesPerBlock = blockSize/packet->frameSize;
+    const uint32_t blockCount = (param->txQueueSize+framesPerBlock-1)/framesPerBlock;
+    packet->frameCount = framesPerBlock*blockCount;
+    req.tp_block_size = blockSize;
+    req.tp_block_nr = blockCount;
+    req.tp_frame_size = packet->frameSize;
+    req.tp_frame_nr = packet->frameCount;
+    int bypass = 1;
+    if (0!=setsockopt(packet->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &bypass, sizeof(bypass))) {
+      fprintf(stderr, "warn : ice_transport_packet_initialize: no qdisc bypass: %s (errno %d)\n", strerror(errno),
+        errno);
+    }
+    if (0!=setsockopt(packet->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req))) {
+      return ice_transport_packet_fail("setsockopt(PACKET_TX_RING)");
+    }
+    packet->ringBytes = (uint64_t)blockSize*blockCount;
+  }
+
+  void *ring = mmap(0, packet->ringBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, packet->fd, 0);
+  if (ring==MAP_FAILED) {
+    packet->ringBytes = 0;
+    return ice_transport_packet_fail("mmap");
+  }
+  packet->ring = (uint8_t *)ring;
+
+  struct sockaddr_ll addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = protocol;
+  addr.sll_ifindex = (int)ifIndex;
+  if (0!=bind(packet->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    return ice_transport_packet_fail("bind");
+  }
+
+  if (param->isServer) {
+    fprintf(stderr, "info : ice_transport_packet_initialize: %s RX ring %u blocks of %u bytes\n", param->deviceId,
+      packet->blockCount, packet->blockSize);
+    return 0;
+  }
+
+  fprintf(stderr, "info : ice_transport_packet_initialize: %s TX ring %u frames of %u bytes\n", param->deviceId,
+    packet->frameCount, packet->frameSize);
+  return ice_verb_initialize_send_ring(session);
+}
+
+// Ask the kernel to send every frame marked TP_STATUS_SEND_REQUEST without blocking
+static int ice_transport_packet_kick(struct PacketTransport *packet) {
+  if (0>sendto(packet->fd, 0, 0, MSG_DONTWAIT, 0, 0)) {
+    int rc = errno;
+    if (rc!=EAGAIN && rc!=ENOBUFS) {
+      fprintf(stderr, "warn : ice_transport_packet_kick: sendto failed: %s (errno %d)\n", strerror(rc), rc);
+      return ICE_IB_ERROR_API_ERROR;
+    }
+  }
+  return 0;
+}
+
+static int ice_transport_packet_post_send(struct Transport *transport, uint64_t seq, uint32_t count, uint8_t flush) {
+  struct PacketTransport *packet = &transport->packet;
+  struct Queue *queue = transport->session->send;
+  const uint64_t slot = seq % transport->ringSize;
+  (void)flush;
+
+  for (uint32_t i=0; i<count; ++i) {
+    uint8_t *frame = packet->ring + ((seq+i)%packet->frameCount)*packet->frameSize;
+    struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)frame;
+    const struct ibv_sge *sge = queue->sqe[slot+i];
+
+    memcpy(frame+PACKET_TX_DATA_OFFSET, (const void *)sge[0].addr, sge[0].length);
+    uint32_t length = sge[0].length;
+    if (queue->pktPayload) {
+      memcpy(frame+PACKET_TX_DATA_OFFSET+length, (const void *)sge[1].addr, sge[1].length);
+      length += sge[1].length;
+    }
+    hdr->tp_len = length;
+    hdr->tp_next_offset = 0;
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+  }
+  packet->posted = seq+count;
+
+  return ice_transport_packet_kick(packet);
+}
+
+static int ice_transport_packet_poll_send(struct Transport *transport, uint64_t *completed) {
+  struct PacketTransport *packet = &transport->packet;
+
+  // The kernel returns frames in order by setting them available again
+  int n = 0;
+  while (*completed<packet->posted) {
+    struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)(packet->ring +
+      (*completed%packet->frameCount)*packet->frameSize);
+    const uint32_t status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+    if (status==TP_STATUS_AVAILABLE) {
+      ++*completed;
+      ++n;
+    } else if (status & TP_STATUS_WRONG_FORMAT) {
+      fprintf(stderr, "warn : ice_transport_packet_poll_send: frame %lu rejected by kernel\n", *completed);
+      return -1;
+    } else {
+      break;
+    }
+  }
+
+  // Frames left waiting by an earlier EAGAIN need another kick
+  if (n==0 && *completed<packet->posted && 0!=ice_transport_packet_kick(packet)) {
+    return -1;
+  }
+
+  return n;
+}
+
+static int ice_transport_packet_poll_recv(struct Transport *transport, const uint8_t **pkt, uint32_t *length,
+  uint32_t max) {
+  struct PacketTransport *packet = &transport->packet;
+
+  if (packet->blockLeft==0) {
+    struct tpacket_block_desc *desc = (struct tpacket_block_desc *)(packet->ring +
+      (uint64_t)packet->block*packet->blockSize);
+    // Hand a drained block back before looking at the next
+    if (packet->blockNext) {
+      __atomic_store_n(&desc->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+      packet->blockNext = 0;
+      packet->block = (packet->block+1) % packet->blockCount;
+      desc = (struct tpacket_block_desc *)(packet->ring + (uint64_t)packet->block*packet->blockSize);
+    }
+    const uint32_t status = __atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE);
+    if (0==(status & TP_STATUS_USER)) {
+      return 0;
+    }
+    if (status & TP_STATUS_LOSING) {
+      ++packet->dropped;
+    }
+    packet->blockLeft = desc->hdr.bh1.num_pkts;
+    packet->blockNext = (uint8_t *)desc + desc->hdr.bh1.offset_to_first_pkt;
+    if (packet->blockLeft==0) {
+      return 0;
+    }
+  }
+
+  // Only UDP to the server's ports counts; the interface may carry anything
+  uint32_t n = 0;
+  while (packet->blockLeft>0 && n<max) {
+    const struct tpacket3_hdr *hdr = (const struct tpacket3_hdr *)packet->blockNext;
+    const struct IPV4Packet *ip = (const struct IPV4Packet *)(packet->blockNext + hdr->tp_mac);
+    if (hdr->tp_snaplen>=ice_verb_packet_size(0) && ip->ip_header.ethType==htons(0x0800) &&
+        ip->ipv4_header.nextProtoId==IPPROTO_UDP &&
+        (uint16_t)(ntohs(ip->ipv4udp_header.dstPort)-packet->port)<packet->portCount) {
+      pkt[n] = (const uint8_t *)ip;
+      length[n] = hdr->tp_snaplen;
+      ++n;
+    }
+    packet->blockNext += hdr->tp_next_offset;
+    --packet->blockLeft;
+  }
+
+  return (int)n;
+}
+
+static int ice_transport_packet_release_recv(struct Transport *transport, uint32_t count) {
+  // Blocks go back to the kernel once drained by 'poll_recv'
+  (void)transport;
+  (void)count;
+  return 0;
+}
+
+static void ice_transport_packet_deinitialize(struct Transport *transport) {
+  struct PacketTransport *packet = &transport->packet;
+
+  if (packet->fd>=0 && transport->session->userParam->isServer) {
+    struct tpacket_stats_v3 stats;
+    socklen_t size = sizeof(stats);
+    if (0==getsockopt(packet->fd, SOL_PACKET, PACKET_STATISTICS, &stats, &size)) {
+      fprintf(stderr, "info : ice_transport_packet: kernel queued %u packets, dropped %u, ring full %lu times\n",
+        stats.tp_packets, stats.tp_drops, packet->dropped);
+    }
+  }
+  if (packet->ring) {
+    munmap(packet->ring, packet->ringBytes);
+  }
+  if (packet->fd>=0) {
+    close(packet->fd);
+  }
+  memset(packet, 0, sizeof(struct PacketTransport));
+  packet->fd = -1;
+}
+
+const struct TransportOps iceTransportPacket = {
+  .name = "packet",
+  .initialize = ice_transport_packet_initialize,
+  .post_send = ice_transport_packet_post_send,
+  .poll_send = ice_transport_packet_poll_send,
+  .poll_recv = ice_transport_packet_poll_recv,
+  .release_recv = ice_transport_packet_release_recv,
+  .deinitialize = ice_transport_packet_deinitialize,
+};
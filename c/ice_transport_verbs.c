@@ -0,0 +1,144 @@
+#include <ice_verb.h>
+
+#include <errno.h>
+#include <stdio.h>
+
+// Verbs backend: the session QP posts chained send WRs from the ring built by 'ice_verb_build_send_ring' and
+// receives into the ring posted by 'ice_verb_post_recv_ring'
+
+static int ice_transport_verbs_initialize(const struct UserParam *param, struct Session *session) {
+  assert(param);
+  assert(session);
+
+  int rc;
+  if (0!=(rc=ice_verb_allocate_session(param, session)) ||
+      0!=(rc=ice_verb_set_rtr(session)) ||
+      0!=(rc=ice_verb_set_rts(session))) {
+    return rc;
+  }
+
+  if (param->isServer) {
+    if (0==(rc=ice_verb_initialize_flow(session, &session->server))) {
+      rc = ice_verb_initialize_recv_ring(session);
+    }
+  } else {
+    rc = ice_verb_initialize_send_ring(session);
+  }
+
+  return rc;
+}
+
+static int ice_transport_verbs_post_send(struct Transport *transport, uint64_t seq, uint32_t count, uint8_t flush) {
+  struct Session *session = transport->session;
+  struct Queue *queue = session->send;
+  const struct UserParam *param = session->userParam;
+  const unsigned int sendFlags = ((param->checksumMode==ICE_CHECKSUM_MODE_OFFLOAD) ? IBV_SEND_IP_CSUM : 0) |
+                                 ((queue->pktSize<=queue->inlineSize) ? IBV_SEND_INLINE : 0);
+
+  const uint64_t slot = seq % transport->ringSize;
+  for (uint32_t i=0; i<count; ++i) {
+    struct ibv_send_wr *wr = queue->wsq+slot+i;
+    wr->wr_id = seq+i;
+    if (++transport->verbs.sinceSignal>=param->txSignalInterval || (flush && i+1==count)) {
+      wr->send_flags = IBV_SEND_SIGNALED | sendFlags;
+      transport->verbs.sinceSignal = 0;
+    } else {
+      wr->send_flags = sendFlags;
+    }
+  }
+
+  struct ibv_send_wr *badWr = 0;
+  struct ibv_send_wr *last = queue->wsq+slot+count-1;
+  struct ibv_send_wr *next = last->next;
+  last->next = 0;
+  int rc = ibv_post_send(session->common->qp, queue->wsq+slot, &badWr);
+  last->next = next;
+  if (rc!=0) {
+    fprintf(stderr, "warn : ice_transport_verbs_post_send: ibv_post_send failed: %s (errno %d)\n", strerror(rc), rc);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  return 0;
+}
+
+static int ice_transport_verbs_poll_send(struct Transport *transport, uint64_t *completed) {
+  struct Queue *queue = transport->session->send;
+
+  // A signaled WR's completion implies all WRs before it are complete
+  int n = ibv_poll_cq(queue->cq, MAX_POLL_ENTRIES, queue->wc);
+  if (n<0) {
+    fprintf(stderr, "warn : ice_transport_verbs_poll_send: ibv_poll_cq failed: %d\n", n);
+    return n;
+  }
+  for (int i=0; i<n; ++i) {
+    if (queue->wc[i].status!=IBV_WC_SUCCESS) {
+      fprintf(stderr, "warn : ice_transport_verbs_poll_send: send wr_id %lu failed: %s (status %d)\n",
+        queue->wc[i].wr_id, ibv_wc_status_str(queue->wc[i].status), queue->wc[i].status);
+      return -1;
+    }
+    *completed = queue->wc[i].wr_id+1;
+  }
+
+  return n;
+}
+
+static int ice_transport_verbs_poll_recv(struct Transport *transport, const uint8_t **packet, uint32_t *length,
+  uint32_t max) {
+  struct Queue *queue = transport->session->recv;
+
+  int n = ibv_poll_cq(queue->cq, (int)(max<MAX_POLL_ENTRIES ? max : MAX_POLL_ENTRIES), queue->wc);
+  if (n<0) {
+    fprintf(stderr, "warn : ice_transport_verbs_poll_recv: ibv_poll_cq failed: %d\n", n);
+    return n;
+  }
+
+  // Chain consumed WRs in completion order for one re-post on release
+  for (int i=0; i<n; ++i) {
+    if (queue->wc[i].status!=IBV_WC_SUCCESS) {
+      fprintf(stderr, "warn : ice_transport_verbs_poll_recv: recv wr_id %lu failed: %s (status %d)\n",
+        queue->wc[i].wr_id, ibv_wc_status_str(queue->wc[i].status), queue->wc[i].status);
+      return -1;
+    }
+    packet[i] = (const uint8_t *)ice_verb_packet(queue, (uint32_t)queue->wc[i].wr_id);
+    length[i] = queue->wc[i].byte_len;
+    queue->wrq[queue->wc[i].wr_id].next = (i+1<n) ? queue->wrq+queue->wc[i+1].wr_id : 0;
+  }
+  if (n>0) {
+    transport->verbs.recvFirst = queue->wc[0].wr_id;
+  }
+
+  return n;
+}
+
+static int ice_transport_verbs_release_recv(struct Transport *transport, uint32_t count) {
+  struct Session *session = transport->session;
+  struct ibv_recv_wr *badWr = 0;
+
+  if (count==0) {
+    return 0;
+  }
+
+  int rc = ibv_post_recv(session->common->qp, session->recv->wrq+transport->verbs.recvFirst, &badWr);
+  if (rc!=0) {
+    fprintf(stderr, "warn : ice_transport_verbs_release_recv: ibv_post_recv failed: %s (errno %d)\n", strerror(rc),
+      rc);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  return 0;
+}
+
+static void ice_transport_verbs_deinitialize(struct Transport *transport) {
+  // QP, CQs and MRs belong to the session
+  (void)transport;
+}
+
+const struct TransportOps iceTransportVerbs = {
+  .name = "verbs",
+  .initialize = ice_transport_verbs_initialize,
+  .post_send = ice_transport_verbs_post_send,
+  .poll_send = ice_transport_verbs_poll_send,
+  .poll_recv = ice_transport_verbs_poll_recv,
+  .release_recv = ice_transport_verbs_release_recv,
+  .deinitialize = ice_transport_verbs_deinitialize,
+};
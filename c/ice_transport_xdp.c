@@ -0,0 +1,440 @@
+#include <ice_verb.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+// AF_XDP backend: '-d' names a network interface of any driver (veth included) and '-Q' its queue. The UMEM is the
+// session arena registered whole with unaligned chunks, so clients put pool packets on the TX ring where they already
+// are. Servers fill the fill ring with frames carved from the arena after the queues and attach a small XDP program
+// redirecting the queue to the socket through an XSKMAP. Rings are driven in batches; with need-wakeup (the default)
+// syscalls are made only when the kernel asks for one.
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+enum kXDP {
+  XDP_FRAME_SIZE = 2048,                                      // UMEM chunk size; bytes per RX frame
+};
+
+static int ice_transport_xdp_fail(const char *what) {
+  int rc = errno;
+  fprintf(stderr, "warn : ice_transport_xdp_initialize: %s failed: %s (errno %d)\n", what, strerror(rc), rc);
+  return ICE_IB_ERROR_API_ERROR;
+}
+
+static uint32_t ice_transport_xdp_pow2(uint32_t value) {
+  uint32_t size = 1;
+  while (size<value) {
+    size <<= 1;
+  }
+  return size;
+}
+
+static long ice_transport_xdp_bpf(int cmd, union bpf_attr *attr) {
+  return syscall(__NR_bpf, cmd, attr, sizeof(union bpf_attr));
+}
+
+// Map the 'entries' entry ring at 'pgoff' laid out per 'offset' into 'ring'. 'entrySize' is 8 for fill and completion
+// rings and sizeof(struct xdp_desc) for RX and TX. Return 0 on success and non-zero otherwise
+static int ice_transport_xdp_map_ring(int fd, uint64_t pgoff, const struct xdp_ring_offset *offset, uint32_t entries,
+  uint32_t entrySize, struct XdpRing *ring) {
+  const uint64_t mapBytes = offset->desc + (uint64_t)entries*entrySize;
+  void *map = mmap(0, mapBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, (off_t)pgoff);
+  if (map==MAP_FAILED) {
+    return ice_transport_xdp_fail("mmap(ring)");
+  }
+
+  ring->map = map;
+  ring->mapBytes = mapBytes;
+  ring->producer = (uint32_t *)((uint8_t *)map + offset->producer);
+  ring->consumer = (uint32_t *)((uint8_t *)map + offset->consumer);
+  ring->flags = (uint32_t *)((uint8_t *)map + offset->flags);
+  ring->desc = (uint8_t *)map + offset->desc;
+  ring->mask = entries-1;
+  ring->head = 0;
+
+  return 0;
+}
+
+// Load an XDP program redirecting packets on each queue to the XSKMAP entry of the same index, passing them to the
+// stack if there's none, and attach it to 'ifIndex'. Return 0 on success and non-zero otherwise
+static int ice_transport_xdp_attach(struct XdpTransport *xdp, unsigned int ifIndex, uint32_t queueId, uint8_t mode) {
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_XSKMAP;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint32_t);
+  attr.max_entries = queueId+1;
+  if (0>(xdp->mapFd = (int)ice_transport_xdp_bpf(BPF_MAP_CREATE, &attr))) {
+    return ice_transport_xdp_fail("bpf(BPF_MAP_CREATE)");
+  }
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = (uint32_t)xdp->mapFd;
+  attr.key = (uint64_t)&queueId;
+  attr.value = (uint64_t)&xdp->fd;
+  if (0!=ice_transport_xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr)) {
+    return ice_transport_xdp_fail("bpf(BPF_MAP_UPDATE_ELEM)");
+  }
+
+  // return bpf_redirect_map(&xskmap, ctx->rx_queue_index, XDP_PASS)
+  const struct bpf_insn program[] = {
+    {.code = BPF_LDX | BPF_MEM | BPF_W, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1,
+     .off = offsetof(struct xdp_md, rx_queue_index)},
+    {.code = BPF_LD | BPF_IMM | BPF_DW, .dst_reg = BPF_REG_1, .src_reg = BPF_PSEUDO_MAP_FD, .imm = xdp->mapFd},
+    {.code = 0},
+    {.code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3, .imm = XDP_PASS},
+    {.code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map},
+    {.code = BPF_JMP | BPF_EXIT},
+  };
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.insns = (uint64_t)program;
+  attr.insn_cnt = sizeof(program)/sizeof(program[0]);
+  attr.license = (uint64_t)"GPL";
+  if (0>(xdp->progFd = (int)ice_transport_xdp_bpf(BPF_PROG_LOAD, &attr))) {
+    return ice_transport_xdp_fail("bpf(BPF_PROG_LOAD)");
+  }
+
+  // Zero-copy needs the driver's native XDP hook; otherwise the kernel
+  // picks native if the driver has one else generic
+  memset(&attr, 0, sizeof(attr));
+  attr.link_create.prog_fd = (uint32_t)xdp->progFd;
+  attr.link_create.target_ifindex = ifIndex;
+  attr.link_create.attach_type = BPF_XDP;
+  attr.link_create.flags = (mode==ICE_XDP_MODE_ZEROCOPY) ? XDP_FLAGS_DRV_MODE : 0;
+  if (0>(xdp->linkFd = (int)ice_transport_xdp_bpf(BPF_LINK_CREATE, &attr))) {
+    return ice_transport_xdp_fail("bpf(BPF_LINK_CREATE)");
+  }
+
+  return 0;
+}
+
+static int ice_transport_xdp_initialize(const struct UserParam *param, struct Session *session) {
+  assert(param);
+  assert(session);
+
+  struct XdpTransport *xdp = &session->transport.xdp;
+  xdp->fd = xdp->mapFd = xdp->progFd = xdp->linkFd = -1;
+  session->userParam = param;
+
+  if (0!=ice_verb_initialize_endpoint(param->clientMac, param->clientIpAddr, param->clientPort, &session->client) ||
+      0!=ice_verb_initialize_endpoint(param->serverMac, param->serverIpAddr, param->serverPort, &session->server)) {
+    return ICE_IB_ERROR_BAD_IP_ADDR;
+  }
+
+  if (param->checksumMode==ICE_CHECKSUM_MODE_OFFLOAD) {
+    fprintf(stderr, "warn : ice_transport_xdp_initialize: AF_XDP has no IPV4 checksum offload\n");
+    return ICE_IB_ERROR_API_ERROR;
+  } else if (param->checksumMode==ICE_CHECKSUM_MODE_BATCH) {
+    fprintf(stderr, "info : ice_transport_xdp_initialize: batch checksum kernel %s\n", ice_checksum_initialize());
+  }
+  if (param->splitPayload) {
+    fprintf(stderr, "warn : ice_transport_xdp_initialize: AF_XDP sends one buffer per packet; drop -P\n");
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  const unsigned int ifIndex = if_nametoindex(param->deviceId);
+  if (ifIndex==0) {
+    return ice_transport_xdp_fail("if_nametoindex");
+  }
+
+  // Servers need UMEM frames to receive into beyond the queues. They start on a page so no frame straddles one;
+  // reserve a page more for the padding that takes
+  const uint32_t txEntries = ice_transport_xdp_pow2(param->txQueueSize);
+  const uint32_t rxEntries = ice_transport_xdp_pow2(param->rxQueueSize);
+  const uint64_t pageBytes = (uint64_t)sysconf(_SC_PAGESIZE);
+  const uint64_t frameBytes = param->isServer ? (uint64_t)rxEntries*XDP_FRAME_SIZE : 0;
+  char deviceDir[256];
+  snprintf(deviceDir, sizeof(deviceDir), "/sys/class/net/%s/device", param->deviceId);
+  int rc = ice_verb_allocate_queues(param, session, deviceDir, frameBytes ? frameBytes+pageBytes : 0);
+  if (rc!=0) {
+    return rc;
+  }
+  uint8_t *frames = 0;
+  if (param->isServer &&
+      0==(frames = (uint8_t *)ice_arena_allocate_aligned(&session->arena, frameBytes, pageBytes))) {
+    return ICE_IB_ERROR_NO_MEMORY;
+  }
+
+  if (0>(xdp->fd = socket(AF_XDP, SOCK_RAW, 0))) {
+    return ice_transport_xdp_fail("socket(AF_XDP)");
+  }
+
+  // Unaligned chunks let pool packets stay at their cache line stride
+  // rather than one per chunk
+  struct xdp_umem_reg umem;
+  memset(&umem, 0, sizeof(umem));
+  umem.addr = (uint64_t)session->arena.memory;
+  umem.len = session->arena.sizeBytes;
+  umem.chunk_size = XDP_FRAME_SIZE;
+  umem.flags = XDP_UMEM_UNALIGNED_CHUNK_FLAG;
+  if (0!=setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_REG, &umem, sizeof(umem))) {
+    return ice_transport_xdp_fail("setsockopt(XDP_UMEM_REG)");
+  }
+  xdp->umem = session->arena.memory;
+
+  // Fill and completion rings are required even though a client never
+  // fills and a server never completes. Clients only TX, servers only RX
+  const uint32_t fillEntries = param->isServer ? rxEntries : txEntries;
+  const int dataRing = param->isServer ? XDP_RX_RING : XDP_TX_RING;
+  const uint32_t dataEntries = param->isServer ? rxEntries : txEntries;
+  if (0!=setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_FILL_RING, &fillEntries, sizeof(fillEntries)) ||
+      0!=setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &txEntries, sizeof(txEntries)) ||
+      0!=setsockopt(xdp->fd, SOL_XDP, dataRing, &dataEntries, sizeof(dataEntries))) {
+    return ice_transport_xdp_fail("setsockopt(ring size)");
+  }
+
+  struct xdp_mmap_offsets offsets;
+  socklen_t size = sizeof(offsets);
+  if (0!=getsockopt(xdp->fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &size)) {
+    return ice_transport_xdp_fail("getsockopt(XDP_MMAP_OFFSETS)");
+  }
+  if (0!=ice_transport_xdp_map_ring(xdp->fd, XDP_UMEM_PGOFF_FILL_RING, &offsets.fr, fillEntries, sizeof(uint64_t),
+        &xdp->fill) ||
+      0!=ice_transport_xdp_map_ring(xdp->fd, XDP_UMEM_PGOFF_COMPLETION_RING, &offsets.cr, txEntries,
+        sizeof(uint64_t), &xdp->completion)) {
+    return ICE_IB_ERROR_API_ERROR;
+  }
+  if (param->isServer) {
+    rc = ice_transport_xdp_map_ring(xdp->fd, XDP_PGOFF_RX_RING, &offsets.rx, rxEntries, sizeof(struct xdp_desc),
+      &xdp->rx);
+  } else {
+    rc = ice_transport_xdp_map_ring(xdp->fd, XDP_PGOFF_TX_RING, &offsets.tx, txEntries, sizeof(struct xdp_desc),
+      &xdp->tx);
+  }
+  if (rc!=0) {
+    return rc;
+  }
+
+  // Neither XDP_COPY nor XDP_ZEROCOPY lets the kernel fall back to copy
+  struct sockaddr_xdp addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sxdp_family = AF_XDP;
+  addr.sxdp_ifindex = ifIndex;
+  addr.sxdp_queue_id = param->xdpQueueId;
+  addr.sxdp_flags = (param->xdpMode==ICE_XDP_MODE_ZEROCOPY) ? XDP_ZEROCOPY :
+                    (param->xdpMode==ICE_XDP_MODE_COPY) ? XDP_COPY : 0;
+  if (!param->xdpAlwaysKick) {
+    addr.sxdp_flags |= XDP_USE_NEED_WAKEUP;
+  }
+  if (0!=bind(xdp->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    return ice_transport_xdp_fail("bind(AF_XDP)");
+  }
+  xdp->needWakeup = !param->xdpAlwaysKick;
+
+  struct xdp_options options;
+  size = sizeof(options);
+  if (0==getsockopt(xdp->fd, SOL_XDP, XDP_OPTIONS, &options, &size)) {
+    xdp->zeroCopy = (options.flags & XDP_OPTIONS_ZEROCOPY) ? 1 : 0;
+  }
+
+  if (param->isServer) {
+    // Hand every frame to the kernel up front
+    uint64_t *fill = (uint64_t *)xdp->fill.desc;
+    for (uint32_t i=0; i<rxEntries; ++i) {
+      fill[i] = (uint64_t)(frames-xdp->umem) + (uint64_t)i*XDP_FRAME_SIZE;
+    }
+    xdp->fill.head = rxEntries;
+    __atomic_store_n(xdp->fill.producer, xdp->fill.head, __ATOMIC_RELEASE);
+    xdp->port = ntohs(session->server.port);
+    xdp->portCount = ice_verb_flow_ports(param);
+
+    if (0!=(rc=ice_transport_xdp_attach(xdp, ifIndex, param->xdpQueueId, param->xdpMode))) {
+      return rc;
+    }
+  } else if (0!=(rc=ice_verb_initialize_send_ring(session))) {
+    return rc;
+  }
+
+  fprintf(stderr, "info : ice_transport_xdp_initialize: %s queue %u %s mode, %s, UMEM %lu bytes, %s ring %u entries\n",
+    param->deviceId, param->xdpQueueId, xdp->zeroCopy ? "zero-copy" : "copy",
+    xdp->needWakeup ? "need-wakeup" : "always kick", session->arena.sizeBytes, param->isServer ? "RX" : "TX",
+    dataEntries);
+
+  return 0;
+}
+
+// Make the kernel process the TX ring (send) or fill ring (receive) if it asked for it or need-wakeup is off.
+// Return 0 on success and non-zero otherwise
+static int ice_transport_xdp_kick(struct XdpTransport *xdp, const struct XdpRing *ring, uint8_t send) {
+  if (xdp->needWakeup && 0==(__atomic_load_n(ring->flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP)) {
+    return 0;
+  }
+
+  ++xdp->wakeups;
+  long rc = send ? sendto(xdp->fd, 0, 0, MSG_DONTWAIT, 0, 0) : recvfrom(xdp->fd, 0, 0, MSG_DONTWAIT, 0, 0);
+  if (rc<0) {
+    int error = errno;
+    if (error!=EAGAIN && error!=ENOBUFS && error!=EBUSY && error!=ENETDOWN) {
+      fprintf(stderr, "warn : ice_transport_xdp_kick: %s failed: %s (errno %d)\n", send ? "sendto" : "recvfrom",
+        strerror(error), error);
+      return ICE_IB_ERROR_API_ERROR;
+    }
+  }
+
+  return 0;
+}
+
+static int ice_transport_xdp_post_send(struct Transport *transport, uint64_t seq, uint32_t count, uint8_t flush) {
+  struct XdpTransport *xdp = &transport->xdp;
+  struct Queue *queue = transport->session->send;
+  struct xdp_desc *desc = (struct xdp_desc *)xdp->tx.desc;
+  const uint64_t slot = seq % transport->ringSize;
+  (void)flush;
+
+  // TX ring holds at least 'ringSize' entries and no more than that are
+  // ever outstanding so there's always room
+  for (uint32_t i=0; i<count; ++i) {
+    const struct ibv_sge *sge = queue->sqe[slot+i];
+    struct xdp_desc *entry = desc + ((xdp->tx.head+i) & xdp->tx.mask);
+    entry->addr = sge[0].addr - (uint64_t)xdp->umem;
+    entry->len = sge[0].length;
+    entry->options = 0;
+  }
+  xdp->tx.head += count;
+  __atomic_store_n(xdp->tx.producer, xdp->tx.head, __ATOMIC_RELEASE);
+
+  return ice_transport_xdp_kick(xdp, &xdp->tx, 1);
+}
+
+static int ice_transport_xdp_poll_send(struct Transport *transport, uint64_t *completed) {
+  struct XdpTransport *xdp = &transport->xdp;
+
+  // Completions come back in send order; only the count matters
+  const uint32_t producer = __atomic_load_n(xdp->completion.producer, __ATOMIC_ACQUIRE);
+  const uint32_t n = producer - xdp->completion.head;
+  if (n>0) {
+    xdp->completion.head = producer;
+    __atomic_store_n(xdp->completion.consumer, producer, __ATOMIC_RELEASE);
+    *completed += n;
+    return (int)n;
+  }
+
+  // Copy mode sends only from syscalls so nudge outstanding sends along
+  if (xdp->tx.head!=xdp->completion.head && 0!=ice_transport_xdp_kick(xdp, &xdp->tx, 1)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static int ice_transport_xdp_release_recv(struct Transport *transport, uint32_t count) {
+  struct XdpTransport *xdp = &transport->xdp;
+  const struct xdp_desc *desc = (const struct xdp_desc *)xdp->rx.desc;
+  uint64_t *fill = (uint64_t *)xdp->fill.desc;
+  (void)count;
+
+  // Everything the last poll looked at goes back, matched or not. Fill
+  // ring holds every frame so there's always room
+  for (uint32_t i=0; i<xdp->peeked; ++i) {
+    const uint64_t addr = desc[(xdp->rx.head+i) & xdp->rx.mask].addr & XSK_UNALIGNED_BUF_ADDR_MASK;
+    fill[(xdp->fill.head+i) & xdp->fill.mask] = addr;
+  }
+  xdp->fill.head += xdp->peeked;
+  xdp->rx.head += xdp->peeked;
+  xdp->peeked = 0;
+  __atomic_store_n(xdp->fill.producer, xdp->fill.head, __ATOMIC_RELEASE);
+  __atomic_store_n(xdp->rx.consumer, xdp->rx.head, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+static int ice_transport_xdp_poll_recv(struct Transport *transport, const uint8_t **pkt, uint32_t *length,
+  uint32_t max) {
+  struct XdpTransport *xdp = &transport->xdp;
+  const struct xdp_desc *desc = (const struct xdp_desc *)xdp->rx.desc;
+
+  const uint32_t producer = __atomic_load_n(xdp->rx.producer, __ATOMIC_ACQUIRE);
+  uint32_t available = producer - xdp->rx.head;
+  if (available==0) {
+    xdp->peeked = 0;
+    return ice_transport_xdp_kick(xdp, &xdp->fill, 0)==0 ? 0 : -1;
+  }
+  if (available>max) {
+    available = max;
+  }
+
+  // Only UDP to the server's ports counts; the queue may carry anything.
+  // Descriptors stay on the ring until 'release_recv'
+  uint32_t n = 0;
+  for (uint32_t i=0; i<available; ++i) {
+    const struct xdp_desc *entry = desc + ((xdp->rx.head+i) & xdp->rx.mask);
+    const uint64_t offset = (entry->addr & XSK_UNALIGNED_BUF_ADDR_MASK) +
+                            (entry->addr >> XSK_UNALIGNED_BUF_OFFSET_SHIFT);
+    const struct IPV4Packet *ip = (const struct IPV4Packet *)(xdp->umem + offset);
+    if (entry->len>=ice_verb_packet_size(0) && ip->ip_header.ethType==htons(0x0800) &&
+        ip->ipv4_header.nextProtoId==IPPROTO_UDP &&
+        (uint16_t)(ntohs(ip->ipv4udp_header.dstPort)-xdp->port)<xdp->portCount) {
+      pkt[n] = (const uint8_t *)ip;
+      length[n] = entry->len;
+      ++n;
+    }
+  }
+  xdp->peeked = available;
+
+  // The loop releases only batches it was given
+  if (n==0) {
+    ice_transport_xdp_release_recv(transport, 0);
+  }
+
+  return (int)n;
+}
+
+static void ice_transport_xdp_deinitialize(struct Transport *transport) {
+  struct XdpTransport *xdp = &transport->xdp;
+
+  if (xdp->fd>=0) {
+    struct xdp_statistics stats;
+    socklen_t size = sizeof(stats);
+    if (0==getsockopt(xdp->fd, SOL_XDP, XDP_STATISTICS, &stats, &size)) {
+      fprintf(stderr, "info : ice_transport_xdp: rx dropped %llu, rx ring full %llu, fill ring empty %llu, "
+        "tx ring empty %llu, invalid rx/tx descs %llu/%llu, wakeups %lu\n", stats.rx_dropped, stats.rx_ring_full,
+        stats.rx_fill_ring_empty_descs, stats.tx_ring_empty_descs, stats.rx_invalid_descs, stats.tx_invalid_descs,
+        xdp->wakeups);
+    }
+  }
+
+  // Detach before the socket goes
+  const int fds[] = {xdp->linkFd, xdp->progFd, xdp->mapFd};
+  for (uint32_t i=0; i<sizeof(fds)/sizeof(fds[0]); ++i) {
+    if (fds[i]>=0) {
+      close(fds[i]);
+    }
+  }
+  struct XdpRing *rings[] = {&xdp->fill, &xdp->completion, &xdp->rx, &xdp->tx};
+  for (uint32_t i=0; i<sizeof(rings)/sizeof(rings[0]); ++i) {
+    if (rings[i]->map) {
+      munmap(rings[i]->map, rings[i]->mapBytes);
+    }
+  }
+  if (xdp->fd>=0) {
+    close(xdp->fd);
+  }
+  memset(xdp, 0, sizeof(struct XdpTransport));
+  xdp->fd = xdp->mapFd = xdp->progFd = xdp->linkFd = -1;
+}
+
+const struct TransportOps iceTransportXdp = {
+  .name = "xdp",
+  .initialize = ice_transport_xdp_initialize,
+  .post_send = ice_transport_xdp_post_send,
+  .poll_send = ice_transport_xdp_poll_send,
+  .poll_recv = ice_transport_xdp_poll_recv,
+  .release_recv = ice_transport_xdp_release_recv,
+  .deinitialize = ice_transport_xdp_deinitialize,
+};
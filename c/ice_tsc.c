@@ -0,0 +1,220 @@
+#include <ice_tsc.h>
+#include <ice_topology.h>
+
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <cpuid.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <x86intrin.h>
+
+static const uint64_t TSC_CALIBRATE_NS = 20000000;            // spin this long against CLOCK_MONOTONIC_RAW
+static const uint64_t TSC_SKEW_BUDGET_NS = 200000000;         // give up on a skew measurement after this long
+static const uint64_t TSC_SKEW_STOP = UINT64_MAX;             // 'ping' value ending a skew measurement
+static pthread_once_t tscOnce = PTHREAD_ONCE_INIT;
+static double tscTicksPerNs = 0;
+
+// Ping-pong state two pinned threads share. 'ping' and 'pong' sit on their own cache lines so each round moves
+// exactly two lines between the cores
+struct SkewProbe {
+  _Alignas(64) _Atomic uint64_t ping;                         // round A started; TSC_SKEW_STOP to end
+  _Alignas(64) _Atomic uint64_t pong;                         // round B answered
+  uint64_t                  tscB;                             // B's rdtsc for round 'pong'
+  _Alignas(64) _Atomic int  ready;                            // B pinned: 1 ok, -1 failed
+  int32_t                   cpuA;                             // core thread A pins to
+  int32_t                   cpuB;                             // core thread B pins to
+  uint64_t                  deadline;                         // rdtsc both threads give up at
+  uint32_t                  rounds;                           // rounds A completed
+  int64_t                   bestSkew;                         // tscB-midpoint(A) at the shortest round; ticks
+  uint64_t                  bestRtt;                          // shortest round trip; ticks
+};
+
+static uint64_t ice_tsc_now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+  return (uint64_t)now.tv_sec*1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+// rdtsc not executed ahead of earlier loads
+static inline uint64_t ice_tsc_read_ordered(void) {
+  _mm_lfence();
+  return __rdtsc();
+}
+
+static void ice_tsc_calibrate(void) {
+  // Bracket each clock read with rdtsc and keep the midpoint so the cost
+  // of clock_gettime itself does not skew the rate
+  uint64_t tsc0 = __rdtsc();
+  const uint64_t ns0 = ice_tsc_now_ns();
+  tsc0 = (tsc0+__rdtsc())/2;
+
+  uint64_t tsc1, ns1;
+  do {
+    tsc1 = __rdtsc();
+    ns1 = ice_tsc_now_ns();
+    tsc1 = (tsc1+__rdtsc())/2;
+  } while (ns1-ns0<TSC_CALIBRATE_NS);
+
+  tscTicksPerNs = (double)(tsc1-tsc0)/(double)(ns1-ns0);
+  fprintf(stderr, "info : ice_tsc_calibrate: %.6f rdtsc ticks per ns\n", tscTicksPerNs);
+  if (!ice_tsc_invariant()) {
+    fprintf(stderr, "warn : ice_tsc_calibrate: CPU does not report an invariant TSC; rdtsc times drift with "
+      "frequency changes\n");
+  }
+}
+
+double ice_tsc_ticks_per_ns(void) {
+  pthread_once(&tscOnce, ice_tsc_calibrate);
+  return tscTicksPerNs;
+}
+
+int ice_tsc_invariant(void) {
+  unsigned eax, ebx, ecx, edx;
+  if (0==__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+    return 0;
+  }
+  return (edx>>8) & 1;
+}
+
+// Thread B: stamp each round A starts and answer
+static void *ice_tsc_skew_responder(void *arg) {
+  struct SkewProbe *probe = (struct SkewProbe *)arg;
+
+  if (0!=ice_topology_pin_thread(probe->cpuB)) {
+    atomic_store_explicit(&probe->ready, -1, memory_order_release);
+    return 0;
+  }
+  atomic_store_explicit(&probe->ready, 1, memory_order_release);
+
+  uint64_t last = 0;
+  while (__rdtsc()<probe->deadline) {
+    const uint64_t round = atomic_load_explicit(&probe->ping, memory_order_acquire);
+    if (round==last) {
+      _mm_pause();
+      continue;
+    }
+    if (round==TSC_SKEW_STOP) {
+      break;
+    }
+    probe->tscB = ice_tsc_read_ordered();
+    atomic_store_explicit(&probe->pong, round, memory_order_release);
+    last = round;
+  }
+
+  return 0;
+}
+
+// Thread A: start rounds and keep the one with the shortest round trip. Its midpoint is closest to B's stamp
+static void *ice_tsc_skew_initiator(void *arg) {
+  struct SkewProbe *probe = (struct SkewProbe *)arg;
+
+  int ready = 0;
+  if (0==ice_topology_pin_thread(probe->cpuA)) {
+    while (0==(ready = atomic_load_explicit(&probe->ready, memory_order_acquire)) && __rdtsc()<probe->deadline) {
+      _mm_pause();
+    }
+  }
+
+  for (uint64_t round=1; ready==1 && round<=TSC_SKEW_ROUNDS; ++round) {
+    const uint64_t t0 = ice_tsc_read_ordered();
+    atomic_store_explicit(&probe->ping, round, memory_order_release);
+    while (atomic_load_explicit(&probe->pong, memory_order_acquire)!=round) {
+      if (__rdtsc()>=probe->deadline) {
+        ready = 0;
+        break;
+      }
+      _mm_pause();
+    }
+    if (!ready) {
+      break;
+    }
+    const uint64_t t1 = ice_tsc_read_ordered();
+
+    if (t1-t0<probe->bestRtt) {
+      probe->bestRtt = t1-t0;
+      probe->bestSkew = (int64_t)(probe->tscB-(t0+(t1-t0)/2));
+    }
+    ++probe->rounds;
+  }
+
+  atomic_store_explicit(&probe->ping, TSC_SKEW_STOP, memory_order_release);
+  return 0;
+}
+
+int ice_tsc_measure_skew(int32_t cpuA, int32_t cpuB, double *skewNs, double *uncertaintyNs) {
+  assert(cpuA>=0);
+  assert(cpuB>=0);
+  assert(skewNs);
+  assert(uncertaintyNs);
+
+  const double ticksPerNs = ice_tsc_ticks_per_ns();
+
+  struct SkewProbe probe;
+  memset(&probe, 0, sizeof(probe));
+  probe.cpuA = cpuA;
+  probe.cpuB = cpuB;
+  probe.bestRtt = UINT64_MAX;
+  probe.deadline = __rdtsc() + (uint64_t)(TSC_SKEW_BUDGET_NS*ticksPerNs);
+
+  pthread_t initiator, responder;
+  int rc = pthread_create(&responder, 0, ice_tsc_skew_responder, &probe);
+  if (rc!=0) {
+    fprintf(stderr, "warn : ice_tsc_measure_skew: pthread_create failed: %s (errno %d)\n", strerror(rc), rc);
+    return rc;
+  }
+  rc = pthread_create(&initiator, 0, ice_tsc_skew_initiator, &probe);
+  if (rc!=0) {
+    fprintf(stderr, "warn : ice_tsc_measure_skew: pthread_create failed: %s (errno %d)\n", strerror(rc), rc);
+    atomic_store_explicit(&probe.ping, TSC_SKEW_STOP, memory_order_release);
+    pthread_join(responder, 0);
+    return rc;
+  }
+  pthread_join(initiator, 0);
+  pthread_join(responder, 0);
+
+  if (probe.rounds==0) {
+    fprintf(stderr, "warn : ice_tsc_measure_skew: no ping-pong round between cpu %d and %d completed\n", cpuA, cpuB);
+    return -1;
+  }
+
+  *skewNs = (double)probe.bestSkew/ticksPerNs;
+  *uncertaintyNs = (double)probe.bestRtt/(2.0*ticksPerNs);
+  return 0;
+}
+
+int ice_tsc_check_skew(int32_t txCpu, int32_t rxCpu) {
+  if (txCpu<0 || rxCpu<0 || txCpu==rxCpu) {
+    return 0;
+  }
+
+  double skew = 0;
+  double uncertainty = 0;
+  if (0!=ice_tsc_measure_skew(txCpu, rxCpu, &skew, &uncertainty)) {
+    fprintf(stderr, "warn : ice_tsc_check_skew: cpu %d to cpu %d TSC skew unknown; cross-core latencies "
+      "unchecked\n", txCpu, rxCpu);
+    return 0;
+  }
+
+  // Skew is known to within +/- 'uncertainty' so only what lies beyond it counts against the thresholds
+  const double magnitude = skew<0 ? -skew : skew;
+  const double lowerBound = magnitude>uncertainty ? magnitude-uncertainty : 0;
+  if (lowerBound>TSC_SKEW_FAIL_NS) {
+    fprintf(stderr, "warn : ice_tsc_check_skew: cpu %d TSC leads cpu %d by %.1f ns +/- %.1f ns; beyond %d ns "
+      "cross-core latencies are meaningless\n", rxCpu, txCpu, skew, uncertainty, TSC_SKEW_FAIL_NS);
+    return -1;
+  }
+  if (lowerBound>TSC_SKEW_WARN_NS) {
+    fprintf(stderr, "warn : ice_tsc_check_skew: cpu %d TSC leads cpu %d by %.1f ns +/- %.1f ns; one-way "
+      "latencies are off by as much\n", rxCpu, txCpu, skew, uncertainty);
+  } else if (uncertainty>TSC_SKEW_WARN_NS) {
+    fprintf(stderr, "warn : ice_tsc_check_skew: cpu %d TSC leads cpu %d by %.1f ns +/- %.1f ns; too coarse to "
+      "rule out skew past %d ns\n", rxCpu, txCpu, skew, uncertainty, TSC_SKEW_WARN_NS);
+  } else {
+    fprintf(stderr, "info : ice_tsc_check_skew: cpu %d TSC leads cpu %d by %.1f ns +/- %.1f ns\n", rxCpu, txCpu,
+      skew, uncertainty);
+  }
+
+  return 0;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+// rdtsc tick rate. Calibrated once per process against CLOCK_MONOTONIC_RAW; safe to call from any thread.
+//
+// Latencies subtract an rdtsc read on one core from a read on another: the TX and RX threads, or a client and a
+// server on the same host. That holds only if the TSC ticks at a constant rate through P/C-state changes (invariant
+// TSC) and every core's counter agrees. 'ice_tsc_check_skew' measures how far two cores' counters disagree.
+
+enum kTSC {
+  TSC_SKEW_WARN_NS = 100,                                     // warn when two cores disagree by more
+  TSC_SKEW_FAIL_NS = 1000,                                    // refuse to time across cores that disagree by more
+  TSC_SKEW_ROUNDS = 1000,                                     // ping-pong rounds per measurement
+};
+
+// Return rdtsc ticks per nanosecond
+double ice_tsc_ticks_per_ns(void);
+
+// Return 1 if CPUID reports an invariant TSC (leaf 0x80000007 EDX bit 8) else 0
+int ice_tsc_invariant(void);
+
+// Measure by how much 'cpuB's TSC leads 'cpuA's in '*skewNs' with '*uncertaintyNs' the half round trip bound of the
+// best of up to TSC_SKEW_ROUNDS cache line ping-pongs between two threads pinned to the cores. Return 0 on success
+// and non-zero if the threads could not run or no round completed in time
+int ice_tsc_measure_skew(int32_t cpuA, int32_t cpuB, double *skewNs, double *uncertaintyNs);
+
+// Measure skew between 'txCpu' and 'rxCpu' and print it. Warn past TSC_SKEW_WARN_NS or when the measurement is too
+// coarse to tell. Return 0 if rdtsc differences between the cores can be trusted and non-zero when skew is beyond
+// TSC_SKEW_FAIL_NS
+int ice_tsc_check_skew(int32_t txCpu, int32_t rxCpu);
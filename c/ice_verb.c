@@ -1,11 +1,16 @@
 #include <ice_verb.h>
+#include <ice_tsc.h>
 
+#include <time.h>
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <arpa/inet.h>
+#include <x86intrin.h>
+#include <netinet/in.h>
 #include <sys/ipc.h>
-#include <sys/shm.h>
 #include <sys/mman.h>
 
 int ice_verb_config_check_port_device(struct ibv_context *context, int portId) {
@@ -57,93 +62,98 @@ struct ibv_device **ice_verb_find_device(const char *deviceName, struct ibv_devi
     if (!strcmp(ibv_get_device_name(*item), deviceName)) {
       // matched device
       *device = *item;
-      rc = 0;
+      *rc = 0;
       break;
     }
   }
 
   // OK there are devices but none matching 'deviceName'
-  if (rc!=0) {
+  if (*rc!=0) {
     *rc = ICE_IB_ERROR_ENOENT_DEVICE;
   }
 
   return list;
 }
 
-int ice_verb_allocate_huge_memory(uint64_t requestSizeBytes, struct HugePageMemory *memory) {
+int ice_verb_allocate_memory(struct Arena *arena, uint64_t requestSizeBytes, struct HugePageMemory *memory) {
+  assert(arena);
   assert(requestSizeBytes>0);
   assert(memory!=0);
-  
-  // Round request size up to nearest 2MB
-  uint64_t buf_size = requestSizeBytes;
-  if (buf_size<HUGEPAGE_ALIGN_2MB) {
-    buf_size = HUGEPAGE_ALIGN_2MB;
-  } else if ((buf_size%HUGEPAGE_ALIGN_2MB)!=0) {
-    uint64_t buf_remainder = buf_size & (HUGEPAGE_ALIGN_2MB-1);
-    buf_size += (HUGEPAGE_ALIGN_2MB-buf_remainder);
-  }
-  assert((buf_size%HUGEPAGE_ALIGN_2MB)==0);
-
-  // Record request v. actual memory ask
-  memory->actualSizeBytes = buf_size;
-  memory->requestSizeBytes = requestSizeBytes;
 
-  fprintf(stderr, "info : ice_verb_allocate_huge_memory: requested %lu bytes rounded up to %lu bytes\n",
-    requestSizeBytes, buf_size);
-    
-  // create 2MB huge pages with read/write permissions
-  memory->shmid = shmget(IPC_PRIVATE, buf_size, SHM_HUGETLB | IPC_CREAT | SHM_R | SHM_W);
-  if (memory->shmid < 0) {
-    int rc = errno;
-    fprintf(stderr, "warn : ice_verb_allocate_huge_memory: cannot allocate %lu bytes of hugepage memory: %s (errno %d)\n",
-      buf_size, strerror(rc), rc);
-    assert(rc!=0);
-    return rc;
-  }
+  memset(memory, 0, sizeof(struct HugePageMemory));
 
-  // attach shared memory
-  memory->hugePageMemory = (void *)shmat(memory->shmid, 0, 0);
-  if (memory->hugePageMemory==(void*)(-1)) {
-    int rc = errno;
-    fprintf(stderr, "warn : ice_verb_allocate_huge_memory: cannot attach %lu bytes of hugepage memory: %s (errno %d)\n",
-      buf_size, strerror(rc), rc);
-    memory->hugePageMemory = 0;
-    assert(rc!=0);
-    return rc;
+  // Arena memory comes zeroed from mmap and is never reused so no memset
+  if (0==(memory->hugePageMemory = ice_arena_allocate(arena, requestSizeBytes))) {
+    return ICE_IB_ERROR_NO_MEMORY;
   }
+  memory->requestSizeBytes = requestSizeBytes;
+  memory->actualSizeBytes = ice_arena_round(requestSizeBytes);
 
-  // Mark shmem for auto removal when pid exits
-  if (shmctl(memory->shmid, IPC_RMID, 0) != 0) {
-    int rc = errno;
-    fprintf(stderr, "warn : ice_verb_allocate_session: hugepage memory cannot auto-delete: %s (errno %d)\n",
-      strerror(rc), rc);
+  return 0;
+}
+
+// Return packets in a slab for a 'queueSize' queue: the smallest power of 2 greater than 'queueSize' so send pools
+// always have one free packet and pool indices wrap with a mask
+static uint32_t ice_verb_slab_count(uint32_t queueSize) {
+  assert(queueSize>0 && queueSize<MAX_PACKET_ENTRIES);
+
+  uint32_t count = 2;
+  while (count<=queueSize) {
+    count <<= 1;
   }
+  return count;
+}
 
-  // Initialize memory zero
-  memset((void*)memory->hugePageMemory, 0, buf_size);
+// Return 'size' rounded up to a whole number of cache lines
+static uint64_t ice_verb_cache_line_round(uint64_t size) {
+  return (size+CPU_CACHE_LINE_SIZE_MASK) & ~CPU_CACHE_LINE_SIZE_MASK;
+}
 
-  return 0;
+uint64_t ice_verb_queue_memory_size(uint32_t queueSize, uint32_t payloadSize, uint8_t splitPayload) {
+  assert(payloadSize>=sizeof(struct Payload));
+
+  const uint64_t pktSize = ice_verb_packet_size(payloadSize);
+  const uint64_t slabSize = splitPayload ? sizeof(struct IPV4Packet) : pktSize;
+  const uint64_t payloadBytes = splitPayload ? pktSize-sizeof(struct IPV4Packet) : 0;
+
+  return ice_verb_cache_line_round(sizeof(struct Queue)) +
+    ice_verb_slab_count(queueSize)*ice_verb_cache_line_round(slabSize) + ice_verb_cache_line_round(payloadBytes);
+}
+
+void ice_verb_layout_queue(struct HugePageMemory *memory, uint32_t queueSize, uint32_t payloadSize,
+  uint8_t splitPayload) {
+  assert(memory);
+  assert(memory->hugePageMemory);
+  assert(ice_verb_queue_memory_size(queueSize, payloadSize, splitPayload)<=memory->actualSizeBytes);
+
+  struct Queue *queue = (struct Queue *)memory->hugePageMemory;
+  uint8_t *base = (uint8_t *)memory->hugePageMemory;
+
+  // Slab starts on the first cache line after the Queue object and the
+  // shared payload, if any, on the first cache line after the slab
+  queue->pktSize = ice_verb_packet_size(payloadSize);
+  queue->pktSlabSize = splitPayload ? sizeof(struct IPV4Packet) : queue->pktSize;
+  queue->pktStride = ice_verb_cache_line_round(queue->pktSlabSize);
+  queue->pktCount = ice_verb_slab_count(queueSize);
+  queue->pktSlab = base + ice_verb_cache_line_round(sizeof(struct Queue));
+  queue->pktPayloadSize = queue->pktSize - queue->pktSlabSize;
+  queue->pktPayload = splitPayload ? queue->pktSlab + (uint64_t)queue->pktCount*queue->pktStride : 0;
+
+  fprintf(stderr, "info : ice_verb_layout_queue: %u packets of %u bytes, stride %u bytes, split payload %u bytes\n",
+    queue->pktCount, queue->pktSize, queue->pktStride, queue->pktPayloadSize);
 }
 
-int ice_verb_initialize_queue(struct ibv_pd *pd, struct ibv_context *context, struct HugePageMemory *memory) {
+int ice_verb_initialize_queue(struct ibv_pd *pd, struct ibv_context *context, struct HugePageMemory *memory,
+  uint8_t hardwareTimestamps) {
   assert(pd);
   assert(context);
   assert(memory);
 
-  // This huge page memory is for a Queue object so cast to type
+  // This huge page memory is for a Queue object so cast to type. Packet
+  // memory follows the object (see 'ice_verb_layout_queue') so registering
+  // the whole of 'memory' covers it
   struct Queue *queue = (struct Queue *)memory->hugePageMemory;
-
-  // Packet space is in the tail of the same huge page memory starting at sizeof(Queue)
-  uint64_t startOffset = (uint64_t)memory->hugePageMemory + sizeof(Queue);
-  // Round startOffst up to next cache line
-  if (startOffset & CPU_CACHE_LINE_SIZE_MASK) {
-    offset += CPU_CACHE_LINE_SIZE_BYTES - (startOffset & CPU_CACHE_LINE_SIZE_MASK);
-  }
-  assert((startOffset % CPU_CACHE_LINE_SIZE_BYTES)==0);
-  queue->packetBufferStart = memory->hugePageMemory + startOffset;
-  queue->packetBufferEnd   = memory->hugePageMemory + memory->actualSizeBytes;
-  assert(queue->packetBufferEnd > queue->packetBufferStart);
-  assert((queue->packetBufferEnd-queue->packetBufferStart)<=memory->actualSizeBytes);
+  assert(sizeof(struct Queue)<=memory->actualSizeBytes);
 
   // Assume will succeed
   char valid = 1;
@@ -153,7 +163,7 @@ int ice_verb_initialize_queue(struct ibv_pd *pd, struct ibv_context *context, st
     int flags = 0;
     flags |= IBV_ACCESS_LOCAL_WRITE;
     flags |= IBV_ACCESS_RELAXED_ORDERING;
-    queue->mr = ibv_reg_mr(pd, (void*)queue->start, memory->actualSizeBytes, flags);
+    queue->mr = ibv_reg_mr(pd, (void*)memory->hugePageMemory, memory->actualSizeBytes, flags);
     if (0==queue->mr) {
       int rc = errno;
       fprintf(stderr, "warn : ice_verb_initialize_queue: ibv_reg_mr failed: %s (errno %d)\n",
@@ -162,8 +172,22 @@ int ice_verb_initialize_queue(struct ibv_pd *pd, struct ibv_context *context, st
     }
   }
 
-  // Allocate a completion queue
-  if (0==(queue->cq = ibv_create_cq(context, MAX_COMPLETION_QUEUE_ENTRIES, 0, 0, 0))) {
+  // Allocate a completion queue. Extended CQs are polled with ibv_start_poll
+  // but remain usable through ibv_poll_cq
+  if (hardwareTimestamps) {
+    struct ibv_cq_init_attr_ex attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.cqe = MAX_COMPLETION_QUEUE_ENTRIES;
+    attr.wc_flags = IBV_WC_EX_WITH_BYTE_LEN | IBV_WC_EX_WITH_COMPLETION_TIMESTAMP;
+    if (0==(queue->cqEx = ibv_create_cq_ex(context, &attr))) {
+      int rc = errno;
+      fprintf(stderr, "warn : ice_verb_initialize_queue: ibv_create_cq_ex failed: %s (errno %d)\n",
+        strerror(rc), rc);
+      valid = 0;
+    } else {
+      queue->cq = ibv_cq_ex_to_cq(queue->cqEx);
+    }
+  } else if (0==(queue->cq = ibv_create_cq(context, MAX_COMPLETION_QUEUE_ENTRIES, 0, 0, 0))) {
     int rc = errno;
     fprintf(stderr, "warn : ice_verb_initialize_queue: ibv_create_cq failed: %s (errno %d)\n",
       strerror(rc), rc);
@@ -186,6 +210,119 @@ int ice_verb_deinitialize_queue(struct Queue *queue) {
   return 0;
 }
 
+// Return 0 if the device behind 'context' can honor 'param->checksumMode' and non-zero otherwise. Batch mode picks
+// its vector kernel here
+static int ice_verb_initialize_checksum(const struct UserParam *param, struct ibv_context *context) {
+  assert(param);
+  assert(context);
+
+  if (param->checksumMode==ICE_CHECKSUM_MODE_BATCH) {
+    fprintf(stderr, "info : ice_verb_initialize_checksum: batch checksum kernel %s\n", ice_checksum_initialize());
+  } else if (param->checksumMode==ICE_CHECKSUM_MODE_OFFLOAD) {
+    struct ibv_device_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    int rc = ibv_query_device(context, &attr);
+    if (rc!=0) {
+      fprintf(stderr, "warn : ice_verb_initialize_checksum: ibv_query_device failed: %s (errno %d)\n",
+        strerror(rc), rc);
+      return ICE_IB_ERROR_API_ERROR;
+    }
+    if (0==(attr.device_cap_flags & IBV_DEVICE_RAW_IP_CSUM)) {
+      fprintf(stderr, "warn : ice_verb_initialize_checksum: device does not offload IPV4 checksums on raw packets\n");
+      return ICE_IB_ERROR_API_ERROR;
+    }
+  }
+
+  return 0;
+}
+
+// Return 0 if the device behind 'context' can cut 'param's packets into 'param->tsoMss' byte frames on RAW_PACKET QPs
+// and non-zero otherwise
+static int ice_verb_initialize_tso(const struct UserParam *param, struct ibv_context *context) {
+  assert(param);
+  assert(context);
+
+  if (param->tsoMss==0) {
+    return 0;
+  }
+
+  struct ibv_device_attr_ex attr;
+  memset(&attr, 0, sizeof(attr));
+  int rc = ibv_query_device_ex(context, 0, &attr);
+  if (rc!=0) {
+    fprintf(stderr, "warn : ice_verb_initialize_tso: ibv_query_device_ex failed: %s (errno %d)\n", strerror(rc), rc);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+  const struct ibv_tso_caps *caps = &attr.tso_caps;
+  const uint32_t pktSize = ice_verb_packet_size(param->payloadSize);
+  if (0==(caps->supported_qpts & (1u<<IBV_QPT_RAW_PACKET))) {
+    fprintf(stderr, "warn : ice_verb_initialize_tso: device has no TSO for RAW_PACKET QPs\n");
+    return ICE_IB_ERROR_API_ERROR;
+  }
+  if (pktSize>caps->max_tso) {
+    fprintf(stderr, "warn : ice_verb_initialize_tso: %u byte packets exceed device max TSO %u bytes\n", pktSize,
+      caps->max_tso);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  fprintf(stderr, "info : ice_verb_initialize_tso: %u byte packets cut into %u frames of %u payload bytes; "
+    "max TSO %u bytes\n", pktSize, ice_verb_tso_frames(param->payloadSize, param->tsoMss), param->tsoMss,
+    caps->max_tso);
+
+  return 0;
+}
+
+// Create a QP from 'attr' through the extended verb if it must take TSO headers up to 'maxTsoHeader' bytes
+static struct ibv_qp *ice_verb_create_qp_attr(struct ibv_pd *pd, struct ibv_qp_init_attr *attr,
+  uint16_t maxTsoHeader) {
+  if (maxTsoHeader==0) {
+    return ibv_create_qp(pd, attr);
+  }
+
+  struct ibv_qp_init_attr_ex attrEx;
+  memset(&attrEx, 0, sizeof(attrEx));
+  attrEx.send_cq = attr->send_cq;
+  attrEx.recv_cq = attr->recv_cq;
+  attrEx.cap = attr->cap;
+  attrEx.qp_type = attr->qp_type;
+  attrEx.pd = pd;
+  attrEx.max_tso_header = maxTsoHeader;
+  attrEx.comp_mask = IBV_QP_INIT_ATTR_PD | IBV_QP_INIT_ATTR_MAX_TSO_HEADER;
+
+  struct ibv_qp *qp = ibv_create_qp_ex(pd->context, &attrEx);
+  attr->cap = attrEx.cap;
+  return qp;
+}
+
+struct ibv_qp *ice_verb_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *attr, uint8_t useInline,
+  uint16_t maxTsoHeader) {
+  assert(pd);
+  assert(attr);
+
+  // Devices don't report their max inline size; ask for the largest and
+  // halve until QP creation succeeds. The driver reports what it granted
+  struct ibv_qp *qp = 0;
+  if (useInline) {
+    for (uint32_t size=MAX_INLINE_PROBE_SIZE; size>=MIN_INLINE_PROBE_SIZE && qp==0; size>>=1) {
+      attr->cap.max_inline_data = size;
+      qp = ice_verb_create_qp_attr(pd, attr, maxTsoHeader);
+    }
+    if (qp) {
+      fprintf(stderr, "info : ice_verb_create_qp: max inline data %u bytes\n", attr->cap.max_inline_data);
+      return qp;
+    }
+    fprintf(stderr, "warn : ice_verb_create_qp: device does not inline send data\n");
+  }
+
+  attr->cap.max_inline_data = 0;
+  if (0==(qp = ice_verb_create_qp_attr(pd, attr, maxTsoHeader))) {
+    int rc = errno;
+    fprintf(stderr, "warn : ice_verb_create_qp: ibv_create_qp failed: %s (errno %d)\n", strerror(rc), rc);
+  }
+
+  return qp;
+}
+
 int ice_verb_initialize_session_common(const struct UserParam *param, struct Queue *send, struct Queue *recv,
   struct ibv_context *context, struct ibv_pd *pd, struct ibv_device *device, struct ibv_device **deviceList,
   struct HugePageMemory *memory) {
@@ -209,24 +346,29 @@ int ice_verb_initialize_session_common(const struct UserParam *param, struct Que
 
   // Setup qp
   char valid = 1;
+  if (0!=ice_verb_initialize_checksum(param, context)) {
+    valid = 0;
+  }
+  if (0!=ice_verb_initialize_tso(param, context)) {
+    valid = 0;
+  }
+
   struct ibv_qp_init_attr attr;
   memset(&attr, 0, sizeof(attr));
 
   attr.send_cq = send->cq;
   attr.recv_cq = recv->cq;
-  attr.cap.max_send_wr = MAX_SEND_QUEUE_ENTRIES;
-  attr.cap.max_send_sge = 1;
-  attr.cap.max_recv_wr = MAX_RECV_QUEUE_ENTRIES;
+  attr.cap.max_send_wr = param->txQueueSize;
+  attr.cap.max_send_sge = param->splitPayload ? 2 : 1;
+  attr.cap.max_recv_wr = param->rxQueueSize;
   attr.cap.max_recv_sge = 1;
   attr.qp_type |= IBV_QPT_RAW_PACKET;
-  attr.cap.max_inline_data = 0;
 
-  if (0==(common->qp = ibv_create_qp(pd, &attr))) {
-    int rc = errno;
-    fprintf(stderr, "warn : ice_verb_initialize_session_common: ibv_create_qp failed: %s (errno %d)\n",
-      strerror(rc), rc);
+  if (0==(common->qp = ice_verb_create_qp(pd, &attr, param->useInline, param->tsoMss ? PACKET_HEADER_SIZE : 0))) {
     valid = 0;
   }
+  send->inlineSize = attr.cap.max_inline_data;
+  send->tsoMss = param->tsoMss;
 
   // Put qp into init state
   if (common->qp) {
@@ -251,6 +393,9 @@ int ice_verb_initialize_session_common(const struct UserParam *param, struct Que
 int ice_verb_deinitalize_session_common(struct SessionCommon *common) {
   assert(common);
 
+  if (common->flow) {
+    ibv_destroy_flow(common->flow);
+  }
   if (common->qp) {
     ibv_destroy_qp(common->qp);
   }
@@ -269,6 +414,69 @@ int ice_verb_deinitalize_session_common(struct SessionCommon *common) {
   return 0;
 }
 
+// Read 'context's free running NIC clock into '*nic' bracketed by rdtsc, keeping the midpoint in '*tsc'. Return 0 on
+// success and non-zero otherwise
+static int ice_verb_sample_nic_clock(struct ibv_context *context, uint64_t *nic, uint64_t *tsc) {
+  struct ibv_values_ex values;
+  memset(&values, 0, sizeof(values));
+  values.comp_mask = IBV_VALUES_MASK_RAW_CLOCK;
+
+  const uint64_t before = __rdtsc();
+  int rc = ibv_query_rt_values_ex(context, &values);
+  *tsc = (before+__rdtsc())/2;
+  if (rc!=0) {
+    fprintf(stderr, "warn : ice_verb_sample_nic_clock: ibv_query_rt_values_ex failed: %s (errno %d)\n",
+      strerror(rc), rc);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+  *nic = (uint64_t)values.raw_clock.tv_sec*1000000000ull + (uint64_t)values.raw_clock.tv_nsec;
+
+  return 0;
+}
+
+int ice_verb_initialize_nic_clock(struct ibv_context *context, struct NicClock *clock) {
+  assert(context);
+  assert(clock);
+
+  struct ibv_device_attr_ex attr;
+  memset(&attr, 0, sizeof(attr));
+  int rc = ibv_query_device_ex(context, 0, &attr);
+  if (rc!=0) {
+    fprintf(stderr, "warn : ice_verb_initialize_nic_clock: ibv_query_device_ex failed: %s (errno %d)\n",
+      strerror(rc), rc);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+  if (attr.completion_timestamp_mask==0) {
+    fprintf(stderr, "warn : ice_verb_initialize_nic_clock: device has no completion timestamps\n");
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  // Rate from two samples 10ms apart rather than the nominal hca_core_clock
+  const double tscPerNs = ice_tsc_ticks_per_ns();
+  uint64_t nic0, tsc0, nic1, tsc1;
+  if (0!=ice_verb_sample_nic_clock(context, &nic0, &tsc0)) {
+    return ICE_IB_ERROR_API_ERROR;
+  }
+  while (__rdtsc()-tsc0<(uint64_t)(10000000*tscPerNs)) {
+  }
+  if (0!=ice_verb_sample_nic_clock(context, &nic1, &tsc1)) {
+    return ICE_IB_ERROR_API_ERROR;
+  }
+  if (nic1<=nic0) {
+    fprintf(stderr, "warn : ice_verb_initialize_nic_clock: NIC clock not advancing\n");
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  clock->nicBase = nic1;
+  clock->tscBase = tsc1;
+  clock->tscPerNic = (double)(tsc1-tsc0)/(double)(nic1-nic0);
+  clock->nicPerNs = tscPerNs/clock->tscPerNic;
+  fprintf(stderr, "info : ice_verb_initialize_nic_clock: NIC clock %.3f MHz measured, hca_core_clock %lu kHz, "
+    "timestamp mask 0x%lx\n", clock->nicPerNs*1e3, attr.hca_core_clock, attr.completion_timestamp_mask);
+
+  return 0;
+}
+
 int ice_verb_allocate_session(const struct UserParam *param, struct Session *session) {
   assert(param);
   assert(session);
@@ -289,6 +497,13 @@ int ice_verb_allocate_session(const struct UserParam *param, struct Session *ses
   struct ibv_device *device;
   struct ibv_device **deviceList;
   deviceList = ice_verb_find_device(param->deviceId, &device, &rc);
+  if (deviceList==0 || device==0) {
+    if (deviceList) {
+      ibv_free_device_list(deviceList);
+    }
+    // No viable device
+    return ICE_IB_ERROR_NO_DEVICE;
+  }
 
   // Open a context on found device, if any
   struct ibv_context *context = 0;
@@ -309,50 +524,118 @@ int ice_verb_allocate_session(const struct UserParam *param, struct Session *ses
     }
   }
 
-  // Start initializing session
+  return ice_verb_initialize_session(param, session, device, deviceList, context, 0);
+}
+
+int ice_verb_allocate_queues(const struct UserParam *param, struct Session *session, const char *deviceDir,
+  uint64_t extraBytes) {
+  assert(param);
+  assert(session);
+  assert(deviceDir);
+
   char valid = 1;
-  session->userParam = param;
 
-  // Allocate memory protection domain
-  struct ibv_pd *pd = 0;
-  if (0==(pd = ibv_alloc_pd(context))) {
-    int rc = errno;
-    fprintf(stderr, "warn : ice_verb_allocate_session: ibv_alloc_pd failed: %s (errno %d)\n",
-      strerror(rc), rc);
+  // Find the NIC's node and local cores. With one queue the calling
+  // thread is the hot thread so pin it before any memory is touched
+  if (0!=ice_topology_discover(deviceDir, &session->topology)) {
     return ICE_IB_ERROR_API_ERROR;
   }
+  if (param->queueCount==1) {
+    const char *role = param->isServer ? (param->latencyWindow ? "rx/reflect" : "rx")
+                                       : (param->latencyWindow ? "tx/rx latency" : "tx");
+    int32_t cpu = param->firstCpu;
+    if (cpu<0) {
+      cpu = ice_topology_take_cpu(&session->topology, role);
+    } else {
+      fprintf(stderr, "info : ice_verb_allocate_queues: %s thread on cpu %d per -c\n", role, cpu);
+    }
+    ice_topology_pin_thread(cpu);
+    if (param->tscPeerCpu>=0 && 0!=(param->isServer ? ice_tsc_check_skew(param->tscPeerCpu, cpu)
+                                                     : ice_tsc_check_skew(cpu, param->tscPeerCpu))) {
+      return ICE_IB_ERROR_API_ERROR;
+    }
+  }
+
+  // Calibrate rdtsc now, on the pinned thread, so no timed loop ever waits for it
+  ice_tsc_ticks_per_ns();
+
+  // One arena sized for every queue this run can allocate, bound to the NIC's NUMA node
+  const uint64_t sendBytes = ice_verb_queue_memory_size(param->txQueueSize, param->payloadSize, param->splitPayload);
+  const uint64_t recvBytes = ice_verb_queue_memory_size(param->rxQueueSize, param->payloadSize, 0);
+  uint64_t arenaBytes = ice_arena_round(sendBytes) + ice_arena_round(recvBytes) +
+    ice_arena_round(sizeof(struct SessionCommon)) + ice_arena_round(extraBytes);
+  if (param->queueCount>1) {
+    arenaBytes += param->queueCount * ice_arena_round(param->isServer ? recvBytes : sendBytes);
+  }
+  if (0!=ice_arena_initialize(&session->arena, arenaBytes, param->useHugePages, session->topology.numaNode)) {
+    return ICE_IB_ERROR_NO_MEMORY;
+  }
 
   // Allocate memory for send queue
-  if (0==ice_verb_allocate_huge_memory(sizeof(struct Queue), &session->sendMemory)) {
+  if (0==ice_verb_allocate_memory(&session->arena, sendBytes, &session->sendMemory)) {
     session->send = (struct Queue *)session->sendMemory.hugePageMemory;
+    ice_verb_layout_queue(&session->sendMemory, param->txQueueSize, param->payloadSize, param->splitPayload);
   } else {
     valid = 0;
   }
 
   // Allocate memory for recv queue
-  if (0==ice_verb_allocate_huge_memory(sizeof(struct Queue), &session->recvMemory)) {
+  if (0==ice_verb_allocate_memory(&session->arena, recvBytes, &session->recvMemory)) {
     session->recv = (struct Queue *)session->recvMemory.hugePageMemory;
+    ice_verb_layout_queue(&session->recvMemory, param->rxQueueSize, param->payloadSize, 0);
   } else {
     valid = 0;
   }
 
   // Allocate memory for common data
-  if (0==ice_verb_allocate_huge_memory(sizeof(struct SessionCommon), &session->cmmnMemory)) {
+  if (0==ice_verb_allocate_memory(&session->arena, sizeof(struct SessionCommon), &session->cmmnMemory)) {
     session->common = (struct SessionCommon *)session->cmmnMemory.hugePageMemory;
   } else {
     valid = 0;
   }
 
+  return valid ? 0 : ICE_IB_ERROR_NO_MEMORY;
+}
+
+int ice_verb_initialize_session(const struct UserParam *param, struct Session *session, struct ibv_device *device,
+  struct ibv_device **deviceList, struct ibv_context *context, uint64_t extraBytes) {
+  assert(param);
+  assert(session);
+  assert(device);
+  assert(deviceList);
+  assert(context);
+
+  // Start initializing session
+  char valid = 1;
+  session->userParam = param;
+
+  // Allocate memory protection domain
+  struct ibv_pd *pd = 0;
+  if (0==(pd = ibv_alloc_pd(context))) {
+    int rc = errno;
+    fprintf(stderr, "warn : ice_verb_initialize_session: ibv_alloc_pd failed: %s (errno %d)\n",
+      strerror(rc), rc);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  char deviceDir[256];
+  snprintf(deviceDir, sizeof(deviceDir), "/sys/class/infiniband/%s/device", ibv_get_device_name(device));
+  int rc = ice_verb_allocate_queues(param, session, deviceDir, extraBytes);
+  if (rc!=0) {
+    ibv_dealloc_pd(pd);
+    return rc;
+  }
+
   // Initialize send queue
   if (session->send) {
-    if (0!=(ice_verb_initialize_queue(pd, context, &session->sendMemory))) {
+    if (0!=(ice_verb_initialize_queue(pd, context, &session->sendMemory, param->useHardwareTimestamps))) {
       valid = 0;
     }
   }
 
   // Initialize recv queue
   if (session->recv) {
-    if (0!=(ice_verb_initialize_queue(pd, context, &session->recvMemory))) {
+    if (0!=(ice_verb_initialize_queue(pd, context, &session->recvMemory, param->useHardwareTimestamps))) {
       valid = 0;
     }
   }
@@ -365,6 +648,13 @@ int ice_verb_allocate_session(const struct UserParam *param, struct Session *ses
     }
   }
 
+  // Map NIC completion timestamps onto rdtsc
+  if (valid && param->useHardwareTimestamps) {
+    if (0!=ice_verb_initialize_nic_clock(context, &session->common->nicClock)) {
+      valid = 0;
+    }
+  }
+
   return valid ? 0 : ICE_IB_ERROR_API_ERROR;
 }
 
@@ -380,6 +670,7 @@ int ice_verb_deallocate_session(struct Session *session) {
   if (session->common) {
     ice_verb_deinitalize_session_common(session->common);
   }
+  ice_arena_deinitialize(&session->arena);
 
   memset(session, 0, sizeof(struct Session));
 
@@ -422,31 +713,23 @@ int ice_verb_make_raw_ipv4packet(struct Queue *queue, struct IPV4UDPEndpoint *sr
   assert(src);
   assert(dst);
 
-  // Find the start of future next packet (the one made on next call to
-  // ice_verb_make_ipv4packet) and make sure it's on a on CPU_CACHE_SIZE boundary
-  uint64_t offset = (uint64_t)packet + sizeof(struct IPV4Packet);
-  if (offset & CPU_CACHE_LINE_SIZE_MASK) {
-    offset += CPU_CACHE_LINE_SIZE_BYTES - (offset & CPU_CACHE_LINE_SIZE_MASK);
-  }
-  assert((offset % CPU_CACHE_LINE_SIZE_BYTES)==0);
-  
-  // OK initialize 
-  char *nextPacket = packet + offset;
-  struct IPV4Packet *packetObj = (struct IPV4Packet *)packet;
+  // Packet is made at the write index which is then advanced for the next call
+  struct IPV4Packet *packetObj = ice_verb_packet(queue, queue->pktWriteIndex);
+  queue->pktWriteIndex = (queue->pktWriteIndex+1) & (queue->pktCount-1);
 
-  const uint16_t ipv4_header_size = sizeof(struct IPV4Header) + sizeof(struct IPV4UDPHeader) + sizoef(struct Payload);
-  const uint16_t udp_header_size  = sizeof(struct IPV4UDPHeader) + sizeof(struct Payload);
+  const uint16_t ipv4_header_size = queue->pktSize - sizeof(struct IPHeader);
+  const uint16_t udp_header_size  = ipv4_header_size - sizeof(struct IPV4Header);
 
   // IP header
   memcpy(packetObj->ip_header.dstMac, dst->mac, sizeof(packetObj->ip_header.dstMac));
   memcpy(packetObj->ip_header.srcMac, src->mac, sizeof(packetObj->ip_header.srcMac));
-  packetObj->ip_header.ethType = 2048;                        // Ethernet
+  packetObj->ip_header.ethType = htons(0x0800);               // IPV4
 
   // IPV4 header
   packetObj->ipv4_header.ihl = 5;                             // header is 5 words big
   packetObj->ipv4_header.version = 4;                         // Ethernet V4
   packetObj->ipv4_header.typeOfService = 0;
-  packetObj->ipv4_header.size = ipv4_header_size;             // sizeof header & everything that follows
+  packetObj->ipv4_header.size = htons(ipv4_header_size);      // sizeof header & everything that follows
   packetObj->ipv4_header.packetId = 0;                        // packet sequence number; caller can set on return
   packetObj->ipv4_header.fragmentOffset = 0;
   packetObj->ipv4_header.ttl = 64;
@@ -458,18 +741,16 @@ int ice_verb_make_raw_ipv4packet(struct Queue *queue, struct IPV4UDPEndpoint *sr
   // UDP header
   packetObj->ipv4udp_header.srcPort = src->port;
   packetObj->ipv4udp_header.dstPort = dst->port;
-  packetObj->ipv4udp_header.size = udp_header_size;
+  packetObj->ipv4udp_header.size = htons(udp_header_size);
   packetObj->ipv4udp_header.checksum = 0;                     // optional checksum on UDP data; leaving 0
 
-  queue->packet = (struct IPV4Packet *)nextPacket;
-
   return 0;
 }
 
 int ice_verb_checksum_ipv4packet(struct IPV4Packet *packet) {
   // Calculate IPV4 header checksum
   uint32_t ip_cksum = 0;
-  uint16_t* ptr16 = (uint16_t*)(packet + sizeof(struct IPHeader));
+  uint16_t* ptr16 = (uint16_t*)&packet->ipv4_header;
   ip_cksum += ptr16[0]; ip_cksum += ptr16[1];
   ip_cksum += ptr16[2]; ip_cksum += ptr16[3];
   ip_cksum += ptr16[4];
@@ -484,48 +765,295 @@ int ice_verb_checksum_ipv4packet(struct IPV4Packet *packet) {
   return 0;
 }
 
-int ice_verb_set_rtr(struct Session *session) {
-  assert(session);
+int ice_verb_build_packet_pool(struct Queue *queue, struct IPV4UDPEndpoint *src, struct IPV4UDPEndpoint *dst) {
+  assert(queue);
+  assert(src);
+  assert(dst);
+
+  // Template goes into the first packet and its headers are copied to the
+  // rest. Payload bytes past 'Payload' are left as allocated
+  struct IPV4Packet *packet = ice_verb_packet(queue, 0);
+  queue->pktWriteIndex = 0;
+  ice_verb_make_raw_ipv4packet(queue, src, dst);
+  ice_verb_checksum_ipv4packet(packet);
+  for (uint32_t i=1; i<queue->pktCount; ++i) {
+    memcpy(ice_verb_packet(queue, i), packet, sizeof(struct IPV4Packet));
+  }
+
+  // Sum of every IPV4 header word but packetId (2) and checksum (5). Adding
+  // a packet's id to it and folding gives that packet's checksum
+  const uint16_t *ptr16 = (const uint16_t*)&packet->ipv4_header;
+  queue->pktChecksumBase = (uint32_t)ptr16[0] + ptr16[1] + ptr16[3] + ptr16[4] + ptr16[6] + ptr16[7] + ptr16[8] +
+    ptr16[9];
+
+  queue->pktReadIndex = 0;
+  queue->pktWriteIndex = 0;
+
+  return 0;
+}
+
+int ice_verb_modify_qp_state(struct ibv_qp *qp, uint32_t portId, enum ibv_qp_state state) {
+  assert(qp);
+  assert(portId>0);
 
   struct ibv_qp_attr attr;
   memset(&attr, 0, sizeof(attr));
 
   int flags = IBV_QP_STATE;
 
-  attr.qp_state = IBV_QPS_RTR;                                                                                         
-  attr.ah_attr.src_path_bits = 0;                                                                                      
-  attr.ah_attr.port_num = session->userParam->portId;
+  attr.qp_state = state;
+  attr.ah_attr.src_path_bits = 0;
+  attr.ah_attr.port_num = portId;
+  if (state==IBV_QPS_INIT) {
+    flags |= IBV_QP_PORT;
+    attr.port_num = portId;
+  }
 
-  int rc = ibv_modify_qp(session->common->qp, &attr, flags);
+  int rc = ibv_modify_qp(qp, &attr, flags);
 
   if (rc!=0) {
     int rc = errno;
-    fprintf(stderr, "warn : ice_verb_set_rtr: ibv_modify_qp: failed: %s (errno %d)\n",
-      strerror(rc), rc);
+    fprintf(stderr, "warn : ice_verb_modify_qp_state: ibv_modify_qp to state %d: failed: %s (errno %d)\n",
+      state, strerror(rc), rc);
   }
 
   return rc;
 }
 
+int ice_verb_set_rtr(struct Session *session) {
+  assert(session);
+
+  return ice_verb_modify_qp_state(session->common->qp, session->userParam->portId, IBV_QPS_RTR);
+}
+
 int ice_verb_set_rts(struct Session *session) {
   assert(session);
 
-  struct ibv_qp_attr attr;
+  const struct UserParam *param = session->userParam;
+  int rc = ice_verb_modify_qp_state(session->common->qp, param->portId, IBV_QPS_RTS);
+  if (rc==0 && !param->isServer && param->txRatePps>0 && param->useHardwarePacing) {
+    rc = ice_verb_set_rate_limit(session->common->context, session->common->qp, param->txRatePps,
+      session->send->pktSize, param->txBatchSize);
+  }
+
+  return rc;
+}
+
+int ice_verb_set_rate_limit(struct ibv_context *context, struct ibv_qp *qp, double packetsPerSecond,
+  uint32_t packetSize, uint32_t burstPackets) {
+  assert(context);
+  assert(qp);
+  assert(packetsPerSecond>0);
+  assert(packetSize>0);
+
+  struct ibv_device_attr_ex deviceAttr;
+  memset(&deviceAttr, 0, sizeof(deviceAttr));
+  int rc = ibv_query_device_ex(context, 0, &deviceAttr);
+  if (rc!=0) {
+    fprintf(stderr, "warn : ice_verb_set_rate_limit: ibv_query_device_ex failed: %s (errno %d)\n", strerror(rc), rc);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  // Rate limits are in kbps of packet bytes
+  const struct ibv_packet_pacing_caps *caps = &deviceAttr.packet_pacing_caps;
+  const double kbps = packetsPerSecond*packetSize*8.0/1000.0;
+  if (0==(caps->supported_qpts & (1u<<IBV_QPT_RAW_PACKET))) {
+    fprintf(stderr, "warn : ice_verb_set_rate_limit: device has no packet pacing for RAW_PACKET QPs\n");
+    return ICE_IB_ERROR_API_ERROR;
+  }
+  if (kbps<caps->qp_rate_limit_min || kbps>caps->qp_rate_limit_max) {
+    fprintf(stderr, "warn : ice_verb_set_rate_limit: %.0f kbps outside device pacing range [%u, %u] kbps\n", kbps,
+      caps->qp_rate_limit_min, caps->qp_rate_limit_max);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  struct ibv_qp_rate_limit_attr attr;
   memset(&attr, 0, sizeof(attr));
+  attr.rate_limit = (uint32_t)kbps;
+  attr.max_burst_sz = packetSize*burstPackets;
+  attr.typical_pkt_sz = (uint16_t)(packetSize>UINT16_MAX ? UINT16_MAX : packetSize);
+  if (0!=(rc=ibv_modify_qp_rate_limit(qp, &attr))) {
+    fprintf(stderr, "warn : ice_verb_set_rate_limit: ibv_modify_qp_rate_limit failed: %s (errno %d)\n",
+      strerror(rc), rc);
+    return ICE_IB_ERROR_API_ERROR;
+  }
 
-  int flags = IBV_QP_STATE;
+  fprintf(stderr, "info : ice_verb_set_rate_limit: NIC paces QP %u at %u kbps (%.3f Mpps), burst %u bytes\n",
+    qp->qp_num, attr.rate_limit, packetsPerSecond/1e6, attr.max_burst_sz);
+
+  return 0;
+}
+
+int ice_verb_build_send_ring(struct Queue *queue, uint32_t ringSize, struct IPV4UDPEndpoint *src,
+  struct IPV4UDPEndpoint *dst) {
+  assert(queue);
+  assert(src);
+  assert(dst);
+  assert(ringSize>0 && ringSize<=MAX_QUEUE_ENTRIES);
+
+  // Non-verbs transports have no memory registration
+  const uint32_t lkey = queue->mr ? queue->mr->lkey : 0;
+
+  // Headers are built once here. SGE list and WR per ring slot; the send
+  // loop points the first SGE at the next pool packet. In split payload
+  // mode the second SGE sends the shared payload so it is never copied.
+  // WR 'i' is chained to WR 'i+1' so any contiguous run of slots can be
+  // posted as one list. The send loop terminates the list at the last WR
+  // posted. TSO WRs carry the headers themselves so their SGE only sends
+  // the payload. The NIC copies those headers onto every frame it cuts
+  // without touching UDP length, so they give one frame's
+  ice_verb_build_packet_pool(queue, src, dst);
+  for (uint32_t i=0; queue->tsoMss && i<queue->pktCount; ++i) {
+    ice_verb_packet(queue, i)->ipv4udp_header.size = htons((uint16_t)(sizeof(struct IPV4UDPHeader)+queue->tsoMss));
+  }
+  for (uint32_t i=0; i<ringSize; ++i) {
+    queue->sqe[i][0].addr = (uint64_t)ice_verb_packet(queue, i);
+    queue->sqe[i][0].length = queue->pktSlabSize;
+    queue->sqe[i][0].lkey = lkey;
+    queue->sqe[i][1].addr = (uint64_t)queue->pktPayload;
+    queue->sqe[i][1].length = queue->pktPayloadSize;
+    queue->sqe[i][1].lkey = lkey;
+
+    memset(queue->wsq+i, 0, sizeof(struct ibv_send_wr));
+    queue->wsq[i].wr_id = i;
+    queue->wsq[i].sg_list = queue->sqe[i];
+    queue->wsq[i].num_sge = queue->pktPayload ? 2 : 1;
+    queue->wsq[i].opcode = IBV_WR_SEND;
+    if (queue->tsoMss) {
+      queue->sqe[i][0].addr += PACKET_HEADER_SIZE;
+      queue->sqe[i][0].length -= PACKET_HEADER_SIZE;
+      queue->wsq[i].opcode = IBV_WR_TSO;
+      queue->wsq[i].tso.hdr = ice_verb_packet(queue, i);
+      queue->wsq[i].tso.hdr_sz = PACKET_HEADER_SIZE;
+      queue->wsq[i].tso.mss = queue->tsoMss;
+    }
+    queue->wsq[i].next = (i+1<ringSize) ? queue->wsq+i+1 : 0;
+  }
 
-  attr.qp_state = IBV_QPS_RTS;                                                                                         
-  attr.ah_attr.src_path_bits = 0;                                                                                      
-  attr.ah_attr.port_num = session->userParam->portId;
+  return 0;
+}
 
-  int rc = ibv_modify_qp(session->common->qp, &attr, flags);
+int ice_verb_initialize_send_ring(struct Session *session) {
+  assert(session);
+  assert(session->send);
+  assert(session->userParam);
 
-  if (rc!=0) {
+  const struct UserParam *param = session->userParam;
+  struct Queue *queue = session->send;
+  int rc = ice_verb_build_send_ring(queue, param->txQueueSize, &session->client, &session->server);
+  if (rc!=0 || param->flowCount<=1) {
+    return rc;
+  }
+
+  // Flows start from the pool's template packet; TSO sends take a sequence number per frame
+  assert(session->common);
+  const struct IPV4Packet *packet = ice_verb_packet(queue, 0);
+  if (0!=ice_flow_initialize(&session->common->flows, param->flowCount, param->flowDistribution,
+      param->flowZipfExponent, param->flowFields, (const uint16_t *)&packet->ipv4_header, session->client.port,
+      session->server.port, param->clientPort, ice_verb_tso_frames(param->payloadSize, queue->tsoMss))) {
+    return ICE_IB_ERROR_API_ERROR;
+  }
+  queue->flows = &session->common->flows;
+
+  return 0;
+}
+
+struct ibv_flow *ice_verb_create_flow(struct ibv_qp *qp, uint32_t portId, const struct IPV4UDPEndpoint *endpoint,
+  uint8_t wildcards, uint32_t flowCount) {
+  assert(qp);
+  assert(portId>0);
+  assert(endpoint);
+  assert(flowCount>0);
+
+  struct IPV4UDPFlowRule rule;
+  memset(&rule, 0, sizeof(rule));
+
+  rule.attr.type = IBV_FLOW_ATTR_NORMAL;
+  rule.attr.size = sizeof(rule);
+  rule.attr.num_of_specs = 3;
+  rule.attr.port = portId;
+
+  // Match destination MAC and IPV4 ethernet type
+  rule.eth.type = IBV_FLOW_SPEC_ETH;
+  rule.eth.size = sizeof(rule.eth);
+  memcpy(rule.eth.val.dst_mac, endpoint->mac, MAC_ADDR_SIZE);
+  memset(rule.eth.mask.dst_mac, 0xff, MAC_ADDR_SIZE);
+  rule.eth.val.ether_type = htons(0x0800);
+  rule.eth.mask.ether_type = 0xffff;
+
+  // Match destination IPV4 address, or the prefix holding every flow's
+  rule.ipv4.type = IBV_FLOW_SPEC_IPV4;
+  rule.ipv4.size = sizeof(rule.ipv4);
+  rule.ipv4.mask.dst_ip = (wildcards & ICE_FLOW_FIELD_DST_IP) ?
+    htonl(ice_verb_flow_prefix(ntohl(endpoint->ipAddr), flowCount)) : 0xffffffff;
+  rule.ipv4.val.dst_ip = endpoint->ipAddr & rule.ipv4.mask.dst_ip;
+
+  // Match destination UDP port, or the prefix holding every flow's
+  rule.udp.type = IBV_FLOW_SPEC_UDP;
+  rule.udp.size = sizeof(rule.udp);
+  rule.udp.mask.dst_port = (wildcards & ICE_FLOW_FIELD_DST_PORT) ?
+    htons((uint16_t)ice_verb_flow_prefix(ntohs(endpoint->port), flowCount)) : 0xffff;
+  rule.udp.val.dst_port = endpoint->port & rule.udp.mask.dst_port;
+
+  struct ibv_flow *flow = ibv_create_flow(qp, &rule.attr);
+  if (0==flow) {
     int rc = errno;
-    fprintf(stderr, "warn : ice_verb_set_rtr: ibv_modify_qp: failed: %s (errno %d)\n",
-      strerror(rc), rc);
+    fprintf(stderr, "warn : ice_verb_create_flow: ibv_create_flow failed: %s (errno %d)\n", strerror(rc), rc);
   }
 
-  return rc;
+  return flow;
+}
+
+int ice_verb_initialize_flow(struct Session *session, const struct IPV4UDPEndpoint *endpoint) {
+  assert(session);
+  assert(endpoint);
+  assert(session->common);
+  assert(session->common->qp);
+  assert(session->userParam);
+
+  session->common->flow = ice_verb_create_flow(session->common->qp, session->userParam->portId, endpoint,
+    ice_verb_flow_wildcards(session->userParam), session->userParam->flowCount);
+
+  return session->common->flow ? 0 : ICE_IB_ERROR_API_ERROR;
+}
+
+int ice_verb_post_recv_ring(struct Queue *queue, uint32_t ringSize, struct ibv_qp *qp, struct ibv_wq *wq) {
+  assert(queue);
+  assert(queue->mr);
+  assert(qp || wq);
+  assert(ringSize>0 && ringSize<=MAX_QUEUE_ENTRIES);
+
+  // One receive buffer, SGE and WR per ring slot. 'wr_id' is the slot so
+  // completions say which WR to re-post
+  assert(ringSize<queue->pktCount);
+  for (uint32_t i=0; i<ringSize; ++i) {
+    queue->sqe[i][0].addr = (uint64_t)ice_verb_packet(queue, i);
+    queue->sqe[i][0].length = queue->pktStride;
+    queue->sqe[i][0].lkey = queue->mr->lkey;
+
+    memset(queue->wrq+i, 0, sizeof(struct ibv_recv_wr));
+    queue->wrq[i].wr_id = i;
+    queue->wrq[i].sg_list = queue->sqe[i];
+    queue->wrq[i].num_sge = 1;
+    queue->wrq[i].next = (i+1<ringSize) ? queue->wrq+i+1 : 0;
+  }
+
+  // Fill the receive queue
+  struct ibv_recv_wr *badWr = 0;
+  int rc = ice_verb_post_recv_list(qp, wq, queue->wrq, &badWr);
+  if (rc!=0) {
+    fprintf(stderr, "warn : ice_verb_post_recv_ring: post recv failed: %s (errno %d)\n", strerror(rc), rc);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  return 0;
+}
+
+int ice_verb_initialize_recv_ring(struct Session *session) {
+  assert(session);
+  assert(session->recv);
+  assert(session->common);
+  assert(session->userParam);
+
+  return ice_verb_post_recv_ring(session->recv, session->userParam->rxQueueSize, session->common->qp, 0);
 }
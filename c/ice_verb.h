@@ -1,10 +1,27 @@
 #pragma once
 
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <x86intrin.h>
+
 #include <ib.h>
 #include <umad.h>
 #include <verbs.h>
 #include <mlx5dv.h>
 #include <mlx5_api.h>
+#include <ice_arena.h>
+#include <ice_pacer.h>
+#include <ice_checksum.h>
+#include <ice_topology.h>
+#include <ice_transport.h>
+#include <ice_stats.h>
+#include <ice_histogram.h>
+#include <ice_sequence.h>
+#include <ice_flow.h>
 
 static const uint64_t HUGEPAGE_ALIGN_2MB = 0x200000;
 static const uint64_t CPU_CACHE_LINE_SIZE_BYTES = 64;
@@ -13,9 +30,18 @@ static const uint64_t CPU_CACHE_LINE_SIZE_MASK = (64-1);
 enum kMAX {
   MAC_ADDR_SIZE = 6,
   MAX_QUEUE_ENTRIES = 1024,
-  MAX_PACKET_ENTRIES = 4096,
+  MAX_PACKET_ENTRIES = 4096,                                  // max packets in a queue's slab
+  MAX_SGE_ENTRIES = 2,                                        // header and payload SGEs per WR
+  MAX_PAYLOAD_SIZE = 65535-20-8,                              // IPV4 total length is 16 bits
+  MAX_INLINE_PROBE_SIZE = 1024,                               // largest inline size asked of a new QP
+  MIN_INLINE_PROBE_SIZE = 16,                                 // smallest inline size asked of a new QP
+  MAX_POLL_ENTRIES = 64,                                      // max completions reaped per ibv_poll_cq
+  MAX_COMPLETION_QUEUE_ENTRIES = 1024,
 };
 
+// Packet slab must hold every send WR outstanding plus one
+_Static_assert(MAX_PACKET_ENTRIES>MAX_QUEUE_ENTRIES, "packet pool smaller than send queue");
+
 // define to not conflict with errno
 enum ICE_IB_Error {
   ICE_IB_ERROR_NO_DEVICE = -1,        // Zero IB devices found
@@ -26,7 +52,8 @@ enum ICE_IB_Error {
   ICE_IB_ERROR_MAX = -6,
 };
 
-// Application payload in packets
+// Application payload in packets. This is the fixed prefix of a 'UserParam::payloadSize' byte payload; whatever
+// follows it in the packet slab is sent as is
 struct Payload {
   uint64_t                  sequenceId;                       // payload sequence number
   uint64_t                  createTimestamp;                  // rdtsc value when packet created
@@ -68,10 +95,34 @@ struct IPV4Packet {
   struct IPHeader           ip_header;
   struct IPV4Header         ipv4_header;
   struct IPV4UDPHeader      ipv4udp_header;
-  strucy Payload            payload;
+  struct Payload            payload;
 };
 #pragma pack(pop)
 
+// Ethernet, IPV4 and UDP header bytes heading every packet; the header template a TSO send repeats per frame
+enum kHEADER {
+  PACKET_HEADER_SIZE = sizeof(struct IPV4Packet) - sizeof(struct Payload),
+};
+
+// Return bytes in a packet with a 'payloadSize' byte payload: ethernet, IPV4 and UDP headers plus payload
+static inline uint32_t ice_verb_packet_size(uint32_t payloadSize) {
+  return (uint32_t)PACKET_HEADER_SIZE + payloadSize;
+}
+
+// Return frames on the wire per 'payloadSize' byte packet sent with TSO frame payload 'tsoMss'; 1 if 'tsoMss' is 0
+static inline uint32_t ice_verb_tso_frames(uint32_t payloadSize, uint32_t tsoMss) {
+  return tsoMss ? (payloadSize+tsoMss-1)/tsoMss : 1;
+}
+
+// Flow steering rule for ibv_create_flow: ethernet, IPV4, UDP specs in order. Each spec is a multiple of 4 bytes
+// so members are contiguous as ibv_create_flow expects
+struct IPV4UDPFlowRule {
+  struct ibv_flow_attr      attr;
+  struct ibv_flow_spec_eth  eth;
+  struct ibv_flow_spec_ipv4 ipv4;
+  struct ibv_flow_spec_tcp_udp udp;
+};
+
 struct IPV4UDPEndpoint {
   uint32_t                  ipAddr;                           // IPV4 address (192.16.0.2) in network binary format
   uint16_t                  port;                             // server IPV4 port in network binary format
@@ -84,39 +135,115 @@ struct UserParam {
   char                      serverMac[64];
   char                      clientIpAddr[64];
   char                      serverIpAddr[64];
+  char                      reportPath[256];                  // '-o' file run records are appended to; empty for none
   uint16_t                  clientPort;
   uint16_t                  serverPort;
   uint32_t                  iters;                            // number of packets to send (and receive)
   uint32_t                  portId;                           // some NICs are dual port. one-based
+  uint32_t                  txQueueSize;                      // max send WRs outstanding in [1, MAX_QUEUE_ENTRIES]
+  uint32_t                  rxQueueSize;                      // max recv WRs outstanding in [1, MAX_QUEUE_ENTRIES]
+  uint32_t                  txBatchSize;                      // send WRs chained per ibv_post_send in [1, txQueueSize]
+  uint32_t                  txSignalInterval;                 // signal every Kth send WR in [1, txQueueSize]
+  uint32_t                  payloadSize;                      // size of packet payload in bytes
+  uint32_t                  latencyWindow;                    // ping-pong packets in flight; 0 is bandwidth mode
+  double                    txRatePps;                        // target send rate over all queues; 0 is unpaced
+  uint32_t                  queueCount;                       // workers each with own queue and core
+  int32_t                   firstCpu;                         // pin hot thread 'i' to 'firstCpu+i'; -1 automatic
+  int32_t                   tscPeerCpu;                       // same host peer's hot core to check TSC skew; -1 none
+  uint8_t                   useHugePages;                     // ICE_ArenaPage backing the session arena
+  uint8_t                   useBlueFlame;                     // mlx5 direct path: BlueFlame single WQE batches
+  uint32_t                  packetsPerWqe;                    // mlx5 direct path: packets per enhanced MPW WQE; 0 none
+  uint32_t                  tsoMss;                           // client: payload bytes per frame of a TSO send; 0 none
+  uint32_t                  flowCount;                        // client 5-tuples packets spread over; 1 is one flow
+  uint8_t                   flowDistribution;                 // ICE_FlowDistribution packets pick flows by
+  uint8_t                   flowFields;                       // ICE_FlowField mask of header fields flows vary
+  double                    flowZipfExponent;                 // 's' of ICE_FLOW_DIST_ZIPF
+  uint32_t                  stridesPerWqe;                    // mlx5 server: packets per striding RQ WQE; 0 for none
+  uint8_t                   cqeFormat;                        // mlx5 striding server: MLX5DV_CQE_RES_FORMAT_*; 0 none
+  uint8_t                   checksumMode;                     // ICE_ChecksumMode for IPV4 header checksums
+  uint8_t                   splitPayload;                     // send headers and payload from separate SGEs
+  uint8_t                   useInline;                        // post packets that fit with IBV_SEND_INLINE
+  uint8_t                   transport;                        // ICE_TransportKind; NONE runs native verbs loops
+  uint8_t                   xdpMode;                          // ICE_XdpMode for the AF_XDP transport
+  uint8_t                   xdpAlwaysKick;                    // AF_XDP: kick the kernel every time; no need-wakeup
+  uint32_t                  xdpQueueId;                       // AF_XDP: NIC queue the socket binds to
+  uint8_t                   useHardwarePacing;                // pace 'txRatePps' by ibv_modify_qp_rate_limit not TSC
+  uint32_t                  statsIntervalMs;                  // live stats period; 0 for none
+  uint8_t                   useHardwareTimestamps;            // extended CQs with NIC completion timestamps
   uint8_t                   isServer;
 };
 
+// Memory carved from the session's Arena
 struct HugePageMemory {
   const void                *hugePageMemory;                  // pointer to allocated memory
   uint64_t                  requestSizeBytes;                 // how much requested
-  uint64_t                  actualSizeBytes;                  // actual alloc rounded up to nearest HUGEPAGE_ALIGN_2MB
-  uint32_t                  shmid;                            // shared memory handle to huge memory
+  uint64_t                  actualSizeBytes;                  // actual alloc rounded up to a cache line
 };
 
 struct Queue {
   struct ibv_mr             *mr;                              // memory registration [start, end)
   struct ibv_cq             *cq;                              // completion queue
-  struct ibv_sge            sqe[MAX_QUEUE_ENTRIES];           // scatter-gather memory (to send or receive into)
+  struct ibv_cq_ex          *cqEx;                            // 'cq' as an extended CQ with NIC timestamps; 0 if off
+  struct ibv_sge            sqe[MAX_QUEUE_ENTRIES][MAX_SGE_ENTRIES]; // scatter-gather list per WR
   union {
     struct ibv_send_wr      wsq[MAX_QUEUE_ENTRIES];           // work request queue (for senders)
     struct ibv_recv_wr      wrq[MAX_QUEUE_ENTRIES];           // work request queue (for receivers)
   };
-  uint32_t                  pktReadIndex;                     // read  index
+  struct ibv_wc             wc[MAX_POLL_ENTRIES];             // completions reaped per ibv_poll_cq
+  uint64_t                  wcTimestamp[MAX_POLL_ENTRIES];    // NIC clock completion time per 'wc' if 'cqEx'
+  uint32_t                  pktReadIndex;                     // read  index; oldest packet not yet retired
   uint32_t                  pktWriteIndex;                    // write index for next packet (write or read into)
-  struct IPV4Packet         packet[MAX_PACKET_ENTRIES];       // packet memory to send via queue (or receive into)
+  uint32_t                  pktChecksumBase;                  // template IPV4 header sum less packetId, checksum
+  uint32_t                  inlineSize;                       // max bytes the sending QP inlines; 0 if none
+  uint32_t                  tsoMss;                           // payload bytes per frame the NIC cuts sends into; 0 none
+  uint32_t                  pktCount;                         // packets in 'pktSlab'; power of 2
+  uint32_t                  pktStride;                        // bytes between packets in 'pktSlab'; cache line multiple
+  uint32_t                  pktSize;                          // ethernet frame bytes per packet sent or received
+  uint32_t                  pktSlabSize;                      // bytes per packet held in 'pktSlab'
+  uint32_t                  pktPayloadSize;                   // bytes at 'pktPayload'
+  uint8_t                   *pktSlab;                         // packet memory after this object; send (or receive into)
+  uint8_t                   *pktPayload;                      // split payload mode: payload tail shared by all packets
+  struct FlowTable          *flows;                           // flows packets are spread over; 0 for one flow
+};
+
+// Outcome of one send or receive loop
+// 'counters' are live: loops update them as they go for 'ice_stats' to sample
+struct RunResult {
+  struct StatsCounters      counters;                         // packets, bytes, polls ... so far
+  uint64_t                  paceRestarts;                     // times a paced sender fell a ring behind schedule
+  struct timespec           startTime;                        // CLOCK_MONOTONIC at first packet
+  struct timespec           endTime;                          // CLOCK_MONOTONIC at last packet
+};
+
+// Maps NIC completion timestamps onto rdtsc. Sampled once from ibv_query_rt_values_ex so drift between the clocks
+// accumulates over a run; fine for runs of seconds
+struct NicClock {
+  uint64_t                  nicBase;                          // NIC clock ticks at 'tscBase'
+  uint64_t                  tscBase;                          // rdtsc at 'nicBase'
+  double                    tscPerNic;                        // rdtsc ticks per NIC clock tick
+  double                    nicPerNs;                         // NIC clock ticks per ns
 };
 
 struct SessionCommon {
   struct ibv_qp             *qp;                              // queue pair coordinating send/recv members
+  struct ibv_flow           *flow;                            // flow steering 'qp' receives on (server only)
   struct ibv_pd             *pd;                              // memory protection domain (for multiple memory regions)
   struct ibv_context        *context;                         // NIC device context
   struct ibv_device         *device;                          // the device session operates on
   struct ibv_device         **deviceList;                     // all known devices at initialize time
+
+  struct ibv_port_attr       portData;                        // port data in NIC this session is on (mlx5 only)
+  struct mlx5dv_context_attr contextAttrs;                    // attributes 'context' created with (mlx5 only)
+  struct mlx5dv_context      contextExtended;                 // other data not in 'context' (mlx5 only)
+  struct mlx5dv_port         portDataExtended;                // other data not in 'portData' (mlx5 only)
+
+  struct Histogram          latency;                          // rtt (latency client) or one-way (server) rdtsc ticks
+  struct SequenceSet        sequence;                         // received sequence numbers per flow (server only)
+  struct FlowTable          flows;                            // 5-tuples the send queue spreads over (multi-flow only)
+  struct NicClock           nicClock;                         // NIC to rdtsc time (hardware timestamps only)
+  struct Histogram          nicRtt;                           // rtt between NIC completions in NIC ticks
+  struct Histogram          toNic;                            // packet stamp to NIC receive in rdtsc ticks
+  struct Histogram          fromNic;                          // NIC receive to poll in rdtsc ticks
 };
 
 struct Session {
@@ -127,6 +254,10 @@ struct Session {
   struct HugePageMemory     sendMemory;                       // huge page memory for send work
   struct HugePageMemory     recvMemory;                       // huge page memory for receive work
   struct HugePageMemory     cmmnMemory;                       // huge page memory for data common to send, recv
+  struct Arena              arena;                            // NIC-local mapping all memory above is carved from
+  struct Topology           topology;                         // NIC's NUMA node and cores in placement order
+  struct Transport          transport;                        // backend when 'userParam->transport' is set
+  struct StatsMonitor       stats;                            // live counters printer for the run in progress
 
   struct IPV4UDPEndpoint    server;                           // server endpoint in binary network order
   struct IPV4UDPEndpoint    client;                           // client endpoint in binary network order
@@ -137,9 +268,14 @@ struct Session {
 int ice_verb_config_check_port_device(struct ibv_context *context, int portId);
 struct ibv_device **ice_verb_find_device(const char *deviceName, struct ibv_device **device, int *rc);
 
-int ice_verb_allocate_huge_memory(uint64_t requestSizeBytes, struct HugePageMemory *memory);
+// Carve 'requestSizeBytes' of zeroed cache line aligned memory out of 'arena' into 'memory'. Return 0 on success and
+// non-zero otherwise
+int ice_verb_allocate_memory(struct Arena *arena, uint64_t requestSizeBytes, struct HugePageMemory *memory);
 
-int ice_verb_initialize_queue(struct ibv_pd *pd, struct ibv_context *context, struct HugePageMemory *memory);
+// Register 'memory' holding a Queue and create its CQ: an extended CQ reporting NIC completion timestamps if
+// 'hardwareTimestamps'. Return 0 on success and non-zero otherwise
+int ice_verb_initialize_queue(struct ibv_pd *pd, struct ibv_context *context, struct HugePageMemory *memory,
+  uint8_t hardwareTimestamps);
 int ice_verb_deinitialize_queue(struct Queue *queue);
 
 int ice_verb_initialize_session_common(const struct UserParam *param, struct Queue *send, struct Queue *recv,
@@ -148,12 +284,333 @@ int ice_verb_initialize_session_common(const struct UserParam *param, struct Que
 int ice_verb_deinitalize_session_common(struct SessionCommon *common);
 
 int ice_verb_allocate_session(const struct UserParam *param, struct Session *session);
+// Create 'session's PD, queues and QP on 'context' leaving 'extraBytes' of its arena for the caller to allocate
+int ice_verb_initialize_session(const struct UserParam *param, struct Session *session, struct ibv_device *device,
+  struct ibv_device **deviceList, struct ibv_context *context, uint64_t extraBytes);
 int ice_verb_deallocate_session(struct Session *session); 
 
 int ice_verb_initialize_endpoint(const char *mac, const char *ipAddr, uint16_t port, struct IPV4UDPEndpoint *endpoint);
 
+// Pin the calling thread (single queue runs) to a core near sysfs device directory 'deviceDir' and carve 'session's
+// send, recv and common memory out of a new arena on its NUMA node leaving 'extraBytes' for the caller to allocate.
+// Queues are laid out but not registered. Return 0 on success and non-zero otherwise
+int ice_verb_allocate_queues(const struct UserParam *param, struct Session *session, const char *deviceDir,
+  uint64_t extraBytes);
+
+// Return 1 if receivers have been idle longer than IDLE_TIMEOUT_NS and 0 otherwise. 'idlePolls' counts consecutive
+// empty polls: the first records the time idling started in '*idleTime'. After that the clock is only read every
+// 4096 polls to keep it out of the polling loop
+int ice_verb_idle_timeout(uint64_t idlePolls, struct timespec *idleTime);
+
+// Return bytes of huge page memory for a Queue whose packet slab holds more than 'queueSize' packets of
+// 'payloadSize' payload bytes each. With 'splitPayload' each slab packet only holds headers and 'Payload' and the rest
+// of the payload is one buffer shared by all packets
+uint64_t ice_verb_queue_memory_size(uint32_t queueSize, uint32_t payloadSize, uint8_t splitPayload);
+
+// Lay out the packet slab (and shared payload if 'splitPayload') after the Queue object at the start of 'memory'
+// which must be at least 'ice_verb_queue_memory_size' bytes. Packets are 'pktStride' bytes apart: frame size
+// rounded up to a cache line
+void ice_verb_layout_queue(struct HugePageMemory *memory, uint32_t queueSize, uint32_t payloadSize,
+  uint8_t splitPayload);
+
+// Return packet 'index' in 'queue's slab
+static inline struct IPV4Packet *ice_verb_packet(const struct Queue *queue, uint32_t index) {
+  return (struct IPV4Packet *)(queue->pktSlab + (uint64_t)index*queue->pktStride);
+}
+
 int ice_verb_make_raw_ipv4packet(struct Queue *queue, struct IPV4UDPEndpoint *src, struct IPV4UDPEndpoint *dst);
 int ice_verb_checksum_ipv4packet(struct IPV4Packet *packet);
 
+// Build every packet in 'queue->pktSlab' once from a 'src' to 'dst' template, set 'queue->pktChecksumBase' and reset
+// the pool indices. Send loops then take packets with 'ice_verb_take_packet' which stamps only per packet fields.
+int ice_verb_build_packet_pool(struct Queue *queue, struct IPV4UDPEndpoint *src, struct IPV4UDPEndpoint *dst);
+
+// Stamp the per packet fields of a template packet: payload sequence number and rdtsc timestamp and the IPV4 packet
+// id. With ICE_CHECKSUM_MODE_INCREMENTAL the IPV4 checksum is updated from 'checksumBase' rather than recomputed over
+// the header; other modes leave it to 'ice_verb_checksum_taken' or the NIC
+static inline void ice_verb_stamp_ipv4packet(struct IPV4Packet *packet, uint32_t checksumBase, uint64_t seq,
+  uint8_t checksumMode) {
+  const uint16_t packetId = htons((uint16_t)seq);
+  packet->ipv4_header.packetId = packetId;
+  if (checksumMode==ICE_CHECKSUM_MODE_INCREMENTAL) {
+    uint32_t sum = checksumBase + packetId;
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    packet->ipv4_header.checksum = (uint16_t)~sum;
+  }
+  packet->payload.sequenceId = seq;
+  packet->payload.createTimestamp = __rdtsc();
+}
+
+// Sample 'context's NIC clock against rdtsc into 'clock'. Return 0 on success and non-zero otherwise
+int ice_verb_initialize_nic_clock(struct ibv_context *context, struct NicClock *clock);
+
+// Return NIC clock time 'nic' as rdtsc
+static inline uint64_t ice_verb_nic_to_tsc(const struct NicClock *clock, uint64_t nic) {
+  return clock->tscBase + (uint64_t)(int64_t)((double)(int64_t)(nic-clock->nicBase)*clock->tscPerNic);
+}
+
+// Poll up to 'max' completions of 'queue' into 'queue->wc' like ibv_poll_cq. With an extended CQ each completion's
+// NIC timestamp also goes into 'queue->wcTimestamp'. Return completions or negative on error
+static inline int ice_verb_poll_cq(struct Queue *queue, int max) {
+  struct ibv_cq_ex *cq = queue->cqEx;
+  if (cq==0) {
+    return ibv_poll_cq(queue->cq, max, queue->wc);
+  }
+
+  struct ibv_poll_cq_attr attr;
+  attr.comp_mask = 0;
+  int rc = ibv_start_poll(cq, &attr);
+  if (rc!=0) {
+    return rc==ENOENT ? 0 : -rc;
+  }
+  int n = 0;
+  for (;;) {
+    struct ibv_wc *wc = queue->wc+n;
+    wc->wr_id = cq->wr_id;
+    wc->status = cq->status;
+    wc->opcode = ibv_wc_read_opcode(cq);
+    wc->byte_len = ibv_wc_read_byte_len(cq);
+    queue->wcTimestamp[n] = ibv_wc_read_completion_ts(cq);
+    if (++n==max || 0!=(rc=ibv_next_poll(cq))) {
+      break;
+    }
+  }
+  ibv_end_poll(cq);
+  return (rc==0 || rc==ENOENT) ? n : -rc;
+}
+
+// What receive loops check on every packet. NIC members are 0 without hardware timestamps
+struct RecvCheck {
+  struct Histogram          *latency;                         // one-way times; see 'ice_verb_check_packet'
+  struct SequenceSet        *sequence;                        // loss, duplicates and reordering per flow
+  const struct NicClock     *nicClock;                        // converts 'Queue::wcTimestamp' to rdtsc
+  struct Histogram          *toNic;                           // packet stamp to NIC receive
+  struct Histogram          *fromNic;                         // NIC receive to poll
+};
+
+// Check received 'packet' per 'check' at rdtsc 'now'. The one-way time, 'now' less 'createTimestamp', is only
+// meaningful when sender and receiver share one TSC i.e. run on one host; stamps from the future are not recorded
+static inline void ice_verb_check_packet(const struct RecvCheck *check, const struct IPV4Packet *packet,
+  uint64_t now) {
+  const uint64_t created = packet->payload.createTimestamp;
+  if (created<=now) {
+    ice_histogram_record(check->latency, now-created);
+  }
+  ice_sequence_record_flow(check->sequence, ntohs(packet->ipv4udp_header.srcPort), packet->payload.sequenceId);
+}
+
+// Split received 'packet's one-way time at its NIC receive timestamp 'nic' into 'check->toNic' and 'check->fromNic'
+static inline void ice_verb_check_nic(const struct RecvCheck *check, const struct IPV4Packet *packet, uint64_t now,
+  uint64_t nic) {
+  const uint64_t created = packet->payload.createTimestamp;
+  const uint64_t arrived = ice_verb_nic_to_tsc(check->nicClock, nic);
+  if (created<=arrived) {
+    ice_histogram_record(check->toNic, arrived-created);
+  }
+  if (arrived<=now) {
+    ice_histogram_record(check->fromNic, now-arrived);
+  }
+}
+
+// Reset 'common's histograms and sequence trackers and point 'check' at them for a server receiving under 'param'.
+// NIC members are set only with hardware timestamps
+void ice_verb_initialize_check(const struct UserParam *param, struct SessionCommon *common, struct RecvCheck *check);
+
+// Print what 'check' saw, 'expected' packets having been sent, tagged with 'name'. Return sequence totals in '*total'
+void ice_verb_print_check(const char *name, const struct RecvCheck *check, uint64_t expected,
+  struct SequenceTracker *total);
+
+// Take the packet at 'queue->pktWriteIndex' from the pool built by 'ice_verb_build_packet_pool', stamp it for 'seq'
+// and point 'sge' at it. With 'queue->flows' the packet gets the next scheduled flow's addresses, ports and checksum
+// base and that flow's sequence number instead of 'seq'
+static inline struct IPV4Packet *ice_verb_take_packet(struct Queue *queue, struct ibv_sge *sge, uint64_t seq,
+  uint8_t checksumMode) {
+  struct IPV4Packet *packet = ice_verb_packet(queue, queue->pktWriteIndex);
+  queue->pktWriteIndex = (queue->pktWriteIndex+1) & (queue->pktCount-1);
+  assert(queue->pktWriteIndex!=queue->pktReadIndex);
+  uint32_t checksumBase = queue->pktChecksumBase;
+  if (queue->flows) {
+    const struct FlowTemplate *flow = ice_flow_next(queue->flows, &seq);
+    packet->ipv4_header.srcIpAddr = flow->srcIpAddr;
+    packet->ipv4_header.dstIpAddr = flow->dstIpAddr;
+    packet->ipv4udp_header.srcPort = flow->srcPort;
+    packet->ipv4udp_header.dstPort = flow->dstPort;
+    checksumBase = flow->checksumBase;
+  }
+  ice_verb_stamp_ipv4packet(packet, checksumBase, seq, checksumMode);
+  sge->addr = (uint64_t)packet;
+  return packet;
+}
+
+// Turn send WR 'wr' whose first SGE points at template 'packet' into a TSO send of 'queue->tsoMss' byte frames: the
+// WR carries the headers, the SGE the payload. Every frame's payload starts with its own 'Payload' numbered on from
+// 'packet's so receivers see 'ice_verb_tso_frames' consecutive sequences
+static inline void ice_verb_take_tso(const struct Queue *queue, struct ibv_send_wr *wr, struct IPV4Packet *packet) {
+  wr->tso.hdr = packet;
+  wr->sg_list[0].addr = (uint64_t)packet + PACKET_HEADER_SIZE;
+  uint8_t *payload = (uint8_t *)&packet->payload;
+  const uint32_t payloadSize = queue->pktSize - PACKET_HEADER_SIZE;
+  for (uint32_t offset=queue->tsoMss, k=1; offset<payloadSize; offset+=queue->tsoMss, ++k) {
+    struct Payload *frame = (struct Payload *)(payload+offset);
+    frame->sequenceId = packet->payload.sequenceId+k;
+    frame->createTimestamp = packet->payload.createTimestamp;
+  }
+}
+
+// Recompute IPV4 checksums of the last 'count' packets taken by 'ice_verb_take_packet' in one batch
+static inline void ice_verb_checksum_taken(struct Queue *queue, uint32_t count) {
+  const uint32_t first = (queue->pktWriteIndex-count) & (queue->pktCount-1);
+  const uint32_t head = (first+count<=queue->pktCount) ? count : queue->pktCount-first;
+  ice_checksum_ipv4_batch((uint8_t *)&ice_verb_packet(queue, first)->ipv4_header, queue->pktStride, head);
+  if (head<count) {
+    ice_checksum_ipv4_batch((uint8_t *)&ice_verb_packet(queue, 0)->ipv4_header, queue->pktStride, count-head);
+  }
+}
+
+// Return the oldest 'count' packets taken by 'ice_verb_take_packet' to the pool once their sends completed
+static inline void ice_verb_retire_packets(struct Queue *queue, uint64_t count) {
+  queue->pktReadIndex = (uint32_t)((queue->pktReadIndex+count) & (queue->pktCount-1));
+}
+
+// Create a QP from 'attr'. If 'useInline' is set the largest inline size the device grants is asked for, otherwise
+// none. On return 'attr->cap.max_inline_data' is what was granted. A non-zero 'maxTsoHeader' creates the QP for TSO
+// sends with headers up to that many bytes. Return the QP or 0 on error
+struct ibv_qp *ice_verb_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *attr, uint8_t useInline,
+  uint16_t maxTsoHeader);
+
+int ice_verb_modify_qp_state(struct ibv_qp *qp, uint32_t portId, enum ibv_qp_state state);
 int ice_verb_set_rtr(struct Session *session);
 int ice_verb_set_rts(struct Session *session);
+
+// Have the NIC pace 'qp' at 'packetsPerSecond' 'packetSize' byte packets in bursts of at most 'burstPackets'. Fails
+// if the device has no packet pacing for RAW_PACKET QPs or the rate is outside its limits. Call once 'qp' is in RTS.
+// Return 0 on success and non-zero otherwise
+int ice_verb_set_rate_limit(struct ibv_context *context, struct ibv_qp *qp, double packetsPerSecond,
+  uint32_t packetSize, uint32_t burstPackets);
+
+// Build the packet pool from 'src' to 'dst' and link 'ringSize' send WRs in 'queue' into a ring ready for posting
+int ice_verb_build_send_ring(struct Queue *queue, uint32_t ringSize, struct IPV4UDPEndpoint *src,
+  struct IPV4UDPEndpoint *dst);
+
+// Build the packet pool and link 'userParam->txQueueSize' send WRs in 'session->send' into a ring ready for posting.
+// With 'userParam->flowCount' above 1 the send queue spreads packets over flows in 'session->common->flows'.
+// Call once after 'ice_verb_set_rts' and before 'ice_verb_run_client'.
+int ice_verb_initialize_send_ring(struct Session *session);
+
+// Send 'iters' packets from a ring built by 'ice_verb_build_send_ring' on 'qp' keeping up to 'param->txQueueSize'
+// WRs outstanding. WRs are posted 'param->txBatchSize' at a time as one chained 'ibv_post_send' and only every
+// 'param->txSignalInterval'th WR is signaled. Completions are reaped in bulk. If 'queue->tsoMss' is set each WR is a
+// TSO send the NIC cuts into frames and counters count frames. Return 0 on success and non-zero otherwise.
+int ice_verb_send_loop(struct Queue *queue, struct ibv_qp *qp, const struct UserParam *param, uint64_t iters,
+  struct RunResult *result);
+
+// Post a list of receive WRs to 'wq' if not null and to 'qp' otherwise
+static inline int ice_verb_post_recv_list(struct ibv_qp *qp, struct ibv_wq *wq, struct ibv_recv_wr *wr,
+  struct ibv_recv_wr **badWr) {
+  return wq ? ibv_post_wq_recv(wq, wr, badWr) : ibv_post_recv(qp, wr, badWr);
+}
+
+// Link 'ringSize' receive WRs in 'queue' into a ring and post all of them to 'wq' if not null and 'qp' otherwise
+int ice_verb_post_recv_ring(struct Queue *queue, uint32_t ringSize, struct ibv_qp *qp, struct ibv_wq *wq);
+
+// Receive up to 'iters' packets into a ring posted by 'ice_verb_post_recv_ring'. Consumed buffers are re-posted as
+// one chained list per poll. If 'sharedReceived' is not null it counts packets over all receivers and the loop also
+// stops once it reaches 'iters'. If 'check' is not null every packet is checked per 'ice_verb_check_packet'. Return 0
+// on success and non-zero otherwise.
+int ice_verb_recv_loop(struct Queue *queue, struct ibv_qp *qp, struct ibv_wq *wq, uint64_t iters,
+  _Atomic uint64_t *sharedReceived, const struct RecvCheck *check, struct RunResult *result);
+
+// Return non-zero if 'lhs' is earlier than 'rhs'
+static inline int ice_verb_timespec_before(const struct timespec *lhs, const struct timespec *rhs) {
+  return lhs->tv_sec<rhs->tv_sec || (lhs->tv_sec==rhs->tv_sec && lhs->tv_nsec<rhs->tv_nsec);
+}
+
+// Return elapsed nanoseconds in 'result'
+double ice_verb_elapsed_ns(const struct RunResult *result);
+
+// Return printable state of inline sends for 'queue': on only if its packets fit the QP's inline size
+const char *ice_verb_inline_state(const struct Queue *queue);
+
+// Print 'result' to stderr tagged with 'name'
+void ice_verb_print_result(const char *name, const struct RunResult *result);
+
+// Print send cost of 'result' in TSC cycles per wire byte over 'threads' hot threads tagged with 'name', and how
+// 'queue' cut packets into frames if it sends with TSO
+void ice_verb_print_cost(const char *name, const struct Queue *queue, uint32_t threads,
+  const struct RunResult *result);
+
+// Print target against achieved rate for 'result' tagged with 'name' if 'param' asks for a paced send
+void ice_verb_print_pacing(const char *name, const struct UserParam *param, const struct RunResult *result);
+
+// Zero and watch 'result's counters unless 'result' is 0 then start 'session's live stats monitor every '-i' interval
+// on a spare core. Stop it with 'ice_stats_stop(&session->stats)'
+void ice_verb_start_stats(struct Session *session, struct RunResult *result);
+
+// Return ICE_FlowField destination fields a receiver under 'param' must take a range of values of: those clients'
+// flows vary
+static inline uint8_t ice_verb_flow_wildcards(const struct UserParam *param) {
+  return param->flowCount>1 ? param->flowFields & (ICE_FLOW_FIELD_DST_PORT | ICE_FLOW_FIELD_DST_IP) : 0;
+}
+
+// Return UDP destination ports from the server's a receiver under 'param' takes: one per flow if clients vary it
+static inline uint32_t ice_verb_flow_ports(const struct UserParam *param) {
+  return (ice_verb_flow_wildcards(param) & ICE_FLOW_FIELD_DST_PORT) ? param->flowCount : 1;
+}
+
+// Return the mask of high bits 'first' shares with every value up to 'first+count-1' (host order): the longest
+// prefix covering that range
+static inline uint32_t ice_verb_flow_prefix(uint32_t first, uint32_t count) {
+  const uint32_t differ = first ^ (first+count-1);
+  return differ ? (uint32_t)(~0ull << (32-__builtin_clz(differ))) : ~0u;
+}
+
+// Return a flow steering packets addressed to 'endpoint' to 'qp' or 0 on error. Destination fields in ICE_FlowField
+// mask 'wildcards' match the longest prefix covering 'endpoint's value and the 'flowCount'-1 after it
+struct ibv_flow *ice_verb_create_flow(struct ibv_qp *qp, uint32_t portId, const struct IPV4UDPEndpoint *endpoint,
+  uint8_t wildcards, uint32_t flowCount);
+
+// Install a flow rule steering only packets addressed to 'endpoint' MAC, IPV4 address and UDP port to the session's
+// QP. Servers pass 'session->server'; latency mode clients pass 'session->client' to see reflected packets. Return 0
+// on success and non-zero otherwise.
+int ice_verb_initialize_flow(struct Session *session, const struct IPV4UDPEndpoint *endpoint);
+
+// Link the recv WRs in 'session->recv' into a 'userParam->rxQueueSize' ring and post all of them. Call once before
+// 'ice_verb_run_server'.
+int ice_verb_initialize_recv_ring(struct Session *session);
+
+// Receive up to 'userParam->iters' packets. Completions are reaped in bulk and the consumed receive buffers are
+// re-posted as one chained 'ibv_post_recv' per poll. Return 0 on success and non-zero otherwise.
+int ice_verb_run_server(struct Session *session);
+
+// Latency mode client: keep 'userParam->latencyWindow' packets in flight to a server running
+// 'ice_verb_run_reflector' until 'userParam->iters' replies are received. Round trip time for each reply, computed
+// from 'Payload::createTimestamp', is recorded into 'session->common->latency' and printed on return. Requires
+// 'ice_verb_initialize_send_ring' and 'ice_verb_initialize_recv_ring'. Return 0 on success and non-zero otherwise.
+int ice_verb_run_latency_client(struct Session *session);
+
+// Latency mode server: send each received packet back to its sender in place by swapping MACs, IPV4 addresses and
+// UDP ports. A receive buffer is re-posted once its reflected send completes. Requires
+// 'ice_verb_initialize_recv_ring' and 'txQueueSize>=rxQueueSize'. Return 0 on success and non-zero otherwise.
+int ice_verb_run_reflector(struct Session *session);
+
+// Swap source and destination MACs, IPV4 addresses and UDP ports of 'packet' in place. The IPV4 checksum is unchanged
+static inline void ice_verb_reflect_ipv4packet(struct IPV4Packet *packet) {
+  uint8_t mac[MAC_ADDR_SIZE];
+  memcpy(mac, packet->ip_header.dstMac, MAC_ADDR_SIZE);
+  memcpy(packet->ip_header.dstMac, packet->ip_header.srcMac, MAC_ADDR_SIZE);
+  memcpy(packet->ip_header.srcMac, mac, MAC_ADDR_SIZE);
+
+  const uint32_t ipAddr = packet->ipv4_header.dstIpAddr;
+  packet->ipv4_header.dstIpAddr = packet->ipv4_header.srcIpAddr;
+  packet->ipv4_header.srcIpAddr = ipAddr;
+
+  const uint16_t port = packet->ipv4udp_header.dstPort;
+  packet->ipv4udp_header.dstPort = packet->ipv4udp_header.srcPort;
+  packet->ipv4udp_header.srcPort = port;
+}
+
+// Send 'userParam->iters' packets keeping up to 'txQueueSize' WRs outstanding. WRs are posted 'txBatchSize' at a
+// time as one chained 'ibv_post_send' and only every 'txSignalInterval'th WR is signaled. Completions are reaped in
+// bulk. Return 0 on success and non-zero otherwise.
+int ice_verb_run_client(struct Session *session);
@@ -0,0 +1,671 @@
+#include <ice_verb.h>
+#include <ice_tsc.h>
+#include <ice_report.h>
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <x86intrin.h>
+
+// Timed send and receive loops, the bandwidth and latency runs built on them and their reporting. Session, queue,
+// packet and flow setup is in ice_verb.c
+
+// Give up receiving when nothing arrives for this long after the first packet
+static const int64_t IDLE_TIMEOUT_NS = 2000000000L;
+
+int ice_verb_idle_timeout(uint64_t idlePolls, struct timespec *idleTime) {
+  if (idlePolls==0) {
+    clock_gettime(CLOCK_MONOTONIC, idleTime);
+  } else if ((idlePolls & 0xfff)==0) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const int64_t idleNs = (int64_t)(now.tv_sec-idleTime->tv_sec)*1000000000L + (now.tv_nsec-idleTime->tv_nsec);
+    return idleNs>IDLE_TIMEOUT_NS;
+  }
+  return 0;
+}
+
+int ice_verb_send_loop(struct Queue *queue, struct ibv_qp *qp, const struct UserParam *param, uint64_t iters,
+  struct RunResult *result) {
+  assert(queue);
+  assert(qp);
+  assert(param);
+  assert(result);
+
+  const uint64_t ringSize = param->txQueueSize;
+  const uint64_t batchSize = param->txBatchSize;
+  const uint64_t signalInterval = param->txSignalInterval;
+  assert(batchSize>0 && batchSize<=ringSize);
+  assert(signalInterval>0 && signalInterval<=ringSize);
+
+  const uint8_t checksumMode = param->checksumMode;
+  const unsigned int sendFlags = ((checksumMode==ICE_CHECKSUM_MODE_OFFLOAD) ? IBV_SEND_IP_CSUM : 0) |
+                                 ((queue->pktSize<=queue->inlineSize && !queue->tsoMss) ? IBV_SEND_INLINE : 0);
+  // A TSO WR goes out as 'frames' frames each repeating the headers
+  const uint64_t frames = ice_verb_tso_frames(queue->pktSize-PACKET_HEADER_SIZE, queue->tsoMss);
+  const uint64_t wrBytes = queue->pktSize + (frames-1)*PACKET_HEADER_SIZE;
+
+  uint64_t posted = 0;                                        // WRs posted so far
+  uint64_t completed = 0;                                     // WRs known complete so far
+  uint64_t sinceSignal = 0;                                   // WRs posted since last signaled WR
+  struct ibv_send_wr *badWr = 0;
+  struct Pacer pacer;
+  struct StatsCounters *counters = &result->counters;
+
+  memset(result, 0, sizeof(struct RunResult));
+  // Queues share the target rate equally; the NIC paces instead if asked
+  ice_pacer_initialize(&pacer, param->useHardwarePacing ? 0 : param->txRatePps/param->queueCount, ringSize);
+  clock_gettime(CLOCK_MONOTONIC, &result->startTime);
+
+  while (completed<iters) {
+    // Keep SQ full: post whole batches while there's room for one (or for
+    // whatever is left to send if less than a batch) and, when paced, once
+    // the whole batch is due
+    while (posted<iters) {
+      const uint64_t free = ringSize - (posted-completed);
+      const uint64_t want = (iters-posted < batchSize) ? iters-posted : batchSize;
+      if (free<want || ice_pacer_due(&pacer, posted)<want) {
+        break;
+      }
+
+      // Batch ends early if it would wrap the ring
+      const uint64_t slot = posted % ringSize;
+      const uint64_t count = (ringSize-slot < want) ? ringSize-slot : want;
+
+      for (uint64_t i=0; i<count; ++i) {
+        const uint64_t seq = posted+i;
+        struct ibv_send_wr *wr = queue->wsq+slot+i;
+        struct IPV4Packet *packet = ice_verb_take_packet(queue, queue->sqe[slot+i], seq*frames, checksumMode);
+        if (queue->tsoMss) {
+          ice_verb_take_tso(queue, wr, packet);
+        }
+        wr->wr_id = seq;
+        if (++sinceSignal>=signalInterval || seq+1==iters) {
+          wr->send_flags = IBV_SEND_SIGNALED | sendFlags;
+          sinceSignal = 0;
+        } else {
+          wr->send_flags = sendFlags;
+        }
+      }
+      if (checksumMode==ICE_CHECKSUM_MODE_BATCH) {
+        ice_verb_checksum_taken(queue, count);
+      }
+
+      // If the next batch will have to wait for room, the last WR posted
+      // must be signaled; otherwise the unsignaled tail holding that room
+      // never produces a completion
+      struct ibv_send_wr *last = queue->wsq+slot+count-1;
+      const uint64_t nextPosted = posted+count;
+      const uint64_t nextWant = (iters-nextPosted < batchSize) ? iters-nextPosted : batchSize;
+      if (sinceSignal!=0 && ringSize-(nextPosted-completed)<nextWant) {
+        last->send_flags = IBV_SEND_SIGNALED | sendFlags;
+        sinceSignal = 0;
+      }
+
+      // Post batch as one chained list
+      struct ibv_send_wr *next = last->next;
+      last->next = 0;
+      int rc = ibv_post_send(qp, queue->wsq+slot, &badWr);
+      last->next = next;
+      if (rc!=0) {
+        fprintf(stderr, "warn : ice_verb_send_loop: ibv_post_send failed: %s (errno %d)\n", strerror(rc), rc);
+        return ICE_IB_ERROR_API_ERROR;
+      }
+      posted = nextPosted;
+    }
+
+    // Reap completions in bulk. A signaled WR's completion implies all WRs
+    // before it on this SQ are also complete
+    int n = ibv_poll_cq(queue->cq, MAX_POLL_ENTRIES, queue->wc);
+    ice_stats_add(&counters->polls, 1);
+    if (n<0) {
+      ice_stats_add(&counters->errors, 1);
+      fprintf(stderr, "warn : ice_verb_send_loop: ibv_poll_cq failed: %d\n", n);
+      return ICE_IB_ERROR_API_ERROR;
+    } else if (n==0) {
+      ice_stats_add(&counters->emptyPolls, 1);
+      continue;
+    }
+    const uint64_t priorCompleted = completed;
+    for (int i=0; i<n; ++i) {
+      if (queue->wc[i].status!=IBV_WC_SUCCESS) {
+        ice_stats_add(&counters->errors, 1);
+        fprintf(stderr, "warn : ice_verb_send_loop: send wr_id %lu failed: %s (status %d)\n",
+          queue->wc[i].wr_id, ibv_wc_status_str(queue->wc[i].status), queue->wc[i].status);
+        return ICE_IB_ERROR_API_ERROR;
+      }
+      completed = queue->wc[i].wr_id+1;
+    }
+    ice_verb_retire_packets(queue, completed-priorCompleted);
+    ice_stats_add(&counters->completions, (uint64_t)n);
+    ice_stats_set(&counters->packets, completed * frames);
+    ice_stats_set(&counters->bytes, completed * wrBytes);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &result->endTime);
+  result->paceRestarts = pacer.restarts;
+
+  return 0;
+}
+
+int ice_verb_run_client(struct Session *session) {
+  assert(session);
+  assert(session->send);
+  assert(session->common);
+  assert(session->userParam);
+
+  struct RunResult result;
+  ice_verb_start_stats(session, &result);
+  int rc = ice_verb_send_loop(session->send, session->common->qp, session->userParam, session->userParam->iters,
+    &result);
+  ice_stats_stop(&session->stats);
+  if (rc==0) {
+    ice_verb_print_result("ice_verb_run_client", &result);
+    fprintf(stderr, "info : ice_verb_run_client: batch %u, signal every %u, checksum %s, inline %s\n",
+      session->userParam->txBatchSize, session->userParam->txSignalInterval,
+      ice_checksum_mode_name(session->userParam->checksumMode), ice_verb_inline_state(session->send));
+    ice_verb_print_cost("ice_verb_run_client", session->send, 1, &result);
+    ice_verb_print_pacing("ice_verb_run_client", session->userParam, &result);
+    rc = ice_report_write(session->userParam, "client", 1, &result, 0, "none", 0);
+  }
+
+  return rc;
+}
+
+int ice_verb_recv_loop(struct Queue *queue, struct ibv_qp *qp, struct ibv_wq *wq, uint64_t iters,
+  _Atomic uint64_t *sharedReceived, const struct RecvCheck *check, struct RunResult *result) {
+  assert(queue);
+  assert(qp || wq);
+  assert(result);
+
+  uint64_t received = 0;                                      // packets received so far
+  uint64_t idlePolls = 0;                                     // consecutive empty polls
+  struct ibv_recv_wr *badWr = 0;
+  struct timespec idleTime;
+  struct StatsCounters *counters = &result->counters;
+
+  memset(result, 0, sizeof(struct RunResult));
+  memset(&idleTime, 0, sizeof(idleTime));
+
+  while (received<iters) {
+    int n = ice_verb_poll_cq(queue, MAX_POLL_ENTRIES);
+    ice_stats_add(&counters->polls, 1);
+    if (n<0) {
+      ice_stats_add(&counters->errors, 1);
+      fprintf(stderr, "warn : ice_verb_recv_loop: ibv_poll_cq failed: %d\n", n);
+      return ICE_IB_ERROR_API_ERROR;
+    } else if (n==0) {
+      ice_stats_add(&counters->emptyPolls, 1);
+      if (received>0 && ice_verb_idle_timeout(idlePolls++, &idleTime)) {
+        fprintf(stderr, "warn : ice_verb_recv_loop: idle timeout: received %lu of %lu packets\n", received, iters);
+        break;
+      }
+      if (sharedReceived && atomic_load_explicit(sharedReceived, memory_order_relaxed)>=iters) {
+        break;
+      }
+      continue;
+    }
+
+    if (received==0) {
+      clock_gettime(CLOCK_MONOTONIC, &result->startTime);
+    }
+    idlePolls = 0;
+
+    // Chain consumed WRs in completion order for one re-post
+    const uint64_t now = check ? __rdtsc() : 0;
+    uint64_t bytes = 0;
+    for (int i=0; i<n; ++i) {
+      if (queue->wc[i].status!=IBV_WC_SUCCESS) {
+        ice_stats_add(&counters->errors, 1);
+        fprintf(stderr, "warn : ice_verb_recv_loop: recv wr_id %lu failed: %s (status %d)\n",
+          queue->wc[i].wr_id, ibv_wc_status_str(queue->wc[i].status), queue->wc[i].status);
+        return ICE_IB_ERROR_API_ERROR;
+      }
+      bytes += queue->wc[i].byte_len;
+      if (check) {
+        const struct IPV4Packet *packet = ice_verb_packet(queue, queue->wc[i].wr_id);
+        ice_verb_check_packet(check, packet, now);
+        if (check->nicClock) {
+          ice_verb_check_nic(check, packet, now, queue->wcTimestamp[i]);
+        }
+      }
+      queue->wrq[queue->wc[i].wr_id].next = (i+1<n) ? queue->wrq+queue->wc[i+1].wr_id : 0;
+    }
+    received += n;
+    ice_stats_add(&counters->completions, (uint64_t)n);
+    ice_stats_add(&counters->bytes, bytes);
+    ice_stats_set(&counters->packets, received);
+
+    int rc = ice_verb_post_recv_list(qp, wq, queue->wrq+queue->wc[0].wr_id, &badWr);
+    if (rc!=0) {
+      fprintf(stderr, "warn : ice_verb_recv_loop: post recv failed: %s (errno %d)\n", strerror(rc), rc);
+      return ICE_IB_ERROR_API_ERROR;
+    }
+
+    // Other receivers stop once all packets are in
+    if (sharedReceived && atomic_fetch_add_explicit(sharedReceived, n, memory_order_relaxed)+n>=iters) {
+      clock_gettime(CLOCK_MONOTONIC, &result->endTime);
+      return 0;
+    }
+  }
+
+  // Don't count trailing idle time
+  if (received<iters && received>0) {
+    result->endTime = idleTime;
+  } else {
+    clock_gettime(CLOCK_MONOTONIC, &result->endTime);
+  }
+  if (received==0) {
+    result->startTime = result->endTime;
+  }
+
+  return 0;
+}
+
+int ice_verb_run_server(struct Session *session) {
+  assert(session);
+  assert(session->recv);
+  assert(session->common);
+  assert(session->userParam);
+
+  struct RunResult result;
+  struct RecvCheck check;
+  struct SequenceTracker sequence;
+  ice_verb_initialize_check(session->userParam, session->common, &check);
+  ice_verb_start_stats(session, &result);
+  int rc = ice_verb_recv_loop(session->recv, session->common->qp, 0, session->userParam->iters, 0, &check, &result);
+  ice_stats_stop(&session->stats);
+  if (rc==0) {
+    ice_verb_print_result("ice_verb_run_server", &result);
+    ice_verb_print_check("ice_verb_run_server", &check, session->userParam->iters, &sequence);
+    rc = ice_report_write(session->userParam, "server", 1, &result, check.latency, "one-way", &sequence);
+  }
+
+  return rc;
+}
+
+const char *ice_verb_inline_state(const struct Queue *queue) {
+  assert(queue);
+
+  if (queue->inlineSize==0) {
+    return "off";
+  }
+  return queue->pktSize<=queue->inlineSize ? "on" : "off (packet larger than max inline)";
+}
+
+double ice_verb_elapsed_ns(const struct RunResult *result) {
+  assert(result);
+
+  return (double)(result->endTime.tv_sec-result->startTime.tv_sec)*1e9 +
+    (double)(result->endTime.tv_nsec-result->startTime.tv_nsec);
+}
+
+void ice_verb_print_result(const char *name, const struct RunResult *result) {
+  assert(name);
+  assert(result);
+
+  const double elapsedNs = ice_verb_elapsed_ns(result);
+  const double ns = elapsedNs>0 ? elapsedNs : 1;
+  const struct StatsCounters *counters = &result->counters;
+  fprintf(stderr, "info : %s: packets %lu, bytes %lu, elapsed %.3f ms, %.3f Mpps, %.3f Gbps, polls %lu, empty "
+    "polls %lu\n", name, counters->packets, counters->bytes, elapsedNs/1e6, (double)counters->packets*1e3/ns,
+    (double)counters->bytes*8.0/ns, counters->polls, counters->emptyPolls);
+}
+
+void ice_verb_print_cost(const char *name, const struct Queue *queue, uint32_t threads,
+  const struct RunResult *result) {
+  assert(name);
+  assert(queue);
+  assert(result);
+
+  // Hot threads spin for the whole run so wall clock TSC ticks are their cycles
+  const double cycles = ice_verb_elapsed_ns(result)*ice_tsc_ticks_per_ns()*threads;
+  const uint64_t bytes = result->counters.bytes;
+  fprintf(stderr, "info : %s: %.3f cycles/byte, TSO %s", name, bytes ? cycles/(double)bytes : 0.0,
+    queue->tsoMss ? "on" : "off");
+  if (queue->tsoMss) {
+    fprintf(stderr, ": %u frames of %u payload bytes per send", ice_verb_tso_frames(queue->pktSize-
+      PACKET_HEADER_SIZE, queue->tsoMss), queue->tsoMss);
+  }
+  fprintf(stderr, "\n");
+}
+
+void ice_verb_print_pacing(const char *name, const struct UserParam *param, const struct RunResult *result) {
+  assert(name);
+  assert(param);
+  assert(result);
+
+  if (param->txRatePps==0) {
+    return;
+  }
+  const double elapsedNs = ice_verb_elapsed_ns(result);
+  fprintf(stderr, "info : %s: paced by %s: target %.3f Mpps, achieved %.3f Mpps, schedule restarts %lu\n", name,
+    param->useHardwarePacing ? "NIC" : "TSC", param->txRatePps/1e6,
+    elapsedNs>0 ? (double)result->counters.packets*1e3/elapsedNs : 0.0, result->paceRestarts);
+}
+
+void ice_verb_initialize_check(const struct UserParam *param, struct SessionCommon *common, struct RecvCheck *check) {
+  assert(param);
+  assert(common);
+  assert(check);
+
+  ice_histogram_initialize(&common->latency);
+  ice_histogram_initialize(&common->toNic);
+  ice_histogram_initialize(&common->fromNic);
+  ice_sequence_initialize_set(&common->sequence, param->clientPort, param->rxQueueSize);
+  check->latency = &common->latency;
+  check->sequence = &common->sequence;
+  check->nicClock = param->useHardwareTimestamps ? &common->nicClock : 0;
+  check->toNic = param->useHardwareTimestamps ? &common->toNic : 0;
+  check->fromNic = param->useHardwareTimestamps ? &common->fromNic : 0;
+}
+
+void ice_verb_print_check(const char *name, const struct RecvCheck *check, uint64_t expected,
+  struct SequenceTracker *total) {
+  assert(name);
+  assert(check);
+  assert(total);
+
+  char tag[128];
+  snprintf(tag, sizeof(tag), "%s: one-way ns (same host only)", name);
+  ice_histogram_print(check->latency, tag, 1.0/ice_tsc_ticks_per_ns());
+  if (check->nicClock) {
+    snprintf(tag, sizeof(tag), "%s: one-way to NIC receive timestamp ns", name);
+    ice_histogram_print(check->toNic, tag, 1.0/ice_tsc_ticks_per_ns());
+    snprintf(tag, sizeof(tag), "%s: NIC receive timestamp to poll ns", name);
+    ice_histogram_print(check->fromNic, tag, 1.0/ice_tsc_ticks_per_ns());
+  }
+
+  memset(total, 0, sizeof(struct SequenceTracker));
+  ice_sequence_merge_set(total, check->sequence);
+  ice_sequence_expect(total, expected);
+  snprintf(tag, sizeof(tag), "%s: sequence", name);
+  ice_sequence_print(total, tag);
+}
+
+void ice_verb_start_stats(struct Session *session, struct RunResult *result) {
+  assert(session);
+  assert(session->userParam);
+
+  if (session->userParam->statsIntervalMs==0) {
+    return;
+  }
+  if (result) {
+    // Monitor's first sample precedes the loop's own reset
+    memset(result, 0, sizeof(struct RunResult));
+    ice_stats_watch(&session->stats, &result->counters);
+  }
+  ice_stats_start(&session->stats, session->userParam->statsIntervalMs,
+    ice_topology_spare_cpu(&session->topology, "stats"));
+}
+
+int ice_verb_run_latency_client(struct Session *session) {
+  assert(session);
+  assert(session->send);
+  assert(session->recv);
+  assert(session->common);
+  assert(session->userParam);
+
+  struct Queue *sendQueue = session->send;
+  struct Queue *recvQueue = session->recv;
+  struct Histogram *latency = &session->common->latency;
+  struct Histogram *nicRtt = &session->common->nicRtt;
+  struct ibv_qp *qp = session->common->qp;
+  const uint8_t nicTimestamps = session->userParam->useHardwareTimestamps;
+  const uint64_t iters = session->userParam->iters;
+  const uint64_t ringSize = session->userParam->txQueueSize;
+  const uint64_t window = session->userParam->latencyWindow;
+  const uint8_t checksumMode = session->userParam->checksumMode;
+  const unsigned int sendFlags = ((checksumMode==ICE_CHECKSUM_MODE_OFFLOAD) ? IBV_SEND_IP_CSUM : 0) |
+                                 ((sendQueue->pktSize<=sendQueue->inlineSize) ? IBV_SEND_INLINE : 0);
+  assert(window>0 && window<=ringSize && window<=session->userParam->rxQueueSize);
+
+  uint64_t sent = 0;                                          // packets posted so far
+  uint64_t sendCompleted = 0;                                 // send WRs known complete so far
+  uint64_t received = 0;                                      // replies received so far
+  uint64_t idlePolls = 0;                                     // consecutive polls returning no replies
+  struct ibv_send_wr *badSendWr = 0;
+  struct ibv_recv_wr *badRecvWr = 0;
+  struct timespec startTime, endTime, idleTime;
+  struct Pacer pacer;
+  uint64_t sendNic[MAX_QUEUE_ENTRIES];                        // NIC send completion time per slot
+  uint64_t sendNicSeq[MAX_QUEUE_ENTRIES];                     // sequence whose time 'sendNic' holds, plus one
+
+  ice_histogram_initialize(latency);
+  ice_histogram_initialize(nicRtt);
+  memset(sendNicSeq, 0, sizeof(sendNicSeq));
+
+  ice_pacer_initialize(&pacer, session->userParam->useHardwarePacing ? 0 : session->userParam->txRatePps, window);
+  clock_gettime(CLOCK_MONOTONIC, &startTime);
+  const uint64_t startTsc = __rdtsc();
+
+  while (received<iters) {
+    // Top up the window with one chained post. Every send is signaled so
+    // SQ slots are retired as soon as possible
+    uint64_t count = window - (sent-received);
+    if (count>iters-sent) {
+      count = iters-sent;
+    }
+    if (count>ringSize-(sent-sendCompleted)) {
+      count = ringSize-(sent-sendCompleted);
+    }
+    if (count>0) {
+      // At fixed load only packets whose send time has come go out
+      const uint64_t due = ice_pacer_due(&pacer, sent);
+      count = count<due ? count : due;
+    }
+    const uint64_t slot = sent % ringSize;
+    if (count>ringSize-slot) {
+      count = ringSize-slot;
+    }
+    if (count>0) {
+      for (uint64_t i=0; i<count; ++i) {
+        sendQueue->wsq[slot+i].wr_id = sent+i;
+        sendQueue->wsq[slot+i].send_flags = IBV_SEND_SIGNALED | sendFlags;
+        ice_verb_take_packet(sendQueue, sendQueue->sqe[slot+i], sent+i, checksumMode);
+      }
+      if (checksumMode==ICE_CHECKSUM_MODE_BATCH) {
+        ice_verb_checksum_taken(sendQueue, count);
+      }
+      struct ibv_send_wr *last = sendQueue->wsq+slot+count-1;
+      struct ibv_send_wr *next = last->next;
+      last->next = 0;
+      int rc = ibv_post_send(qp, sendQueue->wsq+slot, &badSendWr);
+      last->next = next;
+      if (rc!=0) {
+        fprintf(stderr, "warn : ice_verb_run_latency_client: ibv_post_send failed: %s (errno %d)\n", strerror(rc), rc);
+        return ICE_IB_ERROR_API_ERROR;
+      }
+      sent += count;
+    }
+
+    // Retire send completions
+    int n = ice_verb_poll_cq(sendQueue, MAX_POLL_ENTRIES);
+    if (n<0) {
+      fprintf(stderr, "warn : ice_verb_run_latency_client: ibv_poll_cq failed: %d\n", n);
+      return ICE_IB_ERROR_API_ERROR;
+    }
+    const uint64_t priorCompleted = sendCompleted;
+    for (int i=0; i<n; ++i) {
+      if (sendQueue->wc[i].status!=IBV_WC_SUCCESS) {
+        fprintf(stderr, "warn : ice_verb_run_latency_client: send wr_id %lu failed: %s (status %d)\n",
+          sendQueue->wc[i].wr_id, ibv_wc_status_str(sendQueue->wc[i].status), sendQueue->wc[i].status);
+        return ICE_IB_ERROR_API_ERROR;
+      }
+      sendCompleted = sendQueue->wc[i].wr_id+1;
+      if (nicTimestamps) {
+        sendNic[sendQueue->wc[i].wr_id % ringSize] = sendQueue->wcTimestamp[i];
+        sendNicSeq[sendQueue->wc[i].wr_id % ringSize] = sendCompleted;
+      }
+    }
+    ice_verb_retire_packets(sendQueue, sendCompleted-priorCompleted);
+
+    // Take replies: record RTT then chain buffers for one re-post
+    n = ice_verb_poll_cq(recvQueue, MAX_POLL_ENTRIES);
+    const uint64_t now = __rdtsc();
+    if (n<0) {
+      fprintf(stderr, "warn : ice_verb_run_latency_client: ibv_poll_cq failed: %d\n", n);
+      return ICE_IB_ERROR_API_ERROR;
+    } else if (n==0) {
+      if (ice_verb_idle_timeout(idlePolls++, &idleTime)) {
+        fprintf(stderr, "warn : ice_verb_run_latency_client: idle timeout: received %lu of %lu replies\n",
+          received, iters);
+        break;
+      }
+      continue;
+    }
+    idlePolls = 0;
+    for (int i=0; i<n; ++i) {
+      if (recvQueue->wc[i].status!=IBV_WC_SUCCESS) {
+        fprintf(stderr, "warn : ice_verb_run_latency_client: recv wr_id %lu failed: %s (status %d)\n",
+          recvQueue->wc[i].wr_id, ibv_wc_status_str(recvQueue->wc[i].status), recvQueue->wc[i].status);
+        return ICE_IB_ERROR_API_ERROR;
+      }
+      const struct IPV4Packet *packet = ice_verb_packet(recvQueue, recvQueue->wc[i].wr_id);
+      ice_histogram_record(latency, now-packet->payload.createTimestamp);
+      // Wire rtt: NIC send completion to NIC receive completion, if the send's is in
+      const uint64_t seq = packet->payload.sequenceId;
+      const uint64_t sentSlot = seq % ringSize;
+      if (nicTimestamps && sendNicSeq[sentSlot]==seq+1 && sendNic[sentSlot]<=recvQueue->wcTimestamp[i]) {
+        ice_histogram_record(nicRtt, recvQueue->wcTimestamp[i]-sendNic[sentSlot]);
+      }
+      recvQueue->wrq[recvQueue->wc[i].wr_id].next = (i+1<n) ? recvQueue->wrq+recvQueue->wc[i+1].wr_id : 0;
+    }
+    received += n;
+
+    int rc = ibv_post_recv(qp, recvQueue->wrq+recvQueue->wc[0].wr_id, &badRecvWr);
+    if (rc!=0) {
+      fprintf(stderr, "warn : ice_verb_run_latency_client: ibv_post_recv failed: %s (errno %d)\n", strerror(rc), rc);
+      return ICE_IB_ERROR_API_ERROR;
+    }
+  }
+
+  const uint64_t endTsc = __rdtsc();
+  clock_gettime(CLOCK_MONOTONIC, &endTime);
+
+  // The run itself calibrates rdtsc ticks to nanoseconds
+  const double elapsedNs = (double)(endTime.tv_sec-startTime.tv_sec)*1e9 + (double)(endTime.tv_nsec-startTime.tv_nsec);
+  const double nsPerTick = elapsedNs/(double)(endTsc-startTsc);
+  fprintf(stderr, "info : ice_verb_run_latency_client: window %lu, sent %lu, received %lu, elapsed %.3f ms, "
+    "inline %s\n", window, sent, received, elapsedNs/1e6, ice_verb_inline_state(sendQueue));
+  if (session->userParam->txRatePps>0) {
+    fprintf(stderr, "info : ice_verb_run_latency_client: paced by %s: target %.3f Mpps, achieved %.3f Mpps, "
+      "schedule restarts %lu\n", session->userParam->useHardwarePacing ? "NIC" : "TSC",
+      session->userParam->txRatePps/1e6, (double)sent*1e3/elapsedNs, pacer.restarts);
+  }
+  ice_histogram_print(latency, "ice_verb_run_latency_client: rtt ns", nsPerTick);
+  if (nicTimestamps) {
+    ice_histogram_print(nicRtt, "ice_verb_run_latency_client: rtt ns by NIC completion timestamps",
+      1.0/session->common->nicClock.nicPerNs);
+  }
+
+  struct RunResult result;
+  memset(&result, 0, sizeof(result));
+  result.counters.packets = received;
+  result.counters.bytes = received * sendQueue->pktSize;
+  result.paceRestarts = pacer.restarts;
+  result.startTime = startTime;
+  result.endTime = endTime;
+  return ice_report_write(session->userParam, "latency-client", 1, &result, latency, "rtt", 0);
+}
+
+int ice_verb_run_reflector(struct Session *session) {
+  assert(session);
+  assert(session->send);
+  assert(session->recv);
+  assert(session->common);
+  assert(session->userParam);
+  assert(session->userParam->txQueueSize>=session->userParam->rxQueueSize);
+
+  struct Queue *sendQueue = session->send;
+  struct Queue *recvQueue = session->recv;
+  struct ibv_qp *qp = session->common->qp;
+  const uint64_t iters = session->userParam->iters;
+
+  uint64_t reflected = 0;                                     // packets sent back so far
+  uint64_t completed = 0;                                     // reflected sends known complete so far
+  uint64_t idlePolls = 0;                                     // consecutive polls returning nothing
+  struct ibv_send_wr *badSendWr = 0;
+  struct ibv_recv_wr *badRecvWr = 0;
+  struct timespec idleTime;
+
+  // Send WR 'i' sends recv buffer 'i' back out
+  for (uint32_t i=0; i<session->userParam->rxQueueSize; ++i) {
+    sendQueue->sqe[i][0].addr = (uint64_t)ice_verb_packet(recvQueue, i);
+    sendQueue->sqe[i][0].lkey = recvQueue->mr->lkey;
+    memset(sendQueue->wsq+i, 0, sizeof(struct ibv_send_wr));
+    sendQueue->wsq[i].wr_id = i;
+    sendQueue->wsq[i].sg_list = sendQueue->sqe[i];
+    sendQueue->wsq[i].num_sge = 1;
+    sendQueue->wsq[i].opcode = IBV_WR_SEND;
+    sendQueue->wsq[i].send_flags = IBV_SEND_SIGNALED;
+  }
+
+  while (completed<iters) {
+    // Reflect what arrived as one chained send
+    int n = ibv_poll_cq(recvQueue->cq, MAX_POLL_ENTRIES, recvQueue->wc);
+    if (n<0) {
+      fprintf(stderr, "warn : ice_verb_run_reflector: ibv_poll_cq failed: %d\n", n);
+      return ICE_IB_ERROR_API_ERROR;
+    }
+    for (int i=0; i<n; ++i) {
+      if (recvQueue->wc[i].status!=IBV_WC_SUCCESS) {
+        fprintf(stderr, "warn : ice_verb_run_reflector: recv wr_id %lu failed: %s (status %d)\n",
+          recvQueue->wc[i].wr_id, ibv_wc_status_str(recvQueue->wc[i].status), recvQueue->wc[i].status);
+        return ICE_IB_ERROR_API_ERROR;
+      }
+      const uint64_t slot = recvQueue->wc[i].wr_id;
+      ice_verb_reflect_ipv4packet(ice_verb_packet(recvQueue, slot));
+      sendQueue->sqe[slot][0].length = recvQueue->wc[i].byte_len;
+      sendQueue->wsq[slot].next = (i+1<n) ? sendQueue->wsq+recvQueue->wc[i+1].wr_id : 0;
+    }
+    if (n>0) {
+      int rc = ibv_post_send(qp, sendQueue->wsq+recvQueue->wc[0].wr_id, &badSendWr);
+      if (rc!=0) {
+        fprintf(stderr, "warn : ice_verb_run_reflector: ibv_post_send failed: %s (errno %d)\n", strerror(rc), rc);
+        return ICE_IB_ERROR_API_ERROR;
+      }
+      reflected += n;
+    }
+
+    // Once a reflected send completes its buffer can receive again
+    int m = ibv_poll_cq(sendQueue->cq, MAX_POLL_ENTRIES, sendQueue->wc);
+    if (m<0) {
+      fprintf(stderr, "warn : ice_verb_run_reflector: ibv_poll_cq failed: %d\n", m);
+      return ICE_IB_ERROR_API_ERROR;
+    }
+    for (int i=0; i<m; ++i) {
+      if (sendQueue->wc[i].status!=IBV_WC_SUCCESS) {
+        fprintf(stderr, "warn : ice_verb_run_reflector: send wr_id %lu failed: %s (status %d)\n",
+          sendQueue->wc[i].wr_id, ibv_wc_status_str(sendQueue->wc[i].status), sendQueue->wc[i].status);
+        return ICE_IB_ERROR_API_ERROR;
+      }
+      recvQueue->wrq[sendQueue->wc[i].wr_id].next = (i+1<m) ? recvQueue->wrq+sendQueue->wc[i+1].wr_id : 0;
+    }
+    if (m>0) {
+      int rc = ibv_post_recv(qp, recvQueue->wrq+sendQueue->wc[0].wr_id, &badRecvWr);
+      if (rc!=0) {
+        fprintf(stderr, "warn : ice_verb_run_reflector: ibv_post_recv failed: %s (errno %d)\n", strerror(rc), rc);
+        return ICE_IB_ERROR_API_ERROR;
+      }
+      completed += m;
+    }
+
+    if (n==0 && m==0) {
+      if (reflected>0 && ice_verb_idle_timeout(idlePolls++, &idleTime)) {
+        fprintf(stderr, "warn : ice_verb_run_reflector: idle timeout: reflected %lu of %lu packets\n", reflected,
+          iters);
+        break;
+      }
+    } else {
+      idlePolls = 0;
+    }
+  }
+
+  fprintf(stderr, "info : ice_verb_run_reflector: reflected %lu packets\n", reflected);
+
+  return 0;
+}
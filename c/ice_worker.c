@@ -0,0 +1,348 @@
+#include <ice_worker.h>
+#include <ice_tsc.h>
+#include <ice_report.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <arpa/inet.h>
+
+// Well known symmetric-friendly Toeplitz key used by most NIC drivers
+static uint8_t RSS_TOEPLITZ_KEY[40] = {
+  0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67,
+  0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0, 0xd0, 0xca, 0x2b, 0xcb,
+  0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30,
+  0xf2, 0x0c, 0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+static int ice_worker_allocate_sender(struct Session *session, struct Worker *worker) {
+  const struct UserParam *param = session->userParam;
+  struct SessionCommon *common = session->common;
+
+  struct ibv_qp_init_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.send_cq = worker->queue->cq;
+  attr.recv_cq = worker->queue->cq;
+  attr.cap.max_send_wr = param->txQueueSize;
+  attr.cap.max_send_sge = param->splitPayload ? 2 : 1;
+  attr.cap.max_recv_wr = 1;
+  attr.cap.max_recv_sge = 1;
+  attr.qp_type = IBV_QPT_RAW_PACKET;
+
+  if (0==(worker->qp = ice_verb_create_qp(common->pd, &attr, param->useInline,
+    param->tsoMss ? PACKET_HEADER_SIZE : 0))) {
+    fprintf(stderr, "warn : ice_worker_allocate_sender: worker %u: no QP\n", worker->id);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+  worker->queue->inlineSize = attr.cap.max_inline_data;
+  worker->queue->tsoMss = param->tsoMss;
+
+  if (0!=ice_verb_modify_qp_state(worker->qp, param->portId, IBV_QPS_INIT) ||
+      0!=ice_verb_modify_qp_state(worker->qp, param->portId, IBV_QPS_RTR) ||
+      0!=ice_verb_modify_qp_state(worker->qp, param->portId, IBV_QPS_RTS)) {
+    return ICE_IB_ERROR_API_ERROR;
+  }
+  if (param->txRatePps>0 && param->useHardwarePacing &&
+      0!=ice_verb_set_rate_limit(common->context, worker->qp, param->txRatePps/param->queueCount,
+        worker->queue->pktSize, param->txBatchSize)) {
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  // Each worker is its own flow so RSS at the receiver can spread them
+  worker->src = session->client;
+  worker->src.port = htons((uint16_t)(param->clientPort+worker->id));
+
+  // Split packets evenly; the first worker takes any remainder
+  worker->iters = param->iters/param->queueCount;
+  if (worker->id==0) {
+    worker->iters += param->iters%param->queueCount;
+  }
+
+  return ice_verb_build_send_ring(worker->queue, param->txQueueSize, &worker->src, &session->server);
+}
+
+static int ice_worker_allocate_receiver(struct Session *session, struct Worker *worker) {
+  const struct UserParam *param = session->userParam;
+  struct SessionCommon *common = session->common;
+
+  struct ibv_wq_init_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.wq_type = IBV_WQT_RQ;
+  attr.max_wr = param->rxQueueSize;
+  attr.max_sge = 1;
+  attr.pd = common->pd;
+  attr.cq = worker->queue->cq;
+
+  if (0==(worker->wq = ibv_create_wq(common->context, &attr))) {
+    int rc = errno;
+    fprintf(stderr, "warn : ice_worker_allocate_receiver: worker %u: ibv_create_wq failed: %s (errno %d)\n",
+      worker->id, strerror(rc), rc);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  struct ibv_wq_attr wqAttr;
+  memset(&wqAttr, 0, sizeof(wqAttr));
+  wqAttr.attr_mask = IBV_WQ_ATTR_STATE;
+  wqAttr.wq_state = IBV_WQS_RDY;
+  if (0!=ibv_modify_wq(worker->wq, &wqAttr)) {
+    int rc = errno;
+    fprintf(stderr, "warn : ice_worker_allocate_receiver: worker %u: ibv_modify_wq failed: %s (errno %d)\n",
+      worker->id, strerror(rc), rc);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  return ice_verb_post_recv_ring(worker->queue, param->rxQueueSize, 0, worker->wq);
+}
+
+static int ice_worker_allocate_rss(struct Session *session, struct WorkerSet *set) {
+  const struct UserParam *param = session->userParam;
+  struct SessionCommon *common = session->common;
+
+  // Indirection table size must be a power of two; repeat WQs to fill it
+  uint32_t logSize = 0;
+  while ((1u<<logSize)<set->count) {
+    ++logSize;
+  }
+  struct ibv_wq *table[MAX_WORKERS];
+  for (uint32_t i=0; i<(1u<<logSize); ++i) {
+    table[i] = set->worker[i%set->count].wq;
+  }
+
+  struct ibv_rwq_ind_table_init_attr tableAttr;
+  memset(&tableAttr, 0, sizeof(tableAttr));
+  tableAttr.log_ind_tbl_size = logSize;
+  tableAttr.ind_tbl = table;
+
+  if (0==(set->indTable = ibv_create_rwq_ind_table(common->context, &tableAttr))) {
+    int rc = errno;
+    fprintf(stderr, "warn : ice_worker_allocate_rss: ibv_create_rwq_ind_table failed: %s (errno %d)\n",
+      strerror(rc), rc);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  // Hash on IPV4 addresses and UDP ports
+  struct ibv_qp_init_attr_ex attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.qp_type = IBV_QPT_RAW_PACKET;
+  attr.comp_mask = IBV_QP_INIT_ATTR_PD | IBV_QP_INIT_ATTR_IND_TABLE | IBV_QP_INIT_ATTR_RX_HASH;
+  attr.pd = common->pd;
+  attr.rwq_ind_tbl = set->indTable;
+  attr.rx_hash_conf.rx_hash_function = IBV_RX_HASH_FUNC_TOEPLITZ;
+  attr.rx_hash_conf.rx_hash_key_len = sizeof(RSS_TOEPLITZ_KEY);
+  attr.rx_hash_conf.rx_hash_key = RSS_TOEPLITZ_KEY;
+  attr.rx_hash_conf.rx_hash_fields_mask = IBV_RX_HASH_SRC_IPV4 | IBV_RX_HASH_DST_IPV4 |
+    IBV_RX_HASH_SRC_PORT_UDP | IBV_RX_HASH_DST_PORT_UDP;
+
+  if (0==(set->rssQp = ibv_create_qp_ex(common->context, &attr))) {
+    int rc = errno;
+    fprintf(stderr, "warn : ice_worker_allocate_rss: ibv_create_qp_ex failed: %s (errno %d)\n", strerror(rc), rc);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  if (0==(set->flow = ice_verb_create_flow(set->rssQp, param->portId, &session->server,
+    ice_verb_flow_wildcards(param), param->flowCount))) {
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  return 0;
+}
+
+int ice_worker_allocate(struct Session *session, struct WorkerSet *set) {
+  assert(session);
+  assert(session->common);
+  assert(session->userParam);
+  assert(set);
+
+  const struct UserParam *param = session->userParam;
+  assert(param->queueCount>0 && param->queueCount<=MAX_WORKERS);
+
+  memset(set, 0, sizeof(struct WorkerSet));
+  set->count = param->queueCount;
+  atomic_init(&set->received, 0);
+
+  for (uint32_t i=0; i<set->count; ++i) {
+    struct Worker *worker = set->worker+i;
+    worker->id = i;
+    if (param->firstCpu<0) {
+      char role[32];
+      snprintf(role, sizeof(role), "%s worker %u", param->isServer ? "rx" : "tx", i);
+      worker->cpu = ice_topology_take_cpu(&session->topology, role);
+    } else {
+      worker->cpu = param->firstCpu+(int32_t)i;
+    }
+    if (param->tscPeerCpu>=0 && 0!=(param->isServer ? ice_tsc_check_skew(param->tscPeerCpu, worker->cpu)
+                                                     : ice_tsc_check_skew(worker->cpu, param->tscPeerCpu))) {
+      return ICE_IB_ERROR_API_ERROR;
+    }
+    worker->session = session;
+    worker->set = set;
+    ice_histogram_initialize(&worker->latency);
+    ice_sequence_initialize_set(&worker->sequence, param->clientPort, param->rxQueueSize);
+
+    // Servers receive whole packets; only senders split payloads
+    const uint32_t queueSize = param->isServer ? param->rxQueueSize : param->txQueueSize;
+    const uint8_t splitPayload = param->isServer ? 0 : param->splitPayload;
+    if (0!=ice_verb_allocate_memory(&session->arena, ice_verb_queue_memory_size(queueSize, param->payloadSize,
+      splitPayload), &worker->memory)) {
+      return ICE_IB_ERROR_NO_MEMORY;
+    }
+    worker->queue = (struct Queue *)worker->memory.hugePageMemory;
+    ice_verb_layout_queue(&worker->memory, queueSize, param->payloadSize, splitPayload);
+    if (0!=ice_verb_initialize_queue(session->common->pd, session->common->context, &worker->memory, 0)) {
+      return ICE_IB_ERROR_API_ERROR;
+    }
+
+    int rc = param->isServer ? ice_worker_allocate_receiver(session, worker)
+                             : ice_worker_allocate_sender(session, worker);
+    if (rc!=0) {
+      return rc;
+    }
+  }
+
+  if (param->isServer) {
+    return ice_worker_allocate_rss(session, set);
+  }
+
+  return 0;
+}
+
+static void *ice_worker_main(void *arg) {
+  struct Worker *worker = (struct Worker *)arg;
+  struct WorkerSet *set = worker->set;
+  const struct UserParam *param = worker->session->userParam;
+
+  ice_topology_pin_thread(worker->cpu);
+  pthread_barrier_wait(&set->barrier);
+
+  if (param->isServer) {
+    const struct RecvCheck check = { .latency = &worker->latency, .sequence = &worker->sequence };
+    worker->rc = ice_verb_recv_loop(worker->queue, set->rssQp, worker->wq, param->iters, &set->received, &check,
+      &worker->result);
+  } else {
+    worker->rc = ice_verb_send_loop(worker->queue, worker->qp, param, worker->iters, &worker->result);
+  }
+
+  return 0;
+}
+
+int ice_worker_run(struct WorkerSet *set) {
+  assert(set);
+  assert(set->count>0);
+
+  int rc = 0;
+
+  if (0!=(rc=pthread_barrier_init(&set->barrier, 0, set->count))) {
+    fprintf(stderr, "warn : ice_worker_run: pthread_barrier_init failed: %s (errno %d)\n", strerror(rc), rc);
+    return ICE_IB_ERROR_API_ERROR;
+  }
+
+  struct Session *session = set->worker[0].session;
+  for (uint32_t i=0; i<set->count; ++i) {
+    ice_stats_watch(&session->stats, &set->worker[i].result.counters);
+  }
+  ice_verb_start_stats(session, 0);
+
+  uint32_t started = 0;
+  for (; started<set->count; ++started) {
+    if (0!=(rc=pthread_create(&set->worker[started].thread, 0, ice_worker_main, set->worker+started))) {
+      fprintf(stderr, "warn : ice_worker_run: pthread_create failed: %s (errno %d)\n", strerror(rc), rc);
+      // Workers already started wait at the barrier forever; nothing to
+      // recover so fail hard
+      return ICE_IB_ERROR_API_ERROR;
+    }
+  }
+
+  for (uint32_t i=0; i<started; ++i) {
+    pthread_join(set->worker[i].thread, 0);
+  }
+  pthread_barrier_destroy(&set->barrier);
+  ice_stats_stop(&session->stats);
+
+  // Per worker then aggregate over the span of all workers
+  const struct UserParam *param = session->userParam;
+  struct RunResult total;
+  struct RecvCheck check;
+  struct SequenceTracker sequence;
+  memset(&total, 0, sizeof(total));
+  ice_verb_initialize_check(param, session->common, &check);
+  char name[64];
+  for (uint32_t i=0; i<set->count; ++i) {
+    const struct Worker *worker = set->worker+i;
+    const struct RunResult *result = &worker->result;
+    if (worker->rc!=0) {
+      rc = worker->rc;
+      continue;
+    }
+    snprintf(name, sizeof(name), "ice_worker_run: worker %u cpu %d", worker->id, worker->cpu);
+    ice_verb_print_result(name, result);
+
+    if (result->counters.packets==0) {
+      continue;
+    }
+    if (total.counters.packets==0 || ice_verb_timespec_before(&result->startTime, &total.startTime)) {
+      total.startTime = result->startTime;
+    }
+    if (total.counters.packets==0 || ice_verb_timespec_before(&total.endTime, &result->endTime)) {
+      total.endTime = result->endTime;
+    }
+    total.counters.packets += result->counters.packets;
+    total.counters.bytes += result->counters.bytes;
+    total.counters.polls += result->counters.polls;
+    total.counters.emptyPolls += result->counters.emptyPolls;
+    total.paceRestarts += result->paceRestarts;
+    ice_histogram_merge(check.latency, &worker->latency);
+  }
+  ice_verb_print_result("ice_worker_run: aggregate", &total);
+  ice_verb_print_pacing("ice_worker_run: aggregate", param, &total);
+  memset(&sequence, 0, sizeof(sequence));
+  if (param->isServer) {
+    // Every flow lands on one worker; trackers of the flows a worker never saw are empty
+    for (uint32_t i=0; i<set->count; ++i) {
+      ice_sequence_merge_set(&sequence, &set->worker[i].sequence);
+    }
+    ice_sequence_expect(&sequence, param->iters);
+    ice_histogram_print(check.latency, "ice_worker_run: aggregate one-way ns (same host only)",
+      1.0/ice_tsc_ticks_per_ns());
+    ice_sequence_print(&sequence, "ice_worker_run: aggregate sequence");
+  } else {
+    fprintf(stderr, "info : ice_worker_run: inline %s\n", ice_verb_inline_state(set->worker[0].queue));
+    ice_verb_print_cost("ice_worker_run: aggregate", set->worker[0].queue, set->count, &total);
+  }
+  if (rc==0) {
+    rc = ice_report_write(param, param->isServer ? "server" : "client", set->count, &total, check.latency, "one-way",
+      param->isServer ? &sequence : 0);
+  }
+
+  return rc;
+}
+
+int ice_worker_deallocate(struct WorkerSet *set) {
+  assert(set);
+
+  if (set->flow) {
+    ibv_destroy_flow(set->flow);
+  }
+  if (set->rssQp) {
+    ibv_destroy_qp(set->rssQp);
+  }
+  if (set->indTable) {
+    ibv_destroy_rwq_ind_table(set->indTable);
+  }
+  for (uint32_t i=0; i<set->count; ++i) {
+    struct Worker *worker = set->worker+i;
+    if (worker->qp) {
+      ibv_destroy_qp(worker->qp);
+    }
+    if (worker->wq) {
+      ibv_destroy_wq(worker->wq);
+    }
+    if (worker->queue) {
+      ice_verb_deinitialize_queue(worker->queue);
+    }
+  }
+
+  memset(set, 0, sizeof(struct WorkerSet));
+
+  return 0;
+}
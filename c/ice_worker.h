@@ -0,0 +1,54 @@
+#pragma once
+
+#include <ice_verb.h>
+
+#include <pthread.h>
+
+// Multi-queue mode: one worker thread per core each driving its own queue.
+// Clients give every worker its own RAW_PACKET QP and source UDP port.
+// Servers give every worker its own receive WQ; one RSS hash QP spreads
+// incoming flows over the WQs through an indirection table.
+
+enum kWORKER {
+  MAX_WORKERS = 64,
+};
+
+struct Worker {
+  uint32_t                  id;                               // zero-based worker index
+  int32_t                   cpu;                              // core worker thread is pinned to
+  struct Queue              *queue;                           // convenience pointer into 'memory'
+  struct HugePageMemory     memory;                           // huge page memory for 'queue'
+  struct ibv_qp             *qp;                              // sender QP (client only)
+  struct ibv_wq             *wq;                              // receive work queue (server only)
+  struct IPV4UDPEndpoint    src;                              // client endpoint with per-worker port (client only)
+  uint64_t                  iters;                            // packets to send (client only)
+  struct Session            *session;                         // not owned
+  struct WorkerSet          *set;                             // set this worker belongs to
+  pthread_t                 thread;                           // thread running worker
+  int                       rc;                               // worker's return code
+  struct RunResult          result;                           // worker's outcome
+  struct Histogram          latency;                          // one-way times in rdtsc ticks (server only)
+  struct SequenceSet        sequence;                         // received sequence numbers per flow (server only)
+};
+
+struct WorkerSet {
+  uint32_t                  count;                            // number of workers in 'worker'
+  struct Worker             worker[MAX_WORKERS];              // per-core workers
+  struct ibv_rwq_ind_table  *indTable;                        // WQ indirection table (server only)
+  struct ibv_qp             *rssQp;                           // RSS hash QP over 'indTable' (server only)
+  struct ibv_flow           *flow;                            // flow steering to 'rssQp' (server only)
+  _Atomic uint64_t          received;                         // packets received over all workers
+  pthread_barrier_t         barrier;                          // lines workers up to start together
+};
+
+// Create 'userParam->queueCount' workers in 'set' on 'session's context and PD. Worker 'i' is pinned to
+// 'userParam->firstCpu+i' or, by default, the next core from 'session->topology'. Return 0 on success and non-zero
+// otherwise.
+int ice_worker_allocate(struct Session *session, struct WorkerSet *set);
+
+// Run all workers in 'set' to completion then print per worker and aggregate throughput. Return 0 on success and
+// non-zero otherwise.
+int ice_worker_run(struct WorkerSet *set);
+
+// Free whatever 'ice_worker_allocate' allocated
+int ice_worker_deallocate(struct WorkerSet *set);
@@ -1,24 +1,66 @@
 #include <ice_verb.h>
+#include <ice_param.h>
+#include <ice_worker.h>
 
-int main() {
+#include <stdio.h>
+
+int main(int argc, char **argv) {
   int rc;
-  struct UserParam param = {0};
-
-  strcpy(param.deviceId, "rocep1s0f1");
-  strcpy(param.clientMac, "08:c0:eb:d4:d0:df");
-  strcpy(param.serverMac, "08:c0:eb:d4:d0:df");
-  strcpy(param.clientIpAddr, "192.168.0.2");
-  strcpy(param.serverIpAddr, "192.168.0.2");
-  param.clientPort = 10011;
-  param.serverPort = 10013;
-  param.iters = 100;
-  param.portId = 1;
-  param.isServer = 0;
+  struct UserParam param;
+
+  ice_param_initialize(&param);
+  ice_param_parse(argc, argv, &param);
+
+  // Striding RQs, CQE compression, multi-packet WQEs and BlueFlame live on the mlx5 direct path only
+  if (param.stridesPerWqe || param.cqeFormat || param.packetsPerWqe || param.useBlueFlame) {
+    fprintf(stderr, "warn : main: -m, -Z, -w and -F need ib_mlx5\n");
+    return ICE_IB_ERROR_API_ERROR;
+  }
 
   struct Session session;
-  if (0!=(rc=ice_verb_allocate_session(&param, &session))) {
-    ice_verb_set_rtr(&session);
-    ice_verb_set_rts(&session);
+  static struct WorkerSet workers;
+
+  if (param.transport!=ICE_TRANSPORT_NONE) {
+    if (0==(rc=ice_transport_allocate_session(&param, &session))) {
+      if (param.transport==ICE_TRANSPORT_LOOPBACK) {
+        rc = ice_transport_run_loopback(&session);
+      } else {
+        rc = param.isServer ? ice_transport_run_server(&session) : ice_transport_run_client(&session);
+      }
+    }
+    ice_transport_deallocate_session(&session);
+    return rc;
+  }
+
+  if (0==(rc=ice_verb_allocate_session(&param, &session))) {
+    if (0==(rc=ice_verb_set_rtr(&session)) && 0==(rc=ice_verb_set_rts(&session))) {
+      if (param.queueCount>1) {
+        if (0==(rc=ice_worker_allocate(&session, &workers))) {
+          rc = ice_worker_run(&workers);
+        }
+        ice_worker_deallocate(&workers);
+      } else if (param.isServer && param.latencyWindow) {
+        if (0==(rc=ice_verb_initialize_flow(&session, &session.server)) &&
+            0==(rc=ice_verb_initialize_recv_ring(&session))) {
+          rc = ice_verb_run_reflector(&session);
+        }
+      } else if (param.isServer) {
+        if (0==(rc=ice_verb_initialize_flow(&session, &session.server)) &&
+            0==(rc=ice_verb_initialize_recv_ring(&session))) {
+          rc = ice_verb_run_server(&session);
+        }
+      } else if (param.latencyWindow) {
+        if (0==(rc=ice_verb_initialize_flow(&session, &session.client)) &&
+            0==(rc=ice_verb_initialize_recv_ring(&session)) &&
+            0==(rc=ice_verb_initialize_send_ring(&session))) {
+          rc = ice_verb_run_latency_client(&session);
+        }
+      } else {
+        if (0==(rc=ice_verb_initialize_send_ring(&session))) {
+          rc = ice_verb_run_client(&session);
+        }
+      }
+    }
   }
 
   // Free whatever was allocated
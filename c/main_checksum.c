@@ -0,0 +1,162 @@
+#include <ice_verb.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Micro-benchmark IPV4 checksum variants over a packet pool built like the send path builds it. Reports ns/packet
+// for the CPU side of each; offload costs the CPU only the stamp so the NIC's share is measured by running 'ib -C'.
+
+static struct Queue *queue;
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end) {
+  return (double)(end->tv_sec-start->tv_sec)*1e9 + (double)(end->tv_nsec-start->tv_nsec);
+}
+
+// Stamp every pool packet 'rounds' times with 'checksumMode'. Batch mode then checksums each 'batchSize' run
+static double run_stamp(uint32_t rounds, uint32_t batchSize, uint8_t checksumMode, ice_checksum_ipv4_batch_fn kernel) {
+  struct timespec start, end;
+  uint64_t seq = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint32_t r=0; r<rounds; ++r) {
+    for (uint32_t i=0; i<queue->pktCount; i+=batchSize) {
+      for (uint32_t j=0; j<batchSize; ++j, ++seq) {
+        ice_verb_stamp_ipv4packet(ice_verb_packet(queue, i+j), queue->pktChecksumBase, seq, checksumMode);
+      }
+      if (kernel) {
+        kernel((uint8_t *)&ice_verb_packet(queue, i)->ipv4_header, queue->pktStride, batchSize);
+      }
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  return elapsed_ns(&start, &end)/(double)seq;
+}
+
+// Checksum every pool packet 'rounds' times with 'kernel' 'batchSize' packets at a time without stamping
+static double run_kernel(uint32_t rounds, uint32_t batchSize, ice_checksum_ipv4_batch_fn kernel) {
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint32_t r=0; r<rounds; ++r) {
+    for (uint32_t i=0; i<queue->pktCount; i+=batchSize) {
+      kernel((uint8_t *)&ice_verb_packet(queue, i)->ipv4_header, queue->pktStride, batchSize);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  return elapsed_ns(&start, &end)/((double)rounds*queue->pktCount);
+}
+
+// Recompute every pool packet's checksum one at a time 'rounds' times
+static double run_full(uint32_t rounds) {
+  struct timespec start, end;
+  uint64_t seq = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint32_t r=0; r<rounds; ++r) {
+    for (uint32_t i=0; i<queue->pktCount; ++i, ++seq) {
+      ice_verb_stamp_ipv4packet(ice_verb_packet(queue, i), queue->pktChecksumBase, seq, ICE_CHECKSUM_MODE_OFFLOAD);
+      ice_verb_checksum_ipv4packet(ice_verb_packet(queue, i));
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  return elapsed_ns(&start, &end)/(double)seq;
+}
+
+// Return the number of pool packets whose IPV4 header does not sum to 0xffff
+static uint32_t count_bad_checksums(void) {
+  uint32_t bad = 0;
+  for (uint32_t i=0; i<queue->pktCount; ++i) {
+    const uint16_t *ptr16 = (const uint16_t *)&ice_verb_packet(queue, i)->ipv4_header;
+    uint32_t sum = 0;
+    for (uint32_t j=0; j<ICE_CHECKSUM_IPV4_HEADER_SIZE/2; ++j) {
+      sum += ptr16[j];
+    }
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    bad += (sum!=0xffff);
+  }
+  return bad;
+}
+
+// Print 'nsPerPacket' for variant 'name'. Unless 'verify' is 0 flag the run if any checksum it left is wrong
+static void report(const char *name, double nsPerPacket, int verify) {
+  const uint32_t bad = verify ? count_bad_checksums() : 0;
+  fprintf(stderr, "info : checksum_bench: %-24s %7.3f ns/packet%s\n", name, nsPerPacket, bad ? " (BAD CHECKSUMS)" : "");
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  uint32_t rounds = 1000;
+  uint32_t batchSize = 32;
+  uint32_t payloadSize = 32;
+
+  while ((opt = getopt(argc, argv, "n:b:s:h")) != -1) {
+    switch (opt) {
+      case 'n':
+        rounds = (uint32_t)atoi(optarg);
+        break;
+      case 'b':
+        batchSize = (uint32_t)atoi(optarg);
+        break;
+      case 's':
+        payloadSize = (uint32_t)atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-n <rounds over %d packets>] [-b <batch size power of 2>] [-s <payload size>]\n",
+          argv[0], MAX_PACKET_ENTRIES);
+        exit(2);
+    }
+  }
+  if (rounds==0 || batchSize==0 || batchSize>MAX_PACKET_ENTRIES || (batchSize & (batchSize-1))!=0 ||
+      payloadSize<32 || payloadSize>MAX_PAYLOAD_SIZE) {
+    fprintf(stderr, "usage: %s [-n <rounds over %d packets>] [-b <batch size power of 2>] [-s <payload size>]\n",
+      argv[0], MAX_PACKET_ENTRIES);
+    exit(2);
+  }
+
+  struct IPV4UDPEndpoint src, dst;
+  ice_verb_initialize_endpoint("08:c0:eb:d4:d0:df", "192.168.0.2", 10011, &src);
+  ice_verb_initialize_endpoint("08:c0:eb:d4:d0:df", "192.168.0.2", 10013, &dst);
+
+  // Same slab layout as a send queue but plain memory; nothing is registered
+  struct HugePageMemory memory;
+  memset(&memory, 0, sizeof(memory));
+  memory.requestSizeBytes = ice_verb_queue_memory_size(MAX_PACKET_ENTRIES-1, payloadSize, 0);
+  memory.actualSizeBytes = memory.requestSizeBytes;
+  if (0==(memory.hugePageMemory = aligned_alloc(CPU_CACHE_LINE_SIZE_BYTES, memory.actualSizeBytes))) {
+    fprintf(stderr, "warn : checksum_bench: cannot allocate %lu bytes\n", memory.actualSizeBytes);
+    exit(1);
+  }
+  memset((void *)memory.hugePageMemory, 0, memory.actualSizeBytes);
+  queue = (struct Queue *)memory.hugePageMemory;
+  ice_verb_layout_queue(&memory, MAX_PACKET_ENTRIES-1, payloadSize, 0);
+  ice_verb_build_packet_pool(queue, &src, &dst);
+
+  fprintf(stderr, "info : checksum_bench: %u rounds over %u packets, batch %u, stride %u\n", rounds, queue->pktCount,
+    batchSize, queue->pktStride);
+
+  // CPU cost of offload mode: stamp only, NIC fills in checksum
+  report("offload (stamp only)", run_stamp(rounds, batchSize, ICE_CHECKSUM_MODE_OFFLOAD, 0), 0);
+  report("full per packet", run_full(rounds), 1);
+  report("incremental", run_stamp(rounds, batchSize, ICE_CHECKSUM_MODE_INCREMENTAL, 0), 1);
+
+  static const char *kernel[] = {"scalar", "avx2", "avx512"};
+  for (uint32_t i=0; i<sizeof(kernel)/sizeof(kernel[0]); ++i) {
+    char name[32];
+    snprintf(name, sizeof(name), "batch %s", kernel[i]);
+    ice_checksum_ipv4_batch_fn fn = ice_checksum_find(kernel[i]);
+    if (fn) {
+      report(name, run_stamp(rounds, batchSize, ICE_CHECKSUM_MODE_BATCH, fn), 1);
+      snprintf(name, sizeof(name), "%s kernel only", kernel[i]);
+      report(name, run_kernel(rounds, batchSize, fn), 1);
+    } else {
+      fprintf(stderr, "info : checksum_bench: %-24s not supported by this CPU\n", name);
+    }
+  }
+
+  return 0;
+}
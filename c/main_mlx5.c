@@ -1,25 +1,58 @@
-#include <ice_mlx5.h>
+#include <ice_mlx5_verb.h>
+#include <ice_param.h>
 
-int main() {
+int main(int argc, char **argv) {
   int rc;
-  struct UserParam param = {0};
+  struct UserParam param;
 
-  strcpy(param.deviceId, "rocep1s0f1");
-  strcpy(param.clientMac, "08:c0:eb:d4:d0:df");
-  strcpy(param.serverMac, "08:c0:eb:d4:d0:df");
-  strcpy(param.clientIpAddr, "192.168.0.2");
-  strcpy(param.serverIpAddr, "192.168.0.2");
-  param.clientPort = 10011;
-  param.serverPort = 10013;
-  param.iters = 100;
-  param.portId = 1;
-  param.isServer = 0;
+  ice_param_initialize(&param);
+  ice_param_parse(argc, argv, &param);
 
-  // Initialize session
+  // Server and latency modes are the same as 'ib' unless the server
+  // receives into a striding RQ. Client bandwidth mode writes WQEs
+  // directly into the send queue
   struct Session session;
-  ice_mlx5_allocate_session(&param, &session);
+  struct Mlx5SendQueue sq;
+  struct Mlx5StridingRq rq;
+  memset(&rq, 0, sizeof(rq));
+  if (0==(rc=ice_mlx5_allocate_session(&param, &session))) {
+    if (0==(rc=ice_verb_set_rtr(&session)) && 0==(rc=ice_verb_set_rts(&session))) {
+      if (param.isServer && param.latencyWindow) {
+        if (0==(rc=ice_verb_initialize_flow(&session, &session.server)) &&
+            0==(rc=ice_verb_initialize_recv_ring(&session))) {
+          rc = ice_verb_run_reflector(&session);
+        }
+      } else if (param.isServer && param.stridesPerWqe) {
+        if (0==(rc=ice_mlx5_initialize_striding_rq(&session, &rq))) {
+          rc = ice_mlx5_run_striding_server(&session, &rq);
+        }
+      } else if (param.isServer) {
+        if (0==(rc=ice_verb_initialize_flow(&session, &session.server)) &&
+            0==(rc=ice_verb_initialize_recv_ring(&session))) {
+          rc = ice_verb_run_server(&session);
+        }
+      } else if (param.latencyWindow) {
+        if (0==(rc=ice_verb_initialize_flow(&session, &session.client)) &&
+            0==(rc=ice_verb_initialize_recv_ring(&session)) &&
+            0==(rc=ice_verb_initialize_send_ring(&session))) {
+          rc = ice_verb_run_latency_client(&session);
+        }
+      } else if (param.tsoMss) {
+        // TSO sends are verbs WRs; the direct path writes no LSO WQEs
+        if (0==(rc=ice_verb_initialize_send_ring(&session))) {
+          rc = ice_verb_run_client(&session);
+        }
+      } else {
+        if (0==(rc=ice_verb_initialize_send_ring(&session)) &&
+            0==(rc=ice_mlx5_initialize_send_queue(&session, &sq))) {
+          rc = ice_mlx5_run_client(&session, &sq);
+        }
+      }
+    }
+  }
 
   // Free whatever was allocated
+  ice_mlx5_deinitialize_striding_rq(&rq);
   ice_mlx5_deallocate_session(&session);
 
   return rc;
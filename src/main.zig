@@ -58,7 +58,7 @@ pub fn usageAndExit(param: *Param) void {
   std.debug.print("-n <int>         optional: number of packets >0 to send (default {d})\n", .{param.iters});
   std.debug.print("-t <int>         optional: number of client TX request items (default {d}) in [1,4096]\n", .{param.txQueueSize});
   std.debug.print("-r <int>         optional: number of server RX request items (default {d}) in [1,4096]\n", .{param.rxQueueSize});
-  std.debug.print("-s <int>         optional: size of packet payload (default {d}) in [32, 65536]\n", .{param.payloadSize});
+  std.debug.print("-s <int>         optional: size of packet payload (default {d}) in [32, 65507]\n", .{param.payloadSize});
 
   std.debug.print("-H               optional: allocate memory from 2048KB hugepage memory\n", .{});
   std.debug.print("-S               optional: run in server mode and client model if omitted\n", .{});
@@ -197,7 +197,7 @@ pub fn parseCommandLine(allocator: std.mem.Allocator, param: *Param) i32 {
   if (param.rxQueueSize<1 or param.rxQueueSize>4096) {
     valid = false;
   }
-  if (param.payloadSize<32 or param.payloadSize>65536) {
+  if (param.payloadSize<32 or param.payloadSize>65507) {
     valid = false;
   }
 